@@ -0,0 +1,445 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+#include <psapi.h>
+
+#include <tchar.h>
+#include <stdio.h>
+
+#include "SrvChild.h"
+#include "SrvState.h"
+#include "SrvDump.h"
+#include "SrvJava.h"
+#include "SrvLog.h"
+
+#pragma comment(lib, "psapi.lib")
+
+#define MAX_CHILD_PROCESSES 1024
+
+typedef LONG (WINAPI *LPNT_PROCESS_FUNCTION)(HANDLE);
+
+static BOOL ForEachChildProcess(LPSRV_CHILD, LPCSTR, LPDWORD);
+
+BOOL SrvChildLaunch(LPSRV_CONFIG lpSrvConfig, HANDLE hStdOutput, HANDLE hStdError, LPSRV_CHILD lpChild) {
+
+	DWORD dwCreationFlags = CREATE_SUSPENDED;		// Do NOT use CREATE_NO_WINDOW; that suppresses the ability to send console signals
+
+	STARTUPINFO si;
+	ZeroMemory(&si, sizeof(si));
+	si.cb = sizeof(si);
+	si.dwFlags = STARTF_USESTDHANDLES;
+	si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+	si.hStdOutput = (hStdOutput != NULL) ? hStdOutput : GetStdHandle(STD_OUTPUT_HANDLE);
+	si.hStdError = (hStdError != NULL) ? hStdError : (hStdOutput != NULL) ? hStdOutput : GetStdHandle(STD_ERROR_HANDLE);
+
+	ZeroMemory(&lpChild->pi, sizeof(lpChild->pi));
+	ZeroMemory(&lpChild->ftReady, sizeof(lpChild->ftReady));
+	ZeroMemory(&lpChild->ftStopRequested, sizeof(lpChild->ftStopRequested));
+	lpChild->stopStep = SRV_STOP_NONE;
+	lpChild->hJob = NULL;
+	lpChild->bSuspended = FALSE;
+
+	// In Java mode the JVM options are chosen afresh for each launch
+	// so that changed jars are noticed.
+
+	LPTSTR lpCommandLine = lpSrvConfig->lpCommandLine;
+	char javaCommandLine[SRV_JAVA_COMMAND_LINE_SIZE];
+
+	if (lpSrvConfig->dwJava != 0) {
+		if (!SrvJavaCommandLine(lpSrvConfig, javaCommandLine, sizeof(javaCommandLine))) {
+			return FALSE;
+		}
+		lpCommandLine = javaCommandLine;
+	}
+
+	BOOL bSuccess = CreateProcess(
+			lpSrvConfig->lpApplicationName,
+			lpCommandLine,
+			NULL,							// lpProcessAttributes
+			NULL,							// lpThreadAttributes
+			TRUE,							// bInheritHandles
+			dwCreationFlags,				// dwCreationFlags
+			lpSrvConfig->lpEnvironment,
+			lpSrvConfig->lpCurrentDirectory,
+			&si,							// lpStartupInfo
+			&lpChild->pi);					// lpProcessInformation
+
+	if (!bSuccess) {
+		return FALSE;
+	}
+
+	// Place the child in a job before it runs so that its descendants
+	// are in the job too.  Closing the job kills any left behind, so none
+	// outlives the child it was started by.  Without a job, only the child
+	// itself can be acted on, so failure here is not fatal.
+
+	lpChild->hJob = CreateJobObject(NULL, NULL);
+
+	if (lpChild->hJob != NULL) {
+
+		JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+		ZeroMemory(&limits, sizeof(limits));
+		limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+
+		SetInformationJobObject(lpChild->hJob, JobObjectExtendedLimitInformation, &limits, sizeof(limits));
+
+		if (!AssignProcessToJobObject(lpChild->hJob, lpChild->pi.hProcess)) {
+			CloseHandle(lpChild->hJob);
+			lpChild->hJob = NULL;
+		}
+	}
+
+	// Label captured output with the new process before it can write any.
+
+	SrvLogSetProcessId(lpChild->pi.dwProcessId);
+
+	if (ResumeThread(lpChild->pi.hThread) == (DWORD)-1) {
+		DWORD dwLastError = GetLastError();
+		TerminateProcess(lpChild->pi.hProcess, dwLastError);
+		SrvChildClose(lpChild);
+		SetLastError(dwLastError);
+		return FALSE;
+	}
+
+	GetSystemTimeAsFileTime(&lpChild->ftLaunched);
+	lpChild->dwLaunches++;
+
+	return TRUE;
+}
+
+BOOL SrvChildStop(LPSRV_CHILD lpChild, DWORD dwWaitMillis, LPBOOL pbKilled) {
+
+	*pbKilled = FALSE;
+
+	// A suspended child cannot respond to the signal.
+
+	if (lpChild->bSuspended) {
+		DWORD dwProcesses;
+		SrvChildResume(lpChild, &dwProcesses);
+	}
+
+	// Try sending CTRL + C signal.  The signal affects not only child processes
+	// but also this parent process, which ignores it.
+
+	GetSystemTimeAsFileTime(&lpChild->ftStopRequested);
+	lpChild->stopStep = SRV_STOP_SIGNALED;
+
+	if (!SrvChildSignal(lpChild, CTRL_C_EVENT)) {
+		return FALSE;
+	}
+
+	// Wait for the child process to terminate,
+	// reporting progress to the SCM about once a second.
+
+	DWORD dwStarted = GetTickCount();
+	DWORD dwElapsed = 0;
+	DWORD waitResult = WAIT_TIMEOUT;
+
+	while ((waitResult == WAIT_TIMEOUT) && (dwElapsed < dwWaitMillis)) {
+
+		DWORD dwRemaining = dwWaitMillis - dwElapsed;
+		SrvStateCheckPoint(dwRemaining);
+
+		waitResult = WaitForSingleObject(lpChild->pi.hProcess, (dwRemaining < 1000) ? dwRemaining : 1000);
+		dwElapsed = GetTickCount() - dwStarted;
+	}
+
+	if (waitResult == WAIT_OBJECT_0) {
+		// Normal termination.
+		return TRUE;
+	}
+	else if (waitResult != WAIT_TIMEOUT) {
+		return FALSE;
+	}
+
+	// The child process did not terminate itself in a timely way.
+	// Capture what it was doing, then kill it.
+
+	*pbKilled = TRUE;
+
+	lpChild->stopStep = SRV_STOP_DUMPED;
+	SrvDumpCapture(lpChild);
+
+	if (WaitForSingleObject(lpChild->pi.hProcess, 0) == WAIT_OBJECT_0) {
+		return TRUE;
+	}
+
+	lpChild->stopStep = SRV_STOP_KILLED;
+
+	// Kill the whole tree, so that no descendant keeps holding
+	// ports or files that the next child will need.
+
+	UINT uExitCode = WAIT_TIMEOUT;
+
+	BOOL bTerminated = (lpChild->hJob != NULL)
+			? TerminateJobObject(lpChild->hJob, uExitCode)
+			: TerminateProcess(lpChild->pi.hProcess, uExitCode);
+
+	if (!bTerminated) {
+		return FALSE;
+	}
+
+	return WaitForSingleObject(lpChild->pi.hProcess, INFINITE) == WAIT_OBJECT_0;
+}
+
+BOOL SrvChildSignal(LPSRV_CHILD lpChild, DWORD dwCtrlEvent) {
+
+	if (lpChild->pi.hProcess == NULL) {
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+
+	// The child shares the wrapper's console, so process group 0
+	// addresses the child and all of its descendants.
+
+	return GenerateConsoleCtrlEvent(dwCtrlEvent, 0);
+}
+
+BOOL SrvChildSuspend(LPSRV_CHILD lpChild, LPDWORD pdwProcesses) {
+
+	if (!ForEachChildProcess(lpChild, "NtSuspendProcess", pdwProcesses)) {
+		return FALSE;
+	}
+
+	lpChild->bSuspended = TRUE;
+	return TRUE;
+}
+
+BOOL SrvChildResume(LPSRV_CHILD lpChild, LPDWORD pdwProcesses) {
+
+	if (!ForEachChildProcess(lpChild, "NtResumeProcess", pdwProcesses)) {
+		return FALSE;
+	}
+
+	lpChild->bSuspended = FALSE;
+	return TRUE;
+}
+
+BOOL SrvChildRunCommand(LPCSTR lpCommandLine, HANDLE hStdOutput, LPHANDLE phProcess) {
+
+	// CreateProcess() may modify the command line, so pass a copy.
+
+	char commandLine[1024];
+	if (strlen(lpCommandLine) >= sizeof(commandLine)) {
+		SetLastError(ERROR_BAD_ARGUMENTS);
+		return FALSE;
+	}
+	strcpy(commandLine, lpCommandLine);
+
+	STARTUPINFO si;
+	ZeroMemory(&si, sizeof(si));
+	si.cb = sizeof(si);
+	si.dwFlags = STARTF_USESTDHANDLES;
+	si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+	si.hStdOutput = (hStdOutput != NULL) ? hStdOutput : GetStdHandle(STD_OUTPUT_HANDLE);
+	si.hStdError = (hStdOutput != NULL) ? hStdOutput : GetStdHandle(STD_ERROR_HANDLE);
+
+	PROCESS_INFORMATION pi;
+	ZeroMemory(&pi, sizeof(pi));
+
+	BOOL bSuccess = CreateProcess(
+			NULL,							// lpApplicationName
+			commandLine,
+			NULL,							// lpProcessAttributes
+			NULL,							// lpThreadAttributes
+			TRUE,							// bInheritHandles
+			0,								// dwCreationFlags
+			NULL,							// lpEnvironment
+			NULL,							// lpCurrentDirectory
+			&si,							// lpStartupInfo
+			&pi);							// lpProcessInformation
+
+	if (!bSuccess) {
+		return FALSE;
+	}
+
+	if (phProcess != NULL) {
+		*phProcess = pi.hProcess;
+	}
+	else {
+		CloseHandle(pi.hProcess);
+	}
+	CloseHandle(pi.hThread);
+
+	return TRUE;
+}
+
+DWORD SrvChildGetProcessIds(LPSRV_CHILD lpChild, LPDWORD pProcessIds, DWORD dwMaxProcessIds) {
+
+	if (lpChild->hJob == NULL) {
+		pProcessIds[0] = lpChild->pi.dwProcessId;
+		return 1;
+	}
+
+	static BYTE buffer[sizeof(JOBOBJECT_BASIC_PROCESS_ID_LIST) + MAX_CHILD_PROCESSES * sizeof(ULONG_PTR)];
+	JOBOBJECT_BASIC_PROCESS_ID_LIST* pList = (JOBOBJECT_BASIC_PROCESS_ID_LIST*)buffer;
+
+	// A full list reports ERROR_MORE_DATA but is still filled in as far as it goes.
+
+	if (!QueryInformationJobObject(lpChild->hJob, JobObjectBasicProcessIdList, pList, sizeof(buffer), NULL)
+			&& (GetLastError() != ERROR_MORE_DATA)) {
+		pProcessIds[0] = lpChild->pi.dwProcessId;
+		return 1;
+	}
+
+	DWORD dwCount = (pList->NumberOfProcessIdsInList < dwMaxProcessIds) ? pList->NumberOfProcessIdsInList : dwMaxProcessIds;
+	for (DWORD i = 0; i < dwCount; i++) {
+		pProcessIds[i] = (DWORD)pList->ProcessIdList[i];
+	}
+
+	return dwCount;
+}
+
+BOOL SrvChildGetMemory(LPSRV_CHILD lpChild, PULONGLONG pullPrivateBytes, PULONGLONG pullWorkingSetBytes) {
+
+	*pullPrivateBytes = 0;
+	*pullWorkingSetBytes = 0;
+
+	if (lpChild->pi.hProcess == NULL) {
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+
+	static DWORD processIds[MAX_CHILD_PROCESSES];
+	DWORD dwCount = SrvChildGetProcessIds(lpChild, processIds, MAX_CHILD_PROCESSES);
+
+	for (DWORD i = 0; i < dwCount; i++) {
+
+		HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processIds[i]);
+
+		if (hProcess == NULL) {
+			continue;
+		}
+
+		PROCESS_MEMORY_COUNTERS_EX counters;
+		if (GetProcessMemoryInfo(hProcess, (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters))) {
+			*pullPrivateBytes += counters.PrivateUsage;
+			*pullWorkingSetBytes += counters.WorkingSetSize;
+		}
+
+		CloseHandle(hProcess);
+	}
+
+	return TRUE;
+}
+
+BOOL SrvChildGetUsage(LPSRV_CHILD lpChild, PULONGLONG pullPeakBytes, PULONGLONG pullCpuTime) {
+
+	*pullPeakBytes = 0;
+	*pullCpuTime = 0;
+
+	if (lpChild->pi.hProcess == NULL) {
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+
+	if (lpChild->hJob != NULL) {
+
+		JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+		JOBOBJECT_BASIC_ACCOUNTING_INFORMATION accounting;
+
+		if (QueryInformationJobObject(lpChild->hJob, JobObjectExtendedLimitInformation, &limits, sizeof(limits), NULL)
+				&& QueryInformationJobObject(lpChild->hJob, JobObjectBasicAccountingInformation, &accounting, sizeof(accounting), NULL)) {
+
+			*pullPeakBytes = limits.PeakJobMemoryUsed;
+			*pullCpuTime = accounting.TotalUserTime.QuadPart + accounting.TotalKernelTime.QuadPart;
+			return TRUE;
+		}
+	}
+
+	FILETIME ftCreation, ftExit, ftKernel, ftUser;
+	if (!GetProcessTimes(lpChild->pi.hProcess, &ftCreation, &ftExit, &ftKernel, &ftUser)) {
+		return FALSE;
+	}
+
+	ULARGE_INTEGER uliKernel, uliUser;
+	uliKernel.LowPart = ftKernel.dwLowDateTime;
+	uliKernel.HighPart = ftKernel.dwHighDateTime;
+	uliUser.LowPart = ftUser.dwLowDateTime;
+	uliUser.HighPart = ftUser.dwHighDateTime;
+	*pullCpuTime = uliKernel.QuadPart + uliUser.QuadPart;
+
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(lpChild->pi.hProcess, &counters, sizeof(counters))) {
+		*pullPeakBytes = counters.PeakPagefileUsage;
+	}
+
+	return TRUE;
+}
+
+void SrvChildClose(LPSRV_CHILD lpChild) {
+
+	if (lpChild->pi.hProcess != NULL) {
+		CloseHandle(lpChild->pi.hProcess);
+	}
+	if (lpChild->pi.hThread != NULL) {
+		CloseHandle(lpChild->pi.hThread);
+	}
+	if (lpChild->hJob != NULL) {
+		CloseHandle(lpChild->hJob);
+		lpChild->hJob = NULL;
+	}
+
+	ZeroMemory(&lpChild->pi, sizeof(lpChild->pi));
+}
+
+/**
+ * Apply an undocumented but long-stable ntdll process function,
+ * NtSuspendProcess or NtResumeProcess, to each process in the child's process tree.
+ * Every process is attempted even if one fails.
+ */
+static BOOL ForEachChildProcess(LPSRV_CHILD lpChild, LPCSTR lpFunctionName, LPDWORD pdwProcesses) {
+
+	*pdwProcesses = 0;
+
+	if (lpChild->pi.hProcess == NULL) {
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+
+	LPNT_PROCESS_FUNCTION lpFunction = (LPNT_PROCESS_FUNCTION)GetProcAddress(GetModuleHandle("ntdll.dll"), lpFunctionName);
+	if (lpFunction == NULL) {
+		return FALSE;
+	}
+
+	static DWORD processIds[MAX_CHILD_PROCESSES];
+	DWORD dwCount = SrvChildGetProcessIds(lpChild, processIds, MAX_CHILD_PROCESSES);
+
+	BOOL bSuccess = TRUE;
+
+	for (DWORD i = 0; i < dwCount; i++) {
+
+		HANDLE hProcess = OpenProcess(PROCESS_SUSPEND_RESUME, FALSE, processIds[i]);
+
+		if (hProcess == NULL) {
+			bSuccess = FALSE;
+			continue;
+		}
+
+		if (lpFunction(hProcess) < 0) {
+			SetLastError(ERROR_ACCESS_DENIED);
+			bSuccess = FALSE;
+		}
+		else {
+			(*pdwProcesses)++;
+		}
+
+		CloseHandle(hProcess);
+	}
+
+	return bSuccess;
+}
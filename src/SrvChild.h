@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVCHILD_H_
+#define SRVCHILD_H_
+
+#include <windows.h>
+
+#include "SrvConfig.h"
+
+/**
+ * How far SrvChildStop() had to go to stop the child.
+ *
+ *	SRV_STOP_NONE		the child has not been asked to stop.
+ *	SRV_STOP_SIGNALED	the child was sent CTRL + C.
+ *	SRV_STOP_DUMPED		the child did not stop in time and hang diagnostics were captured.
+ *	SRV_STOP_KILLED		the child was killed.
+ */
+typedef enum tagSRV_STOP_STEP {
+	SRV_STOP_NONE,
+	SRV_STOP_SIGNALED,
+	SRV_STOP_DUMPED,
+	SRV_STOP_KILLED
+} SRV_STOP_STEP;
+
+/**
+ * The child and its descendants are placed in a job object, if possible,
+ * so that the whole process tree can be acted on at once.  The job kills
+ * any descendants still running when it is closed by SrvChildClose().
+ * ftReady is left for the caller to set when it reports the service running.
+ */
+typedef struct tagSRV_CHILD {
+	PROCESS_INFORMATION pi;
+	HANDLE hJob;
+	FILETIME ftLaunched;
+	FILETIME ftReady;
+	FILETIME ftStopRequested;
+	SRV_STOP_STEP stopStep;
+	DWORD dwLaunches;
+	BOOL bSuspended;
+} SRV_CHILD,*LPSRV_CHILD;
+
+/**
+ * Launch the wrapped executable described by the service configuration.
+ *
+ *	hStdOutput		is the handle to receive the child's standard output,
+ *					or NULL to use the wrapper's own handles.
+ *
+ *	hStdError		is the handle to receive the child's standard error,
+ *					or NULL to use hStdOutput.
+ *
+ * Returns FALSE if CreateProcess() fails.
+ */
+BOOL SrvChildLaunch(LPSRV_CONFIG lpSrvConfig, HANDLE hStdOutput, HANDLE hStdError, LPSRV_CHILD lpChild);
+
+/**
+ * Stop the child process by sending CTRL + C to the console,
+ * waiting up to dwWaitMillis for it to terminate and then killing it,
+ * with every process in its job, after capturing any configured hang
+ * diagnostics.
+ * Wait hints are reported to the SCM while waiting.
+ *
+ *	pbKilled		receives TRUE if the child had to be killed.
+ *
+ * Returns FALSE if the child could not be signaled or killed.
+ */
+BOOL SrvChildStop(LPSRV_CHILD lpChild, DWORD dwWaitMillis, LPBOOL pbKilled);
+
+/**
+ * Send a console control event, CTRL_C_EVENT or CTRL_BREAK_EVENT,
+ * to the child.  The wrapper ignores the event itself.
+ */
+BOOL SrvChildSignal(LPSRV_CHILD lpChild, DWORD dwCtrlEvent);
+
+/**
+ * Suspend every process in the child's process tree.
+ *
+ *	pdwProcesses	receives the number of processes suspended.
+ */
+BOOL SrvChildSuspend(LPSRV_CHILD lpChild, LPDWORD pdwProcesses);
+
+/**
+ * Resume every process in the child's process tree
+ * after SrvChildSuspend().
+ */
+BOOL SrvChildResume(LPSRV_CHILD lpChild, LPDWORD pdwProcesses);
+
+/**
+ * Get the ids of the processes in the child's process tree,
+ * or just the child's id if it is not in a job.
+ *
+ * Returns the number of ids stored in pProcessIds.
+ */
+DWORD SrvChildGetProcessIds(LPSRV_CHILD lpChild, LPDWORD pProcessIds, DWORD dwMaxProcessIds);
+
+/**
+ * Get the memory committed privately by, and the working set of,
+ * all processes in the child's process tree.  Processes that exit
+ * or cannot be opened while sampling are skipped.
+ */
+BOOL SrvChildGetMemory(LPSRV_CHILD lpChild, PULONGLONG pullPrivateBytes, PULONGLONG pullWorkingSetBytes);
+
+/**
+ * Get the peak committed memory and the total CPU time, in 100 nanosecond units,
+ * of the child's process tree, or of the child alone if it is not in a job.
+ */
+BOOL SrvChildGetUsage(LPSRV_CHILD lpChild, PULONGLONG pullPeakBytes, PULONGLONG pullCpuTime);
+
+/**
+ * Run a side command, such as a diagnostic tool, alongside the child
+ * without waiting for it to finish.
+ *
+ *	hStdOutput		is the handle to receive the command's output,
+ *					or NULL to use the wrapper's own handles.
+ *
+ *	phProcess		points to a variable to receive the command's process handle,
+ *					which the caller must close, or is NULL if not needed.
+ */
+BOOL SrvChildRunCommand(LPCSTR lpCommandLine, HANDLE hStdOutput, LPHANDLE phProcess);
+
+/**
+ * Close the handles to a terminated child process.
+ */
+void SrvChildClose(LPSRV_CHILD lpChild);
+
+#endif /* SRVCHILD_H_ */
@@ -17,112 +17,586 @@
 #include <windows.h>
 
 #include <tchar.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "SrvConfig.h"
+#include "SrvControl.h"
+#include "SrvConfigCache.h"
+#include "SrvEnvCache.h"
+#include "SrvPrefetch.h"
+#include "SrvLogTransform.h"
+#include "SrvLogCompress.h"
+#include "SrvLogLimit.h"
+#include "SrvLogForward.h"
 
-static BOOL GetSrvEnvironment(char*, FILE*, LPVOID*);
+#define MAX_LINE_LENGTH 256
 
-LPSRV_CONFIG GetSrvConfig(LPSTR lpConfigName) {
+/**
+ * Types of configuration value.
+ *
+ *	KEY_STRING			any text.
+ *	KEY_LIST			entries separated by semicolons; repeating the key adds more.
+ *	KEY_ENVIRONMENT		the Environment key, which may read further lines.
+ *	KEY_CONTROL_ACTION	the OnControl key.
+ *	KEY_INCLUDE			the Include key, which reads another file.
+ *	KEY_NUMBER			decimal digits.
+ *	KEY_DURATION		decimal digits with an optional unit of ms, s, m or h.
+ *	KEY_SIZE			decimal digits with an optional unit of KB, MB or GB.
+ *	KEY_BOOLEAN			0 or 1, false or true, no or yes, off or on.
+ *
+ * Types from KEY_NUMBER on are kept in a DWORD field.  A duration or size
+ * without a unit is in the unit of its field.
+ */
+typedef enum {
+	KEY_STRING,
+	KEY_LIST,
+	KEY_ENVIRONMENT,
+	KEY_CONTROL_ACTION,
+	KEY_INCLUDE,
+	KEY_NUMBER,
+	KEY_DURATION,
+	KEY_SIZE,
+	KEY_BOOLEAN
+} KEY_TYPE;
+
+/**
+ * Check a string value.
+ *
+ * Returns NULL if the value is acceptable, or else a description of what is expected.
+ */
+typedef LPCSTR (*KEY_VALIDATOR)(LPCSTR);
+
+typedef struct {
+	LPCSTR lpName;
+	KEY_TYPE type;
+	SIZE_T offset;						// of the field in SRV_CONFIG
+	DWORD dwDefault;
+	DWORD dwUnit;						// milliseconds or bytes in one unit of the field
+	DWORD dwMin;
+	DWORD dwMax;
+	KEY_VALIDATOR lpValidate;
+} CONFIG_KEY;
+
+#define STRING_KEY(name, field, validate) \
+	{ name, KEY_STRING, offsetof(SRV_CONFIG, field), 0, 0, 0, 0, validate }
+#define LIST_KEY(name, field) \
+	{ name, KEY_LIST, offsetof(SRV_CONFIG, field), 0, 0, 0, 0, NULL }
+#define SPECIAL_KEY(name, type) \
+	{ name, type, 0, 0, 0, 0, 0, NULL }
+#define NUMBER_KEY(name, field, def, min, max) \
+	{ name, KEY_NUMBER, offsetof(SRV_CONFIG, field), def, 1, min, max, NULL }
+#define DURATION_KEY(name, field, def, unit, min) \
+	{ name, KEY_DURATION, offsetof(SRV_CONFIG, field), def, unit, min, MAXDWORD, NULL }
+#define SIZE_KEY(name, field, def, unit) \
+	{ name, KEY_SIZE, offsetof(SRV_CONFIG, field), def, unit, 0, MAXDWORD, NULL }
+#define BOOLEAN_KEY(name, field, def) \
+	{ name, KEY_BOOLEAN, offsetof(SRV_CONFIG, field), def, 1, 0, 1, NULL }
+
+#define MINUTE_MILLIS 60000
+#define KILOBYTE_BYTES 1024
+#define MEGABYTE_BYTES (1024 * 1024)
+
+static LPCSTR ValidateHealthCheck(LPCSTR);
+static LPCSTR ValidateHealthAction(LPCSTR);
+static LPCSTR ValidateOutputLogFormat(LPCSTR);
+static LPCSTR ValidateOutputLogCompression(LPCSTR);
+static LPCSTR ValidateOutputLogLimitPolicy(LPCSTR);
+static LPCSTR ValidateOutputLogForward(LPCSTR);
+
+/**
+ * The configuration keys, with the type, default and limits of each value.
+ * Fields not named here start as 0 or NULL.
+ */
+static const CONFIG_KEY configKeys[] = {
+	SPECIAL_KEY("Include", KEY_INCLUDE),
+	STRING_KEY("ApplicationName", lpApplicationName, NULL),
+	STRING_KEY("CommandLine", lpCommandLine, NULL),
+	STRING_KEY("CurrentDirectory", lpCurrentDirectory, NULL),
+	SPECIAL_KEY("Environment", KEY_ENVIRONMENT),
+	STRING_KEY("OutputLog", lpOutputLog, NULL),
+	SIZE_KEY("OutputLogRotateBytes", dwOutputLogRotateBytes, 0, 1),
+	SIZE_KEY("OutputLogIndexKB", dwOutputLogIndexKB, 64, KILOBYTE_BYTES),
+	STRING_KEY("OutputLogFormat", lpOutputLogFormat, ValidateOutputLogFormat),
+	STRING_KEY("OutputLogCompression", lpOutputLogCompression, ValidateOutputLogCompression),
+	NUMBER_KEY("OutputLogCompressLimit", dwOutputLogCompressLimit, 2, 1, 64),
+	NUMBER_KEY("OutputLogKeep", dwOutputLogKeep, 0, 0, MAXDWORD),
+	DURATION_KEY("OutputLogKeepHours", dwOutputLogKeepHours, 0, 60 * MINUTE_MILLIS, 0),
+	SIZE_KEY("OutputLogKeepMB", dwOutputLogKeepMB, 0, MEGABYTE_BYTES),
+	SIZE_KEY("OutputLogRateBytes", dwOutputLogRateBytes, 0, 1),
+	SIZE_KEY("OutputLogBurstBytes", dwOutputLogBurstBytes, 0, 1),
+	STRING_KEY("OutputLogLimitPolicy", lpOutputLogLimitPolicy, ValidateOutputLogLimitPolicy),
+	NUMBER_KEY("OutputLogSample", dwOutputLogSample, 100, 1, MAXDWORD),
+	STRING_KEY("OutputLogForward", lpOutputLogForward, ValidateOutputLogForward),
+	SIZE_KEY("OutputLogForwardBufferKB", dwOutputLogForwardBufferKB, 1024, KILOBYTE_BYTES),
+	SIZE_KEY("OutputLogForwardSpillMB", dwOutputLogForwardSpillMB, 64, MEGABYTE_BYTES),
+	SPECIAL_KEY("OnControl", KEY_CONTROL_ACTION),
+	BOOLEAN_KEY("WatchConfig", dwWatchConfig, 0),
+	BOOLEAN_KEY("ConfigCache", dwConfigCache, 0),
+	BOOLEAN_KEY("Expand", dwExpand, 0),
+	STRING_KEY("HealthCheck", lpHealthCheck, ValidateHealthCheck),
+	STRING_KEY("HealthAction", lpHealthAction, ValidateHealthAction),
+	DURATION_KEY("HealthIntervalMillis", dwHealthIntervalMillis, 10000, 1, 1),
+	DURATION_KEY("HealthTimeoutMillis", dwHealthTimeoutMillis, 2000, 1, 1),
+	NUMBER_KEY("HealthFailures", dwHealthFailures, 3, 0, MAXDWORD),
+	NUMBER_KEY("HealthWindow", dwHealthWindow, 100, 1, MAXDWORD),
+	DURATION_KEY("HealthMaxP99Millis", dwHealthMaxP99Millis, 0, 1, 0),
+	DURATION_KEY("WatchdogMillis", dwWatchdogMillis, 0, 1, 0),
+	STRING_KEY("HangDumpDirectory", lpHangDumpDirectory, NULL),
+	NUMBER_KEY("HangDumpsKept", dwHangDumpsKept, 5, 1, MAXDWORD),
+	DURATION_KEY("HangThreadDumpMillis", dwHangThreadDumpMillis, 0, 1, 0),
+	DURATION_KEY("RecycleSampleMillis", dwRecycleSampleMillis, 60000, 1, 1),
+	SIZE_KEY("RecycleMaxPrivateMB", dwRecycleMaxPrivateMB, 0, MEGABYTE_BYTES),
+	SIZE_KEY("RecycleMaxGrowthMBPerHour", dwRecycleMaxGrowthMBPerHour, 0, MEGABYTE_BYTES),
+	DURATION_KEY("RecycleAfterMinutes", dwRecycleAfterMinutes, 0, MINUTE_MILLIS, 0),
+	STRING_KEY("Journal", lpJournal, NULL),
+	NUMBER_KEY("JournalRecords", dwJournalRecords, 1000, 1, MAXDWORD),
+	DURATION_KEY("StopTimeoutMillis", dwStopTimeoutMillis, 30000, 1, 0),
+	BOOLEAN_KEY("StopTimeoutAdaptive", dwStopTimeoutAdaptive, 0),
+	NUMBER_KEY("StopTimeoutPercentile", dwStopTimeoutPercentile, 99, 1, 100),
+	DURATION_KEY("StopTimeoutMarginMillis", dwStopTimeoutMarginMillis, 5000, 1, 0),
+	DURATION_KEY("StopTimeoutMinMillis", dwStopTimeoutMinMillis, 5000, 1, 0),
+	DURATION_KEY("StopTimeoutMaxMillis", dwStopTimeoutMaxMillis, 300000, 1, 0),
+	NUMBER_KEY("StartGateSlots", dwStartGateSlots, 0, 0, MAXIMUM_WAIT_OBJECTS),
+	DURATION_KEY("StartGateWaitMillis", dwStartGateWaitMillis, 600000, 1, 0),
+	LIST_KEY("Prefetch", lpPrefetch),
+	NUMBER_KEY("PrefetchThreads", dwPrefetchThreads, 4, 1, SRV_PREFETCH_MAX_THREADS),
+	DURATION_KEY("PrefetchWaitMillis", dwPrefetchWaitMillis, 10000, 1, 0),
+	BOOLEAN_KEY("Java", dwJava, 0),
+	STRING_KEY("JavaArchiveDirectory", lpJavaArchiveDirectory, NULL),
+	NUMBER_KEY("JavaHeapPercent", dwJavaHeapPercent, 75, 0, 100),
+};
+
+#define CONFIG_KEYS (sizeof(configKeys) / sizeof(configKeys[0]))
+
+#define IS_NUMERIC_KEY(lpKey) ((lpKey)->type >= KEY_NUMBER)
+
+// Perfect hash of the key names.  With keySeed, every name hashes to its own
+// slot, which holds its index in configKeys plus 1, so a lookup costs one hash
+// and one comparison.  BuildKeyTable() searches for the seed on first use.
+
+#define KEY_SLOTS 512
+#define KEY_SEED_TRIES 65536
+
+static WORD keySlots[KEY_SLOTS];
+static DWORD dwKeySeed = 0;
+static BOOL bKeyTableBuilt = FALSE;
+static BOOL bKeyTableHashed = FALSE;
+
+// Offsets of the single string fields, for releasing and caching them.
+
+static SIZE_T stringFields[CONFIG_KEYS + 1];
+static DWORD dwStringFields = 0;
+
+// Fingerprint of the keys and of this file's build, for the configuration cache.
+
+#define SCHEMA_OFFSET_BASIS 14695981039346656037ULL
+#define SCHEMA_PRIME 1099511628211ULL
+
+static const char parserBuild[] = __DATE__ " " __TIME__;
+static ULONGLONG ullSchemaHash = 0;
+
+/**
+ * A file being parsed, for reporting where an error was found.
+ */
+typedef struct {
+	LPCSTR lpPath;
+	FILE* file;
+	DWORD dwLine;
+} CONFIG_SOURCE;
+
+/**
+ * Where parsing is among the sections of a file, which carries on into included files.
+ */
+typedef struct {
+	LPCSTR lpServiceName;
+	BOOL bSelected;						// lines of the current section apply to this service
+	BOOL bEnvironment;					// lines of the current section are environment variables
+	BOOL bServiceSeen;					// a [service:name] section has been seen
+	BOOL bServiceFound;					// a [service:name] section matched this service
+	DWORD dwIncludeDepth;
+	LPSTR lpExpanded;					// the last value expanded, MAX_EXPANDED_LENGTH bytes
+	LPSRV_ENV_FILE lpEnvFile;			// the environment file, if read from its text
+} CONFIG_SCOPE;
+
+#define MAX_INCLUDE_DEPTH 8
+
+// An expanded value may hold an environment variable of the greatest length.
+
+#define MAX_EXPANDED_LENGTH 32768
+
+static char configError[MAX_PATH + MAX_LINE_LENGTH];
+
+/**
+ * Units accepted after a duration or size, as multiples of a millisecond or byte.
+ */
+static const struct {
+	KEY_TYPE type;
+	LPCSTR lpName;
+	DWORD dwMultiple;
+} configUnits[] = {
+	{ KEY_DURATION, "ms", 1 },
+	{ KEY_DURATION, "s", 1000 },
+	{ KEY_DURATION, "m", MINUTE_MILLIS },
+	{ KEY_DURATION, "h", 60 * MINUTE_MILLIS },
+	{ KEY_SIZE, "B", 1 },
+	{ KEY_SIZE, "KB", KILOBYTE_BYTES },
+	{ KEY_SIZE, "MB", MEGABYTE_BYTES },
+	{ KEY_SIZE, "GB", 1024 * MEGABYTE_BYTES },
+};
+
+#define CONFIG_UNITS (sizeof(configUnits) / sizeof(configUnits[0]))
+
+static const struct {
+	LPCSTR lpName;
+	DWORD dwValue;
+} configBooleans[] = {
+	{ "0", 0 }, { "1", 1 },
+	{ "false", 0 }, { "true", 1 },
+	{ "no", 0 }, { "yes", 1 },
+	{ "off", 0 }, { "on", 1 },
+};
+
+#define CONFIG_BOOLEANS (sizeof(configBooleans) / sizeof(configBooleans[0]))
+
+static void BuildKeyTable(void);
+static DWORD HashKeyword(DWORD, LPCSTR);
+static ULONGLONG HashSchema(ULONGLONG, LPCVOID, SIZE_T);
+static const CONFIG_KEY* FindConfigKey(LPCSTR);
+static void SetSrvConfigError(CONFIG_SOURCE*, DWORD, LPCSTR, ...);
+static BOOL ReadSrvConfigLine(CONFIG_SOURCE*, char*, int);
+static BOOL GetSrvConfigLines(CONFIG_SOURCE*, CONFIG_SCOPE*, LPSRV_CONFIG);
+static BOOL SetSrvConfigSection(CONFIG_SOURCE*, char*, CONFIG_SCOPE*);
+static BOOL SetSrvConfigValue(CONFIG_SOURCE*, CONFIG_SCOPE*, const CONFIG_KEY*, char*, DWORD, LPSRV_CONFIG);
+static BOOL IncludeSrvConfig(char*, DWORD, CONFIG_SOURCE*, CONFIG_SCOPE*, LPSRV_CONFIG);
+static BOOL SetSrvString(LPTSTR*, LPCSTR, BOOL);
+static BOOL GetSrvEnvironment(char*, DWORD, CONFIG_SOURCE*, CONFIG_SCOPE*, LPSRV_CONFIG);
+static LPSRV_ENV_FILE ReadSrvEnvFile(LPCSTR, DWORD, CONFIG_SOURCE*);
+static BOOL SetSrvEnvironmentVariable(CONFIG_SOURCE*, CONFIG_SCOPE*, char*, LPSRV_CONFIG);
+static BOOL ExpandSrvConfigValue(CONFIG_SOURCE*, CONFIG_SCOPE*, LPCSTR, DWORD, LPSRV_CONFIG);
+static BOOL EvaluateSrvExpression(CONFIG_SOURCE*, CONFIG_SCOPE*, char*, DWORD, LPSRV_CONFIG, DWORD*);
+static BOOL GetSrvVariable(CONFIG_SOURCE*, CONFIG_SCOPE*, LPCSTR, DWORD, LPSTR, DWORD, DWORD*, LPSRV_CONFIG);
+static BOOL GetSrvVariableValue(LPCSTR, LPCSTR, BOOL, LPSTR, DWORD, DWORD*);
+static BOOL AddSrvReference(LPSRV_CONFIG, LPCSTR, BOOL, LPCSTR);
+static void FormatSrvReference(LPCSTR, BOOL, LPCSTR, LPSTR, DWORD);
+static size_t GetSrvNameLength(LPCSTR);
+static BOOL AddSrvMultiString(LPTSTR*, LPCSTR);
+static DWORD GetSrvEnvironmentHash(void);
+static BOOL IsSrvEnvironmentKept(LPCSTR);
+static BOOL SetSrvEnvironmentBlock(LPCSTR, BOOL);
+static BOOL EqualSrvStrings(LPCTSTR, LPCTSTR);
+static BOOL GetSrvNumber(char*, DWORD*);
+static BOOL GetSrvTypedNumber(CONFIG_SOURCE*, const CONFIG_KEY*, char*, DWORD, DWORD*);
+static BOOL GetSrvBoolean(CONFIG_SOURCE*, const CONFIG_KEY*, char*, DWORD, DWORD*);
+static BOOL GetSrvControlAction(char*, DWORD, CONFIG_SOURCE*, LPSRV_CONFIG);
+
+LPSRV_CONFIG GetSrvConfig(LPSTR lpConfigName, LPCSTR lpServiceName) {
+
+	// Parsing began before any source written later, which the cache must not claim.
+
+	FILETIME ftParseStarted;
+	GetSystemTimeAsFileTime(&ftParseStarted);
+
+	LPSRV_CONFIG lpSrvConfig = SrvConfigCacheLoad(lpConfigName, lpServiceName);
+
+	if (lpSrvConfig == NULL) {
+
+		lpSrvConfig = ReadSrvConfig(lpConfigName, lpServiceName);
+
+		if (lpSrvConfig == NULL) {
+			return NULL;
+		}
+
+		// A configuration that cannot be cached still works.
+
+		if (lpSrvConfig->dwConfigCache != 0) {
+			SrvConfigCacheSave(lpConfigName, lpServiceName, lpSrvConfig, &ftParseStarted);
+		}
+	}
+
+	// Fingerprint the environment that the child will inherit
+	// so that a reload can tell whether it changed.
+
+	lpSrvConfig->dwEnvironmentHash = GetSrvEnvironmentHash();
+
+	return lpSrvConfig;
+}
+
+LPVOID SaveSrvEnvironment(void) {
+
+	LPCH lpEnvironment = GetEnvironmentStrings();
+	if (lpEnvironment == NULL) {
+		return NULL;
+	}
+
+	// The block is a sequence of null terminated strings ending with an empty string.
+
+	LPCH p = lpEnvironment;
+	while (*p != 0) {
+		p += strlen(p) + 1;
+	}
+	SIZE_T cbEnvironment = p + 1 - lpEnvironment;
+
+	LPVOID lpSaved = HeapAlloc(GetProcessHeap(), 0, cbEnvironment);
+	if (lpSaved != NULL) {
+		memcpy(lpSaved, lpEnvironment, cbEnvironment);
+	}
+	else {
+		SetLastError(ERROR_OUTOFMEMORY);
+	}
+
+	FreeEnvironmentStrings(lpEnvironment);
+	return lpSaved;
+}
+
+BOOL RestoreSrvEnvironment(LPCVOID lpSaved) {
+
+	LPCH lpEnvironment = GetEnvironmentStrings();
+	if (lpEnvironment == NULL) {
+		return FALSE;
+	}
+
+	// Remove every variable, then set those saved.
+
+	BOOL bSuccess = SetSrvEnvironmentBlock(lpEnvironment, FALSE);
+	FreeEnvironmentStrings(lpEnvironment);
+
+	return SetSrvEnvironmentBlock(lpSaved, TRUE) && bSuccess;
+}
+
+LPVOID ReleaseSrvEnvironment(LPVOID lpSaved) {
+
+	if (lpSaved != NULL) {
+		HeapFree(GetProcessHeap(), 0, lpSaved);
+	}
+	return NULL;
+}
+
+LPSRV_CONFIG ReadSrvConfig(LPSTR lpConfigName, LPCSTR lpServiceName) {
 
 	HANDLE hHeap = GetProcessHeap();
 	if (hHeap == NULL) {
 		return NULL;
 	}
 
-	LPSRV_CONFIG lpSrvConfig = HeapAlloc(hHeap, 0, sizeof(*lpSrvConfig));
+	configError[0] = 0;
+
+	LPSRV_CONFIG lpSrvConfig = HeapAlloc(hHeap, HEAP_ZERO_MEMORY, sizeof(*lpSrvConfig));
 	if (lpSrvConfig == NULL) {
 		SetLastError(ERROR_OUTOFMEMORY);
 		return NULL;
 	}
 
-	lpSrvConfig->lpApplicationName = NULL;
-	lpSrvConfig->lpCommandLine = NULL;
-	lpSrvConfig->lpCurrentDirectory = NULL;
-	lpSrvConfig->lpEnvironment = NULL;
+	for (DWORD i = 0; i < CONFIG_KEYS; i++) {
+		if (IS_NUMERIC_KEY(&configKeys[i])) {
+			*(DWORD*)((LPBYTE)lpSrvConfig + configKeys[i].offset) = configKeys[i].dwDefault;
+		}
+	}
+
+	// Open the file and read it.
 
-	// Open the file and loop over it line by line.
+	CONFIG_SOURCE source;
+	source.lpPath = lpConfigName;
+	source.file = fopen(lpConfigName, "r");
+	source.dwLine = 0;
 
-	FILE* file = fopen(lpConfigName, "r");
-	if (file == NULL) {
+	if (source.file == NULL) {
+		SetSrvConfigError(&source, 0, "cannot be opened");
 		SetLastError(ERROR_FILE_NOT_FOUND);
 		return ReleaseSrvConfig(lpSrvConfig);
 	}
 
-	const int MAX_LINE_LENGTH = 256;
-	char line[MAX_LINE_LENGTH];
-	while (fgets(line, sizeof(line), file)) {
+	// Lines before the first section apply to every service.
 
-		// Expecting line with "keyword=value\n\0".
-		// Replace "=" and "\n" with 0 terminators.
-		// Ignore empty lines.
+	CONFIG_SCOPE scope;
+	ZeroMemory(&scope, sizeof(scope));
+	scope.lpServiceName = lpServiceName;
+	scope.bSelected = TRUE;
+	scope.lpExpanded = HeapAlloc(hHeap, 0, MAX_EXPANDED_LENGTH);
 
-		char* pNewline = strchr(line, '\n');
-		if (pNewline != NULL) {
-			*pNewline = 0;
-		}
+	BOOL bSuccess = (scope.lpExpanded != NULL);
 
-		if (line[0] == 0) {
-			continue;
+	if (bSuccess) {
+		bSuccess = GetSrvConfigLines(&source, &scope, lpSrvConfig);
+		HeapFree(hHeap, 0, scope.lpExpanded);
+	}
+	else {
+		SetLastError(ERROR_OUTOFMEMORY);
+	}
+
+	fclose(source.file);
+
+	// An environment file read from its text is cached for the next service
+	// to read it, which need not use the same configuration file.
+
+	if (scope.lpEnvFile != NULL) {
+		DWORD dwLastError = GetLastError();
+		if (bSuccess && (lpSrvConfig->dwConfigCache != 0)) {
+			SrvEnvCacheSave(lpSrvConfig->lpEnvironmentFile, scope.lpEnvFile);
 		}
+		SrvEnvFileRelease(scope.lpEnvFile);
+		SetLastError(dwLastError);
+	}
 
-		char* pEquals = strchr(line, '=');
-		if (pEquals == NULL) {
-			SetLastError(ERROR_BAD_FORMAT);
-			return ReleaseSrvConfig(lpSrvConfig);
+	if (!bSuccess) {
+		return ReleaseSrvConfig(lpSrvConfig);
+	}
+
+	if (scope.bServiceSeen && !scope.bServiceFound) {
+		source.dwLine = 0;
+		if (lpServiceName != NULL) {
+			SetSrvConfigError(&source, 0, "has no [service:%s] section", lpServiceName);
 		}
-		*pEquals = 0;
+		else {
+			SetSrvConfigError(&source, 0, "has [service:name] sections but no service was named");
+		}
+		return ReleaseSrvConfig(lpSrvConfig);
+	}
 
-		char* pKeyword = line;
-		char* pValue = pEquals + 1;
+	return lpSrvConfig;
+}
+
+DWORD CompareSrvConfig(LPSRV_CONFIG lpOldConfig, LPSRV_CONFIG lpNewConfig) {
+
+	DWORD dwChanges = 0;
+
+	if (!EqualSrvStrings(lpOldConfig->lpApplicationName, lpNewConfig->lpApplicationName)
+			|| !EqualSrvStrings(lpOldConfig->lpCommandLine, lpNewConfig->lpCommandLine)
+			|| !EqualSrvStrings(lpOldConfig->lpCurrentDirectory, lpNewConfig->lpCurrentDirectory)
+			|| (lpOldConfig->dwEnvironmentHash != lpNewConfig->dwEnvironmentHash)
+			|| (lpOldConfig->dwWatchdogMillis != lpNewConfig->dwWatchdogMillis)
+			|| (lpOldConfig->dwJava != lpNewConfig->dwJava)
+			|| !EqualSrvStrings(lpOldConfig->lpJavaArchiveDirectory, lpNewConfig->lpJavaArchiveDirectory)
+			|| (lpOldConfig->dwJavaHeapPercent != lpNewConfig->dwJavaHeapPercent)) {
+		dwChanges |= SRV_CONFIG_CHANGED_LAUNCH;
+	}
+
+	// Starting or stopping capture changes the child's standard handles, and the
+	// output log settings are applied with the launch.  Otherwise they only
+	// apply while capturing.
 
-		// Check for keyword with simple value.
+	if ((lpOldConfig->lpOutputLog == NULL) != (lpNewConfig->lpOutputLog == NULL)) {
+		dwChanges |= SRV_CONFIG_CHANGED_LAUNCH;
+	}
+	else if (lpNewConfig->lpOutputLog != NULL) {
 
-		LPTSTR* pField = NULL;
-		if (strcmp(pKeyword, "ApplicationName") == 0) {
-			pField = (LPTSTR*)&lpSrvConfig->lpApplicationName;
+		if (!EqualSrvStrings(lpOldConfig->lpOutputLog, lpNewConfig->lpOutputLog)
+				|| (lpOldConfig->dwOutputLogRotateBytes != lpNewConfig->dwOutputLogRotateBytes)
+				|| (lpOldConfig->dwOutputLogIndexKB != lpNewConfig->dwOutputLogIndexKB)
+				|| !EqualSrvStrings(lpOldConfig->lpOutputLogFormat, lpNewConfig->lpOutputLogFormat)) {
+			dwChanges |= SRV_CONFIG_CHANGED_OUTPUT_LOG;
 		}
-		else if (strcmp(pKeyword, "CommandLine") == 0) {
-			pField = &lpSrvConfig->lpCommandLine;
+
+		if (!EqualSrvStrings(lpOldConfig->lpOutputLogCompression, lpNewConfig->lpOutputLogCompression)
+				|| (lpOldConfig->dwOutputLogKeep != lpNewConfig->dwOutputLogKeep)
+				|| (lpOldConfig->dwOutputLogKeepHours != lpNewConfig->dwOutputLogKeepHours)
+				|| (lpOldConfig->dwOutputLogKeepMB != lpNewConfig->dwOutputLogKeepMB)) {
+			dwChanges |= SRV_CONFIG_CHANGED_OUTPUT_LOG;
 		}
-		else if (strcmp(pKeyword, "CurrentDirectory") == 0) {
-			pField = (LPTSTR*)&lpSrvConfig->lpCurrentDirectory;
+
+		if ((lpOldConfig->dwOutputLogRateBytes != lpNewConfig->dwOutputLogRateBytes)
+				|| (lpOldConfig->dwOutputLogBurstBytes != lpNewConfig->dwOutputLogBurstBytes)
+				|| !EqualSrvStrings(lpOldConfig->lpOutputLogLimitPolicy, lpNewConfig->lpOutputLogLimitPolicy)
+				|| (lpOldConfig->dwOutputLogSample != lpNewConfig->dwOutputLogSample)) {
+			dwChanges |= SRV_CONFIG_CHANGED_OUTPUT_LOG;
 		}
 
-		if (pField != NULL) {
+		if (!EqualSrvStrings(lpOldConfig->lpOutputLogForward, lpNewConfig->lpOutputLogForward)
+				|| (lpOldConfig->dwOutputLogForwardBufferKB != lpNewConfig->dwOutputLogForwardBufferKB)
+				|| (lpOldConfig->dwOutputLogForwardSpillMB != lpNewConfig->dwOutputLogForwardSpillMB)) {
+			dwChanges |= SRV_CONFIG_CHANGED_OUTPUT_LOG;
+		}
+	}
 
-			*pField = HeapAlloc(hHeap, 0, MAX_LINE_LENGTH);
-			if (*pField == NULL) {
-				SetLastError(ERROR_OUTOFMEMORY);
-				return ReleaseSrvConfig(lpSrvConfig);
-			}
+	if (lpOldConfig->dwWatchConfig != lpNewConfig->dwWatchConfig) {
+		dwChanges |= SRV_CONFIG_CHANGED_WATCH;
+	}
 
-			strcpy(*pField, pValue);
+	for (int i = 0; i < SRV_CONTROL_ACTIONS; i++) {
+		if (!EqualSrvStrings(lpOldConfig->lpControlActions[i], lpNewConfig->lpControlActions[i])) {
+			dwChanges |= SRV_CONFIG_CHANGED_ACTIONS;
 		}
-		else if (strcmp(pKeyword, "Environment") == 0) {
+	}
 
-			// Environment keyword requires complex handling.
+	if (!EqualSrvStrings(lpOldConfig->lpHealthCheck, lpNewConfig->lpHealthCheck)
+			|| !EqualSrvStrings(lpOldConfig->lpHealthAction, lpNewConfig->lpHealthAction)
+			|| (lpOldConfig->dwHealthIntervalMillis != lpNewConfig->dwHealthIntervalMillis)
+			|| (lpOldConfig->dwHealthTimeoutMillis != lpNewConfig->dwHealthTimeoutMillis)
+			|| (lpOldConfig->dwHealthFailures != lpNewConfig->dwHealthFailures)
+			|| (lpOldConfig->dwHealthWindow != lpNewConfig->dwHealthWindow)
+			|| (lpOldConfig->dwHealthMaxP99Millis != lpNewConfig->dwHealthMaxP99Millis)) {
+		dwChanges |= SRV_CONFIG_CHANGED_HEALTH;
+	}
 
-			BOOL bSuccess = GetSrvEnvironment(pValue, file, &lpSrvConfig->lpEnvironment);
+	if (!EqualSrvStrings(lpOldConfig->lpHangDumpDirectory, lpNewConfig->lpHangDumpDirectory)
+			|| (lpOldConfig->dwHangDumpsKept != lpNewConfig->dwHangDumpsKept)
+			|| (lpOldConfig->dwHangThreadDumpMillis != lpNewConfig->dwHangThreadDumpMillis)) {
+		dwChanges |= SRV_CONFIG_CHANGED_DIAGNOSTICS;
+	}
 
-			if (!bSuccess) {
-				return ReleaseSrvConfig(lpSrvConfig);
-			}
-		}
-		else {
-			SetLastError(ERROR_BAD_FORMAT);
-			return ReleaseSrvConfig(lpSrvConfig);
-		}
+	if ((lpOldConfig->dwRecycleSampleMillis != lpNewConfig->dwRecycleSampleMillis)
+			|| (lpOldConfig->dwRecycleMaxPrivateMB != lpNewConfig->dwRecycleMaxPrivateMB)
+			|| (lpOldConfig->dwRecycleMaxGrowthMBPerHour != lpNewConfig->dwRecycleMaxGrowthMBPerHour)
+			|| (lpOldConfig->dwRecycleAfterMinutes != lpNewConfig->dwRecycleAfterMinutes)) {
+		dwChanges |= SRV_CONFIG_CHANGED_RECYCLE;
 	}
 
-	if (feof(file) == 0) {
-		SetLastError(ERROR_READ_FAULT);
-		return ReleaseSrvConfig(lpSrvConfig);
+	if (!EqualSrvStrings(lpOldConfig->lpJournal, lpNewConfig->lpJournal)
+			|| (lpOldConfig->dwStopTimeoutMillis != lpNewConfig->dwStopTimeoutMillis)
+			|| (lpOldConfig->dwStopTimeoutAdaptive != lpNewConfig->dwStopTimeoutAdaptive)
+			|| (lpOldConfig->dwStopTimeoutPercentile != lpNewConfig->dwStopTimeoutPercentile)
+			|| (lpOldConfig->dwStopTimeoutMarginMillis != lpNewConfig->dwStopTimeoutMarginMillis)
+			|| (lpOldConfig->dwStopTimeoutMinMillis != lpNewConfig->dwStopTimeoutMinMillis)
+			|| (lpOldConfig->dwStopTimeoutMaxMillis != lpNewConfig->dwStopTimeoutMaxMillis)) {
+		dwChanges |= SRV_CONFIG_CHANGED_STOP;
 	}
 
-	fclose(file);
+	return dwChanges;
+}
+
+HANDLE WatchSrvConfig(LPSTR lpConfigName) {
 
-	return lpSrvConfig;
+	// Change notifications are per directory.
+
+	char directory[MAX_PATH];
+	LPSTR lpFilePart = NULL;
+
+	DWORD dwLength = GetFullPathName(lpConfigName, sizeof(directory), directory, &lpFilePart);
+	if ((dwLength == 0) || (dwLength >= sizeof(directory)) || (lpFilePart == NULL)) {
+		SetLastError(ERROR_BAD_ARGUMENTS);
+		return INVALID_HANDLE_VALUE;
+	}
+	*lpFilePart = 0;
+
+	return FindFirstChangeNotification(
+			directory,
+			FALSE,												// bWatchSubtree
+			FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+}
+
+BOOL GetSrvConfigTime(LPSTR lpConfigName, LPFILETIME lpLastWriteTime) {
+
+	WIN32_FILE_ATTRIBUTE_DATA data;
+
+	if (!GetFileAttributesEx(lpConfigName, GetFileExInfoStandard, &data)) {
+		return FALSE;
+	}
+
+	*lpLastWriteTime = data.ftLastWriteTime;
+	return TRUE;
+}
+
+int GetSrvControlActionIndex(DWORD dwControl) {
+
+	if ((dwControl >= SRV_CONTROL_USER_FIRST) && (dwControl <= SRV_CONTROL_USER_LAST)) {
+		return dwControl - SRV_CONTROL_USER_FIRST;
+	}
+	else if (dwControl == SERVICE_CONTROL_PARAMCHANGE) {
+		return SRV_CONTROL_ACTIONS - 1;
+	}
+
+	return -1;
 }
 
 LPSRV_CONFIG ReleaseSrvConfig(LPSRV_CONFIG lpSrvConfig) {
@@ -136,127 +610,1522 @@ LPSRV_CONFIG ReleaseSrvConfig(LPSRV_CONFIG lpSrvConfig) {
 		return NULL;
 	}
 
-	if (lpSrvConfig->lpApplicationName != NULL) {
-		HeapFree(hHeap, 0, (LPTSTR)lpSrvConfig->lpApplicationName);
-	}
-	if (lpSrvConfig->lpCommandLine != NULL) {
-		HeapFree(hHeap, 0, lpSrvConfig->lpCommandLine);
+	// Strings loaded from the cache are in its view.
+
+	if (lpSrvConfig->lpCacheView != NULL) {
+		UnmapViewOfFile(lpSrvConfig->lpCacheView);
+		HeapFree(hHeap, 0, lpSrvConfig);
+		return NULL;
 	}
-	if (lpSrvConfig->lpCurrentDirectory != NULL) {
-		HeapFree(hHeap, 0, (LPTSTR)lpSrvConfig->lpCurrentDirectory);
+
+	const SIZE_T* lpOffsets;
+	DWORD dwCount = GetSrvConfigStringFields(&lpOffsets);
+
+	for (DWORD i = 0; i < dwCount; i++) {
+		LPTSTR lpString = *(LPTSTR*)((LPBYTE)lpSrvConfig + lpOffsets[i]);
+		if (lpString != NULL) {
+			HeapFree(hHeap, 0, lpString);
+		}
 	}
 	if (lpSrvConfig->lpEnvironment != NULL) {
 		HeapFree(hHeap, 0, lpSrvConfig->lpEnvironment);
 	}
+	for (int i = 0; i < SRV_CONTROL_ACTIONS; i++) {
+		if (lpSrvConfig->lpControlActions[i] != NULL) {
+			HeapFree(hHeap, 0, lpSrvConfig->lpControlActions[i]);
+		}
+	}
+	if (lpSrvConfig->lpEnvironmentVariables != NULL) {
+		HeapFree(hHeap, 0, lpSrvConfig->lpEnvironmentVariables);
+	}
+	if (lpSrvConfig->lpIncludedFiles != NULL) {
+		HeapFree(hHeap, 0, lpSrvConfig->lpIncludedFiles);
+	}
+	if (lpSrvConfig->lpReferences != NULL) {
+		HeapFree(hHeap, 0, lpSrvConfig->lpReferences);
+	}
 
 	HeapFree(hHeap, 0, lpSrvConfig);
 	return NULL;
 }
 
-/**
- * Construct the environment.
- *
- *	pSource
- *			must point to a string in form "source[:path]"
- *			where source is default, inline, or file.
- *
- *	inlineFile
- *			is the file from which to read environment variables
- *			if source is "inline".
- *
- *	plpEnvironment
- *			points to a variable to receive the environment block
- *			suitable for passing to CreateProcess().
- *
- * For ease of implementation, this function simply updates the current environment
- * and returns NULL for plpEnvironment for the caller to pass to CreateProcess()
- * to indicate that the current environment should be inherited by the child process.
- */
-static BOOL GetSrvEnvironment(
-		char* pSource,
-		FILE* inlineFile,
-		LPVOID* plpEnvironment) {
+LPCSTR GetSrvConfigError(void) {
+	return configError;
+}
 
-	*plpEnvironment = NULL;
+ULONGLONG GetSrvConfigSchemaHash(void) {
 
-	FILE* file = NULL;
-	if (strcmp(pSource, "default") == 0) {
-		return TRUE;
+	BuildKeyTable();
+
+	return ullSchemaHash;
+}
+
+DWORD GetSrvConfigStringFields(const SIZE_T** lplpOffsets) {
+
+	BuildKeyTable();
+
+	*lplpOffsets = stringFields;
+	return dwStringFields;
+}
+
+BOOL IsSrvConfigReferenceCurrent(LPCSTR lpServiceName, LPCSTR lpReference) {
+
+	BOOL bBuiltIn = lpReference[0] == '%';
+	LPCSTR lpName = lpReference + (bBuiltIn ? 1 : 0);
+
+	char name[MAX_LINE_LENGTH];
+	size_t nameLength = strcspn(lpName, "=");
+	if (nameLength >= sizeof(name)) {
+		return FALSE;
 	}
-	else if (strcmp(pSource, "inline") == 0) {
-		file = inlineFile;
+	memcpy(name, lpName, nameLength);
+	name[nameLength] = 0;
+
+	char value[MAX_EXPANDED_LENGTH];
+	DWORD dwLength;
+	BOOL bFound = GetSrvVariableValue(lpServiceName, name, bBuiltIn, value, sizeof(value), &dwLength);
+
+	char current[MAX_LINE_LENGTH + 32];
+	FormatSrvReference(name, bBuiltIn, bFound ? value : NULL, current, sizeof(current));
+
+	return strcmp(current, lpReference) == 0;
+}
+
+/**
+ * Build the perfect hash of the key names and the list of string fields.
+ */
+static void BuildKeyTable(void) {
+
+	if (bKeyTableBuilt) {
+		return;
 	}
-	else {
-		char* pColon = strchr(pSource, ':');
-		if (pColon == NULL) {
-			SetLastError(ERROR_BAD_FORMAT);
-			return FALSE;
-		}
-		*pColon = 0;
 
-		char* pKeyword = pSource;
-		char* pPath = pColon + 1;
+	// Try seeds in order until no two names share a slot.  The same keys
+	// always get the same seed; for the 56 keys here it is found on the
+	// fifth try, seed 4.  Should no seed be found, lookups fall back to
+	// searching the keys.
 
-		if (strcmp(pKeyword, "file") == 0) {
+	for (DWORD dwSeed = 0; !bKeyTableHashed && (dwSeed < KEY_SEED_TRIES); dwSeed++) {
 
-			file = fopen(pPath, "r");
-			if (file == NULL) {
-				SetLastError(ERROR_FILE_NOT_FOUND);
-				return FALSE;
-			}
+		ZeroMemory(keySlots, sizeof(keySlots));
+		bKeyTableHashed = TRUE;
+		dwKeySeed = dwSeed;
+
+		for (DWORD i = 0; bKeyTableHashed && (i < CONFIG_KEYS); i++) {
+
+			DWORD dwSlot = HashKeyword(dwSeed, configKeys[i].lpName);
+
+			bKeyTableHashed = keySlots[dwSlot] == 0;
+			keySlots[dwSlot] = (WORD)(i + 1);
 		}
-		else {
-			SetLastError(ERROR_BAD_FORMAT);
-			return FALSE;
+	}
+
+	dwStringFields = 0;
+
+	for (DWORD i = 0; i < CONFIG_KEYS; i++) {
+		if ((configKeys[i].type == KEY_STRING) || (configKeys[i].type == KEY_LIST)) {
+			stringFields[dwStringFields++] = configKeys[i].offset;
 		}
 	}
+	stringFields[dwStringFields++] = offsetof(SRV_CONFIG, lpEnvironmentFile);
 
-	// Loop reading and setting environment variables.
+	// A cached configuration is only as good as the keys, defaults and limits
+	// it was parsed with, and the parsing and validating code in this file.
 
-	BOOL bSuccess = TRUE;
+	ullSchemaHash = HashSchema(SCHEMA_OFFSET_BASIS, parserBuild, sizeof(parserBuild));
 
-	char line[256];
-	while (fgets(line, sizeof(line), file)) {
+	for (DWORD i = 0; i < CONFIG_KEYS; i++) {
+		const CONFIG_KEY* lpKey = &configKeys[i];
+		ullSchemaHash = HashSchema(ullSchemaHash, lpKey->lpName, strlen(lpKey->lpName) + 1);
+		ullSchemaHash = HashSchema(ullSchemaHash, &lpKey->type, sizeof(lpKey->type));
+		ullSchemaHash = HashSchema(ullSchemaHash, &lpKey->offset, sizeof(lpKey->offset));
+		ullSchemaHash = HashSchema(ullSchemaHash, &lpKey->dwDefault, sizeof(lpKey->dwDefault));
+		ullSchemaHash = HashSchema(ullSchemaHash, &lpKey->dwUnit, sizeof(lpKey->dwUnit));
+		ullSchemaHash = HashSchema(ullSchemaHash, &lpKey->dwMin, sizeof(lpKey->dwMin));
+		ullSchemaHash = HashSchema(ullSchemaHash, &lpKey->dwMax, sizeof(lpKey->dwMax));
+	}
 
-		// Expecting line with "keyword=value\n\0".
-		// Replace "=" and "\n" with 0 terminators.
-		// Ignore empty lines.
+	bKeyTableBuilt = TRUE;
+}
 
-		char* pNewline = strchr(line, '\n');
-		if (pNewline != NULL) {
-			*pNewline = 0;
-		}
+/**
+ * Continue a 64 bit FNV-1a hash over some bytes.
+ */
+static ULONGLONG HashSchema(ULONGLONG ullHash, LPCVOID lpData, SIZE_T cbData) {
 
-		if (line[0] == 0) {
-			continue;
-		}
+	const BYTE* lpByte = lpData;
 
-		char* pEquals = strchr(line, '=');
-		if (pEquals == NULL) {
-			SetLastError(ERROR_BAD_FORMAT);
-			return FALSE;
-		}
-		*pEquals = 0;
+	for (SIZE_T i = 0; i < cbData; i++) {
+		ullHash = (ullHash ^ lpByte[i]) * SCHEMA_PRIME;
+	}
 
-		char* pName = line;
-		char* pValue = pEquals + 1;
+	return ullHash;
+}
+
+/**
+ * Compute the slot of a key name with an FNV-1a hash varied by a seed.
+ */
+static DWORD HashKeyword(DWORD dwSeed, LPCSTR lpKeyword) {
 
-		// Set environment variable.
+	DWORD dwHash = 2166136261 ^ (dwSeed * 2654435761);
 
-		bSuccess = SetEnvironmentVariable(pName, pValue);
-		if (!bSuccess) {
-			break;
-		}
+	while (*lpKeyword != 0) {
+		dwHash = (dwHash ^ (BYTE)*lpKeyword++) * 16777619;
 	}
 
-	if (feof(file) == 0) {
-		SetLastError(ERROR_READ_FAULT);
-		return FALSE;
+	return (dwHash ^ (dwHash >> 16)) & (KEY_SLOTS - 1);
+}
+
+/**
+ * Find a configuration key by name.
+ *
+ * Returns NULL if there is no such key.
+ */
+static const CONFIG_KEY* FindConfigKey(LPCSTR lpKeyword) {
+
+	BuildKeyTable();
+
+	if (!bKeyTableHashed) {
+		for (DWORD i = 0; i < CONFIG_KEYS; i++) {
+			if (strcmp(configKeys[i].lpName, lpKeyword) == 0) {
+				return &configKeys[i];
+			}
+		}
+		return NULL;
 	}
 
-	if (file != inlineFile) {
-		fclose(file);
+	WORD wIndex = keySlots[HashKeyword(dwKeySeed, lpKeyword)];
+
+	if ((wIndex == 0) || (strcmp(configKeys[wIndex - 1].lpName, lpKeyword) != 0)) {
+		return NULL;
 	}
 
-	return bSuccess;
+	return &configKeys[wIndex - 1];
+}
+
+/**
+ * Describe an error found in a source as "path(line,column): message",
+ * or "path: message" before any line is read, for GetSrvConfigError().
+ * Sets the last error to ERROR_BAD_FORMAT.
+ */
+static void SetSrvConfigError(CONFIG_SOURCE* lpSource, DWORD dwColumn, LPCSTR lpFormat, ...) {
+
+	int length = (lpSource->dwLine != 0)
+			? _snprintf(configError, sizeof(configError), "%s(%lu,%lu): ", lpSource->lpPath, lpSource->dwLine, dwColumn)
+			: _snprintf(configError, sizeof(configError), "%s: ", lpSource->lpPath);
+
+	if ((length < 0) || ((DWORD)length >= sizeof(configError))) {
+		length = 0;
+	}
+
+	va_list args;
+	va_start(args, lpFormat);
+	_vsnprintf(configError + length, sizeof(configError) - length, lpFormat, args);
+	va_end(args);
+
+	configError[sizeof(configError) - 1] = 0;
+
+	SetLastError(ERROR_BAD_FORMAT);
+}
+
+/**
+ * Read the next line that is neither empty nor a comment, without its newline.
+ *
+ * Returns FALSE with ERROR_HANDLE_EOF at the end of the source.
+ */
+static BOOL ReadSrvConfigLine(CONFIG_SOURCE* lpSource, char* line, int size) {
+
+	while (fgets(line, size, lpSource->file)) {
+
+		lpSource->dwLine++;
+
+		size_t length = strlen(line);
+		if ((length > 0) && (line[length - 1] == '\n')) {
+			line[--length] = 0;
+		}
+		else if (feof(lpSource->file) == 0) {
+			SetSrvConfigError(lpSource, size - 1, "line is longer than %d characters", size - 2);
+			return FALSE;
+		}
+
+		if ((length != 0) && (line[0] != ';') && (line[0] != '#')) {
+			return TRUE;
+		}
+	}
+
+	SetLastError((feof(lpSource->file) != 0) ? ERROR_HANDLE_EOF : ERROR_READ_FAULT);
+	return FALSE;
+}
+
+/**
+ * Read section headers and keyword=value lines from a configuration file,
+ * keeping those of the sections that apply to the service.
+ */
+static BOOL GetSrvConfigLines(CONFIG_SOURCE* lpSource, CONFIG_SCOPE* lpScope, LPSRV_CONFIG lpSrvConfig) {
+
+	char line[MAX_LINE_LENGTH];
+	while (ReadSrvConfigLine(lpSource, line, sizeof(line))) {
+
+		if (line[0] == '[') {
+			if (!SetSrvConfigSection(lpSource, line, lpScope)) {
+				return FALSE;
+			}
+			continue;
+		}
+
+		if (!lpScope->bSelected) {
+			continue;
+		}
+
+		// Include works in any section.
+
+		if (lpScope->bEnvironment && (strncmp(line, "Include=", 8) != 0)) {
+			if (!SetSrvEnvironmentVariable(lpSource, lpScope, line, lpSrvConfig)) {
+				return FALSE;
+			}
+			continue;
+		}
+
+		// Expecting line with "keyword=value".
+		// Replace "=" with a 0 terminator.
+
+		char* pEquals = strchr(line, '=');
+		if (pEquals == NULL) {
+			SetSrvConfigError(lpSource, 1, "expected keyword=value");
+			return FALSE;
+		}
+		*pEquals = 0;
+
+		char* pKeyword = line;
+		char* pValue = pEquals + 1;
+
+		const CONFIG_KEY* lpKey = FindConfigKey(pKeyword);
+		if (lpKey == NULL) {
+			SetSrvConfigError(lpSource, 1, "unknown keyword %s", pKeyword);
+			return FALSE;
+		}
+
+		DWORD dwColumn = (DWORD)(pValue - line) + 1;
+
+		if (!ExpandSrvConfigValue(lpSource, lpScope, pValue, dwColumn, lpSrvConfig)
+				|| !SetSrvConfigValue(lpSource, lpScope, lpKey, lpScope->lpExpanded, dwColumn, lpSrvConfig)) {
+			return FALSE;
+		}
+	}
+
+	return GetLastError() == ERROR_HANDLE_EOF;
+}
+
+/**
+ * Start a section.
+ *
+ *	line
+ *			must be "[defaults]", "[service:name]", "[service:prefix*]", "[env]", "[limits]",
+ *			"[logging]" or "[health]".  The last four continue the defaults
+ *			or service section before them.
+ */
+static BOOL SetSrvConfigSection(CONFIG_SOURCE* lpSource, char* line, CONFIG_SCOPE* lpScope) {
+
+	size_t length = strlen(line);
+	if (line[length - 1] != ']') {
+		SetSrvConfigError(lpSource, (DWORD)length, "expected ] to end the section name");
+		return FALSE;
+	}
+	line[length - 1] = 0;
+
+	char* pSection = line + 1;
+
+	if (strcmp(pSection, "defaults") == 0) {
+
+		// Defaults after a service section would override it.
+
+		if (lpScope->bServiceSeen) {
+			SetSrvConfigError(lpSource, 1, "[defaults] must come before any [service:name] section");
+			return FALSE;
+		}
+		lpScope->bSelected = TRUE;
+	}
+	else if (strncmp(pSection, "service:", 8) == 0) {
+
+		// A name ending with * matches every service it begins, so that instances
+		// such as orders1 and orders2 can share [service:orders*].  A service may
+		// match several sections, and a later one overrides an earlier one.
+
+		LPCSTR pPattern = pSection + 8;
+		size_t patternLength = strlen(pPattern);
+		BOOL bSelected = FALSE;
+
+		if (lpScope->lpServiceName != NULL) {
+			bSelected = ((patternLength > 0) && (pPattern[patternLength - 1] == '*'))
+					? (_strnicmp(pPattern, lpScope->lpServiceName, patternLength - 1) == 0)
+					: (_stricmp(pPattern, lpScope->lpServiceName) == 0);
+		}
+
+		lpScope->bSelected = bSelected;
+		lpScope->bServiceSeen = TRUE;
+		lpScope->bServiceFound = lpScope->bServiceFound || bSelected;
+	}
+	else if ((strcmp(pSection, "env") != 0)
+			&& (strcmp(pSection, "limits") != 0)
+			&& (strcmp(pSection, "logging") != 0)
+			&& (strcmp(pSection, "health") != 0)) {
+		SetSrvConfigError(lpSource, 2, "unknown section [%s]", pSection);
+		return FALSE;
+	}
+
+	lpScope->bEnvironment = strcmp(pSection, "env") == 0;
+	return TRUE;
+}
+
+/**
+ * Check a value against its key and store it.
+ *
+ *	dwColumn
+ *			is the column of the value in its line, for error reports.
+ */
+static BOOL SetSrvConfigValue(
+		CONFIG_SOURCE* lpSource,
+		CONFIG_SCOPE* lpScope,
+		const CONFIG_KEY* lpKey,
+		char* pValue,
+		DWORD dwColumn,
+		LPSRV_CONFIG lpSrvConfig) {
+
+	LPBYTE lpField = (LPBYTE)lpSrvConfig + lpKey->offset;
+
+	switch (lpKey->type) {
+
+	case KEY_STRING:
+
+		if (lpKey->lpValidate != NULL) {
+			LPCSTR lpExpected = lpKey->lpValidate(pValue);
+			if (lpExpected != NULL) {
+				SetSrvConfigError(lpSource, dwColumn, "%s expects %s", lpKey->lpName, lpExpected);
+				return FALSE;
+			}
+		}
+		return SetSrvString((LPTSTR*)lpField, pValue, FALSE);
+
+	case KEY_LIST:
+		return SetSrvString((LPTSTR*)lpField, pValue, TRUE);
+
+	case KEY_ENVIRONMENT:
+
+		// Environment keyword requires complex handling.
+
+		return GetSrvEnvironment(pValue, dwColumn, lpSource, lpScope, lpSrvConfig);
+
+	case KEY_CONTROL_ACTION:
+		return GetSrvControlAction(pValue, dwColumn, lpSource, lpSrvConfig);
+
+	case KEY_INCLUDE:
+		return IncludeSrvConfig(pValue, dwColumn, lpSource, lpScope, lpSrvConfig);
+
+	case KEY_BOOLEAN:
+		return GetSrvBoolean(lpSource, lpKey, pValue, dwColumn, (DWORD*)lpField);
+
+	default:
+		return GetSrvTypedNumber(lpSource, lpKey, pValue, dwColumn, (DWORD*)lpField);
+	}
+}
+
+/**
+ * Read the lines of another file as though they were in place of the Include line.
+ *
+ *	pPath
+ *			is the path of the file, relative to the directory of the including file.
+ */
+static BOOL IncludeSrvConfig(
+		char* pPath,
+		DWORD dwColumn,
+		CONFIG_SOURCE* lpSource,
+		CONFIG_SCOPE* lpScope,
+		LPSRV_CONFIG lpSrvConfig) {
+
+	if (lpScope->dwIncludeDepth == MAX_INCLUDE_DEPTH) {
+		SetSrvConfigError(lpSource, dwColumn, "Include nests more than %d files deep", MAX_INCLUDE_DEPTH);
+		return FALSE;
+	}
+
+	// Prefix the directory of the including file to a relative path.
+
+	char path[MAX_PATH];
+	size_t directoryLength = 0;
+
+	if ((pPath[0] != '\\') && (pPath[0] != '/') && ((pPath[0] == 0) || (pPath[1] != ':'))) {
+		LPCSTR pSlash = strrchr(lpSource->lpPath, '\\');
+		LPCSTR pForward = strrchr(lpSource->lpPath, '/');
+		if ((pSlash == NULL) || ((pForward != NULL) && (pForward > pSlash))) {
+			pSlash = pForward;
+		}
+		directoryLength = (pSlash != NULL) ? (size_t)(pSlash - lpSource->lpPath + 1) : 0;
+	}
+
+	if (directoryLength + strlen(pPath) >= sizeof(path)) {
+		SetSrvConfigError(lpSource, dwColumn, "Include path is too long");
+		return FALSE;
+	}
+
+	memcpy(path, lpSource->lpPath, directoryLength);
+	strcpy(path + directoryLength, pPath);
+
+	CONFIG_SOURCE include;
+	include.lpPath = path;
+	include.file = fopen(path, "r");
+	include.dwLine = 0;
+
+	if (include.file == NULL) {
+		SetSrvConfigError(lpSource, dwColumn, "cannot open included file %s", path);
+		SetLastError(ERROR_FILE_NOT_FOUND);
+		return FALSE;
+	}
+
+	// The cache checks included files along with the configuration file.
+
+	BOOL bSuccess = AddSrvMultiString(&lpSrvConfig->lpIncludedFiles, path);
+
+	if (bSuccess) {
+		lpScope->dwIncludeDepth++;
+		bSuccess = GetSrvConfigLines(&include, lpScope, lpSrvConfig);
+		lpScope->dwIncludeDepth--;
+	}
+
+	fclose(include.file);
+	return bSuccess;
+}
+
+/**
+ * Set a string field to a copy of a value, or for a list,
+ * add the value to the field after a semicolon.
+ */
+static BOOL SetSrvString(LPTSTR* pField, LPCSTR pValue, BOOL bAppend) {
+
+	HANDLE hHeap = GetProcessHeap();
+
+	size_t oldLength = (bAppend && (*pField != NULL)) ? strlen(*pField) + 1 : 0;
+	size_t newLength = oldLength + strlen(pValue) + 1;
+
+	LPTSTR lpString = (oldLength == 0)
+			? HeapAlloc(hHeap, 0, newLength)
+			: HeapReAlloc(hHeap, 0, *pField, newLength);
+
+	if (lpString == NULL) {
+		SetLastError(ERROR_OUTOFMEMORY);
+		return FALSE;
+	}
+
+	if (oldLength != 0) {
+		lpString[oldLength - 1] = ';';
+	}
+	else if (*pField != NULL) {
+		HeapFree(hHeap, 0, *pField);
+	}
+
+	strcpy(lpString + oldLength, pValue);
+	*pField = lpString;
+	return TRUE;
+}
+
+/**
+ * Construct the environment.
+ *
+ *	pSource
+ *			must point to a string in form "source[:path]"
+ *			where source is default, inline, or file.
+ *
+ *	dwColumn
+ *			is the column of pSource in its line, for error reports.
+ *
+ *	lpInline
+ *			is the file from which to read environment variables
+ *			if source is "inline", up to the next section.
+ *
+ *	lpSrvConfig
+ *			points to the configuration to receive the environment file path
+ *			and the variables set.
+ *
+ * For ease of implementation, this function simply updates the current environment
+ * and leaves lpEnvironment NULL for the caller to pass to CreateProcess()
+ * to indicate that the current environment should be inherited by the child process.
+ * A reload restores the saved environment around this; see RestoreSrvEnvironment().
+ */
+static BOOL GetSrvEnvironment(
+		char* pSource,
+		DWORD dwColumn,
+		CONFIG_SOURCE* lpInline,
+		CONFIG_SCOPE* lpScope,
+		LPSRV_CONFIG lpSrvConfig) {
+
+	if (strcmp(pSource, "default") == 0) {
+		return TRUE;
+	}
+	else if (strcmp(pSource, "inline") == 0) {
+
+		// The rest of the section holds variables, as an [env] section does.
+
+		lpScope->bEnvironment = TRUE;
+		return TRUE;
+	}
+
+	char* pColon = strchr(pSource, ':');
+	if ((pColon == NULL) || (pColon - pSource != 4) || (strncmp(pSource, "file", 4) != 0)) {
+		SetSrvConfigError(lpInline, dwColumn, "Environment expects default, inline or file:path");
+		return FALSE;
+	}
+
+	// Keep the path, since expanding the variables reuses the buffer that holds it.
+
+	char path[MAX_PATH];
+	if (strlen(pColon + 1) >= sizeof(path)) {
+		SetSrvConfigError(lpInline, dwColumn + 5, "environment file path is too long");
+		return FALSE;
+	}
+	strcpy(path, pColon + 1);
+
+	char* pPath = path;
+
+	// Map the lines from the cache if caching is on and the file is unchanged, or
+	// else read the text, which ReadSrvConfig() may cache.  A cache left from when
+	// caching was on is not trusted once it is off.  Values are expanded for each
+	// service either way.
+
+	lpScope->lpEnvFile = SrvEnvFileRelease(lpScope->lpEnvFile);
+
+	LPSRV_ENV_FILE lpEnvFile = (lpSrvConfig->dwConfigCache != 0) ? SrvEnvCacheLoad(pPath) : NULL;
+	BOOL bRead = (lpEnvFile == NULL);
+
+	if (bRead) {
+		lpEnvFile = ReadSrvEnvFile(pPath, dwColumn + 5, lpInline);
+		if (lpEnvFile == NULL) {
+			return FALSE;
+		}
+	}
+
+	// Loop setting environment variables.
+
+	BOOL bSuccess = SetSrvString(&lpSrvConfig->lpEnvironmentFile, pPath, FALSE);
+
+	CONFIG_SOURCE source;
+	source.lpPath = pPath;
+	source.file = NULL;
+
+	for (const SRV_ENV_LINE* lpLine = SrvEnvFileNextLine(lpEnvFile, NULL);
+			bSuccess && (lpLine != NULL); lpLine = SrvEnvFileNextLine(lpEnvFile, lpLine)) {
+
+		char line[MAX_LINE_LENGTH];
+		strncpy(line, lpLine->text, sizeof(line));
+		line[sizeof(line) - 1] = 0;
+
+		source.dwLine = lpLine->dwLine;
+		bSuccess = SetSrvEnvironmentVariable(&source, lpScope, line, lpSrvConfig);
+	}
+
+	if (bRead) {
+		lpScope->lpEnvFile = lpEnvFile;
+	}
+	else {
+		SrvEnvFileRelease(lpEnvFile);
+	}
+
+	return bSuccess;
+}
+
+/**
+ * Read the lines of an environment file, which run to the end of the file.
+ *
+ *	dwColumn
+ *			is the column of the path in the Environment line, for error reports.
+ *
+ * Returns the lines, timed for the cache, or NULL.
+ */
+static LPSRV_ENV_FILE ReadSrvEnvFile(LPCSTR lpPath, DWORD dwColumn, CONFIG_SOURCE* lpInline) {
+
+	LARGE_INTEGER liFrequency, liStart, liEnd;
+	QueryPerformanceFrequency(&liFrequency);
+	QueryPerformanceCounter(&liStart);
+
+	CONFIG_SOURCE source;
+	source.lpPath = lpPath;
+	source.file = fopen(lpPath, "r");
+	source.dwLine = 0;
+
+	LPSRV_ENV_FILE lpEnvFile = (source.file != NULL) ? SrvEnvFileCreate(lpPath) : NULL;
+
+	if (lpEnvFile == NULL) {
+		if (source.file != NULL) {
+			fclose(source.file);
+		}
+		SetSrvConfigError(lpInline, dwColumn, "cannot open environment file %s", lpPath);
+		SetLastError(ERROR_FILE_NOT_FOUND);
+		return NULL;
+	}
+
+	char line[MAX_LINE_LENGTH];
+	while (ReadSrvConfigLine(&source, line, sizeof(line))) {
+
+		LPSRV_ENV_FILE lpGrown = SrvEnvFileAddLine(lpEnvFile, source.dwLine, line);
+		if (lpGrown == NULL) {
+			break;
+		}
+		lpEnvFile = lpGrown;
+	}
+
+	BOOL bSuccess = (GetLastError() == ERROR_HANDLE_EOF);
+
+	fclose(source.file);
+
+	if (!bSuccess) {
+		return SrvEnvFileRelease(lpEnvFile);
+	}
+
+	QueryPerformanceCounter(&liEnd);
+	lpEnvFile->dwReadMicros = (DWORD)((liEnd.QuadPart - liStart.QuadPart) * 1000000 / liFrequency.QuadPart);
+
+	return lpEnvFile;
+}
+
+/**
+ * Set an environment variable from a line with "name=value",
+ * and record it so that a cached configuration can set it again
+ * without reading the environment source.
+ */
+static BOOL SetSrvEnvironmentVariable(CONFIG_SOURCE* lpSource, CONFIG_SCOPE* lpScope, char* line, LPSRV_CONFIG lpSrvConfig) {
+
+	char* pEquals = strchr(line, '=');
+	if (pEquals == NULL) {
+		SetSrvConfigError(lpSource, 1, "expected name=value");
+		return FALSE;
+	}
+	*pEquals = 0;
+
+	if (!ExpandSrvConfigValue(lpSource, lpScope, pEquals + 1, (DWORD)(pEquals - line) + 2, lpSrvConfig)) {
+		return FALSE;
+	}
+
+	if (!SetEnvironmentVariable(line, lpScope->lpExpanded)) {
+		return FALSE;
+	}
+
+	// Record name=value, moving the expanded value along to make room for the name.
+
+	size_t nameLength = pEquals - line;
+	size_t valueLength = strlen(lpScope->lpExpanded);
+
+	if (nameLength + 1 + valueLength >= MAX_EXPANDED_LENGTH) {
+		SetSrvConfigError(lpSource, 1, "environment variable %s is too long", line);
+		return FALSE;
+	}
+
+	memmove(lpScope->lpExpanded + nameLength + 1, lpScope->lpExpanded, valueLength + 1);
+	memcpy(lpScope->lpExpanded, line, nameLength);
+	lpScope->lpExpanded[nameLength] = '=';
+
+	return AddSrvMultiString(&lpSrvConfig->lpEnvironmentVariables, lpScope->lpExpanded);
+}
+
+/**
+ * Copy a value into lpScope->lpExpanded, and if Expand=1 came before it, replace:
+ *
+ *	${name}			the text of a built-in name or environment variable.
+ *	${expression}	the result of whole numbers and names joined by +, -, * and /,
+ *					worked from left to right, as in ${memory_mb / 2} or ${8080 + instance}.
+ *	$$				a single $, so that $${name} passes ${name} on.
+ *	%name%			the same as ${name}, but left as it is if the name is not defined.
+ *	%%				a single %.
+ *
+ * Any other % is left as it is, as in a Java option -Dlog.pattern=%d %c %m%n.
+ *
+ * The built-in names are service, instance (the number ending the service name, or 0),
+ * cores (the logical processors), core (the instance modulo cores) and memory_mb
+ * (the physical memory).  Environment variables not set by this configuration
+ * and built-in names are recorded in lpReferences so that a cached configuration
+ * is used only while they have the same values.
+ *
+ *	dwColumn
+ *			is the column of pValue in its line, for error reports.
+ */
+static BOOL ExpandSrvConfigValue(
+		CONFIG_SOURCE* lpSource,
+		CONFIG_SCOPE* lpScope,
+		LPCSTR pValue,
+		DWORD dwColumn,
+		LPSRV_CONFIG lpSrvConfig) {
+
+	LPSTR lpOutput = lpScope->lpExpanded;
+	DWORD dwLength = 0;
+	LPCSTR p = pValue;
+
+	// Without Expand=1 the value is kept as written.
+
+	if (!lpSrvConfig->dwExpand) {
+		size_t length = strlen(pValue);
+		if (length >= MAX_EXPANDED_LENGTH) {
+			SetSrvConfigError(lpSource, dwColumn, "value is too long when expanded");
+			return FALSE;
+		}
+		memcpy(lpOutput, pValue, length + 1);
+		return TRUE;
+	}
+
+	while (*p != 0) {
+
+		DWORD dwAt = dwColumn + (DWORD)(p - pValue);
+
+		if ((p[0] == '$') && (p[1] == '$')) {
+			p++;
+		}
+		else if ((p[0] == '$') && (p[1] == '{')) {
+
+			LPCSTR pClose = strchr(p + 2, '}');
+			if (pClose == NULL) {
+				SetSrvConfigError(lpSource, dwAt, "expected } to end ${");
+				return FALSE;
+			}
+
+			// The expression is part of a line, so it fits.
+
+			char expression[MAX_LINE_LENGTH];
+			memcpy(expression, p + 2, pClose - p - 2);
+			expression[pClose - p - 2] = 0;
+
+			if (!EvaluateSrvExpression(lpSource, lpScope, expression, dwAt + 2, lpSrvConfig, &dwLength)) {
+				return FALSE;
+			}
+			p = pClose + 1;
+			continue;
+		}
+
+		if ((p[0] == '%') && (p[1] == '%')) {
+			p++;
+		}
+		else if (p[0] == '%') {
+
+			size_t nameLength = GetSrvNameLength(p + 1);
+
+			if ((nameLength > 0) && (p[nameLength + 1] == '%')) {
+
+				char name[MAX_LINE_LENGTH];
+				memcpy(name, p + 1, nameLength);
+				name[nameLength] = 0;
+
+				DWORD dwValueLength;
+				if (GetSrvVariable(lpSource, lpScope, name, dwAt + 1,
+						lpOutput + dwLength, MAX_EXPANDED_LENGTH - dwLength, &dwValueLength, lpSrvConfig)) {
+					dwLength += dwValueLength;
+					p += nameLength + 2;
+					continue;
+				}
+				if (GetLastError() != ERROR_ENVVAR_NOT_FOUND) {
+					return FALSE;
+				}
+			}
+		}
+
+		if (dwLength + 1 >= MAX_EXPANDED_LENGTH) {
+			SetSrvConfigError(lpSource, dwColumn, "value is too long when expanded");
+			return FALSE;
+		}
+		lpOutput[dwLength++] = *p++;
+	}
+
+	lpOutput[dwLength] = 0;
+	return TRUE;
+}
+
+/**
+ * Add the value of ${expression} to lpScope->lpExpanded.
+ *
+ *	pExpression
+ *			is a name, or whole numbers and names joined by +, -, * and /.
+ *
+ *	pdwLength
+ *			points to the length expanded so far, which is advanced past the value.
+ */
+static BOOL EvaluateSrvExpression(
+		CONFIG_SOURCE* lpSource,
+		CONFIG_SCOPE* lpScope,
+		char* pExpression,
+		DWORD dwColumn,
+		LPSRV_CONFIG lpSrvConfig,
+		DWORD* pdwLength) {
+
+	LPSTR lpOutput = lpScope->lpExpanded + *pdwLength;
+	DWORD dwSpace = MAX_EXPANDED_LENGTH - *pdwLength;
+
+	char* p = pExpression + strspn(pExpression, " \t");
+	size_t length = GetSrvNameLength(p);
+
+	// A lone name stands for its text.
+
+	if ((length > 0) && ((p[0] < '0') || (p[0] > '9')) && (p[length + strspn(p + length, " \t")] == 0)) {
+
+		p[length] = 0;
+
+		DWORD dwValueLength;
+		if (!GetSrvVariable(lpSource, lpScope, p, dwColumn + (DWORD)(p - pExpression),
+				lpOutput, dwSpace, &dwValueLength, lpSrvConfig)) {
+			if (GetLastError() == ERROR_ENVVAR_NOT_FOUND) {
+				SetSrvConfigError(lpSource, dwColumn + (DWORD)(p - pExpression), "%s is not defined", p);
+			}
+			return FALSE;
+		}
+
+		*pdwLength += dwValueLength;
+		return TRUE;
+	}
+
+	// Anything else is arithmetic.
+
+	LONGLONG result = 0;
+	char op = '+';
+
+	for (;;) {
+
+		p += strspn(p, " \t");
+		DWORD dwAt = dwColumn + (DWORD)(p - pExpression);
+
+		length = GetSrvNameLength(p);
+		if (length == 0) {
+			SetSrvConfigError(lpSource, dwAt, "expected a number or name");
+			return FALSE;
+		}
+
+		char name[MAX_LINE_LENGTH];
+		memcpy(name, p, length);
+		name[length] = 0;
+		p += length;
+
+		char term[MAX_LINE_LENGTH];
+		strcpy(term, name);
+
+		if ((name[0] < '0') || (name[0] > '9')) {
+			DWORD dwTermLength;
+			if (!GetSrvVariable(lpSource, lpScope, name, dwAt, term, sizeof(term), &dwTermLength, lpSrvConfig)) {
+				if (GetLastError() == ERROR_ENVVAR_NOT_FOUND) {
+					SetSrvConfigError(lpSource, dwAt, "%s is not defined", name);
+				}
+				return FALSE;
+			}
+		}
+
+		LONGLONG value = 0;
+		int digits = 0;
+		while ((term[digits] >= '0') && (term[digits] <= '9')) {
+			value = value * 10 + (term[digits++] - '0');
+		}
+
+		if ((digits == 0) || (term[digits] != 0)) {
+			SetSrvConfigError(lpSource, dwAt, "%s is not a whole number", name);
+			return FALSE;
+		}
+
+		switch (op) {
+		case '+':
+			result += value;
+			break;
+		case '-':
+			result -= value;
+			break;
+		case '*':
+			result *= value;
+			break;
+		default:
+			if (value == 0) {
+				SetSrvConfigError(lpSource, dwAt, "%s divides by zero", name);
+				return FALSE;
+			}
+			result /= value;
+			break;
+		}
+
+		p += strspn(p, " \t");
+		if (*p == 0) {
+			break;
+		}
+
+		if (strchr("+-*/", *p) == NULL) {
+			SetSrvConfigError(lpSource, dwColumn + (DWORD)(p - pExpression), "expected +, -, * or /");
+			return FALSE;
+		}
+		op = *p++;
+	}
+
+	int written = _snprintf(lpOutput, dwSpace, "%lld", result);
+	if ((written < 0) || ((DWORD)written >= dwSpace)) {
+		SetSrvConfigError(lpSource, dwColumn, "value is too long when expanded");
+		return FALSE;
+	}
+
+	*pdwLength += written;
+	return TRUE;
+}
+
+/**
+ * Get the text of a built-in name or else an environment variable,
+ * and record it as a reference of the configuration.
+ *
+ * Returns FALSE with ERROR_ENVVAR_NOT_FOUND, and no error reported,
+ * if the name is not defined.
+ */
+static BOOL GetSrvVariable(
+		CONFIG_SOURCE* lpSource,
+		CONFIG_SCOPE* lpScope,
+		LPCSTR lpName,
+		DWORD dwColumn,
+		LPSTR lpBuffer,
+		DWORD dwSize,
+		DWORD* pdwLength,
+		LPSRV_CONFIG lpSrvConfig) {
+
+	BOOL bBuiltIn = TRUE;
+	BOOL bFound = GetSrvVariableValue(lpScope->lpServiceName, lpName, TRUE, lpBuffer, dwSize, pdwLength);
+
+	if (!bFound && (GetLastError() == ERROR_ENVVAR_NOT_FOUND)) {
+		bBuiltIn = FALSE;
+		bFound = GetSrvVariableValue(lpScope->lpServiceName, lpName, FALSE, lpBuffer, dwSize, pdwLength);
+	}
+
+	if (!bFound && (GetLastError() != ERROR_ENVVAR_NOT_FOUND)) {
+		SetSrvConfigError(lpSource, dwColumn, "value is too long when %s is expanded", lpName);
+		return FALSE;
+	}
+
+	if (!AddSrvReference(lpSrvConfig, lpName, bBuiltIn, bFound ? lpBuffer : NULL)) {
+		return FALSE;
+	}
+
+	if (!bFound) {
+		SetLastError(ERROR_ENVVAR_NOT_FOUND);
+	}
+	return bFound;
+}
+
+/**
+ * Get the text of a built-in name or an environment variable.
+ *
+ * Returns FALSE with ERROR_ENVVAR_NOT_FOUND if the name is not defined,
+ * or with ERROR_INSUFFICIENT_BUFFER if the text does not fit.
+ */
+static BOOL GetSrvVariableValue(
+		LPCSTR lpServiceName,
+		LPCSTR lpName,
+		BOOL bBuiltIn,
+		LPSTR lpBuffer,
+		DWORD dwSize,
+		DWORD* pdwLength) {
+
+	if (!bBuiltIn) {
+
+		SetLastError(ERROR_SUCCESS);
+		DWORD dwLength = GetEnvironmentVariable(lpName, lpBuffer, dwSize);
+
+		if ((dwLength == 0) && (GetLastError() == ERROR_ENVVAR_NOT_FOUND)) {
+			return FALSE;
+		}
+		if (dwLength >= dwSize) {
+			SetLastError(ERROR_INSUFFICIENT_BUFFER);
+			return FALSE;
+		}
+
+		*pdwLength = dwLength;
+		return TRUE;
+	}
+
+	// The instance is the number ending the service name, as in orders3 or orders-3.
+
+	LPCSTR lpService = (lpServiceName != NULL) ? lpServiceName : "";
+	LPCSTR pDigits = lpService + strlen(lpService);
+	while ((pDigits > lpService) && (pDigits[-1] >= '0') && (pDigits[-1] <= '9')) {
+		pDigits--;
+	}
+
+	DWORD dwInstance = strtoul(pDigits, NULL, 10);
+	DWORD dwCores = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+	if (dwCores == 0) {
+		dwCores = 1;
+	}
+
+	int length;
+
+	if (strcmp(lpName, "service") == 0) {
+		length = _snprintf(lpBuffer, dwSize, "%s", lpService);
+	}
+	else if (strcmp(lpName, "instance") == 0) {
+		length = _snprintf(lpBuffer, dwSize, "%lu", dwInstance);
+	}
+	else if (strcmp(lpName, "core") == 0) {
+		length = _snprintf(lpBuffer, dwSize, "%lu", dwInstance % dwCores);
+	}
+	else if (strcmp(lpName, "cores") == 0) {
+		length = _snprintf(lpBuffer, dwSize, "%lu", dwCores);
+	}
+	else if (strcmp(lpName, "memory_mb") == 0) {
+		MEMORYSTATUSEX status;
+		status.dwLength = sizeof(status);
+		if (!GlobalMemoryStatusEx(&status)) {
+			status.ullTotalPhys = 0;
+		}
+		length = _snprintf(lpBuffer, dwSize, "%llu", status.ullTotalPhys / MEGABYTE_BYTES);
+	}
+	else {
+		SetLastError(ERROR_ENVVAR_NOT_FOUND);
+		return FALSE;
+	}
+
+	if ((length < 0) || ((DWORD)length >= dwSize)) {
+		SetLastError(ERROR_INSUFFICIENT_BUFFER);
+		return FALSE;
+	}
+
+	*pdwLength = length;
+	return TRUE;
+}
+
+/**
+ * Record a name that a value was expanded from, with a hash of its text,
+ * unless it was recorded before or is an environment variable that this
+ * configuration set, which the cache knows from its sources.
+ *
+ *	lpValue
+ *			is NULL if the name was not defined.
+ */
+static BOOL AddSrvReference(LPSRV_CONFIG lpSrvConfig, LPCSTR lpName, BOOL bBuiltIn, LPCSTR lpValue) {
+
+	size_t nameLength = strlen(lpName);
+
+	if (!bBuiltIn) {
+		for (LPCSTR p = lpSrvConfig->lpEnvironmentVariables; (p != NULL) && (*p != 0); p += strlen(p) + 1) {
+			if ((_strnicmp(p, lpName, nameLength) == 0) && (p[nameLength] == '=')) {
+				return TRUE;
+			}
+		}
+	}
+
+	char reference[MAX_LINE_LENGTH + 32];
+	FormatSrvReference(lpName, bBuiltIn, lpValue, reference, sizeof(reference));
+
+	// The first value seen is the one the configuration depends on.
+
+	size_t keyLength = strcspn(reference, "=");
+
+	for (LPCSTR p = lpSrvConfig->lpReferences; (p != NULL) && (*p != 0); p += strlen(p) + 1) {
+		if ((_strnicmp(p, reference, keyLength) == 0) && ((p[keyLength] == '=') || (p[keyLength] == 0))) {
+			return TRUE;
+		}
+	}
+
+	return AddSrvMultiString(&lpSrvConfig->lpReferences, reference);
+}
+
+/**
+ * Format a reference as name=hash, with % before a built-in name,
+ * or as the name alone if it was not defined.
+ */
+static void FormatSrvReference(LPCSTR lpName, BOOL bBuiltIn, LPCSTR lpValue, LPSTR lpBuffer, DWORD dwSize) {
+
+	LPCSTR lpPrefix = bBuiltIn ? "%" : "";
+
+	if (lpValue == NULL) {
+		_snprintf(lpBuffer, dwSize, "%s%s", lpPrefix, lpName);
+	}
+	else {
+
+		// FNV-1a
+
+		ULONGLONG ullHash = 14695981039346656037ULL;
+		for (LPCSTR p = lpValue; *p != 0; p++) {
+			ullHash = (ullHash ^ (BYTE)*p) * 1099511628211ULL;
+		}
+
+		_snprintf(lpBuffer, dwSize, "%s%s=%016llx", lpPrefix, lpName, ullHash);
+	}
+
+	lpBuffer[dwSize - 1] = 0;
+}
+
+/**
+ * Get the length of the name at the start of a string,
+ * made of letters, digits, _ and parentheses as in ProgramFiles(x86).
+ */
+static size_t GetSrvNameLength(LPCSTR p) {
+
+	size_t length = 0;
+
+	while (((p[length] >= 'a') && (p[length] <= 'z'))
+			|| ((p[length] >= 'A') && (p[length] <= 'Z'))
+			|| ((p[length] >= '0') && (p[length] <= '9'))
+			|| (p[length] == '_') || (p[length] == '(') || (p[length] == ')')) {
+		length++;
+	}
+
+	return length;
+}
+
+/**
+ * Add a string to a list of null terminated strings ending with an empty string.
+ */
+static BOOL AddSrvMultiString(LPTSTR* pList, LPCSTR lpString) {
+
+	HANDLE hHeap = GetProcessHeap();
+
+	size_t oldLength = 0;
+	if (*pList != NULL) {
+		LPCSTR p = *pList;
+		while (*p != 0) {
+			p += strlen(p) + 1;
+		}
+		oldLength = p - *pList;
+	}
+
+	size_t newLength = oldLength + strlen(lpString) + 1;
+
+	LPTSTR lpNewList = (*pList == NULL)
+			? HeapAlloc(hHeap, 0, newLength + 1)
+			: HeapReAlloc(hHeap, 0, *pList, newLength + 1);
+
+	if (lpNewList == NULL) {
+		SetLastError(ERROR_OUTOFMEMORY);
+		return FALSE;
+	}
+
+	strcpy(lpNewList + oldLength, lpString);
+	lpNewList[newLength] = 0;
+
+	*pList = lpNewList;
+	return TRUE;
+}
+
+/**
+ * Convert a decimal value to a number.
+ *
+ *	pValue
+ *			must point to a string of decimal digits.
+ *
+ *	pNumber
+ *			points to a variable to receive the number.
+ */
+static BOOL GetSrvNumber(char* pValue, DWORD* pNumber) {
+
+	char* pEnd = NULL;
+	unsigned long value = strtoul(pValue, &pEnd, 10);
+
+	if ((pValue[0] < '0') || (pValue[0] > '9') || (*pEnd != 0)) {
+		SetLastError(ERROR_BAD_FORMAT);
+		return FALSE;
+	}
+
+	*pNumber = value;
+	return TRUE;
+}
+
+/**
+ * Convert a number, duration or size to the unit of its field
+ * and check it against the limits of its key.
+ *
+ *	pValue
+ *			must point to decimal digits, followed for a duration or size
+ *			by an optional unit that the unit of the field divides.
+ *
+ *	pNumber
+ *			points to the field to receive the number.
+ */
+static BOOL GetSrvTypedNumber(
+		CONFIG_SOURCE* lpSource,
+		const CONFIG_KEY* lpKey,
+		char* pValue,
+		DWORD dwColumn,
+		DWORD* pNumber) {
+
+	LPCSTR lpExpected = (lpKey->type == KEY_DURATION) ? "a duration such as 500ms, 30s, 5m or 1h"
+			: (lpKey->type == KEY_SIZE) ? "a size such as 4096, 64KB, 512MB or 2GB"
+			: "a number";
+
+	char* pEnd = NULL;
+	ULONGLONG value = _strtoui64(pValue, &pEnd, 10);
+
+	if ((pValue[0] < '0') || (pValue[0] > '9')) {
+		SetSrvConfigError(lpSource, dwColumn, "%s expects %s", lpKey->lpName, lpExpected);
+		return FALSE;
+	}
+
+	// Find the unit, and the name of the field's own unit for messages.
+
+	DWORD dwMultiple = (*pEnd == 0) ? lpKey->dwUnit : 0;
+	LPCSTR lpUnitName = "";
+
+	for (DWORD i = 0; i < CONFIG_UNITS; i++) {
+		if (configUnits[i].type != lpKey->type) {
+			continue;
+		}
+		if ((*pEnd != 0) && (_stricmp(configUnits[i].lpName, pEnd) == 0)) {
+			dwMultiple = configUnits[i].dwMultiple;
+		}
+		if (configUnits[i].dwMultiple == lpKey->dwUnit) {
+			lpUnitName = configUnits[i].lpName;
+		}
+	}
+
+	if (dwMultiple == 0) {
+		SetSrvConfigError(lpSource, dwColumn + (DWORD)(pEnd - pValue), "%s expects %s", lpKey->lpName, lpExpected);
+		return FALSE;
+	}
+
+	if ((value <= MAXDWORD) && ((value * dwMultiple) % lpKey->dwUnit != 0)) {
+		SetSrvConfigError(lpSource, dwColumn, "%s must be a multiple of 1%s", lpKey->lpName, lpUnitName);
+		return FALSE;
+	}
+
+	if (value <= MAXDWORD) {
+		value = value * dwMultiple / lpKey->dwUnit;
+	}
+
+	if ((value < lpKey->dwMin) || (value > lpKey->dwMax)) {
+		SetSrvConfigError(lpSource, dwColumn, "%s must be from %lu to %lu%s",
+				lpKey->lpName, lpKey->dwMin, lpKey->dwMax, lpUnitName);
+		return FALSE;
+	}
+
+	*pNumber = (DWORD)value;
+	return TRUE;
+}
+
+/**
+ * Convert a boolean value to 0 or 1.
+ */
+static BOOL GetSrvBoolean(
+		CONFIG_SOURCE* lpSource,
+		const CONFIG_KEY* lpKey,
+		char* pValue,
+		DWORD dwColumn,
+		DWORD* pNumber) {
+
+	for (DWORD i = 0; i < CONFIG_BOOLEANS; i++) {
+		if (_stricmp(configBooleans[i].lpName, pValue) == 0) {
+			*pNumber = configBooleans[i].dwValue;
+			return TRUE;
+		}
+	}
+
+	SetSrvConfigError(lpSource, dwColumn, "%s expects 0 or 1, false or true, no or yes, off or on", lpKey->lpName);
+	return FALSE;
+}
+
+/**
+ * Record the action for an SCM control code.
+ *
+ *	pValue
+ *			must point to a string in form "code:action"
+ *			where code is 128 to 255 or paramchange, and action is
+ *			either a control request such as "signal-child ctrl-break"
+ *			or "exec" followed by a command line.
+ *
+ *	dwColumn
+ *			is the column of pValue in its line, for error reports.
+ */
+static BOOL GetSrvControlAction(char* pValue, DWORD dwColumn, CONFIG_SOURCE* lpSource, LPSRV_CONFIG lpSrvConfig) {
+
+	char* pColon = strchr(pValue, ':');
+	if (pColon == NULL) {
+		SetSrvConfigError(lpSource, dwColumn, "OnControl expects code:action");
+		return FALSE;
+	}
+	*pColon = 0;
+
+	char* pCode = pValue;
+	char* pAction = pColon + 1;
+	DWORD dwActionColumn = dwColumn + (DWORD)(pAction - pValue);
+
+	DWORD dwControl = 0;
+	if (strcmp(pCode, "paramchange") == 0) {
+		dwControl = SERVICE_CONTROL_PARAMCHANGE;
+	}
+	else {
+		GetSrvNumber(pCode, &dwControl);
+	}
+
+	int index = GetSrvControlActionIndex(dwControl);
+	if (index < 0) {
+		SetSrvConfigError(lpSource, dwColumn, "OnControl code must be %d to %d or paramchange",
+				SRV_CONTROL_USER_FIRST, SRV_CONTROL_USER_LAST);
+		return FALSE;
+	}
+
+	// Check that the action names a known command.
+
+	char command[32];
+	size_t commandLength = strcspn(pAction, " ");
+	if (commandLength >= sizeof(command)) {
+		SetSrvConfigError(lpSource, dwActionColumn, "OnControl action is not a known command");
+		return FALSE;
+	}
+	memcpy(command, pAction, commandLength);
+	command[commandLength] = 0;
+
+	if (strcmp(command, "exec") == 0) {
+		if (pAction[commandLength] == 0) {
+			SetSrvConfigError(lpSource, dwActionColumn, "OnControl exec expects a command line");
+			return FALSE;
+		}
+	}
+	else if (SrvControlFindCommand(command) == SRV_COMMAND_COUNT) {
+		SetSrvConfigError(lpSource, dwActionColumn, "OnControl action %s is not a known command", command);
+		return FALSE;
+	}
+
+	return SetSrvString(&lpSrvConfig->lpControlActions[index], pAction, FALSE);
+}
+
+/**
+ * Check the form of HealthCheck; SrvHealthConfigure() checks the rest.
+ */
+static LPCSTR ValidateHealthCheck(LPCSTR lpValue) {
+
+	if ((strncmp(lpValue, "tcp:", 4) == 0)
+			|| (strncmp(lpValue, "http:", 5) == 0)
+			|| ((strncmp(lpValue, "exec:", 5) == 0) && (lpValue[5] != 0))) {
+		return NULL;
+	}
+
+	return "tcp:port, http:port[/path] or exec:cmdline";
+}
+
+/**
+ * Check HealthAction.
+ */
+static LPCSTR ValidateHealthAction(LPCSTR lpValue) {
+
+	if ((strcmp(lpValue, "restart") == 0) || (strcmp(lpValue, "stop") == 0)) {
+		return NULL;
+	}
+
+	return "restart or stop";
+}
+
+/**
+ * Check OutputLogFormat.
+ */
+static LPCSTR ValidateOutputLogFormat(LPCSTR lpValue) {
+
+	SRV_LOG_FORMAT format;
+
+	if (SrvLogParseFormat(lpValue, &format)) {
+		return NULL;
+	}
+
+	return "raw, text or json";
+}
+
+/**
+ * Check OutputLogCompression.
+ */
+static LPCSTR ValidateOutputLogCompression(LPCSTR lpValue) {
+
+	DWORD dwAlgorithm;
+
+	if (SrvLogCompressParseAlgorithm(lpValue, &dwAlgorithm)) {
+		return NULL;
+	}
+
+	return "xpress, xpress-huff, mszip or lzms";
+}
+
+/**
+ * Check OutputLogLimitPolicy.
+ */
+static LPCSTR ValidateOutputLogLimitPolicy(LPCSTR lpValue) {
+
+	SRV_LOG_POLICY policy;
+
+	if (SrvLogLimitParsePolicy(lpValue, &policy)) {
+		return NULL;
+	}
+
+	return "drop, sample or summarize";
+}
+
+static LPCSTR ValidateOutputLogForward(LPCSTR lpValue) {
+
+	if (SrvLogForwardParseTarget(lpValue)) {
+		return NULL;
+	}
+
+	return "syslog:port, syslog-tcp:port or tcp:port";
+}
+
+/**
+ * Compute an FNV-1a hash of the current environment block,
+ * skipping the SRVWRAP_ variables that the wrapper sets for the child itself.
+ */
+static DWORD GetSrvEnvironmentHash(void) {
+
+	LPCH lpEnvironment = GetEnvironmentStrings();
+	if (lpEnvironment == NULL) {
+		return 0;
+	}
+
+	DWORD dwHash = 2166136261;
+
+	// The block is a sequence of null terminated strings ending with an empty string.
+
+	LPCH p = lpEnvironment;
+	while (*p != 0) {
+		if (strncmp(p, "SRVWRAP_", 8) == 0) {
+			p += strlen(p) + 1;
+			continue;
+		}
+		while (*p != 0) {
+			dwHash = (dwHash ^ (BYTE)*p++) * 16777619;
+		}
+		dwHash = (dwHash ^ 0) * 16777619;
+		p++;
+	}
+
+	FreeEnvironmentStrings(lpEnvironment);
+	return dwHash;
+}
+
+/**
+ * Check for a variable that restoring the environment leaves alone:
+ * the SRVWRAP_ variables that the wrapper sets for the child, and the
+ * per-drive directories, whose names begin with =.
+ */
+static BOOL IsSrvEnvironmentKept(LPCSTR lpVariable) {
+	return (lpVariable[0] == '=') || (strncmp(lpVariable, "SRVWRAP_", 8) == 0);
+}
+
+/**
+ * Set, or if not bSet remove, each name=value variable in an environment block.
+ */
+static BOOL SetSrvEnvironmentBlock(LPCSTR lpBlock, BOOL bSet) {
+
+	BOOL bSuccess = TRUE;
+
+	for (LPCSTR p = lpBlock; *p != 0; p += strlen(p) + 1) {
+
+		LPCSTR pEquals = strchr(p, '=');
+		char name[MAX_LINE_LENGTH];
+
+		if (IsSrvEnvironmentKept(p) || (pEquals == NULL) || ((SIZE_T)(pEquals - p) >= sizeof(name))) {
+			continue;
+		}
+
+		memcpy(name, p, pEquals - p);
+		name[pEquals - p] = 0;
+
+		bSuccess = SetEnvironmentVariable(name, bSet ? pEquals + 1 : NULL) && bSuccess;
+	}
+
+	return bSuccess;
+}
+
+/**
+ * Compare two optional strings.
+ */
+static BOOL EqualSrvStrings(LPCTSTR lpString1, LPCTSTR lpString2) {
+
+	if ((lpString1 == NULL) || (lpString2 == NULL)) {
+		return lpString1 == lpString2;
+	}
+
+	return strcmp(lpString1, lpString2) == 0;
 }
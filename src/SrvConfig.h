@@ -19,20 +19,218 @@
 
 #include <windows.h>
 
+/**
+ * Actions for SCM control codes are indexed by the user control code
+ * minus SRV_CONTROL_USER_FIRST, with SERVICE_CONTROL_PARAMCHANGE last.
+ */
+#define SRV_CONTROL_USER_FIRST 128
+#define SRV_CONTROL_USER_LAST 255
+#define SRV_CONTROL_ACTIONS (SRV_CONTROL_USER_LAST - SRV_CONTROL_USER_FIRST + 2)
+
 typedef struct tagSRV_CONFIG {
 	LPCTSTR lpApplicationName;
 	LPTSTR lpCommandLine;
 	LPVOID lpEnvironment;
 	LPCTSTR lpCurrentDirectory;
+	LPCTSTR lpOutputLog;
+	DWORD dwOutputLogRotateBytes;
+	DWORD dwOutputLogIndexKB;
+	LPCTSTR lpOutputLogFormat;
+	LPCTSTR lpOutputLogCompression;
+	DWORD dwOutputLogCompressLimit;
+	DWORD dwOutputLogKeep;
+	DWORD dwOutputLogKeepHours;
+	DWORD dwOutputLogKeepMB;
+	DWORD dwOutputLogRateBytes;
+	DWORD dwOutputLogBurstBytes;
+	LPCTSTR lpOutputLogLimitPolicy;
+	DWORD dwOutputLogSample;
+	LPCTSTR lpOutputLogForward;
+	DWORD dwOutputLogForwardBufferKB;
+	DWORD dwOutputLogForwardSpillMB;
+	LPTSTR lpControlActions[SRV_CONTROL_ACTIONS];
+	DWORD dwWatchConfig;
+	DWORD dwEnvironmentHash;
+	LPCTSTR lpHealthCheck;
+	LPCTSTR lpHealthAction;
+	DWORD dwHealthIntervalMillis;
+	DWORD dwHealthTimeoutMillis;
+	DWORD dwHealthFailures;
+	DWORD dwHealthWindow;
+	DWORD dwHealthMaxP99Millis;
+	DWORD dwWatchdogMillis;
+	LPCTSTR lpHangDumpDirectory;
+	DWORD dwHangDumpsKept;
+	DWORD dwHangThreadDumpMillis;
+	DWORD dwRecycleSampleMillis;
+	DWORD dwRecycleMaxPrivateMB;
+	DWORD dwRecycleMaxGrowthMBPerHour;
+	DWORD dwRecycleAfterMinutes;
+	LPCTSTR lpJournal;
+	DWORD dwJournalRecords;
+	DWORD dwStopTimeoutMillis;
+	DWORD dwStopTimeoutAdaptive;
+	DWORD dwStopTimeoutPercentile;
+	DWORD dwStopTimeoutMarginMillis;
+	DWORD dwStopTimeoutMinMillis;
+	DWORD dwStopTimeoutMaxMillis;
+	DWORD dwStartGateSlots;
+	DWORD dwStartGateWaitMillis;
+	LPCTSTR lpPrefetch;
+	DWORD dwPrefetchThreads;
+	DWORD dwPrefetchWaitMillis;
+	DWORD dwJava;
+	LPCTSTR lpJavaArchiveDirectory;
+	DWORD dwJavaHeapPercent;
+	LPTSTR lpEnvironmentFile;
+	LPTSTR lpEnvironmentVariables;
+	LPTSTR lpIncludedFiles;
+	LPTSTR lpReferences;
+	DWORD dwConfigCache;
+	DWORD dwExpand;
+	LPVOID lpCacheView;
 } SRV_CONFIG,*LPSRV_CONFIG;
 
+/**
+ * Kinds of change found by CompareSrvConfig().
+ *
+ *	SRV_CONFIG_CHANGED_LAUNCH		a setting used to launch the child changed;
+ *									the child must be restarted to apply it.
+ *	SRV_CONFIG_CHANGED_OUTPUT_LOG	an output log setting changed while capture stays on.
+ *	SRV_CONFIG_CHANGED_ACTIONS		a control code action changed.
+ *	SRV_CONFIG_CHANGED_WATCH		watching the configuration file was turned on or off.
+ *	SRV_CONFIG_CHANGED_HEALTH		a health check setting changed.
+ *	SRV_CONFIG_CHANGED_DIAGNOSTICS	a hang diagnostics setting changed.
+ *	SRV_CONFIG_CHANGED_RECYCLE		a memory recycling setting changed.
+ *	SRV_CONFIG_CHANGED_STOP			a stop timeout setting or the journal changed.
+ */
+#define SRV_CONFIG_CHANGED_LAUNCH		0x0001
+#define SRV_CONFIG_CHANGED_OUTPUT_LOG	0x0002
+#define SRV_CONFIG_CHANGED_ACTIONS		0x0004
+#define SRV_CONFIG_CHANGED_WATCH		0x0008
+#define SRV_CONFIG_CHANGED_HEALTH		0x0010
+#define SRV_CONFIG_CHANGED_DIAGNOSTICS	0x0020
+#define SRV_CONFIG_CHANGED_RECYCLE		0x0040
+#define SRV_CONFIG_CHANGED_STOP			0x0080
+
 /**
  * Allocate a service configuration block
- * and initialize it from the service configuration file.
+ * and initialize it from the service configuration file,
+ * or from its binary cache if that is up to date.
+ *
+ * Returns pointer to the block.
+ */
+LPSRV_CONFIG GetSrvConfig(LPSTR lpConfigName, LPCSTR lpServiceName);
+
+/**
+ * Copy the current environment block, since reading a configuration
+ * sets its environment variables in this process.
+ *
+ * Returns the copy, to be released with ReleaseSrvEnvironment(), or NULL on failure.
+ */
+LPVOID SaveSrvEnvironment(void);
+
+/**
+ * Make the current environment what it was when it was saved,
+ * removing variables set since and setting those removed or changed.
+ * The SRVWRAP_ variables that the wrapper sets for the child are left alone.
+ */
+BOOL RestoreSrvEnvironment(LPCVOID lpSaved);
+
+/**
+ * Release a saved environment.  Returns NULL.
+ */
+LPVOID ReleaseSrvEnvironment(LPVOID lpSaved);
+
+/**
+ * Allocate a service configuration block and initialize it
+ * by parsing the service configuration file, ignoring any cache.
+ *
+ * A file with sections gives settings for several services:
+ *
+ *	[defaults]			settings for every service, before any service section.
+ *	[service:name]		settings for the service lpServiceName, which override the defaults.
+ *	[service:prefix*]	settings for every service whose name begins with prefix.
+ *	[env]				environment variables for the defaults or service section above it.
+ *	[limits], [logging], [health]
+ *						settings for the section above it, grouped for readability.
+ *
+ * Settings before the first section apply to every service, so a file
+ * without sections is read as before.  Include=path reads another file
+ * as though its lines were in place of the Include line.
+ *
+ * After Expand=1, values, including those of environment variables, are expanded
+ * once as they are read: ${name} and %name% give an environment variable or a
+ * built-in name (service, instance, core, cores or memory_mb), ${expression}
+ * works out arithmetic such as ${memory_mb / 2}, and $$ gives a single $.
+ * The instance is the number ending the service name.  Other values are kept
+ * as written, so that a command line may pass ${...} or %c through to the child.
+ *
+ * Environment variables are set as they are read and are recorded
+ * in lpEnvironmentVariables as name=value strings ending with an empty string;
+ * a caller that may discard the result saves the environment first.
+ * Included files are recorded the same way in lpIncludedFiles, and the
+ * names that values were expanded from are recorded in lpReferences.
  *
  * Returns pointer to the block.
  */
-LPSRV_CONFIG GetSrvConfig(LPSTR lpConfigName);
+LPSRV_CONFIG ReadSrvConfig(LPSTR lpConfigName, LPCSTR lpServiceName);
+
+/**
+ * Compare a reloaded configuration with the live one.
+ *
+ * Returns a combination of SRV_CONFIG_CHANGED_* flags, or 0 if nothing changed.
+ */
+DWORD CompareSrvConfig(LPSRV_CONFIG lpOldConfig, LPSRV_CONFIG lpNewConfig);
+
+/**
+ * Start watching the directory containing the service configuration file.
+ *
+ * Returns a change notification handle for FindNextChangeNotification(),
+ * or INVALID_HANDLE_VALUE on failure.
+ */
+HANDLE WatchSrvConfig(LPSTR lpConfigName);
+
+/**
+ * Get the last write time of the service configuration file.
+ */
+BOOL GetSrvConfigTime(LPSTR lpConfigName, LPFILETIME lpLastWriteTime);
+
+/**
+ * Get the index into lpControlActions for an SCM control code.
+ *
+ * Returns -1 if the control code cannot have an action.
+ */
+int GetSrvControlActionIndex(DWORD dwControl);
+
+/**
+ * Get a description of the last error found by ReadSrvConfig() in the form
+ * "path(line,column): message", or "path: message" if the file could not be read.
+ *
+ * Returns an empty string if the last error was not in the text of a file.
+ */
+LPCSTR GetSrvConfigError(void);
+
+/**
+ * Get a fingerprint of the configuration keys, with their types, fields,
+ * defaults and limits, and of the build of the parser.  A configuration
+ * cached under a different fingerprint must be parsed again.
+ */
+ULONGLONG GetSrvConfigSchemaHash(void);
+
+/**
+ * Get the offsets within SRV_CONFIG of the fields holding a single string,
+ * including lpEnvironmentFile but not the control actions or lpEnvironmentVariables.
+ *
+ * Returns the number of offsets.
+ */
+DWORD GetSrvConfigStringFields(const SIZE_T** lplpOffsets);
+
+/**
+ * Check that a name recorded in lpReferences has the same value as when
+ * the configuration was read, for a cached configuration of lpServiceName.
+ */
+BOOL IsSrvConfigReferenceCurrent(LPCSTR lpServiceName, LPCSTR lpReference);
 
 /**
  * Release the service configuration block
@@ -0,0 +1,531 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SrvConfigCache.h"
+#include "SrvHistogram.h"
+
+#define CACHE_MAGIC 0x43435753		// "SWCC"
+#define CACHE_VERSION 4
+#define CACHE_SOURCES 8
+#define CACHE_HASH_CHUNK 65536
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/**
+ * A file the configuration was parsed from: the configuration file itself,
+ * then the environment file, if any, then included files.
+ * An unused source has an empty path.
+ */
+typedef struct tagCACHE_SOURCE {
+	char path[MAX_PATH];
+	ULONGLONG ullSize;
+	FILETIME ftLastWrite;
+	ULONGLONG ullHash;
+} CACHE_SOURCE;
+
+/**
+ * The cache file is this header, then an image of SRV_CONFIG whose string
+ * pointers are offsets from the start of the file, then the strings.
+ * The schema hash changes with any key, default or limit, or rebuild of the parser.
+ */
+typedef struct tagCACHE_HEADER {
+	DWORD dwMagic;
+	DWORD dwVersion;
+	ULONGLONG ullSchema;
+	DWORD cbConfig;
+	DWORD cbTotal;
+	CACHE_SOURCE sources[CACHE_SOURCES];
+} CACHE_HEADER;
+
+#define CACHE_IMAGE_OFFSET ((sizeof(CACHE_HEADER) + 7) & ~(SIZE_T)7)
+
+static void GetCachePath(LPCSTR, LPCSTR, LPSTR, DWORD);
+static BOOL GetSource(LPCSTR, CACHE_SOURCE*, BOOL);
+static BOOL IsSourceCurrent(CACHE_SOURCE*);
+static SIZE_T GetMultiStringLength(LPCSTR);
+static BOOL FixString(LPBYTE, DWORD, LPSTR*);
+static void SetEnvironmentVariables(LPCSTR);
+
+LPSRV_CONFIG SrvConfigCacheLoad(LPCSTR lpConfigName, LPCSTR lpServiceName) {
+
+	char cachePath[MAX_PATH * 2];
+	GetCachePath(lpConfigName, lpServiceName, cachePath, sizeof(cachePath));
+
+	HANDLE hFile = CreateFile(cachePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return NULL;
+	}
+
+	LARGE_INTEGER liSize;
+	HANDLE hMapping = NULL;
+
+	if (GetFileSizeEx(hFile, &liSize) && (liSize.QuadPart > (LONGLONG)CACHE_IMAGE_OFFSET + sizeof(SRV_CONFIG))
+			&& (liSize.QuadPart < MAXDWORD)) {
+		hMapping = CreateFileMapping(hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	}
+
+	CloseHandle(hFile);
+
+	if (hMapping == NULL) {
+		return NULL;
+	}
+
+	// Copy-on-write, because the child's command line is passed to CreateProcess(),
+	// which may write to it.  The view outlives the mapping handle.
+
+	LPBYTE lpView = MapViewOfFile(hMapping, FILE_MAP_COPY, 0, 0, 0);
+	CloseHandle(hMapping);
+
+	if (lpView == NULL) {
+		return NULL;
+	}
+
+	CACHE_HEADER* pHeader = (CACHE_HEADER*)lpView;
+	DWORD cbTotal = (DWORD)liSize.QuadPart;
+
+	BOOL bValid = (pHeader->dwMagic == CACHE_MAGIC)
+			&& (pHeader->dwVersion == CACHE_VERSION)
+			&& (pHeader->ullSchema == GetSrvConfigSchemaHash())
+			&& (pHeader->cbConfig == sizeof(SRV_CONFIG))
+			&& (pHeader->cbTotal == cbTotal)
+			&& (lpView[cbTotal - 2] == 0)
+			&& (lpView[cbTotal - 1] == 0)
+			&& (_stricmp(pHeader->sources[0].path, lpConfigName) == 0);
+
+	for (int i = 0; bValid && (i < CACHE_SOURCES); i++) {
+		bValid = IsSourceCurrent(&pHeader->sources[i]);
+	}
+
+	LPSRV_CONFIG lpSrvConfig = NULL;
+
+	if (bValid) {
+		lpSrvConfig = HeapAlloc(GetProcessHeap(), 0, sizeof(*lpSrvConfig));
+		bValid = lpSrvConfig != NULL;
+	}
+
+	if (bValid) {
+
+		memcpy(lpSrvConfig, lpView + CACHE_IMAGE_OFFSET, sizeof(*lpSrvConfig));
+
+		const SIZE_T* lpStringFields;
+		DWORD dwStringFields = GetSrvConfigStringFields(&lpStringFields);
+
+		for (DWORD i = 0; i < dwStringFields; i++) {
+			bValid = bValid && FixString(lpView, cbTotal, (LPSTR*)((LPBYTE)lpSrvConfig + lpStringFields[i]));
+		}
+		for (int i = 0; i < SRV_CONTROL_ACTIONS; i++) {
+			bValid = bValid && FixString(lpView, cbTotal, &lpSrvConfig->lpControlActions[i]);
+		}
+		bValid = bValid && FixString(lpView, cbTotal, &lpSrvConfig->lpEnvironmentVariables);
+		bValid = bValid && FixString(lpView, cbTotal, &lpSrvConfig->lpReferences);
+
+		lpSrvConfig->lpEnvironment = NULL;
+		lpSrvConfig->lpIncludedFiles = NULL;
+	}
+
+	// Values expanded from the inherited environment or the machine
+	// are stale if those changed, though no source did.
+
+	for (LPCSTR p = bValid ? lpSrvConfig->lpReferences : NULL; bValid && (p != NULL) && (*p != 0); p += strlen(p) + 1) {
+		bValid = IsSrvConfigReferenceCurrent(lpServiceName, p);
+	}
+
+	if (!bValid) {
+		if (lpSrvConfig != NULL) {
+			HeapFree(GetProcessHeap(), 0, lpSrvConfig);
+		}
+		UnmapViewOfFile(lpView);
+		return NULL;
+	}
+
+	lpSrvConfig->lpCacheView = lpView;
+
+	if (lpSrvConfig->lpEnvironmentVariables != NULL) {
+		SetEnvironmentVariables(lpSrvConfig->lpEnvironmentVariables);
+	}
+
+	return lpSrvConfig;
+}
+
+BOOL SrvConfigCacheSave(LPCSTR lpConfigName, LPCSTR lpServiceName, LPSRV_CONFIG lpSrvConfig, LPFILETIME lpParseStarted) {
+
+	CACHE_HEADER header;
+	ZeroMemory(&header, sizeof(header));
+
+	header.dwMagic = CACHE_MAGIC;
+	header.dwVersion = CACHE_VERSION;
+	header.ullSchema = GetSrvConfigSchemaHash();
+	header.cbConfig = sizeof(SRV_CONFIG);
+
+	if (!GetSource(lpConfigName, &header.sources[0], TRUE)) {
+		return FALSE;
+	}
+	if ((lpSrvConfig->lpEnvironmentFile != NULL)
+			&& !GetSource(lpSrvConfig->lpEnvironmentFile, &header.sources[1], TRUE)) {
+		return FALSE;
+	}
+
+	int source = 2;
+	for (LPCSTR p = lpSrvConfig->lpIncludedFiles; (p != NULL) && (*p != 0); p += strlen(p) + 1) {
+
+		if (source == CACHE_SOURCES) {
+			SetLastError(ERROR_NOT_SUPPORTED);
+			return FALSE;
+		}
+
+		if (!GetSource(p, &header.sources[source++], TRUE)) {
+			return FALSE;
+		}
+	}
+
+	for (int i = 0; i < CACHE_SOURCES; i++) {
+		if ((header.sources[i].path[0] != 0)
+				&& (CompareFileTime(&header.sources[i].ftLastWrite, lpParseStarted) >= 0)) {
+			SetLastError(ERROR_RETRY);
+			return FALSE;
+		}
+	}
+
+	// Size the file: header, image, strings and two final terminators,
+	// so that even a damaged list of strings ends within the view.
+
+	SIZE_T cbTotal = CACHE_IMAGE_OFFSET + sizeof(SRV_CONFIG) + 2;
+
+	const SIZE_T* lpStringFields;
+	DWORD dwStringFields = GetSrvConfigStringFields(&lpStringFields);
+
+	for (DWORD i = 0; i < dwStringFields; i++) {
+		LPCSTR lpString = *(LPCSTR*)((LPBYTE)lpSrvConfig + lpStringFields[i]);
+		cbTotal += (lpString != NULL) ? strlen(lpString) + 1 : 0;
+	}
+	for (int i = 0; i < SRV_CONTROL_ACTIONS; i++) {
+		cbTotal += (lpSrvConfig->lpControlActions[i] != NULL) ? strlen(lpSrvConfig->lpControlActions[i]) + 1 : 0;
+	}
+	cbTotal += GetMultiStringLength(lpSrvConfig->lpEnvironmentVariables);
+	cbTotal += GetMultiStringLength(lpSrvConfig->lpReferences);
+
+	HANDLE hHeap = GetProcessHeap();
+	LPBYTE lpBuffer = HeapAlloc(hHeap, HEAP_ZERO_MEMORY, cbTotal);
+
+	if (lpBuffer == NULL) {
+		SetLastError(ERROR_OUTOFMEMORY);
+		return FALSE;
+	}
+
+	header.cbTotal = (DWORD)cbTotal;
+	memcpy(lpBuffer, &header, sizeof(header));
+
+	LPSRV_CONFIG lpImage = (LPSRV_CONFIG)(lpBuffer + CACHE_IMAGE_OFFSET);
+	memcpy(lpImage, lpSrvConfig, sizeof(*lpImage));
+	lpImage->lpEnvironment = NULL;
+	lpImage->lpIncludedFiles = NULL;
+	lpImage->lpCacheView = NULL;
+
+	SIZE_T offset = CACHE_IMAGE_OFFSET + sizeof(SRV_CONFIG);
+
+	for (DWORD i = 0; i < dwStringFields; i++) {
+		LPSTR* pField = (LPSTR*)((LPBYTE)lpImage + lpStringFields[i]);
+		if (*pField != NULL) {
+			SIZE_T length = strlen(*pField) + 1;
+			memcpy(lpBuffer + offset, *pField, length);
+			*pField = (LPSTR)(ULONG_PTR)offset;
+			offset += length;
+		}
+	}
+	for (int i = 0; i < SRV_CONTROL_ACTIONS; i++) {
+		LPSTR* pField = &lpImage->lpControlActions[i];
+		if (*pField != NULL) {
+			SIZE_T length = strlen(*pField) + 1;
+			memcpy(lpBuffer + offset, *pField, length);
+			*pField = (LPSTR)(ULONG_PTR)offset;
+			offset += length;
+		}
+	}
+	if (lpImage->lpEnvironmentVariables != NULL) {
+		SIZE_T length = GetMultiStringLength(lpImage->lpEnvironmentVariables);
+		memcpy(lpBuffer + offset, lpImage->lpEnvironmentVariables, length);
+		lpImage->lpEnvironmentVariables = (LPSTR)(ULONG_PTR)offset;
+		offset += length;
+	}
+	if (lpImage->lpReferences != NULL) {
+		SIZE_T length = GetMultiStringLength(lpImage->lpReferences);
+		memcpy(lpBuffer + offset, lpImage->lpReferences, length);
+		lpImage->lpReferences = (LPSTR)(ULONG_PTR)offset;
+	}
+
+	// Write a new file and move it over the old one, so that a service
+	// loading the cache meanwhile sees one or the other.
+
+	char cachePath[MAX_PATH * 2];
+	char tempPath[MAX_PATH * 2 + 16];
+	GetCachePath(lpConfigName, lpServiceName, cachePath, sizeof(cachePath));
+	_snprintf(tempPath, sizeof(tempPath), "%s.%lu", cachePath, GetCurrentProcessId());
+	tempPath[sizeof(tempPath) - 1] = 0;
+
+	HANDLE hFile = CreateFile(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	BOOL bSuccess = FALSE;
+
+	if (hFile != INVALID_HANDLE_VALUE) {
+
+		DWORD dwWritten;
+		bSuccess = WriteFile(hFile, lpBuffer, (DWORD)cbTotal, &dwWritten, NULL) && (dwWritten == cbTotal);
+
+		CloseHandle(hFile);
+
+		bSuccess = bSuccess && MoveFileEx(tempPath, cachePath, MOVEFILE_REPLACE_EXISTING);
+
+		if (!bSuccess) {
+			DWORD dwLastError = GetLastError();
+			DeleteFile(tempPath);
+			SetLastError(dwLastError);
+		}
+	}
+
+	HeapFree(hHeap, 0, lpBuffer);
+	return bSuccess;
+}
+
+int SrvConfigCacheBenchmark(LPSTR lpConfigName, LPCSTR lpServiceName, DWORD dwIterations) {
+
+	// Parse once to write the cache.
+
+	FILETIME ftParseStarted;
+	GetSystemTimeAsFileTime(&ftParseStarted);
+
+	LPSRV_CONFIG lpSrvConfig = ReadSrvConfig(lpConfigName, lpServiceName);
+
+	if (lpSrvConfig == NULL) {
+		fprintf(stderr, "SrvWrap: cannot read configuration %s, error %lu\n", lpConfigName, GetLastError());
+		if (GetSrvConfigError()[0] != 0) {
+			fprintf(stderr, "SrvWrap: %s\n", GetSrvConfigError());
+		}
+		return EXIT_FAILURE;
+	}
+
+	BOOL bSaved = SrvConfigCacheSave(lpConfigName, lpServiceName, lpSrvConfig, &ftParseStarted);
+	DWORD dwLastError = GetLastError();
+	ReleaseSrvConfig(lpSrvConfig);
+
+	if (!bSaved) {
+		fprintf(stderr, "SrvWrap: cannot write configuration cache, error %lu\n", dwLastError);
+		return EXIT_FAILURE;
+	}
+
+	LARGE_INTEGER liFrequency;
+	QueryPerformanceFrequency(&liFrequency);
+
+	static SRV_HISTOGRAM textMicros;
+	static SRV_HISTOGRAM cacheMicros;
+	SrvHistogramReset(&textMicros);
+	SrvHistogramReset(&cacheMicros);
+
+	// Alternate the two paths so that both see the same file cache and clock.
+
+	for (DWORD i = 0; i < dwIterations; i++) {
+
+		LARGE_INTEGER liParseStart, liParsed, liLoadStart, liLoaded;
+
+		QueryPerformanceCounter(&liParseStart);
+		lpSrvConfig = ReadSrvConfig(lpConfigName, lpServiceName);
+		QueryPerformanceCounter(&liParsed);
+		ReleaseSrvConfig(lpSrvConfig);
+
+		QueryPerformanceCounter(&liLoadStart);
+		LPSRV_CONFIG lpCachedConfig = SrvConfigCacheLoad(lpConfigName, lpServiceName);
+		QueryPerformanceCounter(&liLoaded);
+
+		if (lpCachedConfig == NULL) {
+			fprintf(stderr, "SrvWrap: configuration cache went stale during the benchmark\n");
+			return EXIT_FAILURE;
+		}
+		ReleaseSrvConfig(lpCachedConfig);
+
+		SrvHistogramRecord(&textMicros,
+				(DWORD)((liParsed.QuadPart - liParseStart.QuadPart) * 1000000 / liFrequency.QuadPart));
+		SrvHistogramRecord(&cacheMicros,
+				(DWORD)((liLoaded.QuadPart - liLoadStart.QuadPart) * 1000000 / liFrequency.QuadPart));
+	}
+
+	printf("iterations=%lu\n", dwIterations);
+	printf("text-us p50=%lu p90=%lu p99=%lu max=%lu\n",
+			SrvHistogramPercentile(&textMicros, 50.0),
+			SrvHistogramPercentile(&textMicros, 90.0),
+			SrvHistogramPercentile(&textMicros, 99.0),
+			textMicros.dwMax);
+	printf("cache-us p50=%lu p90=%lu p99=%lu max=%lu\n",
+			SrvHistogramPercentile(&cacheMicros, 50.0),
+			SrvHistogramPercentile(&cacheMicros, 90.0),
+			SrvHistogramPercentile(&cacheMicros, 99.0),
+			cacheMicros.dwMax);
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Name the cache file after the configuration file and the service.
+ */
+static void GetCachePath(LPCSTR lpConfigName, LPCSTR lpServiceName, LPSTR lpBuffer, DWORD dwSize) {
+
+	if (lpServiceName != NULL) {
+		_snprintf(lpBuffer, dwSize, "%s.%s.cache", lpConfigName, lpServiceName);
+	}
+	else {
+		_snprintf(lpBuffer, dwSize, "%s.cache", lpConfigName);
+	}
+	lpBuffer[dwSize - 1] = 0;
+}
+
+/**
+ * Describe a source file by its path, size, last write time and,
+ * if bHash, an FNV-1a hash of its content.
+ */
+static BOOL GetSource(LPCSTR lpPath, CACHE_SOURCE* pSource, BOOL bHash) {
+
+	if (strlen(lpPath) >= sizeof(pSource->path)) {
+		SetLastError(ERROR_BAD_PATHNAME);
+		return FALSE;
+	}
+	strcpy(pSource->path, lpPath);
+
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesEx(lpPath, GetFileExInfoStandard, &attributes)) {
+		return FALSE;
+	}
+
+	pSource->ullSize = ((ULONGLONG)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+	pSource->ftLastWrite = attributes.ftLastWriteTime;
+	pSource->ullHash = FNV_OFFSET_BASIS;
+
+	if (!bHash) {
+		return TRUE;
+	}
+
+	HANDLE hFile = CreateFile(lpPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+
+	BYTE buffer[CACHE_HASH_CHUNK];
+	DWORD dwRead;
+	BOOL bSuccess;
+
+	while ((bSuccess = ReadFile(hFile, buffer, sizeof(buffer), &dwRead, NULL)) && (dwRead != 0)) {
+		for (DWORD i = 0; i < dwRead; i++) {
+			pSource->ullHash = (pSource->ullHash ^ buffer[i]) * FNV_PRIME;
+		}
+	}
+
+	CloseHandle(hFile);
+	return bSuccess;
+}
+
+/**
+ * Check a source recorded in the cache against the file as it is now.
+ * The content is hashed only if the size and last write time match.
+ */
+static BOOL IsSourceCurrent(CACHE_SOURCE* pSource) {
+
+	if (pSource->path[0] == 0) {
+		return TRUE;
+	}
+
+	pSource->path[sizeof(pSource->path) - 1] = 0;
+
+	CACHE_SOURCE current;
+	if (!GetSource(pSource->path, &current, FALSE)) {
+		return FALSE;
+	}
+
+	if ((current.ullSize != pSource->ullSize)
+			|| (CompareFileTime(&current.ftLastWrite, &pSource->ftLastWrite) != 0)) {
+		return FALSE;
+	}
+
+	return GetSource(pSource->path, &current, TRUE) && (current.ullHash == pSource->ullHash);
+}
+
+/**
+ * Get the length of a list of null terminated strings ending with an empty string,
+ * including the final terminator.
+ */
+static SIZE_T GetMultiStringLength(LPCSTR lpStrings) {
+
+	if (lpStrings == NULL) {
+		return 0;
+	}
+
+	LPCSTR p = lpStrings;
+	while (*p != 0) {
+		p += strlen(p) + 1;
+	}
+
+	return p - lpStrings + 1;
+}
+
+/**
+ * Turn a string offset from the cache into a pointer into the view.
+ * Offsets must point past the image; the view ends with two terminators.
+ */
+static BOOL FixString(LPBYTE lpView, DWORD cbTotal, LPSTR* pField) {
+
+	ULONG_PTR offset = (ULONG_PTR)*pField;
+
+	if (offset == 0) {
+		*pField = NULL;
+		return TRUE;
+	}
+
+	if ((offset < CACHE_IMAGE_OFFSET + sizeof(SRV_CONFIG)) || (offset >= cbTotal)) {
+		return FALSE;
+	}
+
+	*pField = (LPSTR)(lpView + offset);
+	return TRUE;
+}
+
+/**
+ * Set the name=value environment variables recorded in the cache.
+ */
+static void SetEnvironmentVariables(LPCSTR lpVariables) {
+
+	for (LPCSTR p = lpVariables; *p != 0; p += strlen(p) + 1) {
+
+		LPCSTR pEquals = strchr(p, '=');
+		char name[256];
+
+		if ((pEquals == NULL) || ((SIZE_T)(pEquals - p) >= sizeof(name))) {
+			continue;
+		}
+
+		memcpy(name, p, pEquals - p);
+		name[pEquals - p] = 0;
+
+		SetEnvironmentVariable(name, pEquals + 1);
+	}
+}
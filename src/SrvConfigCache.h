@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVCONFIGCACHE_H_
+#define SRVCONFIGCACHE_H_
+
+#include <windows.h>
+
+#include "SrvConfig.h"
+
+/**
+ * Load a parsed configuration from the binary cache beside the configuration file,
+ * named by adding the service name and .cache to its path, since a file with
+ * sections holds several services.  The cache is used only if it was written
+ * by this build of the wrapper and the configuration file, any environment file
+ * and any included files still have the path, size, last write time and content
+ * hash recorded in it, and the inherited environment variables and built-in names
+ * that values were expanded from still have the same values.  The environment
+ * variables recorded in the cache are set again.
+ *
+ * The cache is mapped copy-on-write and the strings of the configuration
+ * point into the view, which ReleaseSrvConfig() unmaps.
+ *
+ * Returns NULL if there is no usable cache.
+ */
+LPSRV_CONFIG SrvConfigCacheLoad(LPCSTR lpConfigName, LPCSTR lpServiceName);
+
+/**
+ * Write a configuration parsed from text to the cache, replacing it atomically.
+ * Nothing is written if a source was changed after lpParseStarted,
+ * since the configuration might not match what the file now holds,
+ * nor if there are too many included files to record, with ERROR_NOT_SUPPORTED.
+ */
+BOOL SrvConfigCacheSave(LPCSTR lpConfigName, LPCSTR lpServiceName, LPSRV_CONFIG lpSrvConfig, LPFILETIME lpParseStarted);
+
+/**
+ * Time parsing the configuration file against loading it from the cache,
+ * writing the cache first, and print percentiles of each to standard output.
+ *
+ * Returns a process exit code.
+ */
+int SrvConfigCacheBenchmark(LPSTR lpConfigName, LPCSTR lpServiceName, DWORD dwIterations);
+
+#endif /* SRVCONFIGCACHE_H_ */
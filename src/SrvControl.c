@@ -0,0 +1,422 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+
+#include <tchar.h>
+#include <stdio.h>
+
+#include "SrvControl.h"
+
+static const char pipeNamePrefix[] = "\\\\.\\pipe\\SrvWrap-";
+static const DWORD clientTimeoutMillis = 5000;
+
+/**
+ * Command names indexed by SRV_COMMAND.
+ */
+static const LPCSTR commandNames[SRV_COMMAND_COUNT] = {
+	"status",
+	"restart",
+	"reload-config",
+	"rotate-logs",
+	"dump-stats",
+	"signal-child",
+	"tail-log",
+	"reopen-logs",
+	"query-log",
+};
+
+/**
+ * The endpoint is a single overlapped message mode pipe instance.
+ * One client is served at a time and may send any number of requests
+ * before disconnecting.  Other clients wait in WaitNamedPipe().
+ */
+typedef enum tagPIPE_STATE {
+	PIPE_CONNECTING,
+	PIPE_READING,
+	PIPE_WRITING
+} PIPE_STATE;
+
+static HANDLE hPipe = INVALID_HANDLE_VALUE;
+static OVERLAPPED ovPipe;
+static BOOL bIoPending = FALSE;
+static PIPE_STATE pipeState = PIPE_CONNECTING;
+static LPSRV_COMMAND_HANDLER lpCommandHandler = NULL;
+
+static char request[SRV_CONTROL_REQUEST_SIZE + 1];
+static char replyText[SRV_CONTROL_REPLY_SIZE - 32];
+static char reply[SRV_CONTROL_REPLY_SIZE];
+static DWORD dwReplyLength = 0;
+
+static DWORD dwRequests = 0;
+static DWORD dwFailures = 0;
+static LONGLONG llTotalTicks = 0;
+static LONGLONG llMaxTicks = 0;
+static LARGE_INTEGER liFrequency;
+
+static void Listen(void);
+static void Reset(void);
+static void StartRead(void);
+static void StartWrite(void);
+static void HandleRequest(DWORD);
+static BOOL ExecuteRequest(LPSTR, LPSTR, DWORD);
+
+BOOL SrvControlOpen(LPCSTR lpServiceName, LPSRV_COMMAND_HANDLER lpHandler) {
+
+	char pipeName[MAX_PATH];
+	if (strlen(pipeNamePrefix) + strlen(lpServiceName) >= sizeof(pipeName)) {
+		SetLastError(ERROR_BAD_ARGUMENTS);
+		return FALSE;
+	}
+	strcpy(pipeName, pipeNamePrefix);
+	strcat(pipeName, lpServiceName);
+
+	lpCommandHandler = lpHandler;
+	QueryPerformanceFrequency(&liFrequency);
+
+	ZeroMemory(&ovPipe, sizeof(ovPipe));
+	ovPipe.hEvent = CreateEvent(
+			NULL,	// default security attributes
+			TRUE,	// manual reset event
+			FALSE,	// not signaled
+			NULL);	// no name
+
+	if (ovPipe.hEvent == NULL) {
+		return FALSE;
+	}
+
+	// The default security descriptor gives write access to administrators
+	// and LocalSystem only, so only they can send commands.
+
+	hPipe = CreateNamedPipe(
+			pipeName,
+			PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+			PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+			1,							// nMaxInstances
+			SRV_CONTROL_REPLY_SIZE,		// nOutBufferSize
+			SRV_CONTROL_REQUEST_SIZE,	// nInBufferSize
+			0,							// nDefaultTimeOut
+			NULL);						// lpSecurityAttributes
+
+	if (hPipe == INVALID_HANDLE_VALUE) {
+		CloseHandle(ovPipe.hEvent);
+		ovPipe.hEvent = NULL;
+		return FALSE;
+	}
+
+	Listen();
+	return TRUE;
+}
+
+HANDLE SrvControlGetEvent(void) {
+	return ovPipe.hEvent;
+}
+
+void SrvControlService(void) {
+
+	DWORD dwTransferred = 0;
+	BOOL bSuccess = TRUE;
+
+	if (bIoPending) {
+		bSuccess = GetOverlappedResult(hPipe, &ovPipe, &dwTransferred, FALSE);
+		bIoPending = FALSE;
+	}
+	else {
+		ResetEvent(ovPipe.hEvent);
+	}
+
+	if (!bSuccess) {
+
+		// The client disconnected or sent an oversized request.
+
+		Reset();
+		return;
+	}
+
+	switch (pipeState) {
+
+	case PIPE_CONNECTING:
+		StartRead();
+		break;
+
+	case PIPE_READING:
+		HandleRequest(dwTransferred);
+		StartWrite();
+		break;
+
+	case PIPE_WRITING:
+		StartRead();
+		break;
+	}
+}
+
+SRV_COMMAND SrvControlFindCommand(LPCSTR lpName) {
+
+	int command;
+	for (command = 0; command < SRV_COMMAND_COUNT; command++) {
+		if (strcmp(lpName, commandNames[command]) == 0) {
+			break;
+		}
+	}
+
+	return (SRV_COMMAND)command;
+}
+
+BOOL SrvControlExecute(LPSTR lpRequest, LPSTR lpReply, DWORD dwReplySize) {
+
+	if (lpCommandHandler == NULL) {
+		SetLastError(ERROR_NOT_READY);
+		return FALSE;
+	}
+
+	return ExecuteRequest(lpRequest, lpReply, dwReplySize);
+}
+
+DWORD SrvControlFormat(LPSTR lpBuffer, DWORD dwSize) {
+
+	if (dwSize == 0) {
+		return 0;
+	}
+
+	LONGLONG llPerMicro = (liFrequency.QuadPart < 1000000) ? 1 : liFrequency.QuadPart / 1000000;
+
+	int length = _snprintf(lpBuffer, dwSize, "control requests=%lu failed=%lu avg=%lldus max=%lldus\n",
+			dwRequests,
+			dwFailures,
+			(dwRequests == 0) ? 0 : llTotalTicks / dwRequests / llPerMicro,
+			llMaxTicks / llPerMicro);
+
+	if ((length < 0) || ((DWORD)length >= dwSize)) {
+		length = dwSize - 1;
+	}
+	lpBuffer[length] = 0;
+
+	return length;
+}
+
+void SrvControlClose(void) {
+
+	if (hPipe != INVALID_HANDLE_VALUE) {
+		CancelIo(hPipe);
+		DisconnectNamedPipe(hPipe);
+		CloseHandle(hPipe);
+		hPipe = INVALID_HANDLE_VALUE;
+	}
+
+	if (ovPipe.hEvent != NULL) {
+		CloseHandle(ovPipe.hEvent);
+		ovPipe.hEvent = NULL;
+	}
+}
+
+int SrvControlClient(LPCSTR lpServiceName, int argc, char* argv[]) {
+
+	char pipeName[MAX_PATH];
+	if (strlen(pipeNamePrefix) + strlen(lpServiceName) >= sizeof(pipeName)) {
+		fprintf(stderr, "SrvWrap: service name too long\n");
+		return EXIT_FAILURE;
+	}
+	strcpy(pipeName, pipeNamePrefix);
+	strcat(pipeName, lpServiceName);
+
+	// Join the arguments with blanks to form the request.
+
+	char clientRequest[SRV_CONTROL_REQUEST_SIZE];
+	clientRequest[0] = 0;
+
+	for (int i = 0; i < argc; i++) {
+		if (strlen(clientRequest) + strlen(argv[i]) + 2 > sizeof(clientRequest)) {
+			fprintf(stderr, "SrvWrap: request too long\n");
+			return EXIT_FAILURE;
+		}
+		if (i != 0) {
+			strcat(clientRequest, " ");
+		}
+		strcat(clientRequest, argv[i]);
+	}
+
+	static char clientReply[SRV_CONTROL_REPLY_SIZE + 1];
+	DWORD dwRead = 0;
+
+	BOOL bSuccess = CallNamedPipe(
+			pipeName,
+			clientRequest,
+			(DWORD)strlen(clientRequest),
+			clientReply,
+			SRV_CONTROL_REPLY_SIZE,
+			&dwRead,
+			clientTimeoutMillis);
+
+	if (!bSuccess && (GetLastError() != ERROR_MORE_DATA)) {
+		fprintf(stderr, "SrvWrap: cannot reach service %s, error %lu\n", lpServiceName, GetLastError());
+		return EXIT_FAILURE;
+	}
+
+	clientReply[dwRead] = 0;
+	fputs(clientReply, stdout);
+
+	return (strncmp(clientReply, "OK", 2) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Wait for a client to connect.
+ */
+static void Listen(void) {
+
+	pipeState = PIPE_CONNECTING;
+
+	if (ConnectNamedPipe(hPipe, &ovPipe)) {
+		bIoPending = TRUE;
+		return;
+	}
+
+	switch (GetLastError()) {
+
+	case ERROR_IO_PENDING:
+		bIoPending = TRUE;
+		break;
+
+	case ERROR_PIPE_CONNECTED:
+
+		// A client connected between CreateNamedPipe() and ConnectNamedPipe().
+		// No I/O is pending, so signal the event explicitly.
+
+		bIoPending = FALSE;
+		SetEvent(ovPipe.hEvent);
+		break;
+
+	default:
+
+		// Leave the endpoint idle rather than spinning on a persistent error.
+
+		bIoPending = FALSE;
+		ResetEvent(ovPipe.hEvent);
+		break;
+	}
+}
+
+/**
+ * Drop the current client and wait for the next one.
+ */
+static void Reset(void) {
+
+	DisconnectNamedPipe(hPipe);
+	Listen();
+}
+
+/**
+ * Start reading the next request from the connected client.
+ * The event is signaled whether the read completes now or later.
+ */
+static void StartRead(void) {
+
+	pipeState = PIPE_READING;
+
+	if (ReadFile(hPipe, request, SRV_CONTROL_REQUEST_SIZE, NULL, &ovPipe)
+			|| (GetLastError() == ERROR_IO_PENDING)) {
+		bIoPending = TRUE;
+	}
+	else {
+		Reset();
+	}
+}
+
+/**
+ * Start writing the reply prepared by HandleRequest().
+ */
+static void StartWrite(void) {
+
+	pipeState = PIPE_WRITING;
+
+	if (WriteFile(hPipe, reply, dwReplyLength, NULL, &ovPipe)
+			|| (GetLastError() == ERROR_IO_PENDING)) {
+		bIoPending = TRUE;
+	}
+	else {
+		Reset();
+	}
+}
+
+/**
+ * Parse and carry out a request and prepare the reply.
+ * The reply starts with "OK" or "ERR <error code>" on its own line.
+ */
+static void HandleRequest(DWORD dwLength) {
+
+	LARGE_INTEGER liStart;
+	QueryPerformanceCounter(&liStart);
+
+	// Terminate the request and strip any trailing newline.
+
+	request[dwLength] = 0;
+	while ((dwLength > 0) && ((request[dwLength - 1] == '\n') || (request[dwLength - 1] == '\r'))) {
+		request[--dwLength] = 0;
+	}
+
+	replyText[0] = 0;
+	BOOL bSuccess = ExecuteRequest(request, replyText, sizeof(replyText));
+
+	DWORD dwLastError = GetLastError();
+	replyText[sizeof(replyText) - 1] = 0;
+
+	int length;
+	if (bSuccess) {
+		length = _snprintf(reply, sizeof(reply), "OK\n%s", replyText);
+	}
+	else {
+		length = _snprintf(reply, sizeof(reply), "ERR %lu\n%s", dwLastError, replyText);
+		dwFailures++;
+	}
+	dwReplyLength = ((length < 0) || ((DWORD)length > sizeof(reply))) ? sizeof(reply) : (DWORD)length;
+
+	// Account for the time spent handling the request.
+
+	LARGE_INTEGER liEnd;
+	QueryPerformanceCounter(&liEnd);
+
+	LONGLONG llTicks = liEnd.QuadPart - liStart.QuadPart;
+	dwRequests++;
+	llTotalTicks += llTicks;
+	if (llMaxTicks < llTicks) {
+		llMaxTicks = llTicks;
+	}
+}
+
+/**
+ * Split a request into command and argument, look up the command
+ * and pass it to the command handler.
+ */
+static BOOL ExecuteRequest(LPSTR lpRequest, LPSTR lpReply, DWORD dwReplySize) {
+
+	char* pCommand = lpRequest;
+	char* pArgument = strchr(lpRequest, ' ');
+	if (pArgument != NULL) {
+		*pArgument++ = 0;
+	}
+	else {
+		pArgument = lpRequest + strlen(lpRequest);
+	}
+
+	SRV_COMMAND command = SrvControlFindCommand(pCommand);
+
+	if (command == SRV_COMMAND_COUNT) {
+		SetLastError(ERROR_INVALID_FUNCTION);
+		_snprintf(lpReply, dwReplySize, "unknown command %s\n", pCommand);
+		return FALSE;
+	}
+
+	return lpCommandHandler(command, pArgument, lpReply, dwReplySize);
+}
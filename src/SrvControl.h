@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVCONTROL_H_
+#define SRVCONTROL_H_
+
+#include <windows.h>
+
+/**
+ * Maximum size of a control request and of a control reply.
+ */
+#define SRV_CONTROL_REQUEST_SIZE 256
+#define SRV_CONTROL_REPLY_SIZE 8192
+
+/**
+ * Control commands.  A request is a single message containing
+ * the command name optionally followed by a blank and an argument.
+ */
+typedef enum tagSRV_COMMAND {
+	SRV_COMMAND_STATUS,
+	SRV_COMMAND_RESTART,
+	SRV_COMMAND_RELOAD_CONFIG,
+	SRV_COMMAND_ROTATE_LOGS,
+	SRV_COMMAND_DUMP_STATS,
+	SRV_COMMAND_SIGNAL_CHILD,
+	SRV_COMMAND_TAIL_LOG,
+	SRV_COMMAND_REOPEN_LOGS,
+	SRV_COMMAND_QUERY_LOG,
+	SRV_COMMAND_COUNT
+} SRV_COMMAND;
+
+/**
+ * Function that carries out a control command.
+ *
+ *	lpArgument		is the argument following the command name, or an empty string.
+ *
+ *	lpReply			receives the text of the reply.
+ *
+ * Returns FALSE with the last error set if the command failed.
+ */
+typedef BOOL (*LPSRV_COMMAND_HANDLER)(SRV_COMMAND command, LPSTR lpArgument, LPSTR lpReply, DWORD dwReplySize);
+
+/**
+ * Create the control endpoint \\.\pipe\SrvWrap-<service name>
+ * and start listening for a client.
+ */
+BOOL SrvControlOpen(LPCSTR lpServiceName, LPSRV_COMMAND_HANDLER lpHandler);
+
+/**
+ * Get the event that is signaled when the control endpoint needs service.
+ * The caller waits on it alongside its other handles.
+ */
+HANDLE SrvControlGetEvent(void);
+
+/**
+ * Advance the control endpoint after its event was signaled.
+ * Each call completes one step of connecting, reading a request,
+ * handling it, or writing the reply; it never blocks.
+ */
+void SrvControlService(void);
+
+/**
+ * Look up a command by name.
+ *
+ * Returns SRV_COMMAND_COUNT if the name is not a command.
+ */
+SRV_COMMAND SrvControlFindCommand(LPCSTR lpName);
+
+/**
+ * Carry out a request that did not arrive on the control endpoint,
+ * such as the action configured for an SCM control code.
+ * The request is modified in place.
+ */
+BOOL SrvControlExecute(LPSTR lpRequest, LPSTR lpReply, DWORD dwReplySize);
+
+/**
+ * Format the request counters into a buffer.
+ *
+ * Returns the number of characters written, not including the terminator.
+ */
+DWORD SrvControlFormat(LPSTR lpBuffer, DWORD dwSize);
+
+/**
+ * Close the control endpoint.
+ */
+void SrvControlClose(void);
+
+/**
+ * Client mode: send a request built from the arguments to the named service,
+ * print the reply to standard output and return the process exit code.
+ */
+int SrvControlClient(LPCSTR lpServiceName, int argc, char* argv[]);
+
+#endif /* SRVCONTROL_H_ */
@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+#include <dbghelp.h>
+
+#include <stdio.h>
+
+#include "SrvDump.h"
+#include "SrvState.h"
+
+#pragma comment(lib, "dbghelp.lib")
+
+#define MAX_DUMP_PROCESSES 16
+
+/**
+ * Thread stacks, handles and the memory they point at,
+ * but not the whole heap, which for a JVM could be many gigabytes.
+ */
+#define DUMP_TYPE (MiniDumpWithThreadInfo | MiniDumpWithHandleData \
+		| MiniDumpWithUnloadedModules | MiniDumpWithIndirectlyReferencedMemory)
+
+static char dumpDirectory[MAX_PATH];
+static DWORD dwDumpsKept = 0;
+static DWORD dwThreadDumpWait = 0;
+
+static DWORD dwCaptures = 0;
+static DWORD dwDumpsWritten = 0;
+static DWORD dwDumpsFailed = 0;
+static DWORD dwLastCaptureMillis = 0;
+
+static BOOL WriteDump(DWORD, LPSYSTEMTIME);
+static void PruneDumps(void);
+
+BOOL SrvDumpConfigure(LPCSTR lpDirectory, DWORD dwKeep, DWORD dwThreadDumpMillis) {
+
+	// Leave room for the file name.
+
+	if ((lpDirectory != NULL) && ((strlen(lpDirectory) + 40 >= sizeof(dumpDirectory)) || (dwKeep == 0))) {
+		SetLastError(ERROR_BAD_FORMAT);
+		return FALSE;
+	}
+
+	if ((lpDirectory != NULL)
+			&& !CreateDirectory(lpDirectory, NULL)
+			&& (GetLastError() != ERROR_ALREADY_EXISTS)) {
+		return FALSE;
+	}
+
+	strcpy(dumpDirectory, (lpDirectory != NULL) ? lpDirectory : "");
+	dwDumpsKept = dwKeep;
+	dwThreadDumpWait = dwThreadDumpMillis;
+
+	return TRUE;
+}
+
+BOOL SrvDumpCapture(LPSRV_CHILD lpChild) {
+
+	if ((dumpDirectory[0] == 0) && (dwThreadDumpWait == 0)) {
+		return TRUE;
+	}
+
+	DWORD dwStarted = GetTickCount();
+	dwCaptures++;
+
+	// Give the child time to write the thread dump to the output log.
+
+	if ((dwThreadDumpWait != 0) && SrvChildSignal(lpChild, CTRL_BREAK_EVENT)) {
+
+		SrvStateCheckPoint(dwThreadDumpWait + 3000);
+
+		if (WaitForSingleObject(lpChild->pi.hProcess, dwThreadDumpWait) == WAIT_OBJECT_0) {
+
+			// A program without a CTRL + BREAK handler exits instead.
+
+			dwLastCaptureMillis = GetTickCount() - dwStarted;
+			return TRUE;
+		}
+	}
+
+	BOOL bSuccess = TRUE;
+
+	if (dumpDirectory[0] != 0) {
+
+		// Name every dump from one capture with the same time.
+
+		SYSTEMTIME st;
+		GetLocalTime(&st);
+
+		DWORD processIds[MAX_DUMP_PROCESSES];
+		DWORD dwCount = SrvChildGetProcessIds(lpChild, processIds, MAX_DUMP_PROCESSES);
+
+		for (DWORD i = 0; i < dwCount; i++) {
+
+			SrvStateCheckPoint(30000);
+
+			if (WriteDump(processIds[i], &st)) {
+				dwDumpsWritten++;
+			}
+			else {
+				dwDumpsFailed++;
+				bSuccess = FALSE;
+			}
+		}
+
+		PruneDumps();
+	}
+
+	dwLastCaptureMillis = GetTickCount() - dwStarted;
+	return bSuccess;
+}
+
+DWORD SrvDumpFormat(LPSTR lpBuffer, DWORD dwSize) {
+
+	int length = _snprintf(lpBuffer, dwSize, "dumps captures=%lu written=%lu failed=%lu last=%lums\n",
+			dwCaptures, dwDumpsWritten, dwDumpsFailed, dwLastCaptureMillis);
+
+	if ((length < 0) || ((DWORD)length >= dwSize)) {
+		length = dwSize - 1;
+	}
+	lpBuffer[length] = 0;
+
+	return length;
+}
+
+/**
+ * Write a minidump of one process to pid-YYYYMMDD-HHMMSS-mmm.dmp in the dump directory.
+ */
+static BOOL WriteDump(DWORD dwProcessId, LPSYSTEMTIME lpTime) {
+
+	char path[MAX_PATH];
+	_snprintf(path, sizeof(path), "%s\\%lu-%04u%02u%02u-%02u%02u%02u-%03u.dmp",
+			dumpDirectory, dwProcessId,
+			lpTime->wYear, lpTime->wMonth, lpTime->wDay,
+			lpTime->wHour, lpTime->wMinute, lpTime->wSecond, lpTime->wMilliseconds);
+	path[sizeof(path) - 1] = 0;
+
+	HANDLE hProcess = OpenProcess(PROCESS_QUERY_INFORMATION | PROCESS_VM_READ, FALSE, dwProcessId);
+	if (hProcess == NULL) {
+		return FALSE;
+	}
+
+	HANDLE hFile = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		CloseHandle(hProcess);
+		return FALSE;
+	}
+
+	BOOL bSuccess = MiniDumpWriteDump(hProcess, dwProcessId, hFile, DUMP_TYPE, NULL, NULL, NULL);
+	DWORD dwLastError = GetLastError();
+
+	CloseHandle(hFile);
+	CloseHandle(hProcess);
+
+	if (!bSuccess) {
+		DeleteFile(path);
+		SetLastError(dwLastError);
+	}
+
+	return bSuccess;
+}
+
+/**
+ * Delete the oldest dumps until no more than dwDumpsKept remain.
+ */
+static void PruneDumps(void) {
+
+	char pattern[MAX_PATH];
+	_snprintf(pattern, sizeof(pattern), "%s\\*.dmp", dumpDirectory);
+	pattern[sizeof(pattern) - 1] = 0;
+
+	for (;;) {
+
+		DWORD dwCount = 0;
+		FILETIME ftOldest;
+		char oldest[MAX_PATH];
+
+		WIN32_FIND_DATA data;
+		HANDLE hFind = FindFirstFile(pattern, &data);
+		if (hFind == INVALID_HANDLE_VALUE) {
+			return;
+		}
+
+		do {
+			if ((dwCount == 0) || (CompareFileTime(&data.ftLastWriteTime, &ftOldest) < 0)) {
+				ftOldest = data.ftLastWriteTime;
+				strcpy(oldest, data.cFileName);
+			}
+			dwCount++;
+		} while (FindNextFile(hFind, &data));
+
+		FindClose(hFind);
+
+		if (dwCount <= dwDumpsKept) {
+			return;
+		}
+
+		char path[MAX_PATH];
+		_snprintf(path, sizeof(path), "%s\\%s", dumpDirectory, oldest);
+		path[sizeof(path) - 1] = 0;
+
+		if (!DeleteFile(path)) {
+			return;
+		}
+	}
+}
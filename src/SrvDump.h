@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVDUMP_H_
+#define SRVDUMP_H_
+
+#include <windows.h>
+
+#include "SrvChild.h"
+
+/**
+ * Set how hang diagnostics are captured.
+ *
+ *	lpDirectory			is the directory to receive minidumps, or NULL for none.
+ *
+ *	dwKeep				is the number of minidumps to keep in the directory;
+ *						older ones are deleted after each capture.
+ *
+ *	dwThreadDumpMillis	is the time to allow the child to write a thread dump
+ *						after CTRL + BREAK, or 0 not to send it.
+ */
+BOOL SrvDumpConfigure(LPCSTR lpDirectory, DWORD dwKeep, DWORD dwThreadDumpMillis);
+
+/**
+ * Capture diagnostics from a hung child before it is killed:
+ * a thread dump requested with CTRL + BREAK, which a JVM writes to its
+ * standard output and so to the output log, then a minidump of each
+ * process in the child's process tree.
+ *
+ * Does nothing if neither kind of diagnostic is configured.
+ * Returns FALSE if any minidump could not be written.
+ */
+BOOL SrvDumpCapture(LPSRV_CHILD lpChild);
+
+/**
+ * Format a description of the last capture and the capture counters into a buffer.
+ *
+ * Returns the number of characters written, not including the terminator.
+ */
+DWORD SrvDumpFormat(LPSTR lpBuffer, DWORD dwSize);
+
+#endif /* SRVDUMP_H_ */
@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "SrvEnvCache.h"
+
+#define ENV_CACHE_MAGIC 0x43455753		// "SWEC"
+#define ENV_CACHE_VERSION 1
+
+#define LINE_SIZE(length) ((offsetof(SRV_ENV_LINE, text) + (length) + 1 + 3) & ~(SIZE_T)3)
+
+static DWORD dwReads = 0;
+static DWORD dwHits = 0;
+static LONGLONG llSavedMicros = 0;
+static LONGLONG llLastSavedMicros = 0;
+
+static void GetCachePath(LPCSTR, LPSTR, DWORD);
+static BOOL GetIdentity(LPCSTR, LPSRV_ENV_FILE);
+static BOOL IsSameFile(LPSRV_ENV_FILE, LPSRV_ENV_FILE);
+
+LPSRV_ENV_FILE SrvEnvCacheLoad(LPCSTR lpPath) {
+
+	LARGE_INTEGER liFrequency, liStart, liEnd;
+	QueryPerformanceFrequency(&liFrequency);
+	QueryPerformanceCounter(&liStart);
+
+	char cachePath[MAX_PATH * 2];
+	GetCachePath(lpPath, cachePath, sizeof(cachePath));
+
+	HANDLE hFile = CreateFile(cachePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return NULL;
+	}
+
+	LARGE_INTEGER liSize;
+	HANDLE hMapping = NULL;
+
+	if (GetFileSizeEx(hFile, &liSize) && (liSize.QuadPart >= (LONGLONG)sizeof(SRV_ENV_FILE))
+			&& (liSize.QuadPart < MAXDWORD)) {
+		hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	}
+
+	CloseHandle(hFile);
+
+	if (hMapping == NULL) {
+		return NULL;
+	}
+
+	// Read-only, so that every service using the file shares its pages.
+
+	LPSRV_ENV_FILE lpEnvFile = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(hMapping);
+
+	if (lpEnvFile == NULL) {
+		return NULL;
+	}
+
+	SRV_ENV_FILE current;
+
+	BOOL bValid = (lpEnvFile->dwMagic == ENV_CACHE_MAGIC)
+			&& (lpEnvFile->dwVersion == ENV_CACHE_VERSION)
+			&& (lpEnvFile->cbTotal == (DWORD)liSize.QuadPart)
+			&& GetIdentity(lpPath, &current)
+			&& IsSameFile(&current, lpEnvFile);
+
+	// Each line must end within the view.
+
+	for (const SRV_ENV_LINE* lpLine = bValid ? SrvEnvFileNextLine(lpEnvFile, NULL) : NULL;
+			bValid && (lpLine != NULL); lpLine = SrvEnvFileNextLine(lpEnvFile, lpLine)) {
+		SIZE_T offset = (LPBYTE)lpLine->text - (LPBYTE)lpEnvFile;
+		bValid = memchr(lpLine->text, 0, lpEnvFile->cbTotal - offset) != NULL;
+	}
+
+	if (!bValid) {
+		UnmapViewOfFile(lpEnvFile);
+		return NULL;
+	}
+
+	QueryPerformanceCounter(&liEnd);
+
+	llLastSavedMicros = (LONGLONG)lpEnvFile->dwReadMicros
+			- (liEnd.QuadPart - liStart.QuadPart) * 1000000 / liFrequency.QuadPart;
+	llSavedMicros += llLastSavedMicros;
+	dwHits++;
+
+	return lpEnvFile;
+}
+
+LPSRV_ENV_FILE SrvEnvFileCreate(LPCSTR lpPath) {
+
+	LPSRV_ENV_FILE lpEnvFile = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(SRV_ENV_FILE));
+
+	if (lpEnvFile == NULL) {
+		SetLastError(ERROR_OUTOFMEMORY);
+		return NULL;
+	}
+
+	GetSystemTimeAsFileTime(&lpEnvFile->ftRead);
+	lpEnvFile->cbTotal = sizeof(SRV_ENV_FILE);
+
+	if (!GetIdentity(lpPath, lpEnvFile)) {
+		DWORD dwLastError = GetLastError();
+		HeapFree(GetProcessHeap(), 0, lpEnvFile);
+		SetLastError(dwLastError);
+		return NULL;
+	}
+
+	dwReads++;
+	return lpEnvFile;
+}
+
+LPSRV_ENV_FILE SrvEnvFileAddLine(LPSRV_ENV_FILE lpEnvFile, DWORD dwLine, LPCSTR lpText) {
+
+	SIZE_T cbLine = LINE_SIZE(strlen(lpText));
+
+	LPSRV_ENV_FILE lpGrown = HeapReAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, lpEnvFile, lpEnvFile->cbTotal + cbLine);
+
+	if (lpGrown == NULL) {
+		SetLastError(ERROR_OUTOFMEMORY);
+		return NULL;
+	}
+
+	SRV_ENV_LINE* lpLine = (SRV_ENV_LINE*)((LPBYTE)lpGrown + lpGrown->cbTotal);
+	lpLine->dwLine = dwLine;
+	strcpy(lpLine->text, lpText);
+
+	lpGrown->cbTotal += (DWORD)cbLine;
+	return lpGrown;
+}
+
+const SRV_ENV_LINE* SrvEnvFileNextLine(LPSRV_ENV_FILE lpEnvFile, const SRV_ENV_LINE* lpLine) {
+
+	SIZE_T offset = (lpLine == NULL)
+			? sizeof(SRV_ENV_FILE)
+			: ((LPBYTE)lpLine - (LPBYTE)lpEnvFile) + LINE_SIZE(strlen(lpLine->text));
+
+	if (offset + offsetof(SRV_ENV_LINE, text) >= lpEnvFile->cbTotal) {
+		return NULL;
+	}
+
+	return (const SRV_ENV_LINE*)((LPBYTE)lpEnvFile + offset);
+}
+
+BOOL SrvEnvCacheSave(LPCSTR lpPath, LPSRV_ENV_FILE lpEnvFile) {
+
+	// A write in the same tick as the read could leave the time unchanged.
+
+	SRV_ENV_FILE current;
+
+	if (!GetIdentity(lpPath, &current)) {
+		return FALSE;
+	}
+
+	if (!IsSameFile(&current, lpEnvFile) || (CompareFileTime(&lpEnvFile->ftLastWrite, &lpEnvFile->ftRead) >= 0)) {
+		SetLastError(ERROR_RETRY);
+		return FALSE;
+	}
+
+	SRV_ENV_FILE header = *lpEnvFile;
+	header.dwMagic = ENV_CACHE_MAGIC;
+	header.dwVersion = ENV_CACHE_VERSION;
+
+	// Write a new file and move it over the old one, so that a service
+	// loading the cache meanwhile sees one or the other.
+
+	char cachePath[MAX_PATH * 2];
+	char tempPath[MAX_PATH * 2 + 16];
+	GetCachePath(lpPath, cachePath, sizeof(cachePath));
+	_snprintf(tempPath, sizeof(tempPath), "%s.%lu", cachePath, GetCurrentProcessId());
+	tempPath[sizeof(tempPath) - 1] = 0;
+
+	HANDLE hFile = CreateFile(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+
+	DWORD cbLines = lpEnvFile->cbTotal - sizeof(SRV_ENV_FILE);
+	DWORD dwWritten;
+
+	BOOL bSuccess = WriteFile(hFile, &header, sizeof(header), &dwWritten, NULL) && (dwWritten == sizeof(header))
+			&& WriteFile(hFile, lpEnvFile + 1, cbLines, &dwWritten, NULL) && (dwWritten == cbLines);
+
+	CloseHandle(hFile);
+
+	bSuccess = bSuccess && MoveFileEx(tempPath, cachePath, MOVEFILE_REPLACE_EXISTING);
+
+	if (!bSuccess) {
+		DWORD dwLastError = GetLastError();
+		DeleteFile(tempPath);
+		SetLastError(dwLastError);
+	}
+
+	return bSuccess;
+}
+
+LPSRV_ENV_FILE SrvEnvFileRelease(LPSRV_ENV_FILE lpEnvFile) {
+
+	if (lpEnvFile == NULL) {
+		return NULL;
+	}
+
+	// Only a block mapped from the cache has the magic number.
+
+	if (lpEnvFile->dwMagic == ENV_CACHE_MAGIC) {
+		UnmapViewOfFile(lpEnvFile);
+	}
+	else {
+		HeapFree(GetProcessHeap(), 0, lpEnvFile);
+	}
+
+	return NULL;
+}
+
+DWORD SrvEnvCacheFormat(LPSTR lpBuffer, DWORD dwSize) {
+
+	int length = _snprintf(lpBuffer, dwSize, "env-cache reads=%lu hits=%lu saved=%lldus last-saved=%lldus\n",
+			dwReads,
+			dwHits,
+			llSavedMicros,
+			llLastSavedMicros);
+
+	if ((length < 0) || ((DWORD)length >= dwSize)) {
+		length = dwSize - 1;
+	}
+	lpBuffer[length] = 0;
+
+	return length;
+}
+
+/**
+ * Name the cache file after the environment file.
+ */
+static void GetCachePath(LPCSTR lpPath, LPSTR lpBuffer, DWORD dwSize) {
+
+	_snprintf(lpBuffer, dwSize, "%s.envcache", lpPath);
+	lpBuffer[dwSize - 1] = 0;
+}
+
+/**
+ * Get the volume, file index, size and last write time of a file.
+ */
+static BOOL GetIdentity(LPCSTR lpPath, LPSRV_ENV_FILE lpEnvFile) {
+
+	HANDLE hFile = CreateFile(lpPath, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+
+	BY_HANDLE_FILE_INFORMATION info;
+	BOOL bSuccess = GetFileInformationByHandle(hFile, &info);
+
+	CloseHandle(hFile);
+
+	if (bSuccess) {
+		lpEnvFile->dwVolumeSerialNumber = info.dwVolumeSerialNumber;
+		lpEnvFile->nFileIndexHigh = info.nFileIndexHigh;
+		lpEnvFile->nFileIndexLow = info.nFileIndexLow;
+		lpEnvFile->nFileSizeHigh = info.nFileSizeHigh;
+		lpEnvFile->nFileSizeLow = info.nFileSizeLow;
+		lpEnvFile->ftLastWrite = info.ftLastWriteTime;
+	}
+
+	return bSuccess;
+}
+
+static BOOL IsSameFile(LPSRV_ENV_FILE lpEnvFile1, LPSRV_ENV_FILE lpEnvFile2) {
+	return (lpEnvFile1->dwVolumeSerialNumber == lpEnvFile2->dwVolumeSerialNumber)
+			&& (lpEnvFile1->nFileIndexHigh == lpEnvFile2->nFileIndexHigh)
+			&& (lpEnvFile1->nFileIndexLow == lpEnvFile2->nFileIndexLow)
+			&& (lpEnvFile1->nFileSizeHigh == lpEnvFile2->nFileSizeHigh)
+			&& (lpEnvFile1->nFileSizeLow == lpEnvFile2->nFileSizeLow)
+			&& (CompareFileTime(&lpEnvFile1->ftLastWrite, &lpEnvFile2->ftLastWrite) == 0);
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVENVCACHE_H_
+#define SRVENVCACHE_H_
+
+#include <windows.h>
+
+/**
+ * The variable lines of an environment file, either read from its text
+ * into the heap or mapped read-only from the cache beside it, which has
+ * the same layout.  The header identifies the file as it was when read;
+ * SRV_ENV_LINE records follow it up to cbTotal bytes.
+ */
+typedef struct tagSRV_ENV_FILE {
+	DWORD dwMagic;						// 0 in the heap, until written to the cache
+	DWORD dwVersion;
+	DWORD dwVolumeSerialNumber;
+	DWORD nFileIndexHigh;
+	DWORD nFileIndexLow;
+	DWORD nFileSizeHigh;
+	DWORD nFileSizeLow;
+	FILETIME ftLastWrite;
+	FILETIME ftRead;					// when the text was read
+	DWORD dwReadMicros;					// how long reading the text took
+	DWORD cbTotal;
+} SRV_ENV_FILE, *LPSRV_ENV_FILE;
+
+/**
+ * A line of an environment file, with its line number for error reports.
+ * Each record is padded to a multiple of 4 bytes.
+ */
+typedef struct tagSRV_ENV_LINE {
+	DWORD dwLine;
+	char text[4];
+} SRV_ENV_LINE;
+
+/**
+ * Map the lines of an environment file from the cache beside it, named by
+ * adding .envcache to its path, if the file still has the volume, file index,
+ * size and last write time recorded in the cache.  Every service reading the
+ * same file shares the cache, so instances started together read the text once.
+ *
+ * Returns NULL if there is no usable cache.
+ */
+LPSRV_ENV_FILE SrvEnvCacheLoad(LPCSTR lpPath);
+
+/**
+ * Start reading the lines of an environment file into the heap,
+ * noting the identity of the file before any line is read.
+ *
+ * Returns NULL if the file cannot be opened.
+ */
+LPSRV_ENV_FILE SrvEnvFileCreate(LPCSTR lpPath);
+
+/**
+ * Add a line, growing the block.
+ *
+ * Returns the block, which may have moved, or NULL with the block unchanged
+ * if there is not enough memory.
+ */
+LPSRV_ENV_FILE SrvEnvFileAddLine(LPSRV_ENV_FILE lpEnvFile, DWORD dwLine, LPCSTR lpText);
+
+/**
+ * Get the line after lpLine, or the first line if lpLine is NULL.
+ *
+ * Returns NULL after the last line.
+ */
+const SRV_ENV_LINE* SrvEnvFileNextLine(LPSRV_ENV_FILE lpEnvFile, const SRV_ENV_LINE* lpLine);
+
+/**
+ * Write lines read from the text to the cache, replacing it atomically.
+ * Nothing is written, with ERROR_RETRY, if the file changed after it was read
+ * or within the resolution of its last write time.
+ */
+BOOL SrvEnvCacheSave(LPCSTR lpPath, LPSRV_ENV_FILE lpEnvFile);
+
+/**
+ * Free lines read from the text or unmap lines loaded from the cache.
+ *
+ * Always returns NULL.
+ */
+LPSRV_ENV_FILE SrvEnvFileRelease(LPSRV_ENV_FILE lpEnvFile);
+
+/**
+ * Format the count of environment files read from text and from the cache,
+ * and the time the cache saved, in all and for the last load, into a buffer.
+ *
+ * Returns the number of characters written, not including the terminator.
+ */
+DWORD SrvEnvCacheFormat(LPSTR lpBuffer, DWORD dwSize);
+
+#endif /* SRVENVCACHE_H_ */
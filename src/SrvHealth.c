@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "SrvHealth.h"
+#include "SrvHistogram.h"
+#include "SrvChild.h"
+
+#pragma comment(lib, "ws2_32.lib")
+
+/**
+ * Kinds of probe.
+ *
+ *	PROBE_NONE		health checking is off.
+ *	PROBE_TCP		connect to a local port.
+ *	PROBE_HTTP		GET a path from a local port and expect a 2xx or 3xx status.
+ *	PROBE_EXEC		run a command and expect exit code 0.
+ */
+typedef enum tagPROBE_TYPE {
+	PROBE_NONE,
+	PROBE_TCP,
+	PROBE_HTTP,
+	PROBE_EXEC
+} PROBE_TYPE;
+
+static BOOL bWinsockStarted = FALSE;
+static HANDLE hTimer = NULL;
+static HANDLE hProbeEvent = NULL;
+
+// Settings.
+
+static PROBE_TYPE probeType = PROBE_NONE;
+static u_short probePort = 0;
+static char probePath[256];
+static char probeCommand[1024];
+static DWORD dwIntervalMillis = 0;
+static DWORD dwTimeoutMillis = 0;
+static DWORD dwMaxFailures = 0;
+static DWORD dwWindow = 0;
+static DWORD dwMaxP99Micros = 0;
+
+// Probe in progress.
+
+static BOOL bProbing = FALSE;
+static SOCKET probeSocket = INVALID_SOCKET;
+static HANDLE hProbeProcess = NULL;
+static LARGE_INTEGER liProbeStart;
+static char response[64];
+static int responseLength = 0;
+
+// Counters and latencies in microseconds.
+
+static DWORD dwProbes = 0;
+static DWORD dwFailures = 0;
+static DWORD dwConsecutiveFailures = 0;
+static DWORD dwUnhealthy = 0;
+static DWORD dwLastWindowP99 = 0;
+static SRV_HISTOGRAM latencies;
+static SRV_HISTOGRAM windowLatencies;
+static char reason[128];
+
+static BOOL StartProbe(void);
+static SRV_HEALTH EndProbe(BOOL);
+static void CancelProbe(void);
+static void ArmTimer(DWORD);
+static BOOL GetHttpStatusOk(BOOL*);
+
+BOOL SrvHealthOpen(void) {
+
+	WSADATA wsaData;
+	int error = WSAStartup(MAKEWORD(2, 2), &wsaData);
+	if (error != 0) {
+		SetLastError(error);
+		return FALSE;
+	}
+	bWinsockStarted = TRUE;
+
+	hTimer = CreateWaitableTimer(NULL, FALSE, NULL);
+	if (hTimer == NULL) {
+		return FALSE;
+	}
+
+	hProbeEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (hProbeEvent == NULL) {
+		return FALSE;
+	}
+
+	SrvHistogramReset(&latencies);
+	SrvHistogramReset(&windowLatencies);
+	strcpy(reason, "");
+
+	return TRUE;
+}
+
+BOOL SrvHealthConfigure(LPSRV_CONFIG lpSrvConfig) {
+
+	// Parse the probe "tcp:port", "http:port[/path]" or "exec:cmdline".
+
+	PROBE_TYPE newType = PROBE_NONE;
+	u_short newPort = 0;
+	LPCSTR lpNewPath = "/";
+	LPCSTR lpNewCommand = "";
+
+	LPCSTR lpCheck = lpSrvConfig->lpHealthCheck;
+	if (lpCheck != NULL) {
+
+		if (strncmp(lpCheck, "tcp:", 4) == 0) {
+			newType = PROBE_TCP;
+			lpCheck += 4;
+		}
+		else if (strncmp(lpCheck, "http:", 5) == 0) {
+			newType = PROBE_HTTP;
+			lpCheck += 5;
+		}
+		else if (strncmp(lpCheck, "exec:", 5) == 0) {
+			newType = PROBE_EXEC;
+			lpNewCommand = lpCheck + 5;
+		}
+		else {
+			SetLastError(ERROR_BAD_FORMAT);
+			return FALSE;
+		}
+
+		if (newType != PROBE_EXEC) {
+
+			char* pEnd = NULL;
+			unsigned long port = strtoul(lpCheck, &pEnd, 10);
+			if ((pEnd == lpCheck) || (port == 0) || (port > 65535)) {
+				SetLastError(ERROR_BAD_FORMAT);
+				return FALSE;
+			}
+			newPort = (u_short)port;
+
+			if ((newType == PROBE_HTTP) && (*pEnd == '/')) {
+				lpNewPath = pEnd;
+			}
+			else if (*pEnd != 0) {
+				SetLastError(ERROR_BAD_FORMAT);
+				return FALSE;
+			}
+		}
+
+		if ((strlen(lpNewPath) >= sizeof(probePath))
+				|| (strlen(lpNewCommand) >= sizeof(probeCommand))
+				|| ((newType == PROBE_EXEC) && (lpNewCommand[0] == 0))) {
+			SetLastError(ERROR_BAD_FORMAT);
+			return FALSE;
+		}
+	}
+
+	// The service carries out HealthAction; just check it here.
+
+	if ((lpSrvConfig->lpHealthAction != NULL)
+			&& (strcmp(lpSrvConfig->lpHealthAction, "stop") != 0)
+			&& (strcmp(lpSrvConfig->lpHealthAction, "restart") != 0)) {
+		SetLastError(ERROR_BAD_FORMAT);
+		return FALSE;
+	}
+
+	if ((lpSrvConfig->dwHealthIntervalMillis == 0) || (lpSrvConfig->dwHealthTimeoutMillis == 0)) {
+		SetLastError(ERROR_BAD_FORMAT);
+		return FALSE;
+	}
+
+	// Apply the settings.
+
+	CancelProbe();
+	CancelWaitableTimer(hTimer);
+
+	probeType = newType;
+	probePort = newPort;
+	strcpy(probePath, lpNewPath);
+	strcpy(probeCommand, lpNewCommand);
+	dwIntervalMillis = lpSrvConfig->dwHealthIntervalMillis;
+	dwTimeoutMillis = lpSrvConfig->dwHealthTimeoutMillis;
+	dwMaxFailures = lpSrvConfig->dwHealthFailures;
+	dwWindow = lpSrvConfig->dwHealthWindow;
+	dwMaxP99Micros = lpSrvConfig->dwHealthMaxP99Millis * 1000;
+
+	SrvHealthReset();
+	return TRUE;
+}
+
+HANDLE SrvHealthGetTimer(void) {
+	return hTimer;
+}
+
+HANDLE SrvHealthGetProbeHandle(void) {
+	return (hProbeProcess != NULL) ? hProbeProcess : hProbeEvent;
+}
+
+SRV_HEALTH SrvHealthOnTimer(BOOL bActive) {
+
+	if (probeType == PROBE_NONE) {
+		return SRV_HEALTH_PENDING;
+	}
+
+	// The timer fires at the probe deadline while probing,
+	// otherwise when the next probe is due.
+
+	if (bProbing) {
+		return EndProbe(FALSE);
+	}
+
+	if (!bActive) {
+		ArmTimer(dwIntervalMillis);
+		return SRV_HEALTH_PENDING;
+	}
+
+	if (!StartProbe()) {
+		return EndProbe(FALSE);
+	}
+
+	ArmTimer(dwTimeoutMillis);
+	return SRV_HEALTH_PENDING;
+}
+
+SRV_HEALTH SrvHealthOnProbe(void) {
+
+	if (!bProbing) {
+		ResetEvent(hProbeEvent);
+		return SRV_HEALTH_PENDING;
+	}
+
+	if (probeType == PROBE_EXEC) {
+
+		DWORD dwExitCode = 1;
+		GetExitCodeProcess(hProbeProcess, &dwExitCode);
+		return EndProbe(dwExitCode == 0);
+	}
+
+	WSANETWORKEVENTS events;
+	if (WSAEnumNetworkEvents(probeSocket, hProbeEvent, &events) == SOCKET_ERROR) {
+		return EndProbe(FALSE);
+	}
+
+	if (events.lNetworkEvents & FD_CONNECT) {
+
+		if (events.iErrorCode[FD_CONNECT_BIT] != 0) {
+			return EndProbe(FALSE);
+		}
+
+		if (probeType == PROBE_TCP) {
+			return EndProbe(TRUE);
+		}
+
+		char request[sizeof(probePath) + 64];
+		int requestLength = sprintf(request,
+				"GET %s HTTP/1.0\r\nHost: localhost\r\nConnection: close\r\n\r\n", probePath);
+
+		if (send(probeSocket, request, requestLength, 0) != requestLength) {
+			return EndProbe(FALSE);
+		}
+	}
+
+	if (events.lNetworkEvents & (FD_READ | FD_CLOSE)) {
+
+		// Only the status line matters.
+
+		int received = recv(probeSocket, response + responseLength,
+				sizeof(response) - 1 - responseLength, 0);
+
+		if (received > 0) {
+			responseLength += received;
+			response[responseLength] = 0;
+		}
+
+		BOOL bOk;
+		if (GetHttpStatusOk(&bOk)) {
+			return EndProbe(bOk);
+		}
+
+		if ((received == 0)
+				|| ((received == SOCKET_ERROR) && (WSAGetLastError() != WSAEWOULDBLOCK))
+				|| (responseLength == sizeof(response) - 1)) {
+			return EndProbe(FALSE);
+		}
+	}
+
+	return SRV_HEALTH_PENDING;
+}
+
+void SrvHealthReset(void) {
+
+	CancelProbe();
+
+	dwConsecutiveFailures = 0;
+	SrvHistogramReset(&windowLatencies);
+
+	if (probeType != PROBE_NONE) {
+		ArmTimer(dwIntervalMillis);
+	}
+}
+
+DWORD SrvHealthFormat(LPSTR lpBuffer, DWORD dwSize) {
+
+	static const char* probeNames[] = { "none", "tcp", "http", "exec" };
+
+	int length = _snprintf(lpBuffer, dwSize,
+			"health probe=%s probes=%lu failed=%lu consecutive=%lu unhealthy=%lu\n"
+			"health latency p50=%luus p90=%luus p99=%luus max=%luus window-p99=%luus\n",
+			probeNames[probeType],
+			dwProbes,
+			dwFailures,
+			dwConsecutiveFailures,
+			dwUnhealthy,
+			SrvHistogramPercentile(&latencies, 50.0),
+			SrvHistogramPercentile(&latencies, 90.0),
+			SrvHistogramPercentile(&latencies, 99.0),
+			latencies.dwMax,
+			dwLastWindowP99);
+
+	if ((length < 0) || ((DWORD)length >= dwSize)) {
+		length = dwSize - 1;
+	}
+	lpBuffer[length] = 0;
+
+	return length;
+}
+
+LPCSTR SrvHealthReason(void) {
+	return reason;
+}
+
+void SrvHealthClose(void) {
+
+	CancelProbe();
+
+	if (hTimer != NULL) {
+		CancelWaitableTimer(hTimer);
+		CloseHandle(hTimer);
+		hTimer = NULL;
+	}
+
+	if (hProbeEvent != NULL) {
+		CloseHandle(hProbeEvent);
+		hProbeEvent = NULL;
+	}
+
+	if (bWinsockStarted) {
+		WSACleanup();
+		bWinsockStarted = FALSE;
+	}
+
+	probeType = PROBE_NONE;
+}
+
+/**
+ * Start a probe without blocking.
+ */
+static BOOL StartProbe(void) {
+
+	QueryPerformanceCounter(&liProbeStart);
+	bProbing = TRUE;
+	responseLength = 0;
+	response[0] = 0;
+
+	if (probeType == PROBE_EXEC) {
+		return SrvChildRunCommand(probeCommand, NULL, &hProbeProcess);
+	}
+
+	probeSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (probeSocket == INVALID_SOCKET) {
+		return FALSE;
+	}
+
+	// Selecting events makes the socket non-blocking.
+
+	if (WSAEventSelect(probeSocket, hProbeEvent, FD_CONNECT | FD_READ | FD_CLOSE) == SOCKET_ERROR) {
+		return FALSE;
+	}
+
+	struct sockaddr_in address;
+	ZeroMemory(&address, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(probePort);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((connect(probeSocket, (struct sockaddr*)&address, sizeof(address)) == SOCKET_ERROR)
+			&& (WSAGetLastError() != WSAEWOULDBLOCK)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Record the result of the probe in progress, schedule the next one,
+ * and apply the failure policy.
+ */
+static SRV_HEALTH EndProbe(BOOL bSuccess) {
+
+	LARGE_INTEGER liNow, liFrequency;
+	QueryPerformanceCounter(&liNow);
+	QueryPerformanceFrequency(&liFrequency);
+
+	ULONGLONG ullMicros = (ULONGLONG)(liNow.QuadPart - liProbeStart.QuadPart) * 1000000 / liFrequency.QuadPart;
+	DWORD dwMicros = (ullMicros > MAXDWORD) ? MAXDWORD : (DWORD)ullMicros;
+
+	CancelProbe();
+	ArmTimer(dwIntervalMillis);
+
+	dwProbes++;
+
+	if (bSuccess) {
+		SrvHistogramRecord(&latencies, dwMicros);
+		SrvHistogramRecord(&windowLatencies, dwMicros);
+		dwConsecutiveFailures = 0;
+	}
+	else {
+		dwFailures++;
+		dwConsecutiveFailures++;
+	}
+
+	if ((dwMaxFailures != 0) && (dwConsecutiveFailures >= dwMaxFailures)) {
+		sprintf(reason, "%lu consecutive health check failures", dwConsecutiveFailures);
+		dwConsecutiveFailures = 0;
+		dwUnhealthy++;
+		return SRV_HEALTH_UNHEALTHY;
+	}
+
+	// Judge tail latency once per window of successful probes
+	// so that a single slow probe cannot trip the threshold.
+
+	if ((dwWindow != 0) && (windowLatencies.dwCount >= dwWindow)) {
+
+		dwLastWindowP99 = SrvHistogramPercentile(&windowLatencies, 99.0);
+		SrvHistogramReset(&windowLatencies);
+
+		if ((dwMaxP99Micros != 0) && (dwLastWindowP99 > dwMaxP99Micros)) {
+			sprintf(reason, "health check p99 latency %luus exceeds %luus", dwLastWindowP99, dwMaxP99Micros);
+			dwUnhealthy++;
+			return SRV_HEALTH_UNHEALTHY;
+		}
+	}
+
+	return bSuccess ? SRV_HEALTH_HEALTHY : SRV_HEALTH_PENDING;
+}
+
+/**
+ * Abandon the probe in progress and release its socket or process.
+ */
+static void CancelProbe(void) {
+
+	if (probeSocket != INVALID_SOCKET) {
+		closesocket(probeSocket);
+		probeSocket = INVALID_SOCKET;
+	}
+
+	if (hProbeProcess != NULL) {
+		if (WaitForSingleObject(hProbeProcess, 0) == WAIT_TIMEOUT) {
+			TerminateProcess(hProbeProcess, ERROR_TIMEOUT);
+		}
+		CloseHandle(hProbeProcess);
+		hProbeProcess = NULL;
+	}
+
+	if (hProbeEvent != NULL) {
+		ResetEvent(hProbeEvent);
+	}
+
+	bProbing = FALSE;
+}
+
+/**
+ * Set the timer to fire once after the given delay.
+ */
+static void ArmTimer(DWORD dwMillis) {
+
+	// A negative due time is relative, in 100 nanosecond units.
+
+	LARGE_INTEGER liDueTime;
+	liDueTime.QuadPart = -(LONGLONG)dwMillis * 10000;
+
+	SetWaitableTimer(hTimer, &liDueTime, 0, NULL, NULL, FALSE);
+}
+
+/**
+ * Check the status line "HTTP/1.x nnn ..." received so far.
+ *
+ * Returns FALSE if the status line is not yet complete.
+ */
+static BOOL GetHttpStatusOk(BOOL* pbOk) {
+
+	if (strstr(response, "\n") == NULL) {
+		return FALSE;
+	}
+
+	int status = 0;
+	if (strncmp(response, "HTTP/", 5) == 0) {
+		char* pSpace = strchr(response, ' ');
+		if (pSpace != NULL) {
+			status = atoi(pSpace + 1);
+		}
+	}
+
+	*pbOk = (status >= 200) && (status < 400);
+	return TRUE;
+}
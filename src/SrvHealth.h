@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVHEALTH_H_
+#define SRVHEALTH_H_
+
+#include <windows.h>
+
+#include "SrvConfig.h"
+
+/**
+ * Outcome of advancing the health checker.
+ *
+ *	SRV_HEALTH_PENDING		nothing to act on.
+ *	SRV_HEALTH_HEALTHY		a probe succeeded.
+ *	SRV_HEALTH_UNHEALTHY	the failure policy was met; the caller should
+ *							carry out the configured health action.
+ */
+typedef enum tagSRV_HEALTH {
+	SRV_HEALTH_PENDING,
+	SRV_HEALTH_HEALTHY,
+	SRV_HEALTH_UNHEALTHY
+} SRV_HEALTH;
+
+/**
+ * Create the probe timer and event and initialize Windows Sockets.
+ */
+BOOL SrvHealthOpen(void);
+
+/**
+ * Apply the health check settings from a configuration,
+ * cancelling any probe in progress and resetting the failure counters.
+ * Probing is off if the configuration has no HealthCheck.
+ *
+ * Returns FALSE with ERROR_BAD_FORMAT if HealthCheck or HealthAction is invalid.
+ */
+BOOL SrvHealthConfigure(LPSRV_CONFIG lpSrvConfig);
+
+/**
+ * Get the timer that paces probes and times them out.
+ */
+HANDLE SrvHealthGetTimer(void);
+
+/**
+ * Get the handle that is signaled when the probe in progress has news.
+ * The handle may change whenever a probe starts or ends.
+ */
+HANDLE SrvHealthGetProbeHandle(void);
+
+/**
+ * Handle the timer.  Starts a probe if bActive, or fails the probe
+ * in progress if it has run out of time.
+ */
+SRV_HEALTH SrvHealthOnTimer(BOOL bActive);
+
+/**
+ * Handle the probe handle being signaled.
+ */
+SRV_HEALTH SrvHealthOnProbe(void);
+
+/**
+ * Cancel any probe in progress and reset the failure counters,
+ * for example after the child was restarted.
+ */
+void SrvHealthReset(void);
+
+/**
+ * Format the probe counters and latency percentiles into a buffer.
+ *
+ * Returns the number of characters written, not including the terminator.
+ */
+DWORD SrvHealthFormat(LPSTR lpBuffer, DWORD dwSize);
+
+/**
+ * Describe why the checker last reported SRV_HEALTH_UNHEALTHY.
+ */
+LPCSTR SrvHealthReason(void);
+
+/**
+ * Release the timer, event and Windows Sockets.
+ */
+void SrvHealthClose(void);
+
+#endif /* SRVHEALTH_H_ */
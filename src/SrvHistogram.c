@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+
+#include "SrvHistogram.h"
+
+static DWORD GetBucketIndex(DWORD);
+static DWORD GetBucketUpperBound(DWORD);
+
+void SrvHistogramReset(LPSRV_HISTOGRAM lpHistogram) {
+	ZeroMemory(lpHistogram, sizeof(*lpHistogram));
+}
+
+void SrvHistogramRecord(LPSRV_HISTOGRAM lpHistogram, DWORD dwValue) {
+
+	lpHistogram->buckets[GetBucketIndex(dwValue)]++;
+	lpHistogram->dwCount++;
+
+	if (lpHistogram->dwMax < dwValue) {
+		lpHistogram->dwMax = dwValue;
+	}
+}
+
+DWORD SrvHistogramPercentile(LPSRV_HISTOGRAM lpHistogram, double percentile) {
+
+	if (lpHistogram->dwCount == 0) {
+		return 0;
+	}
+
+	// Find the bucket holding the value of the given rank, counting from 1.
+
+	ULONGLONG ullRank = (ULONGLONG)(percentile / 100.0 * lpHistogram->dwCount + 0.5);
+	if (ullRank < 1) {
+		ullRank = 1;
+	}
+
+	ULONGLONG ullSeen = 0;
+	for (DWORD index = 0; index < SRV_HISTOGRAM_BUCKETS; index++) {
+
+		ullSeen += lpHistogram->buckets[index];
+
+		if (ullSeen >= ullRank) {
+			DWORD dwUpper = GetBucketUpperBound(index);
+			return (dwUpper < lpHistogram->dwMax) ? dwUpper : lpHistogram->dwMax;
+		}
+	}
+
+	return lpHistogram->dwMax;
+}
+
+/**
+ * Values below SRV_HISTOGRAM_SUB_BUCKETS have a bucket each.
+ * Larger values are grouped by their most significant bit and
+ * divided within the group by the next SRV_HISTOGRAM_SUB_BUCKET_BITS bits.
+ */
+static DWORD GetBucketIndex(DWORD dwValue) {
+
+	if (dwValue < SRV_HISTOGRAM_SUB_BUCKETS) {
+		return dwValue;
+	}
+
+	DWORD dwMsb = 0;
+	while ((dwValue >> dwMsb) > 1) {
+		dwMsb++;
+	}
+
+	DWORD dwShift = dwMsb - SRV_HISTOGRAM_SUB_BUCKET_BITS;
+	DWORD dwGroup = dwShift + 1;
+	DWORD dwSubBucket = (dwValue >> dwShift) - SRV_HISTOGRAM_SUB_BUCKETS;
+
+	return dwGroup * SRV_HISTOGRAM_SUB_BUCKETS + dwSubBucket;
+}
+
+/**
+ * Get the largest value that falls in a bucket.
+ */
+static DWORD GetBucketUpperBound(DWORD dwIndex) {
+
+	if (dwIndex < SRV_HISTOGRAM_SUB_BUCKETS) {
+		return dwIndex;
+	}
+
+	DWORD dwShift = dwIndex / SRV_HISTOGRAM_SUB_BUCKETS - 1;
+	DWORD dwSubBucket = dwIndex % SRV_HISTOGRAM_SUB_BUCKETS;
+
+	ULONGLONG ullLower = (ULONGLONG)(SRV_HISTOGRAM_SUB_BUCKETS + dwSubBucket) << dwShift;
+	return (DWORD)(ullLower + ((ULONGLONG)1 << dwShift) - 1);
+}
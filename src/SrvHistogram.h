@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVHISTOGRAM_H_
+#define SRVHISTOGRAM_H_
+
+#include <windows.h>
+
+/**
+ * A fixed size log-linear histogram in the style of HdrHistogram.
+ * Each power of two range is split into SRV_HISTOGRAM_SUB_BUCKETS
+ * linear buckets, so any recorded value is reported within about 6%
+ * across the full DWORD range without allocation.
+ */
+#define SRV_HISTOGRAM_SUB_BUCKET_BITS 4
+#define SRV_HISTOGRAM_SUB_BUCKETS (1 << SRV_HISTOGRAM_SUB_BUCKET_BITS)
+#define SRV_HISTOGRAM_BUCKETS ((32 - SRV_HISTOGRAM_SUB_BUCKET_BITS + 1) * SRV_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct tagSRV_HISTOGRAM {
+	DWORD dwCount;
+	DWORD dwMax;
+	DWORD buckets[SRV_HISTOGRAM_BUCKETS];
+} SRV_HISTOGRAM,*LPSRV_HISTOGRAM;
+
+/**
+ * Clear all recorded values.
+ */
+void SrvHistogramReset(LPSRV_HISTOGRAM lpHistogram);
+
+/**
+ * Record one value.
+ */
+void SrvHistogramRecord(LPSRV_HISTOGRAM lpHistogram, DWORD dwValue);
+
+/**
+ * Get the value at or below which the given percentage of recorded values fall,
+ * reported as the upper bound of its bucket but never above the largest value.
+ *
+ * Returns 0 if nothing has been recorded.
+ */
+DWORD SrvHistogramPercentile(LPSRV_HISTOGRAM lpHistogram, double percentile);
+
+#endif /* SRVHISTOGRAM_H_ */
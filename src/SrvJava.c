@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "SrvJava.h"
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// Options chosen for the last launch.
+
+static char archivePath[MAX_PATH] = "";
+static LPCSTR lpArchiveMode = "none";
+static DWORD dwHeapMB = 0;
+
+static LPCSTR NextToken(LPCSTR, LPSTR, DWORD);
+static BOOL IsRelative(LPCSTR);
+static ULONGLONG HashBytes(ULONGLONG, LPCVOID, SIZE_T);
+static ULONGLONG HashFile(ULONGLONG, LPCSTR, LPCSTR);
+static ULONGLONG HashClasspath(ULONGLONG, LPCSTR, LPCSTR);
+static ULONGLONG GetClasspathHash(LPSRV_CONFIG, LPCSTR, LPCSTR);
+
+BOOL SrvJavaCommandLine(LPSRV_CONFIG lpSrvConfig, LPSTR lpBuffer, DWORD dwSize) {
+
+	LPCSTR lpCommandLine = (lpSrvConfig->lpCommandLine != NULL) ? lpSrvConfig->lpCommandLine : "";
+
+	// The options go after the first token, the java executable.
+
+	char javaPath[MAX_PATH];
+	LPCSTR lpArguments = NextToken(lpCommandLine, javaPath, sizeof(javaPath));
+
+	char options[MAX_PATH + 64] = "";
+	size_t optionsLength = 0;
+
+	archivePath[0] = 0;
+	lpArchiveMode = "none";
+	dwHeapMB = 0;
+
+	if ((lpSrvConfig->lpJavaArchiveDirectory != NULL)
+			&& (strstr(lpArguments, "-XX:SharedArchiveFile") == NULL)
+			&& (strstr(lpArguments, "-XX:ArchiveClassesAtExit") == NULL)
+			&& (strstr(lpArguments, "-Xshare:off") == NULL)) {
+
+		ULONGLONG ullHash = GetClasspathHash(lpSrvConfig, javaPath, lpArguments);
+
+		int length = _snprintf(archivePath, sizeof(archivePath), "%s\\srvwrap-%016llx.jsa",
+				lpSrvConfig->lpJavaArchiveDirectory, ullHash);
+
+		if ((length < 0) || ((DWORD)length >= sizeof(archivePath))) {
+			archivePath[0] = 0;
+		}
+		else {
+
+			// A JVM that is killed never writes its archive, so the next launch tries again.
+
+			BOOL bExists = GetFileAttributes(archivePath) != INVALID_FILE_ATTRIBUTES;
+			lpArchiveMode = bExists ? "using" : "creating";
+
+			optionsLength += _snprintf(options + optionsLength, sizeof(options) - optionsLength,
+					" \"-XX:%s=%s\"", bExists ? "SharedArchiveFile" : "ArchiveClassesAtExit", archivePath);
+		}
+	}
+
+	if ((lpSrvConfig->dwRecycleMaxPrivateMB != 0) && (lpSrvConfig->dwJavaHeapPercent != 0)
+			&& (strstr(lpArguments, "-Xmx") == NULL)) {
+
+		dwHeapMB = (DWORD)((ULONGLONG)lpSrvConfig->dwRecycleMaxPrivateMB * lpSrvConfig->dwJavaHeapPercent / 100);
+
+		optionsLength += _snprintf(options + optionsLength, sizeof(options) - optionsLength,
+				" -Xmx%lum", dwHeapMB);
+	}
+
+	size_t headLength = lpArguments - lpCommandLine;
+
+	if (headLength + optionsLength + strlen(lpArguments) >= dwSize) {
+		SetLastError(ERROR_BAD_ARGUMENTS);
+		return FALSE;
+	}
+
+	memcpy(lpBuffer, lpCommandLine, headLength);
+	strcpy(lpBuffer + headLength, options);
+	strcat(lpBuffer + headLength, lpArguments);
+
+	return TRUE;
+}
+
+DWORD SrvJavaFormat(LPSTR lpBuffer, DWORD dwSize) {
+
+	int length = _snprintf(lpBuffer, dwSize, "java archive=%s%s%s xmx=%lumb\n",
+			lpArchiveMode,
+			(archivePath[0] != 0) ? ":" : "",
+			archivePath,
+			dwHeapMB);
+
+	if ((length < 0) || ((DWORD)length >= dwSize)) {
+		length = dwSize - 1;
+	}
+	lpBuffer[length] = 0;
+
+	return length;
+}
+
+/**
+ * Copy the next command line token, without quotes, into a buffer.
+ * A token longer than the buffer is truncated.
+ *
+ * Returns a pointer to the rest of the command line, starting with
+ * the white space after the token.
+ */
+static LPCSTR NextToken(LPCSTR p, LPSTR lpToken, DWORD dwSize) {
+
+	DWORD dwLength = 0;
+	BOOL bQuoted = FALSE;
+
+	while ((*p == ' ') || (*p == '\t')) {
+		p++;
+	}
+
+	while ((*p != 0) && (bQuoted || ((*p != ' ') && (*p != '\t')))) {
+		if (*p == '"') {
+			bQuoted = !bQuoted;
+		}
+		else if (dwLength + 1 < dwSize) {
+			lpToken[dwLength++] = *p;
+		}
+		p++;
+	}
+
+	lpToken[dwLength] = 0;
+	return p;
+}
+
+/**
+ * Check whether a path is relative to the current directory.
+ */
+static BOOL IsRelative(LPCSTR lpPath) {
+	return (lpPath[0] != '\\') && (lpPath[0] != '/') && ((lpPath[0] == 0) || (lpPath[1] != ':'));
+}
+
+/**
+ * Continue an FNV-1a hash over some bytes.
+ */
+static ULONGLONG HashBytes(ULONGLONG ullHash, LPCVOID lpBytes, SIZE_T size) {
+
+	const BYTE* p = lpBytes;
+
+	for (SIZE_T i = 0; i < size; i++) {
+		ullHash = (ullHash ^ p[i]) * FNV_PRIME;
+	}
+
+	return ullHash;
+}
+
+/**
+ * Continue a hash over the path, size and last write time of a file.
+ * A relative path is taken relative to the child's current directory.
+ */
+static ULONGLONG HashFile(ULONGLONG ullHash, LPCSTR lpDirectory, LPCSTR lpPath) {
+
+	char path[MAX_PATH];
+	int length = ((lpDirectory != NULL) && IsRelative(lpPath))
+			? _snprintf(path, sizeof(path), "%s\\%s", lpDirectory, lpPath)
+			: _snprintf(path, sizeof(path), "%s", lpPath);
+
+	if ((length < 0) || ((DWORD)length >= sizeof(path))) {
+		return ullHash;
+	}
+
+	ullHash = HashBytes(ullHash, path, length + 1);
+
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (GetFileAttributesEx(path, GetFileExInfoStandard, &attributes)) {
+		ullHash = HashBytes(ullHash, &attributes.nFileSizeHigh, sizeof(attributes.nFileSizeHigh));
+		ullHash = HashBytes(ullHash, &attributes.nFileSizeLow, sizeof(attributes.nFileSizeLow));
+		ullHash = HashBytes(ullHash, &attributes.ftLastWriteTime, sizeof(attributes.ftLastWriteTime));
+	}
+
+	return ullHash;
+}
+
+/**
+ * Continue a hash over each entry of a classpath.  An entry ending
+ * with * stands for every jar in its directory, as it does for java.
+ */
+static ULONGLONG HashClasspath(ULONGLONG ullHash, LPCSTR lpDirectory, LPCSTR lpClasspath) {
+
+	char entries[SRV_JAVA_COMMAND_LINE_SIZE];
+	strncpy(entries, lpClasspath, sizeof(entries) - 1);
+	entries[sizeof(entries) - 1] = 0;
+
+	for (LPSTR pEntry = strtok(entries, ";"); pEntry != NULL; pEntry = strtok(NULL, ";")) {
+
+		size_t length = strlen(pEntry);
+
+		if ((length == 0) || (pEntry[length - 1] != '*')) {
+			ullHash = HashFile(ullHash, lpDirectory, pEntry);
+			continue;
+		}
+
+		char pattern[MAX_PATH];
+		pEntry[length - 1] = 0;
+
+		int patternLength = ((lpDirectory != NULL) && IsRelative(pEntry))
+				? _snprintf(pattern, sizeof(pattern), "%s\\%s*.jar", lpDirectory, pEntry)
+				: _snprintf(pattern, sizeof(pattern), "%s*.jar", pEntry);
+
+		if ((patternLength < 0) || ((DWORD)patternLength >= sizeof(pattern))) {
+			continue;
+		}
+
+		// FindFirstFile() returns jars in directory order, which is stable enough
+		// for a cache key; a reordering only costs one archive rebuild.
+
+		WIN32_FIND_DATA findData;
+		HANDLE hFind = FindFirstFile(pattern, &findData);
+
+		if (hFind == INVALID_HANDLE_VALUE) {
+			continue;
+		}
+
+		do {
+			ullHash = HashBytes(ullHash, findData.cFileName, strlen(findData.cFileName) + 1);
+			ullHash = HashBytes(ullHash, &findData.nFileSizeHigh, sizeof(findData.nFileSizeHigh));
+			ullHash = HashBytes(ullHash, &findData.nFileSizeLow, sizeof(findData.nFileSizeLow));
+			ullHash = HashBytes(ullHash, &findData.ftLastWriteTime, sizeof(findData.ftLastWriteTime));
+		} while (FindNextFile(hFind, &findData));
+
+		FindClose(hFind);
+	}
+
+	return ullHash;
+}
+
+/**
+ * Hash what makes an archive valid: the java executable, whose JDK must have
+ * written the archive, and the classpath given by -cp, -classpath,
+ * --class-path or -jar before the main class.
+ */
+static ULONGLONG GetClasspathHash(LPSRV_CONFIG lpSrvConfig, LPCSTR lpJavaPath, LPCSTR lpArguments) {
+
+	ULONGLONG ullHash = FNV_OFFSET_BASIS;
+	LPCSTR lpDirectory = lpSrvConfig->lpCurrentDirectory;
+
+	char javaPath[MAX_PATH];
+	if (lpSrvConfig->lpApplicationName != NULL) {
+		ullHash = HashFile(ullHash, NULL, lpSrvConfig->lpApplicationName);
+	}
+	else if (SearchPath(NULL, lpJavaPath, ".exe", sizeof(javaPath), javaPath, NULL) != 0) {
+		ullHash = HashFile(ullHash, NULL, javaPath);
+	}
+
+	char token[SRV_JAVA_COMMAND_LINE_SIZE];
+	LPCSTR p = lpArguments;
+
+	for (;;) {
+
+		p = NextToken(p, token, sizeof(token));
+
+		if ((token[0] == 0) || (token[0] != '-')) {
+			break;
+		}
+
+		if ((strcmp(token, "-cp") == 0) || (strcmp(token, "-classpath") == 0)
+				|| (strcmp(token, "--class-path") == 0)) {
+			p = NextToken(p, token, sizeof(token));
+			ullHash = HashClasspath(ullHash, lpDirectory, token);
+		}
+		else if (strncmp(token, "--class-path=", 13) == 0) {
+			ullHash = HashClasspath(ullHash, lpDirectory, token + 13);
+		}
+		else if (strcmp(token, "-jar") == 0) {
+			p = NextToken(p, token, sizeof(token));
+			ullHash = HashFile(ullHash, lpDirectory, token);
+			break;
+		}
+	}
+
+	return ullHash;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVJAVA_H_
+#define SRVJAVA_H_
+
+#include <windows.h>
+
+#include "SrvConfig.h"
+
+/**
+ * Largest command line accepted by CreateProcess().
+ */
+#define SRV_JAVA_COMMAND_LINE_SIZE 32768
+
+/**
+ * Build the command line for launching a JVM in Java mode, inserting options
+ * after the first token, which must be the java executable:
+ *
+ *	-XX:SharedArchiveFile	if the class data sharing archive for the classpath exists;
+ *	-XX:ArchiveClassesAtExit	if not, so that the JVM writes it when it exits;
+ *	-Xmx					JavaHeapPercent of RecycleMaxPrivateMB, unless -Xmx is given.
+ *
+ * Archives are named by a hash of the classpath and the size and time of each
+ * jar on it, so a changed jar starts a new archive.  Options the command line
+ * already gives are left alone.
+ *
+ * Returns FALSE with ERROR_BAD_ARGUMENTS if the command line would be too long.
+ */
+BOOL SrvJavaCommandLine(LPSRV_CONFIG lpSrvConfig, LPSTR lpBuffer, DWORD dwSize);
+
+/**
+ * Format the options chosen for the last launch into a buffer.
+ *
+ * Returns the number of characters written, not including the terminator.
+ */
+DWORD SrvJavaFormat(LPSTR lpBuffer, DWORD dwSize);
+
+#endif /* SRVJAVA_H_ */
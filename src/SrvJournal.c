@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "SrvJournal.h"
+#include "SrvHistogram.h"
+
+/**
+ * The journal file is a header followed by dwCapacity fixed size record slots
+ * used as a ring.  dwNext is the slot for the next record.
+ */
+#define JOURNAL_MAGIC 0x4C4A5753			// "SWJL"
+#define JOURNAL_VERSION 1
+
+typedef struct tagJOURNAL_HEADER {
+	DWORD dwMagic;
+	DWORD dwVersion;
+	DWORD cbRecord;
+	DWORD dwCapacity;
+	DWORD dwNext;
+	DWORD dwCount;
+} JOURNAL_HEADER;
+
+/**
+ * Totals gathered while printing a journal.
+ */
+typedef struct tagJOURNAL_SUMMARY {
+	DWORD dwRuns;
+	SRV_HISTOGRAM startupMillis;
+	SRV_HISTOGRAM stopMillis;
+	SRV_HISTOGRAM runSeconds;
+} JOURNAL_SUMMARY;
+
+static const char* stopStepNames[] = { "none", "signaled", "dumped", "killed" };
+static const char* endReasonNames[SRV_END_COUNT] = { "exited", "stop", "restart", "unhealthy", "hung", "recycle" };
+
+static void PrintRecord(LPSRV_JOURNAL_RECORD, LPVOID);
+static BOOL ReadHeader(HANDLE, JOURNAL_HEADER*);
+static BOOL WriteAt(HANDLE, LONGLONG, LPCVOID, DWORD);
+static ULONGLONG GetMillisBetween(const FILETIME*, const FILETIME*);
+static BOOL IsSet(const FILETIME*);
+static void PrintPercentiles(LPCSTR, LPSRV_HISTOGRAM);
+
+void SrvJournalDescribe(LPSRV_CHILD lpChild, SRV_END_REASON endReason, LPSRV_JOURNAL_RECORD lpRecord) {
+
+	ZeroMemory(lpRecord, sizeof(*lpRecord));
+
+	lpRecord->ftLaunched = lpChild->ftLaunched;
+	lpRecord->ftReady = lpChild->ftReady;
+	lpRecord->ftStopRequested = lpChild->ftStopRequested;
+	lpRecord->dwProcessId = lpChild->pi.dwProcessId;
+	lpRecord->dwStopStep = lpChild->stopStep;
+	lpRecord->dwEndReason = endReason;
+
+	FILETIME ftCreation, ftKernel, ftUser;
+	GetProcessTimes(lpChild->pi.hProcess, &ftCreation, &lpRecord->ftExited, &ftKernel, &ftUser);
+	GetExitCodeProcess(lpChild->pi.hProcess, &lpRecord->dwExitCode);
+
+	SrvChildGetUsage(lpChild, &lpRecord->ullPeakBytes, &lpRecord->ullCpuTime);
+}
+
+BOOL SrvJournalAppend(LPCSTR lpPath, DWORD dwCapacity, LPSRV_JOURNAL_RECORD lpRecord) {
+
+	if (dwCapacity == 0) {
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	HANDLE hFile = CreateFile(lpPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+			NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+
+	JOURNAL_HEADER header;
+
+	if (!ReadHeader(hFile, &header)
+			|| (header.cbRecord != sizeof(*lpRecord))
+			|| (header.dwCapacity != dwCapacity)) {
+
+		header.dwMagic = JOURNAL_MAGIC;
+		header.dwVersion = JOURNAL_VERSION;
+		header.cbRecord = sizeof(*lpRecord);
+		header.dwCapacity = dwCapacity;
+		header.dwNext = 0;
+		header.dwCount = 0;
+
+		SetFilePointer(hFile, 0, NULL, FILE_BEGIN);
+		SetEndOfFile(hFile);
+	}
+
+	// Write the record before the header that makes it visible.
+
+	BOOL bSuccess = WriteAt(hFile, sizeof(header) + (LONGLONG)header.dwNext * sizeof(*lpRecord), lpRecord, sizeof(*lpRecord));
+
+	if (bSuccess) {
+
+		header.dwNext = (header.dwNext + 1) % dwCapacity;
+		if (header.dwCount < dwCapacity) {
+			header.dwCount++;
+		}
+
+		bSuccess = WriteAt(hFile, 0, &header, sizeof(header));
+	}
+
+	DWORD dwLastError = GetLastError();
+	CloseHandle(hFile);
+	SetLastError(dwLastError);
+
+	return bSuccess;
+}
+
+BOOL SrvJournalForEach(LPCSTR lpPath, LPSRV_JOURNAL_VISITOR lpVisitor, LPVOID lpContext) {
+
+	HANDLE hFile = CreateFile(lpPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+
+	JOURNAL_HEADER header;
+
+	if (!ReadHeader(hFile, &header) || (header.cbRecord != sizeof(SRV_JOURNAL_RECORD))) {
+		CloseHandle(hFile);
+		SetLastError(ERROR_BAD_FORMAT);
+		return FALSE;
+	}
+
+	BOOL bSuccess = TRUE;
+	DWORD dwSlot = (header.dwNext + header.dwCapacity - header.dwCount) % header.dwCapacity;
+
+	for (DWORD i = 0; i < header.dwCount; i++, dwSlot = (dwSlot + 1) % header.dwCapacity) {
+
+		SRV_JOURNAL_RECORD record;
+		DWORD dwRead = 0;
+
+		LARGE_INTEGER liOffset;
+		liOffset.QuadPart = sizeof(header) + (LONGLONG)dwSlot * sizeof(record);
+
+		if (!SetFilePointerEx(hFile, liOffset, NULL, FILE_BEGIN)
+				|| !ReadFile(hFile, &record, sizeof(record), &dwRead, NULL)
+				|| (dwRead != sizeof(record))) {
+			SetLastError(ERROR_READ_FAULT);
+			bSuccess = FALSE;
+			break;
+		}
+
+		lpVisitor(&record, lpContext);
+	}
+
+	DWORD dwLastError = GetLastError();
+	CloseHandle(hFile);
+	SetLastError(dwLastError);
+
+	return bSuccess;
+}
+
+BOOL SrvJournalGetStopMillis(LPSRV_JOURNAL_RECORD lpRecord, PULONGLONG pullMillis) {
+
+	if (!IsSet(&lpRecord->ftStopRequested) || !IsSet(&lpRecord->ftExited)) {
+		return FALSE;
+	}
+
+	*pullMillis = GetMillisBetween(&lpRecord->ftStopRequested, &lpRecord->ftExited);
+	return TRUE;
+}
+
+int SrvJournalPrint(LPCSTR lpPath) {
+
+	JOURNAL_SUMMARY summary;
+	ZeroMemory(&summary, sizeof(summary));
+
+	if (!SrvJournalForEach(lpPath, PrintRecord, &summary)) {
+		fprintf(stderr, "SrvWrap: cannot read journal %s, error %lu\n", lpPath, GetLastError());
+		return EXIT_FAILURE;
+	}
+
+	printf("runs=%lu\n", summary.dwRuns);
+	PrintPercentiles("startup-ms", &summary.startupMillis);
+	PrintPercentiles("stop-ms", &summary.stopMillis);
+	PrintPercentiles("run-s", &summary.runSeconds);
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Print one record and add it to the summary.
+ */
+static void PrintRecord(LPSRV_JOURNAL_RECORD lpRecord, LPVOID lpContext) {
+
+	JOURNAL_SUMMARY* pSummary = (JOURNAL_SUMMARY*)lpContext;
+	pSummary->dwRuns++;
+
+	FILETIME ftLocal;
+	SYSTEMTIME st;
+	FileTimeToLocalFileTime(&lpRecord->ftLaunched, &ftLocal);
+	FileTimeToSystemTime(&ftLocal, &st);
+
+	printf("%04u-%02u-%02u %02u:%02u:%02u pid=%lu",
+			st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond,
+			lpRecord->dwProcessId);
+
+	if (IsSet(&lpRecord->ftReady)) {
+		ULONGLONG ullMillis = GetMillisBetween(&lpRecord->ftLaunched, &lpRecord->ftReady);
+		SrvHistogramRecord(&pSummary->startupMillis, (DWORD)ullMillis);
+		printf(" startup=%llums", ullMillis);
+	}
+
+	ULONGLONG ullStopMillis;
+	if (SrvJournalGetStopMillis(lpRecord, &ullStopMillis)) {
+		SrvHistogramRecord(&pSummary->stopMillis, (DWORD)ullStopMillis);
+		printf(" stop=%llums", ullStopMillis);
+	}
+
+	if (IsSet(&lpRecord->ftExited)) {
+		ULONGLONG ullSeconds = GetMillisBetween(&lpRecord->ftLaunched, &lpRecord->ftExited) / 1000;
+		SrvHistogramRecord(&pSummary->runSeconds, (DWORD)ullSeconds);
+		printf(" run=%llus", ullSeconds);
+	}
+
+	printf(" exit=%lu step=%s end=%s peak=%.1fMB cpu=%.1fs\n",
+			lpRecord->dwExitCode,
+			(lpRecord->dwStopStep <= SRV_STOP_KILLED) ? stopStepNames[lpRecord->dwStopStep] : "?",
+			(lpRecord->dwEndReason < SRV_END_COUNT) ? endReasonNames[lpRecord->dwEndReason] : "?",
+			lpRecord->ullPeakBytes / (1024.0 * 1024.0),
+			lpRecord->ullCpuTime / 10000000.0);
+}
+
+/**
+ * Read and check the journal header.
+ */
+static BOOL ReadHeader(HANDLE hFile, JOURNAL_HEADER* pHeader) {
+
+	DWORD dwRead = 0;
+
+	if (!ReadFile(hFile, pHeader, sizeof(*pHeader), &dwRead, NULL) || (dwRead != sizeof(*pHeader))) {
+		return FALSE;
+	}
+
+	return (pHeader->dwMagic == JOURNAL_MAGIC)
+			&& (pHeader->dwVersion == JOURNAL_VERSION)
+			&& (pHeader->dwCapacity != 0)
+			&& (pHeader->dwNext < pHeader->dwCapacity)
+			&& (pHeader->dwCount <= pHeader->dwCapacity);
+}
+
+/**
+ * Write a buffer at a file offset.
+ */
+static BOOL WriteAt(HANDLE hFile, LONGLONG llOffset, LPCVOID lpBuffer, DWORD dwSize) {
+
+	LARGE_INTEGER liOffset;
+	liOffset.QuadPart = llOffset;
+
+	DWORD dwWritten = 0;
+
+	return SetFilePointerEx(hFile, liOffset, NULL, FILE_BEGIN)
+			&& WriteFile(hFile, lpBuffer, dwSize, &dwWritten, NULL)
+			&& (dwWritten == dwSize);
+}
+
+/**
+ * Get the milliseconds from one time to a later one, or 0 if it is not later.
+ */
+static ULONGLONG GetMillisBetween(const FILETIME* lpFrom, const FILETIME* lpTo) {
+
+	ULARGE_INTEGER uliFrom, uliTo;
+	uliFrom.LowPart = lpFrom->dwLowDateTime;
+	uliFrom.HighPart = lpFrom->dwHighDateTime;
+	uliTo.LowPart = lpTo->dwLowDateTime;
+	uliTo.HighPart = lpTo->dwHighDateTime;
+
+	return (uliTo.QuadPart > uliFrom.QuadPart) ? (uliTo.QuadPart - uliFrom.QuadPart) / 10000 : 0;
+}
+
+static BOOL IsSet(const FILETIME* lpTime) {
+	return (lpTime->dwLowDateTime != 0) || (lpTime->dwHighDateTime != 0);
+}
+
+static void PrintPercentiles(LPCSTR lpName, LPSRV_HISTOGRAM lpHistogram) {
+
+	printf("%s count=%lu p50=%lu p90=%lu p99=%lu max=%lu\n",
+			lpName,
+			lpHistogram->dwCount,
+			SrvHistogramPercentile(lpHistogram, 50.0),
+			SrvHistogramPercentile(lpHistogram, 90.0),
+			SrvHistogramPercentile(lpHistogram, 99.0),
+			lpHistogram->dwMax);
+}
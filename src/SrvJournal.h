@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVJOURNAL_H_
+#define SRVJOURNAL_H_
+
+#include <windows.h>
+
+#include "SrvChild.h"
+
+/**
+ * Why a child's run ended.
+ *
+ *	SRV_END_EXITED		the child exited on its own.
+ *	SRV_END_STOP		the service was stopped.
+ *	SRV_END_RESTART		a restart was requested or a reload changed how the child is launched.
+ *	SRV_END_UNHEALTHY	health checks failed.
+ *	SRV_END_HUNG		the child missed its watchdog heartbeat.
+ *	SRV_END_RECYCLE		the memory recycling policy restarted the child.
+ */
+typedef enum tagSRV_END_REASON {
+	SRV_END_EXITED,
+	SRV_END_STOP,
+	SRV_END_RESTART,
+	SRV_END_UNHEALTHY,
+	SRV_END_HUNG,
+	SRV_END_RECYCLE,
+	SRV_END_COUNT
+} SRV_END_REASON;
+
+/**
+ * One record per child run.  Times are UTC; unset times are zero.
+ */
+typedef struct tagSRV_JOURNAL_RECORD {
+	FILETIME ftLaunched;
+	FILETIME ftReady;
+	FILETIME ftStopRequested;
+	FILETIME ftExited;
+	ULONGLONG ullPeakBytes;
+	ULONGLONG ullCpuTime;
+	DWORD dwProcessId;
+	DWORD dwExitCode;
+	DWORD dwStopStep;
+	DWORD dwEndReason;
+} SRV_JOURNAL_RECORD,*LPSRV_JOURNAL_RECORD;
+
+/**
+ * Fill in a journal record for a child that has exited,
+ * before its handles are closed.
+ */
+void SrvJournalDescribe(LPSRV_CHILD lpChild, SRV_END_REASON endReason, LPSRV_JOURNAL_RECORD lpRecord);
+
+/**
+ * Append a record to the journal file, which holds at most dwCapacity records.
+ * Once full, each record overwrites the oldest.  A journal written with
+ * a different capacity or record layout is started afresh.
+ */
+BOOL SrvJournalAppend(LPCSTR lpPath, DWORD dwCapacity, LPSRV_JOURNAL_RECORD lpRecord);
+
+/**
+ * Function called for each record read from a journal.
+ */
+typedef void (*LPSRV_JOURNAL_VISITOR)(LPSRV_JOURNAL_RECORD lpRecord, LPVOID lpContext);
+
+/**
+ * Read the records in a journal file, oldest first.
+ *
+ * Returns FALSE with ERROR_BAD_FORMAT if the file is not a journal.
+ */
+BOOL SrvJournalForEach(LPCSTR lpPath, LPSRV_JOURNAL_VISITOR lpVisitor, LPVOID lpContext);
+
+/**
+ * Get the time from asking a record's child to stop until it exited,
+ * in milliseconds.
+ *
+ * Returns FALSE if the child was not asked to stop.
+ */
+BOOL SrvJournalGetStopMillis(LPSRV_JOURNAL_RECORD lpRecord, PULONGLONG pullMillis);
+
+/**
+ * Print the records in a journal file, oldest first, followed by
+ * percentiles of startup time, stop time and run time.
+ *
+ * Returns a process exit code.
+ */
+int SrvJournalPrint(LPCSTR lpPath);
+
+#endif /* SRVJOURNAL_H_ */
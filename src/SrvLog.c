@@ -0,0 +1,952 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+
+#include <tchar.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "SrvLog.h"
+#include "SrvLogTransform.h"
+#include "SrvLogCompress.h"
+#include "SrvLogIndex.h"
+#include "SrvLogForward.h"
+
+#define LOG_BUFFER_SIZE 65536
+#define LOG_READS 2						// kept pending on each pipe
+
+#define LOG_STDOUT 0
+#define LOG_STDERR 1
+#define LOG_STREAMS 2
+
+/**
+ * A pipe for each of standard output and standard error carries output from
+ * every launch of the child to the reader thread, which passes it through
+ * a stream transform to the log file.  The wrapper holds the write ends
+ * open for its whole lifetime so that the reader does not see end of file
+ * when one child exits and the next is launched.  In raw format the child
+ * gets the standard output pipe for both, so that its output is interleaved
+ * exactly as written.  The log file and the streams are only touched
+ * while holding csLog.
+ *
+ * The read ends are overlapped, with LOG_READS reads kept pending on each
+ * and completed to one port, so the pipe is still drained into the next
+ * buffer while the reader writes the last one to the log file.  A pipe
+ * completes its reads in the order they were started.
+ */
+static CRITICAL_SECTION csLog;
+static HANDLE hReadPipes[LOG_STREAMS] = { NULL, NULL };
+static HANDLE hWritePipes[LOG_STREAMS] = { NULL, NULL };
+static HANDLE hCompletionPort = NULL;
+static HANDLE hReaderThread = NULL;
+static HANDLE hLogFile = INVALID_HANDLE_VALUE;
+
+/**
+ * A read from a pipe, found from its completion by the OVERLAPPED.
+ */
+typedef struct {
+	OVERLAPPED ov;
+	DWORD dwStream;
+	char buffer[LOG_BUFFER_SIZE];
+} LOG_READ;
+
+static LOG_READ reads[LOG_STREAMS][LOG_READS];
+
+static SRV_LOG_STREAM streams[LOG_STREAMS];
+static char instance[MAX_PATH];
+
+static char logPath[MAX_PATH];
+static DWORD dwLogRotateBytes = 0;
+static DWORD dwLogIndexBytes = 0;
+
+static ULONGLONG ullFileBytes = 0;
+static ULONGLONG ullTotalBytes = 0;
+static DWORD dwRotations = 0;
+
+static BOOL OpenLogFile(void);
+static BOOL RotateLogFile(void);
+static BOOL ConfigureStreams(LPCSTR);
+static BOOL WriteLogFile(LPCVOID, DWORD, LPVOID);
+static BOOL CreateCapturePipe(DWORD, LPSECURITY_ATTRIBUTES);
+static BOOL StartRead(LOG_READ*);
+static DWORD WINAPI LogReaderThread(LPVOID);
+static BOOL WriteReply(LPCVOID, DWORD, LPVOID);
+
+/**
+ * What the capture benchmark's stand-in for the child writes.
+ */
+typedef struct {
+	HANDLE hPipe;
+	ULONGLONG ullBytes;
+	BOOL bClose;
+} BENCH_WRITER;
+
+static double BenchBuffered(LPCSTR, ULONGLONG);
+static double BenchOverlapped(LPCSTR, ULONGLONG);
+static DWORD WINAPI BenchWriterThread(LPVOID);
+
+/**
+ * Where SrvLogQueryRange() copies lines.
+ */
+typedef struct {
+	LPSTR lpBuffer;
+	DWORD dwSize;
+	DWORD dwLength;
+} QUERY_REPLY;
+
+HANDLE SrvLogOpen(LPCSTR lpPath, DWORD dwRotateBytes, DWORD dwIndexBytes, LPCSTR lpFormat, LPCSTR lpInstance) {
+
+	if ((strlen(lpPath) >= sizeof(logPath)) || (strlen(lpInstance) >= sizeof(instance))) {
+		SetLastError(ERROR_BAD_FORMAT);
+		return NULL;
+	}
+
+	InitializeCriticalSection(&csLog);
+
+	strcpy(logPath, lpPath);
+	strcpy(instance, lpInstance);
+	dwLogRotateBytes = dwRotateBytes;
+	dwLogIndexBytes = dwIndexBytes;
+
+	SrvLogStreamInit(&streams[LOG_STDOUT], "stdout", WriteLogFile, &streams[LOG_STDOUT]);
+	SrvLogStreamInit(&streams[LOG_STDERR], "stderr", WriteLogFile, &streams[LOG_STDERR]);
+
+	if (!ConfigureStreams(lpFormat)) {
+		return NULL;
+	}
+
+	if (!OpenLogFile()) {
+		return NULL;
+	}
+
+	// Only the write ends of the pipes may be inherited by the child.
+
+	SECURITY_ATTRIBUTES sa;
+	sa.nLength = sizeof(sa);
+	sa.lpSecurityDescriptor = NULL;
+	sa.bInheritHandle = TRUE;
+
+	hCompletionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (hCompletionPort == NULL) {
+		return NULL;
+	}
+
+	for (DWORD i = 0; i < LOG_STREAMS; i++) {
+		if (!CreateCapturePipe(i, &sa)) {
+			return NULL;
+		}
+	}
+
+	hReaderThread = CreateThread(NULL, 0, LogReaderThread, NULL, 0, NULL);
+	if (hReaderThread == NULL) {
+		return NULL;
+	}
+
+	return hWritePipes[LOG_STDOUT];
+}
+
+HANDLE SrvLogGetErrorHandle(void) {
+
+	if (hReaderThread == NULL) {
+		return NULL;
+	}
+
+	EnterCriticalSection(&csLog);
+	HANDLE hError = (streams[LOG_STDOUT].format == SRV_LOG_RAW) ? hWritePipes[LOG_STDOUT] : hWritePipes[LOG_STDERR];
+	LeaveCriticalSection(&csLog);
+
+	return hError;
+}
+
+void SrvLogSetProcessId(DWORD dwProcessId) {
+
+	if (hReaderThread == NULL) {
+		return;
+	}
+
+	// Output still buffered from the previous child goes out under its own id.
+
+	EnterCriticalSection(&csLog);
+
+	for (DWORD i = 0; i < LOG_STREAMS; i++) {
+		SrvLogStreamFlush(&streams[i], FALSE);
+		streams[i].dwProcessId = dwProcessId;
+	}
+
+	LeaveCriticalSection(&csLog);
+}
+
+BOOL SrvLogConfigure(LPCSTR lpPath, DWORD dwRotateBytes, DWORD dwIndexBytes, LPCSTR lpFormat) {
+
+	if (hReaderThread == NULL) {
+		SetLastError(ERROR_NOT_SUPPORTED);
+		return FALSE;
+	}
+
+	if (strlen(lpPath) >= sizeof(logPath)) {
+		SetLastError(ERROR_BAD_FORMAT);
+		return FALSE;
+	}
+
+	EnterCriticalSection(&csLog);
+
+	BOOL bSuccess = TRUE;
+
+	if (strcmp(lpPath, logPath) != 0) {
+
+		dwLogIndexBytes = dwIndexBytes;
+
+		char oldPath[MAX_PATH];
+		strcpy(oldPath, logPath);
+
+		HANDLE hOldFile = hLogFile;
+		ULONGLONG ullOldFileBytes = ullFileBytes;
+
+		strcpy(logPath, lpPath);
+		bSuccess = OpenLogFile();
+
+		if (bSuccess) {
+			CloseHandle(hOldFile);
+		}
+		else {
+			DWORD dwLastError = GetLastError();
+			strcpy(logPath, oldPath);
+			hLogFile = hOldFile;
+			ullFileBytes = ullOldFileBytes;
+			SetLastError(dwLastError);
+		}
+	}
+	else if (dwIndexBytes != dwLogIndexBytes) {
+		dwLogIndexBytes = dwIndexBytes;
+		SrvLogIndexOpen(logPath, ullFileBytes, dwLogIndexBytes);
+	}
+
+	if (bSuccess) {
+		bSuccess = ConfigureStreams(lpFormat);
+	}
+
+	if (bSuccess) {
+		dwLogRotateBytes = dwRotateBytes;
+	}
+
+	LeaveCriticalSection(&csLog);
+
+	return bSuccess;
+}
+
+BOOL SrvLogSetLimit(LPCSTR lpPolicy, DWORD dwRateBytes, DWORD dwBurstBytes, DWORD dwSample) {
+
+	if (hReaderThread == NULL) {
+		SetLastError(ERROR_NOT_SUPPORTED);
+		return FALSE;
+	}
+
+	SRV_LOG_POLICY policy;
+	if (!SrvLogLimitParsePolicy(lpPolicy, &policy)) {
+		return FALSE;
+	}
+
+	EnterCriticalSection(&csLog);
+
+	BOOL bSuccess = TRUE;
+
+	for (DWORD i = 0; i < LOG_STREAMS; i++) {
+		bSuccess = SrvLogStreamLimit(&streams[i], policy, dwRateBytes, dwBurstBytes, dwSample) && bSuccess;
+	}
+
+	LeaveCriticalSection(&csLog);
+
+	return bSuccess;
+}
+
+BOOL SrvLogRotate(void) {
+
+	if (hReaderThread == NULL) {
+		SetLastError(ERROR_NOT_SUPPORTED);
+		return FALSE;
+	}
+
+	EnterCriticalSection(&csLog);
+	BOOL bSuccess = RotateLogFile();
+	LeaveCriticalSection(&csLog);
+
+	return bSuccess;
+}
+
+BOOL SrvLogReopen(void) {
+
+	if (hReaderThread == NULL) {
+		SetLastError(ERROR_NOT_SUPPORTED);
+		return FALSE;
+	}
+
+	// Keep writing to the old handle if the file cannot be opened again.
+
+	EnterCriticalSection(&csLog);
+
+	HANDLE hOldFile = hLogFile;
+	BOOL bSuccess = OpenLogFile();
+
+	if (bSuccess) {
+		CloseHandle(hOldFile);
+	}
+
+	LeaveCriticalSection(&csLog);
+
+	return bSuccess;
+}
+
+BOOL SrvLogTail(DWORD dwLines, LPSTR lpBuffer, DWORD dwSize) {
+
+	if (hReaderThread == NULL) {
+		SetLastError(ERROR_NOT_SUPPORTED);
+		return FALSE;
+	}
+
+	if (dwSize == 0) {
+		SetLastError(ERROR_INSUFFICIENT_BUFFER);
+		return FALSE;
+	}
+
+	// Hold the lock so that the file is not rotated away while reading it.
+
+	EnterCriticalSection(&csLog);
+
+	HANDLE hFile = CreateFile(
+			logPath,
+			GENERIC_READ,
+			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			NULL,
+			OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL,
+			NULL);
+
+	if (hFile == INVALID_HANDLE_VALUE) {
+		LeaveCriticalSection(&csLog);
+		return FALSE;
+	}
+
+	// Read as much of the end of the file as will fit.
+
+	LARGE_INTEGER liSize;
+	DWORD dwRead = 0;
+	BOOL bSuccess = GetFileSizeEx(hFile, &liSize);
+
+	if (bSuccess) {
+		LONGLONG llWant = dwSize - 1;
+		LARGE_INTEGER liOffset;
+		liOffset.QuadPart = (liSize.QuadPart > llWant) ? liSize.QuadPart - llWant : 0;
+
+		bSuccess = SetFilePointerEx(hFile, liOffset, NULL, FILE_BEGIN)
+				&& ReadFile(hFile, lpBuffer, (DWORD)(liSize.QuadPart - liOffset.QuadPart), &dwRead, NULL);
+	}
+
+	CloseHandle(hFile);
+	LeaveCriticalSection(&csLog);
+
+	if (!bSuccess) {
+		return FALSE;
+	}
+
+	// Scan backwards for the start of the requested number of lines,
+	// ignoring a newline at the very end.
+
+	DWORD dwStart = dwRead;
+	DWORD dwFound = 0;
+	while (dwStart > 0) {
+		if ((lpBuffer[dwStart - 1] == '\n') && (dwStart != dwRead)) {
+			if (++dwFound == dwLines) {
+				break;
+			}
+		}
+		dwStart--;
+	}
+
+	memmove(lpBuffer, lpBuffer + dwStart, dwRead - dwStart);
+	lpBuffer[dwRead - dwStart] = 0;
+
+	return TRUE;
+}
+
+BOOL SrvLogQueryRange(LPCSTR lpFrom, LPCSTR lpTo, LPSTR lpBuffer, DWORD dwSize) {
+
+	if (hReaderThread == NULL) {
+		SetLastError(ERROR_NOT_SUPPORTED);
+		return FALSE;
+	}
+
+	if (dwSize == 0) {
+		SetLastError(ERROR_INSUFFICIENT_BUFFER);
+		return FALSE;
+	}
+
+	FILETIME ftFrom, ftTo;
+
+	if (!SrvLogParseTime(lpFrom, &ftFrom)) {
+		return FALSE;
+	}
+
+	if (lpTo == NULL) {
+		ftTo.dwLowDateTime = MAXDWORD;
+		ftTo.dwHighDateTime = MAXLONG;
+	}
+	else if (!SrvLogParseTime(lpTo, &ftTo)) {
+		return FALSE;
+	}
+
+	// Logging goes on during the query; a file rotated meanwhile may be missed.
+
+	char path[MAX_PATH];
+
+	EnterCriticalSection(&csLog);
+	strcpy(path, logPath);
+	LeaveCriticalSection(&csLog);
+
+	QUERY_REPLY reply;
+	reply.lpBuffer = lpBuffer;
+	reply.dwSize = dwSize;
+	reply.dwLength = 0;
+
+	BOOL bSuccess = SrvLogQuery(path, &ftFrom, &ftTo, WriteReply, &reply);
+
+	lpBuffer[reply.dwLength] = 0;
+
+	return bSuccess;
+}
+
+DWORD SrvLogFormat(LPSTR lpBuffer, DWORD dwSize) {
+
+	if (dwSize == 0) {
+		return 0;
+	}
+
+	if (hReaderThread == NULL) {
+		lpBuffer[0] = 0;
+		return 0;
+	}
+
+	EnterCriticalSection(&csLog);
+
+	int length = _snprintf(lpBuffer, dwSize, "log bytes=%llu file=%llu rotations=%lu lines=%llu records=%llu"
+			" suppressed-lines=%llu suppressed-bytes=%llu markers=%llu\n",
+			ullTotalBytes, ullFileBytes, dwRotations,
+			streams[LOG_STDOUT].ullLines + streams[LOG_STDERR].ullLines,
+			streams[LOG_STDOUT].ullRecords + streams[LOG_STDERR].ullRecords,
+			streams[LOG_STDOUT].limiter.ullSuppressedLines + streams[LOG_STDERR].limiter.ullSuppressedLines,
+			streams[LOG_STDOUT].limiter.ullSuppressedBytes + streams[LOG_STDERR].limiter.ullSuppressedBytes,
+			streams[LOG_STDOUT].limiter.ullMarkers + streams[LOG_STDERR].limiter.ullMarkers);
+
+	LeaveCriticalSection(&csLog);
+
+	if ((length < 0) || ((DWORD)length >= dwSize)) {
+		length = dwSize - 1;
+	}
+	lpBuffer[length] = 0;
+
+	return length;
+}
+
+void SrvLogClose(DWORD dwWaitMillis) {
+
+	if (hReaderThread == NULL) {
+		return;
+	}
+
+	// Closing the write ends lets the reader see end of file
+	// once no process holds an inherited copy.
+
+	for (DWORD i = 0; i < LOG_STREAMS; i++) {
+		CloseHandle(hWritePipes[i]);
+		hWritePipes[i] = NULL;
+	}
+
+	if (WaitForSingleObject(hReaderThread, dwWaitMillis) != WAIT_OBJECT_0) {
+		for (DWORD i = 0; i < LOG_STREAMS; i++) {
+			CancelIoEx(hReadPipes[i], NULL);
+		}
+		WaitForSingleObject(hReaderThread, INFINITE);
+	}
+
+	CloseHandle(hReaderThread);
+	hReaderThread = NULL;
+
+	for (DWORD i = 0; i < LOG_STREAMS; i++) {
+		CloseHandle(hReadPipes[i]);
+		hReadPipes[i] = NULL;
+	}
+
+	CloseHandle(hCompletionPort);
+	hCompletionPort = NULL;
+
+	CloseHandle(hLogFile);
+	hLogFile = INVALID_HANDLE_VALUE;
+
+	SrvLogIndexClose();
+
+	DeleteCriticalSection(&csLog);
+}
+
+int SrvLogCaptureBenchmark(DWORD dwMegabytes) {
+
+	char tempDirectory[MAX_PATH];
+	char tempPath[MAX_PATH];
+
+	if ((GetTempPath(sizeof(tempDirectory), tempDirectory) == 0)
+			|| (GetTempFileName(tempDirectory, "swb", 0, tempPath) == 0)) {
+		fprintf(stderr, "SrvWrap: cannot create a temporary file, error %lu\n", GetLastError());
+		return EXIT_FAILURE;
+	}
+
+	ULONGLONG ullBytes = (ULONGLONG)dwMegabytes * 1024 * 1024;
+
+	DeleteFile(tempPath);
+	double bufferedSeconds = BenchBuffered(tempPath, ullBytes);
+	DWORD dwLastError = GetLastError();
+
+	DeleteFile(tempPath);
+	double overlappedSeconds = (bufferedSeconds >= 0) ? BenchOverlapped(tempPath, ullBytes) : -1;
+	dwLastError = (bufferedSeconds >= 0) ? GetLastError() : dwLastError;
+
+	DeleteFile(tempPath);
+
+	if ((bufferedSeconds < 0) || (overlappedSeconds < 0)) {
+		fprintf(stderr, "SrvWrap: cannot capture to %s, error %lu\n", tempPath, dwLastError);
+		return EXIT_FAILURE;
+	}
+
+	printf("path=buffered bytes=%llu seconds=%.3f MBps=%.1f\n",
+			ullBytes, bufferedSeconds, ullBytes / bufferedSeconds / (1024 * 1024));
+	printf("path=overlapped bytes=%llu seconds=%.3f MBps=%.1f\n",
+			ullBytes, overlappedSeconds, ullBytes / overlappedSeconds / (1024 * 1024));
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Open the log file for appending and start indexing it.  Must be called holding csLog
+ * except during SrvLogOpen().  On failure hLogFile is left as it was, and the caller
+ * still owns any handle it held.
+ */
+static BOOL OpenLogFile(void) {
+
+	HANDLE hFile = CreateFile(
+			logPath,
+			FILE_APPEND_DATA,
+			FILE_SHARE_READ | FILE_SHARE_DELETE,
+			NULL,
+			OPEN_ALWAYS,
+			FILE_ATTRIBUTE_NORMAL,
+			NULL);
+
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+
+	LARGE_INTEGER liSize;
+	if (!GetFileSizeEx(hFile, &liSize)) {
+		DWORD dwLastError = GetLastError();
+		CloseHandle(hFile);
+		SetLastError(dwLastError);
+		return FALSE;
+	}
+
+	hLogFile = hFile;
+	ullFileBytes = liSize.QuadPart;
+	SrvLogIndexOpen(logPath, ullFileBytes, dwLogIndexBytes);
+
+	return TRUE;
+}
+
+/**
+ * Rename the log file to path.YYYYMMDD-HHMMSS-mmm and open a new one.
+ * Must be called holding csLog.
+ */
+static BOOL RotateLogFile(void) {
+
+	SYSTEMTIME st;
+	GetLocalTime(&st);
+
+	char rotatedPath[MAX_PATH + 32];
+	_snprintf(rotatedPath, sizeof(rotatedPath), "%s.%04u%02u%02u-%02u%02u%02u-%03u",
+			logPath,
+			st.wYear, st.wMonth, st.wDay,
+			st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
+	rotatedPath[sizeof(rotatedPath) - 1] = 0;
+
+	CloseHandle(hLogFile);
+	hLogFile = INVALID_HANDLE_VALUE;
+
+	BOOL bMoved = MoveFileEx(logPath, rotatedPath, 0);
+	DWORD dwMoveError = GetLastError();
+
+	if (bMoved) {
+		SrvLogIndexRotate(rotatedPath);
+	}
+
+	// Keep capturing even if the rename failed.
+
+	if (!OpenLogFile()) {
+		return FALSE;
+	}
+
+	if (!bMoved) {
+		SetLastError(dwMoveError);
+		return FALSE;
+	}
+
+	dwRotations++;
+	SrvLogCompressNotify();
+
+	return TRUE;
+}
+
+/**
+ * Set the format of both streams.  Must be called holding csLog
+ * except during SrvLogOpen().
+ */
+static BOOL ConfigureStreams(LPCSTR lpFormat) {
+
+	SRV_LOG_FORMAT format;
+	if (!SrvLogParseFormat(lpFormat, &format)) {
+		return FALSE;
+	}
+
+	BOOL bSuccess = TRUE;
+
+	for (DWORD i = 0; i < LOG_STREAMS; i++) {
+		bSuccess = SrvLogStreamConfigure(&streams[i], format, instance) && bSuccess;
+	}
+
+	return bSuccess;
+}
+
+/**
+ * Write transformed output to the log file, rotating it when full.
+ * Called by the streams holding csLog.
+ */
+static BOOL WriteLogFile(LPCVOID lpData, DWORD dwLength, LPVOID lpContext) {
+
+	SrvLogIndexAdd(ullFileBytes);
+
+	DWORD dwWritten = 0;
+	BOOL bSuccess = (hLogFile != INVALID_HANDLE_VALUE) && WriteFile(hLogFile, lpData, dwLength, &dwWritten, NULL);
+
+	ullFileBytes += dwWritten;
+	ullTotalBytes += dwWritten;
+
+	LPSRV_LOG_STREAM lpStream = lpContext;
+	SrvLogForwardWrite(lpStream == &streams[LOG_STDERR], lpStream->dwProcessId, lpData, dwLength);
+
+	if ((dwLogRotateBytes != 0) && (ullFileBytes >= dwLogRotateBytes)) {
+		RotateLogFile();
+	}
+
+	return bSuccess;
+}
+
+/**
+ * Create the pipe for a stream, with an overlapped read end on the completion
+ * port, and a write end for the child that is not.  CreatePipe() cannot make
+ * an overlapped pipe, so this is a named pipe that only this process knows.
+ */
+static BOOL CreateCapturePipe(DWORD dwStream, LPSECURITY_ATTRIBUTES lpsa) {
+
+	char pipeName[64];
+	_snprintf(pipeName, sizeof(pipeName), "\\\\.\\pipe\\SrvWrap-output-%lu-%lu", GetCurrentProcessId(), dwStream);
+	pipeName[sizeof(pipeName) - 1] = 0;
+
+	hReadPipes[dwStream] = CreateNamedPipe(
+			pipeName,
+			PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+			PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+			1,							// nMaxInstances
+			0,							// nOutBufferSize
+			LOG_BUFFER_SIZE,			// nInBufferSize
+			0,							// nDefaultTimeOut
+			NULL);						// lpSecurityAttributes, not inheritable
+
+	if (hReadPipes[dwStream] == INVALID_HANDLE_VALUE) {
+		hReadPipes[dwStream] = NULL;
+		return FALSE;
+	}
+
+	hWritePipes[dwStream] = CreateFile(pipeName, GENERIC_WRITE, 0, lpsa, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (hWritePipes[dwStream] == INVALID_HANDLE_VALUE) {
+		hWritePipes[dwStream] = NULL;
+		return FALSE;
+	}
+
+	if (CreateIoCompletionPort(hReadPipes[dwStream], hCompletionPort, 0, 0) == NULL) {
+		return FALSE;
+	}
+
+	for (DWORD i = 0; i < LOG_READS; i++) {
+		reads[dwStream][i].dwStream = dwStream;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Start a read from a pipe, which completes to the port even if the
+ * data is already there.
+ *
+ * Returns FALSE if the pipe is at end of file or the read failed.
+ */
+static BOOL StartRead(LOG_READ* lpRead) {
+
+	ZeroMemory(&lpRead->ov, sizeof(lpRead->ov));
+
+	return ReadFile(hReadPipes[lpRead->dwStream], lpRead->buffer, LOG_BUFFER_SIZE, NULL, &lpRead->ov)
+			|| (GetLastError() == ERROR_IO_PENDING);
+}
+
+/**
+ * Copy child output from the pipes through their streams to the log file until
+ * every holder of the write end of each pipe has closed it, or the reads are
+ * cancelled.  A record held open for following stack trace lines is written
+ * once the pipe is empty, so a quiet child's last line is not kept back.
+ */
+static DWORD WINAPI LogReaderThread(LPVOID lpParameter) {
+
+	DWORD dwPending[LOG_STREAMS] = { 0, 0 };
+	DWORD dwPendingTotal = 0;
+
+	for (DWORD i = 0; i < LOG_STREAMS; i++) {
+		for (DWORD j = 0; j < LOG_READS; j++) {
+			if (StartRead(&reads[i][j])) {
+				dwPending[i]++;
+				dwPendingTotal++;
+			}
+		}
+	}
+
+	while (dwPendingTotal > 0) {
+
+		DWORD dwRead;
+		ULONG_PTR ulKey;
+		LPOVERLAPPED lpOverlapped;
+
+		BOOL bSuccess = GetQueuedCompletionStatus(hCompletionPort, &dwRead, &ulKey, &lpOverlapped, INFINITE);
+		if (lpOverlapped == NULL) {
+			break;
+		}
+
+		LOG_READ* lpRead = (LOG_READ*)lpOverlapped;
+		DWORD dwStream = lpRead->dwStream;
+		LPSRV_LOG_STREAM lpStream = &streams[dwStream];
+
+		dwPending[dwStream]--;
+		dwPendingTotal--;
+
+		if (bSuccess) {
+
+			// The pipe is empty if the read started after this one has nothing yet.
+
+			LOG_READ* lpNext = &reads[dwStream][(lpRead - reads[dwStream] + 1) % LOG_READS];
+			BOOL bIdle = !HasOverlappedIoCompleted(&lpNext->ov);
+
+			EnterCriticalSection(&csLog);
+
+			SrvLogStreamWrite(lpStream, lpRead->buffer, dwRead);
+
+			if (bIdle) {
+				SrvLogStreamFlush(lpStream, FALSE);
+			}
+
+			LeaveCriticalSection(&csLog);
+
+			if (StartRead(lpRead)) {
+				dwPending[dwStream]++;
+				dwPendingTotal++;
+				continue;
+			}
+		}
+
+		// After one read fails the rest do too; the last ends the stream.
+
+		if (dwPending[dwStream] == 0) {
+			EnterCriticalSection(&csLog);
+			SrvLogStreamFlush(lpStream, TRUE);
+			LeaveCriticalSection(&csLog);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Time capturing raw output the way it was done before the pipes were
+ * overlapped: one blocking read at a time, each written to the file
+ * before the next is started.
+ *
+ * Returns the seconds taken, or a negative number on failure.
+ */
+static double BenchBuffered(LPCSTR lpPath, ULONGLONG ullBytes) {
+
+	static char buffer[LOG_BUFFER_SIZE];
+
+	HANDLE hFile = CreateFile(lpPath, FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_DELETE,
+			NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return -1;
+	}
+
+	HANDLE hReadPipe, hWritePipe;
+	if (!CreatePipe(&hReadPipe, &hWritePipe, NULL, LOG_BUFFER_SIZE)) {
+		CloseHandle(hFile);
+		return -1;
+	}
+
+	CRITICAL_SECTION cs;
+	InitializeCriticalSection(&cs);
+
+	BENCH_WRITER writer = { hWritePipe, ullBytes, TRUE };
+
+	LARGE_INTEGER liFrequency, liStart, liEnd;
+	QueryPerformanceFrequency(&liFrequency);
+	QueryPerformanceCounter(&liStart);
+
+	HANDLE hWriter = CreateThread(NULL, 0, BenchWriterThread, &writer, 0, NULL);
+	if (hWriter == NULL) {
+		CloseHandle(hWritePipe);
+	}
+
+	DWORD dwRead;
+	while (ReadFile(hReadPipe, buffer, sizeof(buffer), &dwRead, NULL)) {
+
+		DWORD dwAvailable = 0;
+		PeekNamedPipe(hReadPipe, NULL, 0, NULL, &dwAvailable, NULL);
+
+		EnterCriticalSection(&cs);
+		DWORD dwWritten;
+		WriteFile(hFile, buffer, dwRead, &dwWritten, NULL);
+		LeaveCriticalSection(&cs);
+	}
+
+	if (hWriter != NULL) {
+		WaitForSingleObject(hWriter, INFINITE);
+		CloseHandle(hWriter);
+	}
+
+	QueryPerformanceCounter(&liEnd);
+
+	DeleteCriticalSection(&cs);
+	CloseHandle(hReadPipe);
+	CloseHandle(hFile);
+
+	if (hWriter == NULL) {
+		return -1;
+	}
+
+	double seconds = (double)(liEnd.QuadPart - liStart.QuadPart) / liFrequency.QuadPart;
+	return (seconds > 0) ? seconds : 1e-9;
+}
+
+/**
+ * Time capturing raw output through this module to a log file,
+ * until the reader has written all of it.
+ *
+ * Returns the seconds taken, or a negative number on failure.
+ */
+static double BenchOverlapped(LPCSTR lpPath, ULONGLONG ullBytes) {
+
+	HANDLE hOutput = SrvLogOpen(lpPath, 0, 0, "raw", "SrvWrapBench1");
+	if (hOutput == NULL) {
+		return -1;
+	}
+
+	BENCH_WRITER writer = { hOutput, ullBytes, FALSE };
+
+	LARGE_INTEGER liFrequency, liStart, liEnd;
+	QueryPerformanceFrequency(&liFrequency);
+	QueryPerformanceCounter(&liStart);
+
+	HANDLE hWriter = CreateThread(NULL, 0, BenchWriterThread, &writer, 0, NULL);
+	if (hWriter != NULL) {
+		WaitForSingleObject(hWriter, INFINITE);
+		CloseHandle(hWriter);
+	}
+
+	SrvLogClose(INFINITE);
+
+	QueryPerformanceCounter(&liEnd);
+
+	if (hWriter == NULL) {
+		return -1;
+	}
+
+	double seconds = (double)(liEnd.QuadPart - liStart.QuadPart) / liFrequency.QuadPart;
+	return (seconds > 0) ? seconds : 1e-9;
+}
+
+/**
+ * Write sample lines to a pipe the size of its buffer at a time, as a
+ * busy child would.
+ */
+static DWORD WINAPI BenchWriterThread(LPVOID lpParameter) {
+
+	static const char sample[] =
+			"2017-06-01 12:00:00.000 INFO  [pool-1-thread-3] com.example.Handler - Request 1234 handled in 12 ms\n";
+	static char block[LOG_BUFFER_SIZE];
+
+	BENCH_WRITER* lpWriter = lpParameter;
+
+	DWORD dwBlockLength = 0;
+	while (dwBlockLength + sizeof(sample) - 1 <= sizeof(block)) {
+		memcpy(block + dwBlockLength, sample, sizeof(sample) - 1);
+		dwBlockLength += sizeof(sample) - 1;
+	}
+
+	ULONGLONG ullWritten = 0;
+	while (ullWritten < lpWriter->ullBytes) {
+
+		DWORD dwLength = (lpWriter->ullBytes - ullWritten < dwBlockLength)
+				? (DWORD)(lpWriter->ullBytes - ullWritten) : dwBlockLength;
+
+		DWORD dwWritten;
+		if (!WriteFile(lpWriter->hPipe, block, dwLength, &dwWritten, NULL)) {
+			break;
+		}
+		ullWritten += dwWritten;
+	}
+
+	if (lpWriter->bClose) {
+		CloseHandle(lpWriter->hPipe);
+	}
+
+	return 0;
+}
+
+/**
+ * Copy queried lines into a reply until it is full.
+ */
+static BOOL WriteReply(LPCVOID lpData, DWORD dwLength, LPVOID lpContext) {
+
+	QUERY_REPLY* lpReply = lpContext;
+	DWORD dwRoom = lpReply->dwSize - 1 - lpReply->dwLength;
+
+	if (dwLength > dwRoom) {
+		dwLength = dwRoom;
+	}
+
+	memcpy(lpReply->lpBuffer + lpReply->dwLength, lpData, dwLength);
+	lpReply->dwLength += dwLength;
+
+	return lpReply->dwLength < lpReply->dwSize - 1;
+}
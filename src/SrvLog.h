@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVLOG_H_
+#define SRVLOG_H_
+
+#include <windows.h>
+
+/**
+ * Start capturing child output to a log file.
+ *
+ *	lpPath			is the path to the log file, which is appended to.
+ *
+ *	dwRotateBytes	if not zero rotates the log file when it reaches this size.
+ *
+ *	dwIndexBytes	if not zero indexes the log file by time each time it grows
+ *					by this much.  See SrvLogIndex.h.
+ *
+ *	lpFormat		is "raw", "text" or "json", or NULL for raw.  See SrvLogTransform.h.
+ *
+ *	lpInstance		names the wrapper in text and JSON records.
+ *
+ * Returns an inheritable handle to pass to the child as its standard output,
+ * or NULL on failure.  The handle is owned by this module.
+ */
+HANDLE SrvLogOpen(LPCSTR lpPath, DWORD dwRotateBytes, DWORD dwIndexBytes, LPCSTR lpFormat, LPCSTR lpInstance);
+
+/**
+ * Get the inheritable handle to pass to the child as its standard error.
+ * In raw format this is the standard output handle, so the two stay
+ * interleaved as written; otherwise standard error has its own pipe
+ * so that its records are marked as such.
+ *
+ * Returns NULL if not capturing.
+ */
+HANDLE SrvLogGetErrorHandle(void);
+
+/**
+ * Set the process id recorded in text and JSON records,
+ * after launching a child.
+ */
+void SrvLogSetProcessId(DWORD dwProcessId);
+
+/**
+ * Change the log file path, rotation size, index interval and format while capturing.
+ * A new path is opened before the old file is closed,
+ * so capture continues at the old path if it cannot be opened.
+ * A running child keeps the standard error handle it was launched with.
+ */
+BOOL SrvLogConfigure(LPCSTR lpPath, DWORD dwRotateBytes, DWORD dwIndexBytes, LPCSTR lpFormat);
+
+/**
+ * Limit the rate of each of standard output and standard error to dwRateBytes
+ * a second, with bursts of dwBurstBytes, handling output over the rate by
+ * lpPolicy: "drop", "sample" keeping one record in dwSample, or "summarize".
+ * In raw format both are written to the standard output pipe and so share
+ * its limit.  A rate of 0 removes the limit.  See SrvLogLimit.h.
+ */
+BOOL SrvLogSetLimit(LPCSTR lpPolicy, DWORD dwRateBytes, DWORD dwBurstBytes, DWORD dwSample);
+
+/**
+ * Rename the current log file with a timestamp suffix
+ * and continue capturing to a new, empty log file.
+ */
+BOOL SrvLogRotate(void);
+
+/**
+ * Close and reopen the log file by name, for use after
+ * the file has been renamed by an external tool.
+ */
+BOOL SrvLogReopen(void);
+
+/**
+ * Copy up to dwLines trailing lines of the current log file into a buffer
+ * as a null terminated string, truncated at the front to fit.
+ */
+BOOL SrvLogTail(DWORD dwLines, LPSTR lpBuffer, DWORD dwSize);
+
+/**
+ * Copy the lines logged from lpFrom to lpTo, or to now if lpTo is NULL,
+ * into a buffer as a null terminated string, truncated at the end to fit.
+ * The times are as for SrvLogParseTime().
+ */
+BOOL SrvLogQueryRange(LPCSTR lpFrom, LPCSTR lpTo, LPSTR lpBuffer, DWORD dwSize);
+
+/**
+ * Format the capture counters into a buffer.
+ *
+ * Returns the number of characters written, not including the terminator.
+ */
+DWORD SrvLogFormat(LPSTR lpBuffer, DWORD dwSize);
+
+/**
+ * Time capturing dwMegabytes of raw output written to a pipe as fast as
+ * it will take it, first with one blocking read at a time and then through
+ * this module's overlapped reads, and print the throughput of each to
+ * standard output.  Must be called before capturing is started.
+ *
+ * Returns a process exit code.
+ */
+int SrvLogCaptureBenchmark(DWORD dwMegabytes);
+
+/**
+ * Stop capturing.  Waits up to dwWaitMillis for output still held
+ * by descendants of the child to be drained, then closes the log file.
+ */
+void SrvLogClose(DWORD dwWaitMillis);
+
+#endif /* SRVLOG_H_ */
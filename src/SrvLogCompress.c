@@ -0,0 +1,918 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+#include <compressapi.h>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SrvLogCompress.h"
+#include "SrvLogIndex.h"
+
+#pragma comment(lib, "cabinet.lib")
+
+#define COMPRESSED_MAGIC 0x5A4C5753		// "SWLZ"
+#define COMPRESSED_VERSION 1
+#define BLOCK_SIZE (1024 * 1024)
+#define MAX_BLOCK_SIZE (16 * 1024 * 1024)
+
+#define STAMP_LENGTH 19					// YYYYMMDD-HHMMSS-mmm
+#define TEMP_SUFFIX ".tmp"
+
+#define HOUR_FILETIME (3600ULL * 10000000)
+
+static const struct {
+	LPCSTR lpName;
+	DWORD dwAlgorithm;
+} algorithms[] = {
+	{ "xpress", COMPRESS_ALGORITHM_XPRESS },
+	{ "xpress-huff", COMPRESS_ALGORITHM_XPRESS_HUFF },
+	{ "mszip", COMPRESS_ALGORITHM_MSZIP },
+	{ "lzms", COMPRESS_ALGORITHM_LZMS },
+};
+
+/**
+ * What to do with the rotated logs, copied by the thread before each pass.
+ */
+typedef struct {
+	char logPath[MAX_PATH];				// empty if not capturing
+	DWORD dwAlgorithm;					// 0 not to compress
+	DWORD dwKeep;						// 0 for any number
+	DWORD dwKeepHours;					// 0 for any age
+	ULONGLONG ullKeepBytes;				// 0 for any size
+} COMPRESS_SETTINGS;
+
+/**
+ * A rotated log, named by adding .YYYYMMDD-HHMMSS-mmm to the log path
+ * and, once compressed, the compressed suffix.
+ */
+typedef struct {
+	char suffix[STAMP_LENGTH + sizeof(SRV_LOG_COMPRESSED_SUFFIX)];
+	BOOL bCompressed;
+	ULONGLONG ullSize;
+	FILETIME ftLastWrite;
+} ROTATED_LOG;
+
+/**
+ * Where a block of a compressed log is, in the file and in the log.
+ */
+typedef struct {
+	ULONGLONG ullFileOffset;			// of the stored bytes, after the block header
+	ULONGLONG ullRawOffset;
+	DWORD cbRaw;
+	DWORD cbStored;
+} COMPRESSED_BLOCK;
+
+struct tagSRV_LOG_COMPRESSED_FILE {
+	HANDLE hFile;
+	DECOMPRESSOR_HANDLE hDecompressor;
+	DWORD dwBlockSize;
+	COMPRESSED_BLOCK* lpBlocks;
+	DWORD dwBlocks;
+	ULONGLONG ullSize;					// of the log
+	DWORD dwCachedBlock;				// the block in lpRaw, or MAXDWORD
+	LPBYTE lpRaw;
+	LPBYTE lpStored;
+};
+
+/**
+ * The thread compresses and prunes rotated logs at background priority
+ * whenever woken, so rotating never waits for it.  Compressions are limited
+ * across every service on this computer by a named semaphore, whose count
+ * is set by the first service to create it.
+ */
+static CRITICAL_SECTION csCompress;
+static HANDLE hThread = NULL;
+static HANDLE hWakeEvent = NULL;
+static HANDLE hStopEvent = NULL;
+static HANDLE hSemaphore = NULL;
+
+static COMPRESS_SETTINGS settings;
+
+static DWORD dwFiles = 0;
+static ULONGLONG ullRawBytes = 0;
+static ULONGLONG ullCompressedBytes = 0;
+static ULONGLONG ullCpuMicros = 0;
+static DWORD dwFailures = 0;
+static DWORD dwDeleted = 0;
+
+static void CompressRotatedLogs(void);
+static ROTATED_LOG* FindRotatedLogs(COMPRESS_SETTINGS*, LPDWORD);
+static void PruneRotatedLogs(COMPRESS_SETTINGS*, ROTATED_LOG*, LPDWORD);
+static BOOL CompressRotatedLog(COMPRESS_SETTINGS*, ROTATED_LOG*);
+static void GetRotatedPath(COMPRESS_SETTINGS*, LPCSTR, LPCSTR, LPSTR, DWORD);
+static BOOL IsRotationStamp(LPCSTR);
+static int CompareRotatedLogs(const void*, const void*);
+static ULONGLONG GetThreadCpuTime(void);
+static BOOL LoadBlock(LPSRV_LOG_COMPRESSED_FILE, DWORD);
+static BOOL ReadExactly(HANDLE, LPVOID, DWORD);
+static BOOL WriteExactly(HANDLE, LPCVOID, DWORD);
+static DWORD WINAPI CompressThread(LPVOID);
+
+BOOL SrvLogCompressParseAlgorithm(LPCSTR lpName, LPDWORD pdwAlgorithm) {
+
+	for (DWORD i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++) {
+		if (strcmp(lpName, algorithms[i].lpName) == 0) {
+			*pdwAlgorithm = algorithms[i].dwAlgorithm;
+			return TRUE;
+		}
+	}
+
+	SetLastError(ERROR_BAD_FORMAT);
+	return FALSE;
+}
+
+BOOL SrvLogCompressOpen(void) {
+
+	InitializeCriticalSection(&csCompress);
+
+	hWakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if ((hWakeEvent == NULL) || (hStopEvent == NULL)) {
+		return FALSE;
+	}
+
+	hThread = CreateThread(NULL, 0, CompressThread, NULL, 0, NULL);
+
+	return hThread != NULL;
+}
+
+BOOL SrvLogCompressConfigure(LPSRV_CONFIG lpSrvConfig) {
+
+	if (hThread == NULL) {
+		SetLastError(ERROR_NOT_SUPPORTED);
+		return FALSE;
+	}
+
+	DWORD dwAlgorithm = 0;
+
+	if ((lpSrvConfig->lpOutputLogCompression != NULL)
+			&& !SrvLogCompressParseAlgorithm(lpSrvConfig->lpOutputLogCompression, &dwAlgorithm)) {
+		return FALSE;
+	}
+
+	if ((lpSrvConfig->lpOutputLog != NULL) && (strlen(lpSrvConfig->lpOutputLog) >= sizeof(settings.logPath))) {
+		SetLastError(ERROR_BAD_FORMAT);
+		return FALSE;
+	}
+
+	// Services that cannot share the limit, perhaps for lack of access
+	// to a semaphore another account created, keep one of their own.
+
+	if ((dwAlgorithm != 0) && (hSemaphore == NULL)) {
+
+		LONG lLimit = lpSrvConfig->dwOutputLogCompressLimit;
+
+		hSemaphore = CreateSemaphore(NULL, lLimit, lLimit, "Global\\SrvWrapLogCompress");
+		if (hSemaphore == NULL) {
+			hSemaphore = CreateSemaphore(NULL, lLimit, lLimit, NULL);
+		}
+		if (hSemaphore == NULL) {
+			return FALSE;
+		}
+	}
+
+	EnterCriticalSection(&csCompress);
+
+	strcpy(settings.logPath, (lpSrvConfig->lpOutputLog != NULL) ? lpSrvConfig->lpOutputLog : "");
+	settings.dwAlgorithm = dwAlgorithm;
+	settings.dwKeep = lpSrvConfig->dwOutputLogKeep;
+	settings.dwKeepHours = lpSrvConfig->dwOutputLogKeepHours;
+	settings.ullKeepBytes = (ULONGLONG)lpSrvConfig->dwOutputLogKeepMB * 1024 * 1024;
+
+	LeaveCriticalSection(&csCompress);
+
+	// Logs rotated before a restart are found on the first pass.
+
+	SetEvent(hWakeEvent);
+	return TRUE;
+}
+
+void SrvLogCompressNotify(void) {
+
+	if (hThread != NULL) {
+		SetEvent(hWakeEvent);
+	}
+}
+
+LPSRV_LOG_COMPRESSED_FILE SrvLogCompressedOpen(LPCSTR lpPath) {
+
+	LPSRV_LOG_COMPRESSED_FILE lpFile = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*lpFile));
+
+	if (lpFile == NULL) {
+		SetLastError(ERROR_OUTOFMEMORY);
+		return NULL;
+	}
+
+	lpFile->dwCachedBlock = MAXDWORD;
+	lpFile->hFile = CreateFile(lpPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (lpFile->hFile == INVALID_HANDLE_VALUE) {
+		return SrvLogCompressedClose(lpFile);
+	}
+
+	SRV_LOG_COMPRESSED header;
+
+	if (!ReadExactly(lpFile->hFile, &header, sizeof(header))
+			|| (header.dwMagic != COMPRESSED_MAGIC)
+			|| (header.dwVersion != COMPRESSED_VERSION)
+			|| (header.dwBlockSize == 0)
+			|| (header.dwBlockSize > MAX_BLOCK_SIZE)) {
+		SrvLogCompressedClose(lpFile);
+		SetLastError(ERROR_INVALID_DATA);
+		return NULL;
+	}
+
+	lpFile->dwBlockSize = header.dwBlockSize;
+	lpFile->lpRaw = HeapAlloc(GetProcessHeap(), 0, header.dwBlockSize);
+	lpFile->lpStored = HeapAlloc(GetProcessHeap(), 0, header.dwBlockSize);
+
+	if ((lpFile->lpRaw == NULL) || (lpFile->lpStored == NULL)) {
+		SrvLogCompressedClose(lpFile);
+		SetLastError(ERROR_OUTOFMEMORY);
+		return NULL;
+	}
+
+	if (!CreateDecompressor(header.dwAlgorithm, NULL, &lpFile->hDecompressor)) {
+		return SrvLogCompressedClose(lpFile);
+	}
+
+	// Walk the block headers to map offsets in the log to blocks in the file.
+
+	ULONGLONG ullFileOffset = sizeof(header);
+	DWORD dwCapacity = 0;
+
+	for (;;) {
+
+		SRV_LOG_BLOCK block;
+		DWORD dwRead;
+
+		if (!ReadFile(lpFile->hFile, &block, sizeof(block), &dwRead, NULL)) {
+			return SrvLogCompressedClose(lpFile);
+		}
+
+		if (dwRead == 0) {
+			break;
+		}
+
+		LARGE_INTEGER liSkip;
+		liSkip.QuadPart = block.cbStored;
+
+		if ((dwRead != sizeof(block)) || (block.cbRaw > header.dwBlockSize) || (block.cbStored > block.cbRaw)
+				|| !SetFilePointerEx(lpFile->hFile, liSkip, NULL, FILE_CURRENT)) {
+			SrvLogCompressedClose(lpFile);
+			SetLastError(ERROR_INVALID_DATA);
+			return NULL;
+		}
+
+		if (lpFile->dwBlocks == dwCapacity) {
+			DWORD dwNewCapacity = (dwCapacity == 0) ? 64 : dwCapacity * 2;
+			COMPRESSED_BLOCK* lpGrown = (lpFile->lpBlocks == NULL)
+					? HeapAlloc(GetProcessHeap(), 0, dwNewCapacity * sizeof(COMPRESSED_BLOCK))
+					: HeapReAlloc(GetProcessHeap(), 0, lpFile->lpBlocks, dwNewCapacity * sizeof(COMPRESSED_BLOCK));
+			if (lpGrown == NULL) {
+				SrvLogCompressedClose(lpFile);
+				SetLastError(ERROR_OUTOFMEMORY);
+				return NULL;
+			}
+			lpFile->lpBlocks = lpGrown;
+			dwCapacity = dwNewCapacity;
+		}
+
+		COMPRESSED_BLOCK* lpBlock = &lpFile->lpBlocks[lpFile->dwBlocks++];
+		lpBlock->ullFileOffset = ullFileOffset + sizeof(block);
+		lpBlock->ullRawOffset = lpFile->ullSize;
+		lpBlock->cbRaw = block.cbRaw;
+		lpBlock->cbStored = block.cbStored;
+
+		ullFileOffset += sizeof(block) + block.cbStored;
+		lpFile->ullSize += block.cbRaw;
+	}
+
+	// Reading at an offset past the end is only caught when the data is read.
+
+	LARGE_INTEGER liSize;
+	if (!GetFileSizeEx(lpFile->hFile, &liSize) || ((ULONGLONG)liSize.QuadPart != ullFileOffset)) {
+		SrvLogCompressedClose(lpFile);
+		SetLastError(ERROR_INVALID_DATA);
+		return NULL;
+	}
+
+	return lpFile;
+}
+
+ULONGLONG SrvLogCompressedGetSize(LPSRV_LOG_COMPRESSED_FILE lpFile) {
+	return lpFile->ullSize;
+}
+
+BOOL SrvLogCompressedRead(LPSRV_LOG_COMPRESSED_FILE lpFile, ULONGLONG ullOffset,
+		LPVOID lpBuffer, DWORD dwLength, LPDWORD pdwRead) {
+
+	*pdwRead = 0;
+
+	while ((dwLength > 0) && (ullOffset < lpFile->ullSize)) {
+
+		// Find the last block starting at or before the offset.
+
+		DWORD dwLow = 0;
+		DWORD dwHigh = lpFile->dwBlocks - 1;
+
+		while (dwLow < dwHigh) {
+			DWORD dwMiddle = (dwLow + dwHigh + 1) / 2;
+			if (lpFile->lpBlocks[dwMiddle].ullRawOffset <= ullOffset) {
+				dwLow = dwMiddle;
+			}
+			else {
+				dwHigh = dwMiddle - 1;
+			}
+		}
+
+		if (!LoadBlock(lpFile, dwLow)) {
+			return FALSE;
+		}
+
+		COMPRESSED_BLOCK* lpBlock = &lpFile->lpBlocks[dwLow];
+		DWORD dwSkip = (DWORD)(ullOffset - lpBlock->ullRawOffset);
+		DWORD dwCopy = lpBlock->cbRaw - dwSkip;
+		if (dwCopy > dwLength) {
+			dwCopy = dwLength;
+		}
+
+		memcpy(lpBuffer, lpFile->lpRaw + dwSkip, dwCopy);
+
+		lpBuffer = (LPBYTE)lpBuffer + dwCopy;
+		dwLength -= dwCopy;
+		ullOffset += dwCopy;
+		*pdwRead += dwCopy;
+	}
+
+	return TRUE;
+}
+
+LPSRV_LOG_COMPRESSED_FILE SrvLogCompressedClose(LPSRV_LOG_COMPRESSED_FILE lpFile) {
+
+	DWORD dwLastError = GetLastError();
+
+	if (lpFile->hDecompressor != NULL) {
+		CloseDecompressor(lpFile->hDecompressor);
+	}
+	if (lpFile->hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(lpFile->hFile);
+	}
+	if (lpFile->lpBlocks != NULL) {
+		HeapFree(GetProcessHeap(), 0, lpFile->lpBlocks);
+	}
+	if (lpFile->lpRaw != NULL) {
+		HeapFree(GetProcessHeap(), 0, lpFile->lpRaw);
+	}
+	if (lpFile->lpStored != NULL) {
+		HeapFree(GetProcessHeap(), 0, lpFile->lpStored);
+	}
+	HeapFree(GetProcessHeap(), 0, lpFile);
+
+	SetLastError(dwLastError);
+	return NULL;
+}
+
+BOOL SrvLogDecompress(LPCSTR lpPath, HANDLE hOutput) {
+
+	LPSRV_LOG_COMPRESSED_FILE lpFile = SrvLogCompressedOpen(lpPath);
+
+	if (lpFile == NULL) {
+		return FALSE;
+	}
+
+	BOOL bSuccess = TRUE;
+
+	for (DWORD i = 0; bSuccess && (i < lpFile->dwBlocks); i++) {
+		bSuccess = LoadBlock(lpFile, i) && WriteExactly(hOutput, lpFile->lpRaw, lpFile->lpBlocks[i].cbRaw);
+	}
+
+	SrvLogCompressedClose(lpFile);
+	return bSuccess;
+}
+
+DWORD SrvLogCompressFormat(LPSTR lpBuffer, DWORD dwSize) {
+
+	if (dwSize == 0) {
+		return 0;
+	}
+
+	if (hThread == NULL) {
+		lpBuffer[0] = 0;
+		return 0;
+	}
+
+	EnterCriticalSection(&csCompress);
+
+	int length = _snprintf(lpBuffer, dwSize,
+			"log-compress files=%lu raw=%llu compressed=%llu ratio=%.2f cpu=%llums failed=%lu deleted=%lu\n",
+			dwFiles,
+			ullRawBytes,
+			ullCompressedBytes,
+			(ullCompressedBytes != 0) ? (double)ullRawBytes / ullCompressedBytes : 0.0,
+			ullCpuMicros / 1000,
+			dwFailures,
+			dwDeleted);
+
+	LeaveCriticalSection(&csCompress);
+
+	if ((length < 0) || ((DWORD)length >= dwSize)) {
+		length = dwSize - 1;
+	}
+	lpBuffer[length] = 0;
+
+	return length;
+}
+
+void SrvLogCompressClose(void) {
+
+	if (hThread == NULL) {
+		return;
+	}
+
+	SetEvent(hStopEvent);
+	WaitForSingleObject(hThread, INFINITE);
+
+	CloseHandle(hThread);
+	hThread = NULL;
+
+	CloseHandle(hWakeEvent);
+	hWakeEvent = NULL;
+
+	CloseHandle(hStopEvent);
+	hStopEvent = NULL;
+
+	if (hSemaphore != NULL) {
+		CloseHandle(hSemaphore);
+		hSemaphore = NULL;
+	}
+
+	DeleteCriticalSection(&csCompress);
+}
+
+/**
+ * Delete rotated logs beyond the retention limits, compress the rest,
+ * then apply the size limit again to the compressed sizes.
+ */
+static void CompressRotatedLogs(void) {
+
+	COMPRESS_SETTINGS current;
+
+	EnterCriticalSection(&csCompress);
+	current = settings;
+	LeaveCriticalSection(&csCompress);
+
+	if ((current.logPath[0] == 0)
+			|| ((current.dwAlgorithm == 0) && (current.dwKeep == 0)
+				&& (current.dwKeepHours == 0) && (current.ullKeepBytes == 0))) {
+		return;
+	}
+
+	DWORD dwCount;
+	ROTATED_LOG* lpLogs = FindRotatedLogs(&current, &dwCount);
+
+	if (lpLogs == NULL) {
+		return;
+	}
+
+	PruneRotatedLogs(&current, lpLogs, &dwCount);
+
+	for (DWORD i = 0; (i < dwCount) && (current.dwAlgorithm != 0); i++) {
+
+		if (lpLogs[i].bCompressed) {
+			continue;
+		}
+
+		HANDLE hWait[] = { hStopEvent, hSemaphore };
+		if (WaitForMultipleObjects(2, hWait, FALSE, INFINITE) != WAIT_OBJECT_0 + 1) {
+			break;
+		}
+
+		ULONGLONG ullCpuStart = GetThreadCpuTime();
+		BOOL bSuccess = CompressRotatedLog(&current, &lpLogs[i]);
+		ULONGLONG ullCpu = GetThreadCpuTime() - ullCpuStart;
+
+		ReleaseSemaphore(hSemaphore, 1, NULL);
+
+		EnterCriticalSection(&csCompress);
+		ullCpuMicros += ullCpu / 10;
+		if (!bSuccess && (GetLastError() != ERROR_OPERATION_ABORTED)) {
+			dwFailures++;
+		}
+		LeaveCriticalSection(&csCompress);
+	}
+
+	PruneRotatedLogs(&current, lpLogs, &dwCount);
+
+	HeapFree(GetProcessHeap(), 0, lpLogs);
+}
+
+/**
+ * List the rotated logs, oldest first.  Leftovers of an interrupted
+ * compression are deleted on the way.
+ *
+ * Returns a heap block, or NULL if there are none.
+ */
+static ROTATED_LOG* FindRotatedLogs(COMPRESS_SETTINGS* pSettings, LPDWORD pdwCount) {
+
+	char pattern[MAX_PATH + 2];
+	_snprintf(pattern, sizeof(pattern), "%s.*", pSettings->logPath);
+	pattern[sizeof(pattern) - 1] = 0;
+
+	// FindFirstFile() returns names without the directory.
+
+	LPCSTR lpBaseName = pSettings->logPath;
+	for (LPCSTR p = pSettings->logPath; *p != 0; p++) {
+		if ((*p == '\\') || (*p == '/') || (*p == ':')) {
+			lpBaseName = p + 1;
+		}
+	}
+	DWORD dwBaseLength = (DWORD)strlen(lpBaseName);
+
+	WIN32_FIND_DATA data;
+	HANDLE hFind = FindFirstFile(pattern, &data);
+
+	if (hFind == INVALID_HANDLE_VALUE) {
+		return NULL;
+	}
+
+	ROTATED_LOG* lpLogs = NULL;
+	DWORD dwCount = 0;
+	DWORD dwCapacity = 0;
+
+	do {
+		LPCSTR lpSuffix = data.cFileName + dwBaseLength + 1;
+
+		if ((strlen(data.cFileName) <= dwBaseLength) || !IsRotationStamp(lpSuffix)) {
+			continue;
+		}
+
+		LPCSTR lpTail = lpSuffix + STAMP_LENGTH;
+
+		if (strcmp(lpTail, SRV_LOG_COMPRESSED_SUFFIX TEMP_SUFFIX) == 0) {
+			char path[MAX_PATH * 2];
+			GetRotatedPath(pSettings, lpSuffix, "", path, sizeof(path));
+			DeleteFile(path);
+			continue;
+		}
+
+		if ((lpTail[0] != 0) && (strcmp(lpTail, SRV_LOG_COMPRESSED_SUFFIX) != 0)) {
+			continue;
+		}
+
+		if (dwCount == dwCapacity) {
+			DWORD dwNewCapacity = (dwCapacity == 0) ? 64 : dwCapacity * 2;
+			ROTATED_LOG* lpGrown = (lpLogs == NULL)
+					? HeapAlloc(GetProcessHeap(), 0, dwNewCapacity * sizeof(ROTATED_LOG))
+					: HeapReAlloc(GetProcessHeap(), 0, lpLogs, dwNewCapacity * sizeof(ROTATED_LOG));
+			if (lpGrown == NULL) {
+				break;
+			}
+			lpLogs = lpGrown;
+			dwCapacity = dwNewCapacity;
+		}
+
+		ROTATED_LOG* lpLog = &lpLogs[dwCount++];
+		strcpy(lpLog->suffix, lpSuffix);
+		lpLog->bCompressed = (lpTail[0] != 0);
+		lpLog->ullSize = ((ULONGLONG)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+		lpLog->ftLastWrite = data.ftLastWriteTime;
+
+	} while (FindNextFile(hFind, &data));
+
+	FindClose(hFind);
+
+	if (lpLogs == NULL) {
+		return NULL;
+	}
+
+	qsort(lpLogs, dwCount, sizeof(ROTATED_LOG), CompareRotatedLogs);
+
+	// A log whose compressed file was finished but which was not yet deleted
+	// sorts just before it.
+
+	DWORD dwKept = 0;
+
+	for (DWORD i = 0; i < dwCount; i++) {
+
+		if ((i + 1 < dwCount) && !lpLogs[i].bCompressed && lpLogs[i + 1].bCompressed
+				&& (strncmp(lpLogs[i].suffix, lpLogs[i + 1].suffix, STAMP_LENGTH) == 0)) {
+			char path[MAX_PATH * 2];
+			GetRotatedPath(pSettings, lpLogs[i].suffix, "", path, sizeof(path));
+			DeleteFile(path);
+			continue;
+		}
+
+		lpLogs[dwKept++] = lpLogs[i];
+	}
+
+	*pdwCount = dwKept;
+	return lpLogs;
+}
+
+/**
+ * Delete the oldest rotated logs while there are more than dwKeep, the oldest
+ * is older than dwKeepHours, or together they are larger than ullKeepBytes.
+ */
+static void PruneRotatedLogs(COMPRESS_SETTINGS* pSettings, ROTATED_LOG* lpLogs, LPDWORD pdwCount) {
+
+	ULONGLONG ullTotal = 0;
+	for (DWORD i = 0; i < *pdwCount; i++) {
+		ullTotal += lpLogs[i].ullSize;
+	}
+
+	FILETIME ftNow;
+	GetSystemTimeAsFileTime(&ftNow);
+	ULONGLONG ullNow = ((ULONGLONG)ftNow.dwHighDateTime << 32) | ftNow.dwLowDateTime;
+
+	DWORD dwPruned = 0;
+
+	while (dwPruned < *pdwCount) {
+
+		ROTATED_LOG* lpLog = &lpLogs[dwPruned];
+		ULONGLONG ullWritten = ((ULONGLONG)lpLog->ftLastWrite.dwHighDateTime << 32) | lpLog->ftLastWrite.dwLowDateTime;
+
+		BOOL bPrune = ((pSettings->dwKeep != 0) && (*pdwCount - dwPruned > pSettings->dwKeep))
+				|| ((pSettings->dwKeepHours != 0) && (ullNow - ullWritten > pSettings->dwKeepHours * HOUR_FILETIME))
+				|| ((pSettings->ullKeepBytes != 0) && (ullTotal > pSettings->ullKeepBytes));
+
+		if (!bPrune) {
+			break;
+		}
+
+		char path[MAX_PATH * 2];
+		GetRotatedPath(pSettings, lpLog->suffix, "", path, sizeof(path));
+
+		if (DeleteFile(path)) {
+			EnterCriticalSection(&csCompress);
+			dwDeleted++;
+			LeaveCriticalSection(&csCompress);
+		}
+
+		// The index is named without the compressed suffix.
+
+		_snprintf(path, sizeof(path), "%s.%.*s%s", pSettings->logPath, STAMP_LENGTH, lpLog->suffix, SRV_LOG_INDEX_SUFFIX);
+		path[sizeof(path) - 1] = 0;
+		DeleteFile(path);
+
+		ullTotal -= lpLog->ullSize;
+		dwPruned++;
+	}
+
+	memmove(lpLogs, lpLogs + dwPruned, (*pdwCount - dwPruned) * sizeof(ROTATED_LOG));
+	*pdwCount -= dwPruned;
+}
+
+/**
+ * Compress a rotated log to a temporary file, keeping its last write time,
+ * then move it into place and delete the log.
+ */
+static BOOL CompressRotatedLog(COMPRESS_SETTINGS* pSettings, ROTATED_LOG* lpLog) {
+
+	static BYTE raw[BLOCK_SIZE];
+	static BYTE stored[BLOCK_SIZE];
+
+	char path[MAX_PATH * 2];
+	char tempPath[MAX_PATH * 2];
+	char compressedPath[MAX_PATH * 2];
+	GetRotatedPath(pSettings, lpLog->suffix, "", path, sizeof(path));
+	GetRotatedPath(pSettings, lpLog->suffix, SRV_LOG_COMPRESSED_SUFFIX TEMP_SUFFIX, tempPath, sizeof(tempPath));
+	GetRotatedPath(pSettings, lpLog->suffix, SRV_LOG_COMPRESSED_SUFFIX, compressedPath, sizeof(compressedPath));
+
+	HANDLE hInput = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	if (hInput == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+
+	HANDLE hOutput = CreateFile(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (hOutput == INVALID_HANDLE_VALUE) {
+		DWORD dwLastError = GetLastError();
+		CloseHandle(hInput);
+		SetLastError(dwLastError);
+		return FALSE;
+	}
+
+	COMPRESSOR_HANDLE hCompressor = NULL;
+
+	SRV_LOG_COMPRESSED header;
+	header.dwMagic = COMPRESSED_MAGIC;
+	header.dwVersion = COMPRESSED_VERSION;
+	header.dwAlgorithm = pSettings->dwAlgorithm;
+	header.dwBlockSize = BLOCK_SIZE;
+
+	ULONGLONG ullRaw = 0;
+	ULONGLONG ullCompressed = sizeof(header);
+
+	BOOL bSuccess = CreateCompressor(pSettings->dwAlgorithm, NULL, &hCompressor)
+			&& WriteExactly(hOutput, &header, sizeof(header));
+
+	while (bSuccess) {
+
+		DWORD dwRead;
+		bSuccess = ReadFile(hInput, raw, sizeof(raw), &dwRead, NULL);
+
+		if (!bSuccess || (dwRead == 0)) {
+			break;
+		}
+
+		if (WaitForSingleObject(hStopEvent, 0) == WAIT_OBJECT_0) {
+			SetLastError(ERROR_OPERATION_ABORTED);
+			bSuccess = FALSE;
+			break;
+		}
+
+		// A block compression cannot shrink is stored as it is.
+
+		SRV_LOG_BLOCK block;
+		SIZE_T cbCompressed = 0;
+		block.cbRaw = dwRead;
+
+		BOOL bCompressed = Compress(hCompressor, raw, dwRead, stored, sizeof(stored), &cbCompressed)
+				&& (cbCompressed < dwRead);
+		block.cbStored = bCompressed ? (DWORD)cbCompressed : dwRead;
+
+		bSuccess = WriteExactly(hOutput, &block, sizeof(block))
+				&& WriteExactly(hOutput, bCompressed ? stored : raw, block.cbStored);
+
+		ullRaw += dwRead;
+		ullCompressed += sizeof(block) + block.cbStored;
+	}
+
+	FILETIME ftLastWrite;
+	bSuccess = bSuccess
+			&& GetFileTime(hInput, NULL, NULL, &ftLastWrite)
+			&& SetFileTime(hOutput, NULL, NULL, &ftLastWrite);
+
+	DWORD dwLastError = bSuccess ? NO_ERROR : GetLastError();
+
+	if (hCompressor != NULL) {
+		CloseCompressor(hCompressor);
+	}
+	CloseHandle(hOutput);
+	CloseHandle(hInput);
+
+	if (bSuccess && !MoveFileEx(tempPath, compressedPath, MOVEFILE_REPLACE_EXISTING)) {
+		dwLastError = GetLastError();
+		bSuccess = FALSE;
+	}
+
+	if (!bSuccess) {
+		DeleteFile(tempPath);
+		SetLastError(dwLastError);
+		return FALSE;
+	}
+
+	// If the log cannot be deleted now, the next pass deletes it.
+
+	DeleteFile(path);
+
+	strcat(lpLog->suffix, SRV_LOG_COMPRESSED_SUFFIX);
+	lpLog->bCompressed = TRUE;
+	lpLog->ullSize = ullCompressed;
+
+	EnterCriticalSection(&csCompress);
+	dwFiles++;
+	ullRawBytes += ullRaw;
+	ullCompressedBytes += ullCompressed;
+	LeaveCriticalSection(&csCompress);
+
+	return TRUE;
+}
+
+static void GetRotatedPath(COMPRESS_SETTINGS* pSettings, LPCSTR lpSuffix, LPCSTR lpExtra, LPSTR lpBuffer, DWORD dwSize) {
+
+	_snprintf(lpBuffer, dwSize, "%s.%s%s", pSettings->logPath, lpSuffix, lpExtra);
+	lpBuffer[dwSize - 1] = 0;
+}
+
+/**
+ * Check for the YYYYMMDD-HHMMSS-mmm that rotation adds to the log path.
+ */
+static BOOL IsRotationStamp(LPCSTR lpText) {
+
+	static const char form[] = "DDDDDDDD-DDDDDD-DDD";
+
+	for (DWORD i = 0; i < STAMP_LENGTH; i++) {
+		if ((form[i] == 'D') ? !isdigit((unsigned char)lpText[i]) : (lpText[i] != form[i])) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * Order by rotation time, then a log before its compressed file.
+ */
+static int CompareRotatedLogs(const void* p1, const void* p2) {
+
+	const ROTATED_LOG* lpLog1 = p1;
+	const ROTATED_LOG* lpLog2 = p2;
+
+	int result = strncmp(lpLog1->suffix, lpLog2->suffix, STAMP_LENGTH);
+	return (result != 0) ? result : lpLog1->bCompressed - lpLog2->bCompressed;
+}
+
+/**
+ * Get the CPU time of the calling thread, in 100 ns units.
+ */
+static ULONGLONG GetThreadCpuTime(void) {
+
+	FILETIME ftCreation, ftExit, ftKernel, ftUser;
+
+	if (!GetThreadTimes(GetCurrentThread(), &ftCreation, &ftExit, &ftKernel, &ftUser)) {
+		return 0;
+	}
+
+	return (((ULONGLONG)ftKernel.dwHighDateTime << 32) | ftKernel.dwLowDateTime)
+			+ (((ULONGLONG)ftUser.dwHighDateTime << 32) | ftUser.dwLowDateTime);
+}
+
+/**
+ * Read a block of a compressed log into lpRaw, unless it is there already.
+ */
+static BOOL LoadBlock(LPSRV_LOG_COMPRESSED_FILE lpFile, DWORD dwBlock) {
+
+	if (lpFile->dwCachedBlock == dwBlock) {
+		return TRUE;
+	}
+
+	COMPRESSED_BLOCK* lpBlock = &lpFile->lpBlocks[dwBlock];
+	BOOL bStored = (lpBlock->cbStored == lpBlock->cbRaw);
+
+	OVERLAPPED ov;
+	ZeroMemory(&ov, sizeof(ov));
+	ov.Offset = (DWORD)lpBlock->ullFileOffset;
+	ov.OffsetHigh = (DWORD)(lpBlock->ullFileOffset >> 32);
+
+	DWORD dwRead;
+	if (!ReadFile(lpFile->hFile, bStored ? lpFile->lpRaw : lpFile->lpStored, lpBlock->cbStored, &dwRead, &ov)
+			|| (dwRead != lpBlock->cbStored)) {
+		lpFile->dwCachedBlock = MAXDWORD;
+		SetLastError(ERROR_INVALID_DATA);
+		return FALSE;
+	}
+
+	SIZE_T cbDecompressed;
+	if (!bStored && (!Decompress(lpFile->hDecompressor, lpFile->lpStored, lpBlock->cbStored,
+				lpFile->lpRaw, lpBlock->cbRaw, &cbDecompressed) || (cbDecompressed != lpBlock->cbRaw))) {
+		lpFile->dwCachedBlock = MAXDWORD;
+		SetLastError(ERROR_INVALID_DATA);
+		return FALSE;
+	}
+
+	lpFile->dwCachedBlock = dwBlock;
+	return TRUE;
+}
+
+static BOOL ReadExactly(HANDLE hFile, LPVOID lpBuffer, DWORD dwLength) {
+
+	DWORD dwRead;
+	return ReadFile(hFile, lpBuffer, dwLength, &dwRead, NULL) && (dwRead == dwLength);
+}
+
+static BOOL WriteExactly(HANDLE hFile, LPCVOID lpBuffer, DWORD dwLength) {
+
+	DWORD dwWritten;
+	return WriteFile(hFile, lpBuffer, dwLength, &dwWritten, NULL) && (dwWritten == dwLength);
+}
+
+/**
+ * Compress and prune rotated logs each time woken, until stopped.
+ * Background mode lowers the thread's CPU, I/O and memory priority
+ * so that it does not compete with the child or the log writer.
+ */
+static DWORD WINAPI CompressThread(LPVOID lpParameter) {
+
+	SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+
+	HANDLE hWait[] = { hStopEvent, hWakeEvent };
+
+	while (WaitForMultipleObjects(2, hWait, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+		CompressRotatedLogs();
+	}
+
+	return 0;
+}
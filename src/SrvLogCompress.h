@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVLOGCOMPRESS_H_
+#define SRVLOGCOMPRESS_H_
+
+#include <windows.h>
+
+#include "SrvConfig.h"
+
+/**
+ * A compressed log file is named by adding this to the rotated file's name.
+ * It holds a SRV_LOG_COMPRESSED header, then blocks of at most dwBlockSize
+ * bytes of the log, each a SRV_LOG_BLOCK header and the block compressed,
+ * or stored as is when compressing would not make it smaller.
+ */
+#define SRV_LOG_COMPRESSED_SUFFIX ".swz"
+
+typedef struct tagSRV_LOG_COMPRESSED {
+	DWORD dwMagic;
+	DWORD dwVersion;
+	DWORD dwAlgorithm;					// COMPRESS_ALGORITHM_*
+	DWORD dwBlockSize;
+} SRV_LOG_COMPRESSED;
+
+typedef struct tagSRV_LOG_BLOCK {
+	DWORD cbRaw;
+	DWORD cbStored;						// equal to cbRaw if stored as is
+} SRV_LOG_BLOCK;
+
+/**
+ * Convert "xpress", "xpress-huff", "mszip" or "lzms" to a Compression API algorithm.
+ */
+BOOL SrvLogCompressParseAlgorithm(LPCSTR lpName, LPDWORD pdwAlgorithm);
+
+/**
+ * Create the compression thread's events and join the limit shared
+ * by the services on this computer.
+ */
+BOOL SrvLogCompressOpen(void);
+
+/**
+ * Apply the output log compression and retention settings from a configuration
+ * and look for rotated logs to compress or delete.
+ */
+BOOL SrvLogCompressConfigure(LPSRV_CONFIG lpSrvConfig);
+
+/**
+ * Look again for rotated logs, after a rotation.  Does not wait.
+ */
+void SrvLogCompressNotify(void);
+
+/**
+ * A compressed log opened to read any part of the log it holds.
+ */
+typedef struct tagSRV_LOG_COMPRESSED_FILE* LPSRV_LOG_COMPRESSED_FILE;
+
+/**
+ * Open a compressed log, reading only the block headers.
+ *
+ * Returns NULL if the file cannot be opened or is not a compressed log.
+ */
+LPSRV_LOG_COMPRESSED_FILE SrvLogCompressedOpen(LPCSTR lpPath);
+
+/**
+ * Get the size of the log held in a compressed file.
+ */
+ULONGLONG SrvLogCompressedGetSize(LPSRV_LOG_COMPRESSED_FILE lpFile);
+
+/**
+ * Read part of the log, decompressing only the blocks that hold it.
+ * Fewer bytes are read at the end of the log.
+ */
+BOOL SrvLogCompressedRead(LPSRV_LOG_COMPRESSED_FILE lpFile, ULONGLONG ullOffset,
+		LPVOID lpBuffer, DWORD dwLength, LPDWORD pdwRead);
+
+/**
+ * Close a compressed log.  Keeps the last error.
+ *
+ * Always returns NULL.
+ */
+LPSRV_LOG_COMPRESSED_FILE SrvLogCompressedClose(LPSRV_LOG_COMPRESSED_FILE lpFile);
+
+/**
+ * Write the log held in a compressed file to a handle.
+ */
+BOOL SrvLogDecompress(LPCSTR lpPath, HANDLE hOutput);
+
+/**
+ * Format the compression and retention counters into a buffer.
+ *
+ * Returns the number of characters written, not including the terminator.
+ */
+DWORD SrvLogCompressFormat(LPSTR lpBuffer, DWORD dwSize);
+
+/**
+ * Stop the compression thread, abandoning a file being compressed.
+ */
+void SrvLogCompressClose(void);
+
+#endif /* SRVLOGCOMPRESS_H_ */
@@ -0,0 +1,965 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SrvLogForward.h"
+
+#pragma comment(lib, "ws2_32.lib")
+
+#define SEND_SIZE 65536
+#define MAX_DATAGRAM 65000
+#define PARTIAL_SIZE 4096				// of a raw line held until it ends
+#define HEADER_SIZE 512
+#define MIN_RETRY_MILLIS 1000
+#define MAX_RETRY_MILLIS 30000
+#define SEND_TIMEOUT_MILLIS 5000
+#define TEMP_SUFFIX ".tmp"
+
+#define SYSLOG_FACILITY_USER 1
+#define SYSLOG_SEVERITY_ERROR 3
+#define SYSLOG_SEVERITY_INFO 6
+
+/**
+ * Kinds of target.
+ *
+ *	TARGET_NONE			forwarding is off.
+ *	TARGET_SYSLOG		RFC 5424 messages, one per UDP datagram.
+ *	TARGET_SYSLOG_TCP	RFC 5424 messages over TCP, each ended by a newline.
+ *	TARGET_TCP			the output as written to the log, over TCP.
+ */
+typedef enum tagTARGET_TYPE {
+	TARGET_NONE,
+	TARGET_SYSLOG,
+	TARGET_SYSLOG_TCP,
+	TARGET_TCP
+} TARGET_TYPE;
+
+static const struct {
+	LPCSTR lpPrefix;
+	TARGET_TYPE type;
+} targetTypes[] = {
+	{ "syslog:", TARGET_SYSLOG },
+	{ "syslog-tcp:", TARGET_SYSLOG_TCP },
+	{ "tcp:", TARGET_TCP },
+};
+
+/**
+ * The log writer queues output in a ring buffer while it fits, and in the
+ * spill file once it does not.  Everything queued after the spill file is
+ * started goes to it until the thread has sent all of it, so output is sent
+ * in the order written.  For the syslog targets each line is queued as a
+ * message ended by a newline; the TCP targets send as many as fit in one
+ * write, and UDP sends each as a datagram.  The queue, settings and counters
+ * are only touched while holding csForward; the socket only by the thread.
+ */
+static CRITICAL_SECTION csForward;
+static BOOL bOpen = FALSE;
+static HANDLE hThread = NULL;
+static HANDLE hDataEvent = NULL;
+static HANDLE hStopEvent = NULL;
+static BOOL bWinsockStarted = FALSE;
+static char appName[49];
+static char hostName[256];
+
+// Settings.
+
+static TARGET_TYPE targetType = TARGET_NONE;
+static u_short targetPort = 0;
+static char targetText[64];
+static ULONGLONG ullSpillLimit = 0;
+static BOOL bReconnect = FALSE;
+static BOOL bClosing = FALSE;
+
+// Queue.
+
+static LPBYTE lpRing = NULL;
+static DWORD dwRingSize = 0;
+static DWORD dwRingStart = 0;
+static DWORD dwRingLength = 0;
+static char spillPath[MAX_PATH + sizeof(SRV_LOG_FORWARD_SPILL_SUFFIX)];
+static HANDLE hSpill = INVALID_HANDLE_VALUE;
+static BOOL bSpilling = FALSE;
+static ULONGLONG ullSpillSize = 0;
+static ULONGLONG ullSpillSent = 0;
+static char partial[2][PARTIAL_SIZE];
+static DWORD dwPartial[2] = { 0, 0 };
+
+// Counters.
+
+static ULONGLONG ullSentBytes = 0;
+static ULONGLONG ullSentRecords = 0;
+static ULONGLONG ullBatches = 0;
+static ULONGLONG ullSpilledBytes = 0;
+static ULONGLONG ullDropped = 0;
+static DWORD dwConnects = 0;
+static DWORD dwFailures = 0;
+
+// The thread's connection.
+
+static SOCKET sendSocket = INVALID_SOCKET;
+static char sendBuffer[SEND_SIZE];
+
+static BOOL ParseTarget(LPCSTR, TARGET_TYPE*, u_short*);
+static BOOL StartThread(void);
+static void QueueSyslog(BOOL, DWORD, LPCSTR, DWORD);
+static DWORD FormatHeader(BOOL, DWORD, LPSTR);
+static void Queue(LPCVOID*, const DWORD*, DWORD, DWORD);
+static BOOL OpenSpill(void);
+static DWORD TakeChunk(BOOL*, TARGET_TYPE*, u_short*);
+static BOOL SendQueued(void);
+static BOOL SendChunk(TARGET_TYPE, DWORD, LPDWORD);
+static BOOL Connect(TARGET_TYPE, u_short);
+static void Disconnect(void);
+static void SaveQueue(void);
+static DWORD CountLines(LPCSTR, DWORD);
+static DWORD WINAPI ForwardThread(LPVOID);
+
+BOOL SrvLogForwardParseTarget(LPCSTR lpTarget) {
+
+	TARGET_TYPE type;
+	u_short port;
+
+	return ParseTarget(lpTarget, &type, &port);
+}
+
+BOOL SrvLogForwardOpen(LPCSTR lpServiceName) {
+
+	InitializeCriticalSection(&csForward);
+	bOpen = TRUE;
+
+	strcpy(targetText, "none");
+
+	// APP-NAME is at most 48 printable characters.
+
+	DWORD i;
+	for (i = 0; (i < sizeof(appName) - 1) && (lpServiceName[i] != 0); i++) {
+		appName[i] = ((lpServiceName[i] > ' ') && (lpServiceName[i] < 127)) ? lpServiceName[i] : '_';
+	}
+	appName[i] = 0;
+
+	return TRUE;
+}
+
+BOOL SrvLogForwardConfigure(LPSRV_CONFIG lpSrvConfig) {
+
+	if (!bOpen) {
+		SetLastError(ERROR_NOT_SUPPORTED);
+		return FALSE;
+	}
+
+	TARGET_TYPE type = TARGET_NONE;
+	u_short port = 0;
+
+	if ((lpSrvConfig->lpOutputLogForward != NULL) && !ParseTarget(lpSrvConfig->lpOutputLogForward, &type, &port)) {
+		return FALSE;
+	}
+
+	if ((lpSrvConfig->lpOutputLog != NULL) && (strlen(lpSrvConfig->lpOutputLog) >= MAX_PATH)) {
+		SetLastError(ERROR_BAD_FORMAT);
+		return FALSE;
+	}
+
+	// Winsock and the thread are started by the first target.
+
+	if ((type != TARGET_NONE) && (hThread == NULL) && !StartThread()) {
+		return FALSE;
+	}
+
+	EnterCriticalSection(&csForward);
+
+	if ((type != TARGET_NONE) && (lpRing == NULL)) {
+
+		DWORD dwSize = lpSrvConfig->dwOutputLogForwardBufferKB * 1024;
+		if (dwSize < SEND_SIZE) {
+			dwSize = SEND_SIZE;
+		}
+
+		lpRing = HeapAlloc(GetProcessHeap(), 0, dwSize);
+		if (lpRing == NULL) {
+			LeaveCriticalSection(&csForward);
+			SetLastError(ERROR_OUTOFMEMORY);
+			return FALSE;
+		}
+		dwRingSize = dwSize;
+	}
+
+	if ((type != targetType) || (port != targetPort)) {
+		bReconnect = TRUE;
+	}
+
+	targetType = type;
+	targetPort = port;
+	_snprintf(targetText, sizeof(targetText), "%s", (type != TARGET_NONE) ? lpSrvConfig->lpOutputLogForward : "none");
+	targetText[sizeof(targetText) - 1] = 0;
+	ullSpillLimit = (ULONGLONG)lpSrvConfig->dwOutputLogForwardSpillMB * 1024 * 1024;
+
+	// Output left in the spill file by the last run is sent first.
+	// A spill file being sent keeps its path until it is done.
+
+	if (!bSpilling) {
+
+		if (lpSrvConfig->lpOutputLog != NULL) {
+			_snprintf(spillPath, sizeof(spillPath), "%s%s", lpSrvConfig->lpOutputLog, SRV_LOG_FORWARD_SPILL_SUFFIX);
+			spillPath[sizeof(spillPath) - 1] = 0;
+		}
+		else {
+			spillPath[0] = 0;
+		}
+
+		WIN32_FILE_ATTRIBUTE_DATA data;
+
+		if ((type != TARGET_NONE) && (spillPath[0] != 0)
+				&& GetFileAttributesEx(spillPath, GetFileExInfoStandard, &data)
+				&& ((data.nFileSizeHigh != 0) || (data.nFileSizeLow != 0))
+				&& OpenSpill()) {
+			ullSpillSize = ((ULONGLONG)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+			ullSpillSent = 0;
+			bSpilling = TRUE;
+		}
+	}
+
+	LeaveCriticalSection(&csForward);
+
+	if (hDataEvent != NULL) {
+		SetEvent(hDataEvent);
+	}
+	return TRUE;
+}
+
+void SrvLogForwardWrite(BOOL bError, DWORD dwProcessId, LPCVOID lpData, DWORD dwLength) {
+
+	if (!bOpen) {
+		return;
+	}
+
+	EnterCriticalSection(&csForward);
+
+	if (targetType == TARGET_NONE) {
+		LeaveCriticalSection(&csForward);
+		return;
+	}
+
+	if (targetType == TARGET_TCP) {
+		LPCVOID parts[1] = { lpData };
+		DWORD lengths[1] = { dwLength };
+		Queue(parts, lengths, 1, CountLines(lpData, dwLength));
+	}
+	else {
+		QueueSyslog(bError, dwProcessId, lpData, dwLength);
+	}
+
+	LeaveCriticalSection(&csForward);
+
+	SetEvent(hDataEvent);
+}
+
+DWORD SrvLogForwardFormat(LPSTR lpBuffer, DWORD dwSize) {
+
+	if (dwSize == 0) {
+		return 0;
+	}
+
+	if (!bOpen) {
+		lpBuffer[0] = 0;
+		return 0;
+	}
+
+	EnterCriticalSection(&csForward);
+
+	int length = _snprintf(lpBuffer, dwSize,
+			"log-forward target=%s sent-bytes=%llu sent-records=%llu batches=%llu buffered=%lu"
+			" spilled=%llu spill-pending=%llu dropped=%llu connects=%lu failures=%lu\n",
+			targetText, ullSentBytes, ullSentRecords, ullBatches, dwRingLength,
+			ullSpilledBytes, ullSpillSize - ullSpillSent, ullDropped, dwConnects, dwFailures);
+
+	LeaveCriticalSection(&csForward);
+
+	if ((length < 0) || ((DWORD)length >= dwSize)) {
+		length = dwSize - 1;
+	}
+	lpBuffer[length] = 0;
+
+	return length;
+}
+
+void SrvLogForwardClose(DWORD dwWaitMillis) {
+
+	if (hThread != NULL) {
+
+		EnterCriticalSection(&csForward);
+		bClosing = TRUE;
+		LeaveCriticalSection(&csForward);
+
+		SetEvent(hDataEvent);
+
+		// A send to a collector that stopped reading times out.
+
+		if (WaitForSingleObject(hThread, dwWaitMillis) != WAIT_OBJECT_0) {
+			SetEvent(hStopEvent);
+			WaitForSingleObject(hThread, INFINITE);
+		}
+
+		CloseHandle(hThread);
+		hThread = NULL;
+
+		Disconnect();
+		SaveQueue();
+	}
+
+	if (bOpen) {
+
+		if (lpRing != NULL) {
+			HeapFree(GetProcessHeap(), 0, lpRing);
+			lpRing = NULL;
+		}
+
+		DeleteCriticalSection(&csForward);
+		bOpen = FALSE;
+	}
+
+	if (hDataEvent != NULL) {
+		CloseHandle(hDataEvent);
+		hDataEvent = NULL;
+	}
+
+	if (hStopEvent != NULL) {
+		CloseHandle(hStopEvent);
+		hStopEvent = NULL;
+	}
+
+	if (bWinsockStarted) {
+		WSACleanup();
+		bWinsockStarted = FALSE;
+	}
+}
+
+/**
+ * Parse "syslog:port", "syslog-tcp:port" or "tcp:port".
+ */
+static BOOL ParseTarget(LPCSTR lpTarget, TARGET_TYPE* pType, u_short* pPort) {
+
+	for (DWORD i = 0; i < sizeof(targetTypes) / sizeof(targetTypes[0]); i++) {
+
+		SIZE_T length = strlen(targetTypes[i].lpPrefix);
+
+		if (strncmp(lpTarget, targetTypes[i].lpPrefix, length) == 0) {
+
+			char* lpEnd;
+			unsigned long port = strtoul(lpTarget + length, &lpEnd, 10);
+
+			if ((lpEnd == lpTarget + length) || (*lpEnd != 0) || (port == 0) || (port > 65535)) {
+				break;
+			}
+
+			*pType = targetTypes[i].type;
+			*pPort = (u_short)port;
+			return TRUE;
+		}
+	}
+
+	SetLastError(ERROR_BAD_FORMAT);
+	return FALSE;
+}
+
+/**
+ * Start Winsock and the sending thread.
+ */
+static BOOL StartThread(void) {
+
+	if (!bWinsockStarted) {
+
+		WSADATA wsaData;
+		int error = WSAStartup(MAKEWORD(2, 2), &wsaData);
+		if (error != 0) {
+			SetLastError(error);
+			return FALSE;
+		}
+		bWinsockStarted = TRUE;
+
+		if (gethostname(hostName, sizeof(hostName)) != 0) {
+			strcpy(hostName, "-");
+		}
+	}
+
+	if (hDataEvent == NULL) {
+		hDataEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	}
+	if (hStopEvent == NULL) {
+		hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	}
+
+	if ((hDataEvent == NULL) || (hStopEvent == NULL)) {
+		return FALSE;
+	}
+
+	hThread = CreateThread(NULL, 0, ForwardThread, NULL, 0, NULL);
+
+	return hThread != NULL;
+}
+
+/**
+ * Queue each line as an RFC 5424 message.  A raw line split across writes
+ * is held until it ends, or until it is too long to hold.
+ */
+static void QueueSyslog(BOOL bError, DWORD dwProcessId, LPCSTR lpData, DWORD dwLength) {
+
+	static const char newline[] = "\n";
+
+	char header[HEADER_SIZE];
+	DWORD dwHeader = FormatHeader(bError, dwProcessId, header);
+	DWORD i = bError ? 1 : 0;
+
+	while (dwLength > 0) {
+
+		LPCSTR lpNewline = memchr(lpData, '\n', dwLength);
+
+		if (lpNewline == NULL) {
+
+			DWORD dwCopy = sizeof(partial[i]) - dwPartial[i];
+			if (dwCopy > dwLength) {
+				dwCopy = dwLength;
+			}
+
+			memcpy(partial[i] + dwPartial[i], lpData, dwCopy);
+			dwPartial[i] += dwCopy;
+			lpData += dwCopy;
+			dwLength -= dwCopy;
+
+			if (dwPartial[i] == sizeof(partial[i])) {
+				LPCVOID parts[3] = { header, partial[i], newline };
+				DWORD lengths[3] = { dwHeader, dwPartial[i], 1 };
+				Queue(parts, lengths, 3, 1);
+				dwPartial[i] = 0;
+			}
+			continue;
+		}
+
+		DWORD dwLineLength = (DWORD)(lpNewline - lpData);
+		DWORD dwNext = dwLineLength + 1;
+
+		if ((dwLineLength > 0) && (lpData[dwLineLength - 1] == '\r')) {
+			dwLineLength--;
+		}
+
+		if (dwPartial[i] + dwLineLength > 0) {
+			LPCVOID parts[4] = { header, partial[i], lpData, newline };
+			DWORD lengths[4] = { dwHeader, dwPartial[i], dwLineLength, 1 };
+			Queue(parts, lengths, 4, 1);
+			dwPartial[i] = 0;
+		}
+
+		lpData += dwNext;
+		dwLength -= dwNext;
+	}
+}
+
+/**
+ * Format the part of an RFC 5424 message before the text:
+ *
+ *	<14>1 2017-06-01T12:00:00.123456Z host orders3 1234 - -
+ */
+static DWORD FormatHeader(BOOL bError, DWORD dwProcessId, LPSTR lpHeader) {
+
+	FILETIME ft;
+	GetSystemTimePreciseAsFileTime(&ft);
+
+	SYSTEMTIME st;
+	FileTimeToSystemTime(&ft, &st);
+
+	ULARGE_INTEGER uli;
+	uli.LowPart = ft.dwLowDateTime;
+	uli.HighPart = ft.dwHighDateTime;
+
+	char procId[16];
+	if (dwProcessId != 0) {
+		_snprintf(procId, sizeof(procId), "%lu", dwProcessId);
+	}
+	else {
+		strcpy(procId, "-");
+	}
+
+	int length = _snprintf(lpHeader, HEADER_SIZE, "<%u>1 %04u-%02u-%02uT%02u:%02u:%02u.%06luZ %s %s %s - - ",
+			SYSLOG_FACILITY_USER * 8 + (bError ? SYSLOG_SEVERITY_ERROR : SYSLOG_SEVERITY_INFO),
+			st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond,
+			(DWORD)((uli.QuadPart % 10000000) / 10),
+			hostName, appName, procId);
+
+	if ((length < 0) || (length >= HEADER_SIZE)) {
+		length = HEADER_SIZE - 1;
+	}
+
+	return length;
+}
+
+/**
+ * Queue the parts of one unit of output, holding dwRecords records,
+ * in the ring buffer, the spill file, or neither.
+ */
+static void Queue(LPCVOID* lpParts, const DWORD* lpLengths, DWORD dwParts, DWORD dwRecords) {
+
+	DWORD dwTotal = 0;
+	for (DWORD i = 0; i < dwParts; i++) {
+		dwTotal += lpLengths[i];
+	}
+
+	if (!bSpilling && (dwRingSize - dwRingLength >= dwTotal)) {
+
+		for (DWORD i = 0; i < dwParts; i++) {
+
+			DWORD dwEnd = (dwRingStart + dwRingLength) % dwRingSize;
+			DWORD dwFirst = dwRingSize - dwEnd;
+			if (dwFirst > lpLengths[i]) {
+				dwFirst = lpLengths[i];
+			}
+
+			memcpy(lpRing + dwEnd, lpParts[i], dwFirst);
+			memcpy(lpRing, (const BYTE*)lpParts[i] + dwFirst, lpLengths[i] - dwFirst);
+			dwRingLength += lpLengths[i];
+		}
+		return;
+	}
+
+	if ((ullSpillSize + dwTotal <= ullSpillLimit) && OpenSpill()) {
+
+		ULONGLONG ullOffset = ullSpillSize;
+		BOOL bWritten = TRUE;
+
+		for (DWORD i = 0; bWritten && (i < dwParts); i++) {
+
+			OVERLAPPED ov;
+			ZeroMemory(&ov, sizeof(ov));
+			ov.Offset = (DWORD)ullOffset;
+			ov.OffsetHigh = (DWORD)(ullOffset >> 32);
+
+			DWORD dwWritten;
+			bWritten = WriteFile(hSpill, lpParts[i], lpLengths[i], &dwWritten, &ov) && (dwWritten == lpLengths[i]);
+			ullOffset += lpLengths[i];
+		}
+
+		if (bWritten) {
+			ullSpillSize = ullOffset;
+			ullSpilledBytes += dwTotal;
+			bSpilling = TRUE;
+			return;
+		}
+	}
+
+	ullDropped += dwRecords;
+}
+
+static BOOL OpenSpill(void) {
+
+	if (hSpill != INVALID_HANDLE_VALUE) {
+		return TRUE;
+	}
+
+	if (spillPath[0] == 0) {
+		return FALSE;
+	}
+
+	hSpill = CreateFile(spillPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+			NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	return hSpill != INVALID_HANDLE_VALUE;
+}
+
+/**
+ * Copy the oldest queued output into the send buffer, first from the
+ * ring buffer and then from the spill file, deleting the spill file
+ * once all of it has been sent.  Must be called holding csForward.
+ *
+ * Returns the number of bytes copied, 0 if there is nothing to send.
+ */
+static DWORD TakeChunk(BOOL* pbFromSpill, TARGET_TYPE* pType, u_short* pPort) {
+
+	*pType = targetType;
+	*pPort = targetPort;
+
+	if (targetType == TARGET_NONE) {
+		return 0;
+	}
+
+	if (dwRingLength > 0) {
+
+		DWORD dwLength = (dwRingLength < sizeof(sendBuffer)) ? dwRingLength : sizeof(sendBuffer);
+		DWORD dwFirst = dwRingSize - dwRingStart;
+		if (dwFirst > dwLength) {
+			dwFirst = dwLength;
+		}
+
+		memcpy(sendBuffer, lpRing + dwRingStart, dwFirst);
+		memcpy(sendBuffer + dwFirst, lpRing, dwLength - dwFirst);
+
+		*pbFromSpill = FALSE;
+		return dwLength;
+	}
+
+	if (!bSpilling) {
+		return 0;
+	}
+
+	if (ullSpillSent < ullSpillSize) {
+
+		ULONGLONG ullLeft = ullSpillSize - ullSpillSent;
+		DWORD dwLength = (ullLeft < sizeof(sendBuffer)) ? (DWORD)ullLeft : sizeof(sendBuffer);
+
+		OVERLAPPED ov;
+		ZeroMemory(&ov, sizeof(ov));
+		ov.Offset = (DWORD)ullSpillSent;
+		ov.OffsetHigh = (DWORD)(ullSpillSent >> 32);
+
+		DWORD dwRead;
+		if (!ReadFile(hSpill, sendBuffer, dwLength, &dwRead, &ov) || (dwRead == 0)) {
+
+			// Give up on the rest of a spill file that cannot be read.
+
+			ullSpillSent = ullSpillSize;
+			return 0;
+		}
+
+		*pbFromSpill = TRUE;
+		return dwRead;
+	}
+
+	CloseHandle(hSpill);
+	hSpill = INVALID_HANDLE_VALUE;
+	DeleteFile(spillPath);
+
+	bSpilling = FALSE;
+	ullSpillSize = 0;
+	ullSpillSent = 0;
+
+	return 0;
+}
+
+/**
+ * Send queued output until none is left, or until told to stop, which
+ * leaves the rest for SaveQueue() so that a slow collector cannot hold
+ * up closing.
+ *
+ * Returns FALSE if the collector could not be reached, leaving the rest queued.
+ */
+static BOOL SendQueued(void) {
+
+	for (;;) {
+
+		BOOL bFromSpill = FALSE;
+		TARGET_TYPE type;
+		u_short port;
+
+		if (WaitForSingleObject(hStopEvent, 0) == WAIT_OBJECT_0) {
+			return TRUE;
+		}
+
+		EnterCriticalSection(&csForward);
+
+		BOOL bChanged = bReconnect;
+		bReconnect = FALSE;
+		DWORD dwLength = TakeChunk(&bFromSpill, &type, &port);
+
+		LeaveCriticalSection(&csForward);
+
+		if (bChanged) {
+			Disconnect();
+		}
+
+		if (dwLength == 0) {
+			return TRUE;
+		}
+
+		if ((sendSocket == INVALID_SOCKET) && !Connect(type, port)) {
+			EnterCriticalSection(&csForward);
+			dwFailures++;
+			LeaveCriticalSection(&csForward);
+			return FALSE;
+		}
+
+		DWORD dwSent = 0;
+		BOOL bSuccess = SendChunk(type, dwLength, &dwSent);
+
+		// What was sent is done with even if the rest was not.
+
+		EnterCriticalSection(&csForward);
+
+		if (bFromSpill) {
+			ullSpillSent += dwSent;
+		}
+		else {
+			dwRingStart = (dwRingStart + dwSent) % dwRingSize;
+			dwRingLength -= dwSent;
+		}
+
+		ullSentBytes += dwSent;
+		ullSentRecords += CountLines(sendBuffer, dwSent);
+
+		if (!bSuccess) {
+			dwFailures++;
+		}
+
+		LeaveCriticalSection(&csForward);
+
+		if (!bSuccess) {
+			Disconnect();
+			return FALSE;
+		}
+	}
+}
+
+/**
+ * Send the send buffer, over TCP in one write, or over UDP a datagram
+ * for each message.  A message too long for a datagram is cut short.
+ * Over UDP only whole messages are sent, unless one fills the buffer.
+ */
+static BOOL SendChunk(TARGET_TYPE type, DWORD dwLength, LPDWORD pdwSent) {
+
+	if (type != TARGET_SYSLOG) {
+
+		while (*pdwSent < dwLength) {
+
+			int sent = send(sendSocket, sendBuffer + *pdwSent, dwLength - *pdwSent, 0);
+			if (sent == SOCKET_ERROR) {
+				return FALSE;
+			}
+
+			*pdwSent += sent;
+		}
+
+		EnterCriticalSection(&csForward);
+		ullBatches++;
+		LeaveCriticalSection(&csForward);
+
+		return TRUE;
+	}
+
+	DWORD dwDatagrams = 0;
+	BOOL bSuccess = TRUE;
+
+	while (*pdwSent < dwLength) {
+
+		LPCSTR lpMessage = sendBuffer + *pdwSent;
+		DWORD dwLeft = dwLength - *pdwSent;
+		LPCSTR lpNewline = memchr(lpMessage, '\n', dwLeft);
+
+		DWORD dwMessageLength;
+		DWORD dwNext;
+
+		if (lpNewline != NULL) {
+			dwMessageLength = (DWORD)(lpNewline - lpMessage);
+			dwNext = dwMessageLength + 1;
+		}
+		else if ((*pdwSent == 0) && (dwLength == sizeof(sendBuffer))) {
+			dwMessageLength = dwLeft;
+			dwNext = dwLeft;
+		}
+		else {
+			break;
+		}
+
+		if (dwMessageLength > MAX_DATAGRAM) {
+			dwMessageLength = MAX_DATAGRAM;
+		}
+
+		if (send(sendSocket, lpMessage, dwMessageLength, 0) == SOCKET_ERROR) {
+			bSuccess = FALSE;
+			break;
+		}
+
+		*pdwSent += dwNext;
+		dwDatagrams++;
+	}
+
+	EnterCriticalSection(&csForward);
+	ullBatches += dwDatagrams;
+	LeaveCriticalSection(&csForward);
+
+	return bSuccess;
+}
+
+/**
+ * Connect to the collector on this computer.  A UDP socket is connected
+ * too, so that an unreachable port is reported by a later send.
+ */
+static BOOL Connect(TARGET_TYPE type, u_short port) {
+
+	BOOL bDatagram = (type == TARGET_SYSLOG);
+
+	sendSocket = socket(AF_INET, bDatagram ? SOCK_DGRAM : SOCK_STREAM, bDatagram ? IPPROTO_UDP : IPPROTO_TCP);
+	if (sendSocket == INVALID_SOCKET) {
+		return FALSE;
+	}
+
+	DWORD dwTimeout = SEND_TIMEOUT_MILLIS;
+	setsockopt(sendSocket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&dwTimeout, sizeof(dwTimeout));
+
+	struct sockaddr_in address;
+	ZeroMemory(&address, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+
+	if (connect(sendSocket, (struct sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+		Disconnect();
+		return FALSE;
+	}
+
+	EnterCriticalSection(&csForward);
+	dwConnects++;
+	LeaveCriticalSection(&csForward);
+
+	return TRUE;
+}
+
+static void Disconnect(void) {
+
+	if (sendSocket != INVALID_SOCKET) {
+		closesocket(sendSocket);
+		sendSocket = INVALID_SOCKET;
+	}
+}
+
+/**
+ * Keep what is still queued in the spill file, the ring buffer first,
+ * leaving out what was already sent from the spill file.
+ */
+static void SaveQueue(void) {
+
+	if ((dwRingLength == 0) && (ullSpillSent == 0)) {
+		if (hSpill != INVALID_HANDLE_VALUE) {
+			CloseHandle(hSpill);
+			hSpill = INVALID_HANDLE_VALUE;
+		}
+		return;
+	}
+
+	if (spillPath[0] == 0) {
+		return;
+	}
+
+	char tempPath[sizeof(spillPath) + sizeof(TEMP_SUFFIX)];
+	_snprintf(tempPath, sizeof(tempPath), "%s%s", spillPath, TEMP_SUFFIX);
+	tempPath[sizeof(tempPath) - 1] = 0;
+
+	HANDLE hTemp = CreateFile(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hTemp == INVALID_HANDLE_VALUE) {
+		return;
+	}
+
+	DWORD dwFirst = dwRingSize - dwRingStart;
+	if (dwFirst > dwRingLength) {
+		dwFirst = dwRingLength;
+	}
+
+	DWORD dwWritten;
+	BOOL bSuccess = WriteFile(hTemp, lpRing + dwRingStart, dwFirst, &dwWritten, NULL)
+			&& WriteFile(hTemp, lpRing, dwRingLength - dwFirst, &dwWritten, NULL);
+
+	while (bSuccess && bSpilling && (ullSpillSent < ullSpillSize)) {
+
+		OVERLAPPED ov;
+		ZeroMemory(&ov, sizeof(ov));
+		ov.Offset = (DWORD)ullSpillSent;
+		ov.OffsetHigh = (DWORD)(ullSpillSent >> 32);
+
+		DWORD dwRead;
+		bSuccess = ReadFile(hSpill, sendBuffer, sizeof(sendBuffer), &dwRead, &ov) && (dwRead > 0)
+				&& WriteFile(hTemp, sendBuffer, dwRead, &dwWritten, NULL);
+		ullSpillSent += dwRead;
+	}
+
+	CloseHandle(hTemp);
+
+	if (hSpill != INVALID_HANDLE_VALUE) {
+		CloseHandle(hSpill);
+		hSpill = INVALID_HANDLE_VALUE;
+	}
+
+	if (bSuccess) {
+		MoveFileEx(tempPath, spillPath, MOVEFILE_REPLACE_EXISTING);
+	}
+	else {
+		DeleteFile(tempPath);
+	}
+}
+
+static DWORD CountLines(LPCSTR lpData, DWORD dwLength) {
+
+	DWORD dwLines = 0;
+	LPCSTR lpEnd = lpData + dwLength;
+
+	while ((lpData < lpEnd) && ((lpData = memchr(lpData, '\n', lpEnd - lpData)) != NULL)) {
+		lpData++;
+		dwLines++;
+	}
+
+	return dwLines;
+}
+
+/**
+ * Send queued output as it is written, retrying a collector that cannot
+ * be reached after a delay that doubles up to a limit.  When closing,
+ * makes one last attempt and exits.
+ */
+static DWORD WINAPI ForwardThread(LPVOID lpParameter) {
+
+	HANDLE handles[2] = { hStopEvent, hDataEvent };
+	ULONGLONG ullRetryTick = 0;
+	DWORD dwRetryMillis = MIN_RETRY_MILLIS;
+
+	for (;;) {
+
+		DWORD dwTimeout = INFINITE;
+
+		if (ullRetryTick != 0) {
+			ULONGLONG ullNow = GetTickCount64();
+			dwTimeout = (ullRetryTick > ullNow) ? (DWORD)(ullRetryTick - ullNow) : 0;
+		}
+
+		if (WaitForMultipleObjects(2, handles, FALSE, dwTimeout) == WAIT_OBJECT_0) {
+			break;
+		}
+
+		EnterCriticalSection(&csForward);
+		BOOL bLast = bClosing;
+		LeaveCriticalSection(&csForward);
+
+		// Output written while waiting to retry waits too.
+
+		if (!bLast && (ullRetryTick != 0) && (GetTickCount64() < ullRetryTick)) {
+			continue;
+		}
+
+		if (SendQueued()) {
+			ullRetryTick = 0;
+			dwRetryMillis = MIN_RETRY_MILLIS;
+		}
+		else {
+			ullRetryTick = GetTickCount64() + dwRetryMillis;
+			dwRetryMillis = (dwRetryMillis * 2 < MAX_RETRY_MILLIS) ? dwRetryMillis * 2 : MAX_RETRY_MILLIS;
+		}
+
+		if (bLast) {
+			break;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVLOGFORWARD_H_
+#define SRVLOGFORWARD_H_
+
+#include <windows.h>
+
+#include "SrvConfig.h"
+
+/**
+ * Records not yet sent when the collector cannot be reached are kept in a file
+ * named by adding this to the output log's name, and sent when it can.
+ */
+#define SRV_LOG_FORWARD_SPILL_SUFFIX ".fwd"
+
+/**
+ * Check a forwarding target: "syslog:port", "syslog-tcp:port" or "tcp:port".
+ */
+BOOL SrvLogForwardParseTarget(LPCSTR lpTarget);
+
+/**
+ * Prepare to forward output.  lpServiceName is the APP-NAME of syslog
+ * messages.  Winsock and the sending thread are not started until
+ * SrvLogForwardConfigure() is given a target.
+ */
+BOOL SrvLogForwardOpen(LPCSTR lpServiceName);
+
+/**
+ * Apply the forwarding target and buffer limits from a configuration,
+ * starting Winsock and the sending thread for the first target.
+ * A new target is connected to for the records still buffered.
+ * The memory buffer keeps the size it was first given until a restart.
+ */
+BOOL SrvLogForwardConfigure(LPSRV_CONFIG lpSrvConfig);
+
+/**
+ * Queue output written to the log for forwarding.  Never waits for the
+ * collector: records that do not fit the memory buffer go to the spill
+ * file, and those that do not fit there are dropped and counted.
+ * Lines of standard error are sent at syslog severity error, others
+ * at informational.
+ */
+void SrvLogForwardWrite(BOOL bError, DWORD dwProcessId, LPCVOID lpData, DWORD dwLength);
+
+/**
+ * Format the forwarding counters into a buffer.
+ *
+ * Returns the number of characters written, not including the terminator.
+ */
+DWORD SrvLogForwardFormat(LPSTR lpBuffer, DWORD dwSize);
+
+/**
+ * Stop the sending thread, giving it dwWaitMillis to send what is buffered,
+ * and keep anything left in the spill file for the next start.
+ */
+void SrvLogForwardClose(DWORD dwWaitMillis);
+
+#endif /* SRVLOGFORWARD_H_ */
@@ -0,0 +1,774 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SrvLogIndex.h"
+#include "SrvLogCompress.h"
+
+#define INDEX_MAGIC 0x58495753			// "SWIX"
+#define INDEX_VERSION 1
+#define MAX_INDEX_SIZE (64 * 1024 * 1024)
+
+#define STAMP_LENGTH 19					// YYYYMMDD-HHMMSS-mmm, as added by rotation
+#define QUERY_BUFFER_SIZE 65536
+
+/**
+ * The index of the live log.  Only touched by the log writer, holding its lock.
+ */
+static HANDLE hIndexFile = INVALID_HANDLE_VALUE;
+static char indexPath[MAX_PATH + sizeof(SRV_LOG_INDEX_SUFFIX)];
+static DWORD dwIndexInterval = 0;
+static ULONGLONG ullNextIndexOffset = 0;
+
+/**
+ * A log file being queried, compressed or not.
+ */
+typedef struct {
+	HANDLE hFile;
+	LPSRV_LOG_COMPRESSED_FILE lpCompressed;
+	ULONGLONG ullSize;
+} LOG_READER;
+
+typedef struct {
+	ULONGLONG ullFrom;
+	ULONGLONG ullTo;
+	SRV_LOG_WRITER lpWriter;
+	LPVOID lpContext;
+	BOOL bStopped;
+} LOG_QUERY;
+
+typedef struct {
+	char suffix[STAMP_LENGTH + sizeof(SRV_LOG_COMPRESSED_SUFFIX)];
+	FILETIME ftLastWrite;
+} QUERY_FILE;
+
+static BOOL QueryFile(LOG_QUERY*, LPCSTR, LPCSTR);
+static BOOL ScanRange(LOG_QUERY*, LOG_READER*, ULONGLONG, ULONGLONG);
+static SRV_LOG_INDEX_ENTRY* ReadIndex(LPCSTR, ULONGLONG, LPDWORD);
+static BOOL OpenLogReader(LOG_READER*, LPCSTR);
+static BOOL ReadLog(LOG_READER*, ULONGLONG, LPVOID, DWORD, LPDWORD);
+static void CloseLogReader(LOG_READER*);
+static BOOL ParseLineTime(LPCSTR, DWORD, ULONGLONG*);
+static LPCSTR ParseNumber(LPCSTR, DWORD, LPWORD);
+static ULONGLONG GetFileTimeValue(const FILETIME*);
+static BOOL IsRotationStamp(LPCSTR);
+static int CompareQueryFiles(const void*, const void*);
+static BOOL WriteStandardOutput(LPCVOID, DWORD, LPVOID);
+
+void SrvLogIndexOpen(LPCSTR lpLogPath, ULONGLONG ullLogSize, DWORD dwIntervalBytes) {
+
+	SrvLogIndexClose();
+
+	dwIndexInterval = dwIntervalBytes;
+
+	if ((dwIntervalBytes == 0) || (strlen(lpLogPath) >= MAX_PATH)) {
+		return;
+	}
+
+	_snprintf(indexPath, sizeof(indexPath), "%s%s", lpLogPath, SRV_LOG_INDEX_SUFFIX);
+	indexPath[sizeof(indexPath) - 1] = 0;
+
+	hIndexFile = CreateFile(indexPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE,
+			NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (hIndexFile == INVALID_HANDLE_VALUE) {
+		return;
+	}
+
+	// Keep adding to an index whose last entry is within the log.
+
+	LARGE_INTEGER liSize;
+	SRV_LOG_INDEX header;
+	SRV_LOG_INDEX_ENTRY last;
+	DWORD dwRead;
+
+	BOOL bKeep = (ullLogSize > 0)
+			&& GetFileSizeEx(hIndexFile, &liSize)
+			&& (liSize.QuadPart >= (LONGLONG)(sizeof(header) + sizeof(last)))
+			&& ((liSize.QuadPart - sizeof(header)) % sizeof(last) == 0)
+			&& ReadFile(hIndexFile, &header, sizeof(header), &dwRead, NULL) && (dwRead == sizeof(header))
+			&& (header.dwMagic == INDEX_MAGIC)
+			&& (header.dwVersion == INDEX_VERSION);
+
+	if (bKeep) {
+		LARGE_INTEGER liLast;
+		liLast.QuadPart = liSize.QuadPart - sizeof(last);
+
+		bKeep = SetFilePointerEx(hIndexFile, liLast, NULL, FILE_BEGIN)
+				&& ReadFile(hIndexFile, &last, sizeof(last), &dwRead, NULL) && (dwRead == sizeof(last))
+				&& (last.ullOffset <= ullLogSize);
+	}
+
+	if (bKeep) {
+		ullNextIndexOffset = last.ullOffset + dwIntervalBytes;
+		return;
+	}
+
+	// Start again, indexing the next write.
+
+	LARGE_INTEGER liZero;
+	liZero.QuadPart = 0;
+
+	header.dwMagic = INDEX_MAGIC;
+	header.dwVersion = INDEX_VERSION;
+
+	DWORD dwWritten;
+
+	if (!SetFilePointerEx(hIndexFile, liZero, NULL, FILE_BEGIN)
+			|| !SetEndOfFile(hIndexFile)
+			|| !WriteFile(hIndexFile, &header, sizeof(header), &dwWritten, NULL)) {
+		SrvLogIndexClose();
+		return;
+	}
+
+	ullNextIndexOffset = ullLogSize;
+}
+
+void SrvLogIndexAdd(ULONGLONG ullOffset) {
+
+	if ((hIndexFile == INVALID_HANDLE_VALUE) || (ullOffset < ullNextIndexOffset)) {
+		return;
+	}
+
+	SRV_LOG_INDEX_ENTRY entry;
+	GetSystemTimeAsFileTime(&entry.ftTime);
+	entry.ullOffset = ullOffset;
+
+	DWORD dwWritten;
+	WriteFile(hIndexFile, &entry, sizeof(entry), &dwWritten, NULL);
+
+	ullNextIndexOffset = ullOffset + dwIndexInterval;
+}
+
+void SrvLogIndexRotate(LPCSTR lpRotatedPath) {
+
+	if (hIndexFile == INVALID_HANDLE_VALUE) {
+		return;
+	}
+
+	SrvLogIndexClose();
+
+	char rotatedIndexPath[MAX_PATH * 2];
+	_snprintf(rotatedIndexPath, sizeof(rotatedIndexPath), "%s%s", lpRotatedPath, SRV_LOG_INDEX_SUFFIX);
+	rotatedIndexPath[sizeof(rotatedIndexPath) - 1] = 0;
+
+	MoveFileEx(indexPath, rotatedIndexPath, MOVEFILE_REPLACE_EXISTING);
+}
+
+void SrvLogIndexClose(void) {
+
+	if (hIndexFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(hIndexFile);
+		hIndexFile = INVALID_HANDLE_VALUE;
+	}
+}
+
+BOOL SrvLogParseTime(LPCSTR lpText, LPFILETIME lpTime) {
+
+	SYSTEMTIME st;
+	ZeroMemory(&st, sizeof(st));
+
+	LPCSTR p = lpText;
+
+	if ((strlen(p) >= 3) && (p[2] == ':')) {
+		GetLocalTime(&st);
+		st.wHour = st.wMinute = st.wSecond = st.wMilliseconds = 0;
+	}
+	else {
+		p = ParseNumber(p, 4, &st.wYear);
+		p = ((p != NULL) && (*p == '-')) ? ParseNumber(p + 1, 2, &st.wMonth) : NULL;
+		p = ((p != NULL) && (*p == '-')) ? ParseNumber(p + 1, 2, &st.wDay) : NULL;
+
+		if ((p != NULL) && ((*p == 'T') || (*p == ' '))) {
+			p++;
+		}
+		else if ((p != NULL) && (*p != 0) && (*p != 'Z')) {
+			p = NULL;
+		}
+	}
+
+	if ((p != NULL) && isdigit((unsigned char)*p)) {
+
+		p = ParseNumber(p, 2, &st.wHour);
+		p = ((p != NULL) && (*p == ':')) ? ParseNumber(p + 1, 2, &st.wMinute) : NULL;
+
+		if ((p != NULL) && (*p == ':')) {
+			p = ParseNumber(p + 1, 2, &st.wSecond);
+		}
+
+		if ((p != NULL) && (*p == '.')) {
+			p = ParseNumber(p + 1, 3, &st.wMilliseconds);
+		}
+	}
+
+	BOOL bUtc = (p != NULL) && (*p == 'Z');
+	if (bUtc) {
+		p++;
+	}
+
+	if ((p == NULL) || (*p != 0)) {
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	SYSTEMTIME stUtc = st;
+
+	if (!bUtc && !TzSpecificLocalTimeToSystemTime(NULL, &st, &stUtc)) {
+		return FALSE;
+	}
+
+	return SystemTimeToFileTime(&stUtc, lpTime);
+}
+
+BOOL SrvLogQuery(LPCSTR lpLogPath, const FILETIME* lpFrom, const FILETIME* lpTo,
+		SRV_LOG_WRITER lpWriter, LPVOID lpContext) {
+
+	if (strlen(lpLogPath) >= MAX_PATH) {
+		SetLastError(ERROR_BAD_PATHNAME);
+		return FALSE;
+	}
+
+	LOG_QUERY query;
+	query.ullFrom = GetFileTimeValue(lpFrom);
+	query.ullTo = GetFileTimeValue(lpTo);
+	query.lpWriter = lpWriter;
+	query.lpContext = lpContext;
+	query.bStopped = FALSE;
+
+	// List the rotated logs, oldest first, skipping any written last before the range.
+
+	char pattern[MAX_PATH + 2];
+	_snprintf(pattern, sizeof(pattern), "%s.*", lpLogPath);
+	pattern[sizeof(pattern) - 1] = 0;
+
+	// FindFirstFile() returns names without the directory.
+
+	LPCSTR lpBaseName = lpLogPath;
+	for (LPCSTR p = lpLogPath; *p != 0; p++) {
+		if ((*p == '\\') || (*p == '/') || (*p == ':')) {
+			lpBaseName = p + 1;
+		}
+	}
+	DWORD dwBaseLength = (DWORD)strlen(lpBaseName);
+
+	QUERY_FILE* lpFiles = NULL;
+	DWORD dwCount = 0;
+	DWORD dwCapacity = 0;
+
+	WIN32_FIND_DATA data;
+	HANDLE hFind = FindFirstFile(pattern, &data);
+
+	if (hFind != INVALID_HANDLE_VALUE) {
+
+		do {
+			LPCSTR lpSuffix = data.cFileName + dwBaseLength + 1;
+
+			if ((strlen(data.cFileName) <= dwBaseLength) || !IsRotationStamp(lpSuffix)
+					|| ((lpSuffix[STAMP_LENGTH] != 0) && (strcmp(lpSuffix + STAMP_LENGTH, SRV_LOG_COMPRESSED_SUFFIX) != 0))
+					|| (GetFileTimeValue(&data.ftLastWriteTime) < query.ullFrom)) {
+				continue;
+			}
+
+			if (dwCount == dwCapacity) {
+				DWORD dwNewCapacity = (dwCapacity == 0) ? 64 : dwCapacity * 2;
+				QUERY_FILE* lpGrown = (lpFiles == NULL)
+						? HeapAlloc(GetProcessHeap(), 0, dwNewCapacity * sizeof(QUERY_FILE))
+						: HeapReAlloc(GetProcessHeap(), 0, lpFiles, dwNewCapacity * sizeof(QUERY_FILE));
+				if (lpGrown == NULL) {
+					break;
+				}
+				lpFiles = lpGrown;
+				dwCapacity = dwNewCapacity;
+			}
+
+			strcpy(lpFiles[dwCount].suffix, lpSuffix);
+			lpFiles[dwCount].ftLastWrite = data.ftLastWriteTime;
+			dwCount++;
+
+		} while (FindNextFile(hFind, &data));
+
+		FindClose(hFind);
+	}
+
+	if (lpFiles != NULL) {
+		qsort(lpFiles, dwCount, sizeof(QUERY_FILE), CompareQueryFiles);
+	}
+
+	BOOL bSuccess = TRUE;
+
+	for (DWORD i = 0; bSuccess && !query.bStopped && (i < dwCount); i++) {
+
+		// A log still being compressed may be listed both ways; read it once.
+
+		if ((i + 1 < dwCount) && (strncmp(lpFiles[i].suffix, lpFiles[i + 1].suffix, STAMP_LENGTH) == 0)) {
+			continue;
+		}
+
+		char path[MAX_PATH * 2];
+		char basePath[MAX_PATH * 2];
+		_snprintf(path, sizeof(path), "%s.%s", lpLogPath, lpFiles[i].suffix);
+		path[sizeof(path) - 1] = 0;
+		_snprintf(basePath, sizeof(basePath), "%s.%.*s", lpLogPath, STAMP_LENGTH, lpFiles[i].suffix);
+		basePath[sizeof(basePath) - 1] = 0;
+
+		bSuccess = QueryFile(&query, path, basePath);
+	}
+
+	if (lpFiles != NULL) {
+		HeapFree(GetProcessHeap(), 0, lpFiles);
+	}
+
+	if (bSuccess && !query.bStopped) {
+		bSuccess = QueryFile(&query, lpLogPath, lpLogPath);
+	}
+
+	return bSuccess;
+}
+
+int SrvLogQueryPrint(LPCSTR lpLogPath, LPCSTR lpFrom, LPCSTR lpTo) {
+
+	FILETIME ftFrom, ftTo;
+
+	if (!SrvLogParseTime(lpFrom, &ftFrom)) {
+		fprintf(stderr, "SrvWrap: cannot understand the time %s\n", lpFrom);
+		return EXIT_FAILURE;
+	}
+
+	if (lpTo == NULL) {
+		ftTo.dwLowDateTime = MAXDWORD;
+		ftTo.dwHighDateTime = MAXLONG;
+	}
+	else if (!SrvLogParseTime(lpTo, &ftTo)) {
+		fprintf(stderr, "SrvWrap: cannot understand the time %s\n", lpTo);
+		return EXIT_FAILURE;
+	}
+
+	if (!SrvLogQuery(lpLogPath, &ftFrom, &ftTo, WriteStandardOutput, GetStdHandle(STD_OUTPUT_HANDLE))) {
+		fprintf(stderr, "SrvWrap: cannot query %s, error %lu\n", lpLogPath, GetLastError());
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Find the part of a log file written in the query range from its index
+ * and scan it.  Returns TRUE, doing nothing, if the file has no index.
+ */
+static BOOL QueryFile(LOG_QUERY* pQuery, LPCSTR lpPath, LPCSTR lpBasePath) {
+
+	LOG_READER reader;
+
+	if (!OpenLogReader(&reader, lpPath)) {
+		return (GetLastError() == ERROR_FILE_NOT_FOUND);
+	}
+
+	DWORD dwEntries;
+	SRV_LOG_INDEX_ENTRY* lpEntries = ReadIndex(lpBasePath, reader.ullSize, &dwEntries);
+
+	if (lpEntries == NULL) {
+		CloseLogReader(&reader);
+		return TRUE;
+	}
+
+	// Start at the last write made at or before the start of the range.
+
+	DWORD dwLow = 0;
+	DWORD dwHigh = dwEntries;
+
+	while (dwLow < dwHigh) {
+		DWORD dwMiddle = (dwLow + dwHigh) / 2;
+		if (GetFileTimeValue(&lpEntries[dwMiddle].ftTime) <= pQuery->ullFrom) {
+			dwLow = dwMiddle + 1;
+		}
+		else {
+			dwHigh = dwMiddle;
+		}
+	}
+
+	ULONGLONG ullStart = (dwLow > 0) ? lpEntries[dwLow - 1].ullOffset : 0;
+
+	// End one entry after the first write made after the range, since a record
+	// can be written a little after the time it carries.
+
+	dwHigh = dwEntries;
+
+	while (dwLow < dwHigh) {
+		DWORD dwMiddle = (dwLow + dwHigh) / 2;
+		if (GetFileTimeValue(&lpEntries[dwMiddle].ftTime) <= pQuery->ullTo) {
+			dwLow = dwMiddle + 1;
+		}
+		else {
+			dwHigh = dwMiddle;
+		}
+	}
+
+	ULONGLONG ullEnd = (dwLow + 1 < dwEntries) ? lpEntries[dwLow + 1].ullOffset : reader.ullSize;
+
+	// Nothing in a file indexed from its start after the range, nor in any later file.
+
+	if ((dwLow == 0) && (lpEntries[0].ullOffset == 0)) {
+		ullEnd = 0;
+		pQuery->bStopped = TRUE;
+	}
+
+	HeapFree(GetProcessHeap(), 0, lpEntries);
+
+	BOOL bSuccess = (ullStart >= ullEnd) || ScanRange(pQuery, &reader, ullStart, ullEnd);
+
+	CloseLogReader(&reader);
+	return bSuccess;
+}
+
+/**
+ * Write the lines from ullStart to ullEnd that fall in the query range.
+ * A line partly outside is read whole; a line with no time of its own,
+ * such as a stack trace line or any line of a raw log, goes with the line before.
+ */
+static BOOL ScanRange(LOG_QUERY* pQuery, LOG_READER* lpReader, ULONGLONG ullStart, ULONGLONG ullEnd) {
+
+	static char buffer[QUERY_BUFFER_SIZE];
+
+	BOOL bLineStart = TRUE;
+	BOOL bPartial = FALSE;
+	BOOL bInclude = TRUE;
+	DWORD dwRead;
+
+	// An offset in a raw log may be inside a line.
+
+	if (ullStart > 0) {
+		char c;
+		if (!ReadLog(lpReader, ullStart - 1, &c, 1, &dwRead)) {
+			return FALSE;
+		}
+		bPartial = (dwRead == 1) && (c != '\n');
+		bLineStart = !bPartial;
+	}
+
+	ULONGLONG ullPosition = ullStart;
+
+	while (!pQuery->bStopped && ((ullPosition < ullEnd) || !bLineStart)) {
+
+		if (!ReadLog(lpReader, ullPosition, buffer, sizeof(buffer), &dwRead)) {
+			return FALSE;
+		}
+
+		if (dwRead == 0) {
+			break;
+		}
+
+		DWORD i = 0;
+
+		while (i < dwRead) {
+
+			LPCSTR lpLine = buffer + i;
+			LPCSTR lpNewline = memchr(lpLine, '\n', dwRead - i);
+			DWORD dwLength = (lpNewline != NULL) ? (DWORD)(lpNewline - lpLine) + 1 : dwRead - i;
+
+			// Read a line that starts near the end of the buffer again from its start,
+			// so that its time can be parsed.
+
+			if (bLineStart && (lpNewline == NULL) && (i > 0)) {
+				break;
+			}
+
+			if (bPartial) {
+				bPartial = (lpNewline == NULL);
+			}
+			else {
+				ULONGLONG ullTime;
+				if (bLineStart && ParseLineTime(lpLine, dwLength, &ullTime)) {
+					bInclude = (ullTime >= pQuery->ullFrom) && (ullTime <= pQuery->ullTo);
+				}
+
+				if (bInclude && !pQuery->lpWriter(lpLine, dwLength, pQuery->lpContext)) {
+					pQuery->bStopped = TRUE;
+					break;
+				}
+			}
+
+			bLineStart = (lpNewline != NULL);
+			i += dwLength;
+
+			if ((ullPosition + i >= ullEnd) && bLineStart) {
+				break;
+			}
+		}
+
+		ullPosition += i;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Read the entries of an index, dropping any past the end of its log.
+ *
+ * Returns a heap block, or NULL if there is no usable index.
+ */
+static SRV_LOG_INDEX_ENTRY* ReadIndex(LPCSTR lpBasePath, ULONGLONG ullLogSize, LPDWORD pdwEntries) {
+
+	char path[MAX_PATH * 2];
+	_snprintf(path, sizeof(path), "%s%s", lpBasePath, SRV_LOG_INDEX_SUFFIX);
+	path[sizeof(path) - 1] = 0;
+
+	HANDLE hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return NULL;
+	}
+
+	LARGE_INTEGER liSize;
+	SRV_LOG_INDEX header;
+	DWORD dwRead;
+
+	if (!GetFileSizeEx(hFile, &liSize)
+			|| (liSize.QuadPart < (LONGLONG)(sizeof(header) + sizeof(SRV_LOG_INDEX_ENTRY)))
+			|| (liSize.QuadPart > MAX_INDEX_SIZE)
+			|| !ReadFile(hFile, &header, sizeof(header), &dwRead, NULL) || (dwRead != sizeof(header))
+			|| (header.dwMagic != INDEX_MAGIC)
+			|| (header.dwVersion != INDEX_VERSION)) {
+		CloseHandle(hFile);
+		return NULL;
+	}
+
+	// An entry being written as the index is read is left out.
+
+	DWORD dwEntries = (DWORD)((liSize.QuadPart - sizeof(header)) / sizeof(SRV_LOG_INDEX_ENTRY));
+	SRV_LOG_INDEX_ENTRY* lpEntries = HeapAlloc(GetProcessHeap(), 0, dwEntries * sizeof(SRV_LOG_INDEX_ENTRY));
+
+	if ((lpEntries == NULL)
+			|| !ReadFile(hFile, lpEntries, dwEntries * sizeof(SRV_LOG_INDEX_ENTRY), &dwRead, NULL)) {
+		if (lpEntries != NULL) {
+			HeapFree(GetProcessHeap(), 0, lpEntries);
+		}
+		CloseHandle(hFile);
+		return NULL;
+	}
+
+	CloseHandle(hFile);
+
+	dwEntries = dwRead / sizeof(SRV_LOG_INDEX_ENTRY);
+	while ((dwEntries > 0) && (lpEntries[dwEntries - 1].ullOffset > ullLogSize)) {
+		dwEntries--;
+	}
+
+	if (dwEntries == 0) {
+		HeapFree(GetProcessHeap(), 0, lpEntries);
+		return NULL;
+	}
+
+	*pdwEntries = dwEntries;
+	return lpEntries;
+}
+
+/**
+ * Open a log file to read at any offset, up to its size now.
+ */
+static BOOL OpenLogReader(LOG_READER* lpReader, LPCSTR lpPath) {
+
+	SIZE_T length = strlen(lpPath);
+	SIZE_T suffixLength = strlen(SRV_LOG_COMPRESSED_SUFFIX);
+
+	lpReader->hFile = INVALID_HANDLE_VALUE;
+	lpReader->lpCompressed = NULL;
+
+	if ((length > suffixLength) && (strcmp(lpPath + length - suffixLength, SRV_LOG_COMPRESSED_SUFFIX) == 0)) {
+		lpReader->lpCompressed = SrvLogCompressedOpen(lpPath);
+		if (lpReader->lpCompressed == NULL) {
+			return FALSE;
+		}
+		lpReader->ullSize = SrvLogCompressedGetSize(lpReader->lpCompressed);
+		return TRUE;
+	}
+
+	lpReader->hFile = CreateFile(lpPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (lpReader->hFile == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+
+	LARGE_INTEGER liSize;
+	if (!GetFileSizeEx(lpReader->hFile, &liSize)) {
+		DWORD dwLastError = GetLastError();
+		CloseHandle(lpReader->hFile);
+		SetLastError(dwLastError);
+		return FALSE;
+	}
+
+	lpReader->ullSize = liSize.QuadPart;
+	return TRUE;
+}
+
+static BOOL ReadLog(LOG_READER* lpReader, ULONGLONG ullOffset, LPVOID lpBuffer, DWORD dwLength, LPDWORD pdwRead) {
+
+	*pdwRead = 0;
+
+	if (ullOffset >= lpReader->ullSize) {
+		return TRUE;
+	}
+
+	if (dwLength > lpReader->ullSize - ullOffset) {
+		dwLength = (DWORD)(lpReader->ullSize - ullOffset);
+	}
+
+	if (lpReader->lpCompressed != NULL) {
+		return SrvLogCompressedRead(lpReader->lpCompressed, ullOffset, lpBuffer, dwLength, pdwRead);
+	}
+
+	OVERLAPPED ov;
+	ZeroMemory(&ov, sizeof(ov));
+	ov.Offset = (DWORD)ullOffset;
+	ov.OffsetHigh = (DWORD)(ullOffset >> 32);
+
+	return ReadFile(lpReader->hFile, lpBuffer, dwLength, pdwRead, &ov) || (GetLastError() == ERROR_HANDLE_EOF);
+}
+
+static void CloseLogReader(LOG_READER* lpReader) {
+
+	if (lpReader->lpCompressed != NULL) {
+		SrvLogCompressedClose(lpReader->lpCompressed);
+	}
+
+	if (lpReader->hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(lpReader->hFile);
+	}
+}
+
+/**
+ * Parse the time that starts a record in the text or json format:
+ * 2017-06-01T12:00:00.123456Z or {"time":"2017-06-01T12:00:00.123456Z"
+ */
+static BOOL ParseLineTime(LPCSTR lpLine, DWORD dwLength, ULONGLONG* pullTime) {
+
+	static const char jsonStart[] = "{\"time\":\"";
+	static const char form[] = "DDDD-DD-DDTDD:DD:DD";
+
+	if ((dwLength >= sizeof(jsonStart) - 1) && (memcmp(lpLine, jsonStart, sizeof(jsonStart) - 1) == 0)) {
+		lpLine += sizeof(jsonStart) - 1;
+		dwLength -= sizeof(jsonStart) - 1;
+	}
+
+	if (dwLength < sizeof(form)) {
+		return FALSE;
+	}
+
+	for (DWORD i = 0; i < sizeof(form) - 1; i++) {
+		if ((form[i] == 'D') ? !isdigit((unsigned char)lpLine[i]) : (lpLine[i] != form[i])) {
+			return FALSE;
+		}
+	}
+
+	SYSTEMTIME st;
+	ZeroMemory(&st, sizeof(st));
+	ParseNumber(lpLine, 4, &st.wYear);
+	ParseNumber(lpLine + 5, 2, &st.wMonth);
+	ParseNumber(lpLine + 8, 2, &st.wDay);
+	ParseNumber(lpLine + 11, 2, &st.wHour);
+	ParseNumber(lpLine + 14, 2, &st.wMinute);
+	ParseNumber(lpLine + 17, 2, &st.wSecond);
+
+	// Up to seven digits of fraction, in 100 ns units.
+
+	DWORD i = sizeof(form) - 1;
+	ULONGLONG ullFraction = 0;
+	DWORD dwDigits = 0;
+
+	if (lpLine[i] == '.') {
+		for (i++; (i < dwLength) && isdigit((unsigned char)lpLine[i]); i++) {
+			if (dwDigits < 7) {
+				ullFraction = ullFraction * 10 + (lpLine[i] - '0');
+				dwDigits++;
+			}
+		}
+	}
+
+	if ((i >= dwLength) || (lpLine[i] != 'Z')) {
+		return FALSE;
+	}
+
+	while (dwDigits++ < 7) {
+		ullFraction *= 10;
+	}
+
+	FILETIME ft;
+	if (!SystemTimeToFileTime(&st, &ft)) {
+		return FALSE;
+	}
+
+	*pullTime = GetFileTimeValue(&ft) + ullFraction;
+	return TRUE;
+}
+
+/**
+ * Parse up to dwMaxDigits digits, at least one.
+ *
+ * Returns the text after the number, or NULL if there is no number.
+ */
+static LPCSTR ParseNumber(LPCSTR lpText, DWORD dwMaxDigits, LPWORD pwValue) {
+
+	DWORD dwValue = 0;
+	DWORD i;
+
+	for (i = 0; (i < dwMaxDigits) && isdigit((unsigned char)lpText[i]); i++) {
+		dwValue = dwValue * 10 + (lpText[i] - '0');
+	}
+
+	if (i == 0) {
+		return NULL;
+	}
+
+	*pwValue = (WORD)dwValue;
+	return lpText + i;
+}
+
+static ULONGLONG GetFileTimeValue(const FILETIME* lpTime) {
+	return ((ULONGLONG)lpTime->dwHighDateTime << 32) | lpTime->dwLowDateTime;
+}
+
+/**
+ * Check for the YYYYMMDD-HHMMSS-mmm that rotation adds to the log path.
+ */
+static BOOL IsRotationStamp(LPCSTR lpText) {
+
+	static const char form[] = "DDDDDDDD-DDDDDD-DDD";
+
+	for (DWORD i = 0; i < STAMP_LENGTH; i++) {
+		if ((form[i] == 'D') ? !isdigit((unsigned char)lpText[i]) : (lpText[i] != form[i])) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static int CompareQueryFiles(const void* p1, const void* p2) {
+	return strcmp(((const QUERY_FILE*)p1)->suffix, ((const QUERY_FILE*)p2)->suffix);
+}
+
+static BOOL WriteStandardOutput(LPCVOID lpData, DWORD dwLength, LPVOID lpContext) {
+
+	DWORD dwWritten;
+	return WriteFile((HANDLE)lpContext, lpData, dwLength, &dwWritten, NULL) && (dwWritten == dwLength);
+}
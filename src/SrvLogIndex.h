@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVLOGINDEX_H_
+#define SRVLOGINDEX_H_
+
+#include <windows.h>
+
+#include "SrvLogTransform.h"
+
+/**
+ * The index of a log file is named by adding this to the log file's name.
+ * Rotated logs keep their index under the rotated name, without the
+ * compressed suffix, and its offsets are into the uncompressed log.
+ *
+ * It holds a SRV_LOG_INDEX header, then an entry each time the log grew by
+ * the index interval, giving the time of the write that started at the offset.
+ */
+#define SRV_LOG_INDEX_SUFFIX ".idx"
+
+typedef struct tagSRV_LOG_INDEX {
+	DWORD dwMagic;
+	DWORD dwVersion;
+} SRV_LOG_INDEX;
+
+typedef struct tagSRV_LOG_INDEX_ENTRY {
+	FILETIME ftTime;
+	ULONGLONG ullOffset;
+} SRV_LOG_INDEX_ENTRY;
+
+/**
+ * Start indexing a log file just opened, which holds ullLogSize bytes.
+ * An index that does not fit the log, such as one left by a log renamed
+ * by an external tool, is started again.  With dwIntervalBytes 0 no index
+ * is kept.  Failure to open the index only stops indexing.
+ */
+void SrvLogIndexOpen(LPCSTR lpLogPath, ULONGLONG ullLogSize, DWORD dwIntervalBytes);
+
+/**
+ * Note a write about to start at ullOffset of the log file.
+ */
+void SrvLogIndexAdd(ULONGLONG ullOffset);
+
+/**
+ * Close the index and give it the name the log file was rotated to.
+ */
+void SrvLogIndexRotate(LPCSTR lpRotatedPath);
+
+/**
+ * Close the index.
+ */
+void SrvLogIndexClose(void);
+
+/**
+ * Parse a query time: YYYY-MM-DD, YYYY-MM-DDTHH:MM[:SS[.fff]] or HH:MM[:SS[.fff]]
+ * for today, in local time, or in UTC when followed by Z.  A blank may take
+ * the place of the T.
+ */
+BOOL SrvLogParseTime(LPCSTR lpText, LPFILETIME lpTime);
+
+/**
+ * Write the lines of a log, its rotated files and their compressed files
+ * from ftFrom to ftTo.  Each file's index is searched for the part of the
+ * file written in that time; lines starting with a time, as in the text and
+ * json output log formats, are then checked one by one.  Files without an
+ * index are skipped.  Stops without error when the writer returns FALSE.
+ */
+BOOL SrvLogQuery(LPCSTR lpLogPath, const FILETIME* lpFrom, const FILETIME* lpTo,
+		SRV_LOG_WRITER lpWriter, LPVOID lpContext);
+
+/**
+ * Query mode: print the lines of a log from lpFrom to lpTo, or to the end
+ * if lpTo is NULL, to standard output and return the process exit code.
+ */
+int SrvLogQueryPrint(LPCSTR lpLogPath, LPCSTR lpFrom, LPCSTR lpTo);
+
+#endif /* SRVLOGINDEX_H_ */
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "SrvLogLimit.h"
+
+#define HASH_SCAN_LENGTH 256
+
+static void Refill(LPSRV_LOG_LIMITER);
+static void Account(LPSRV_LOG_LIMITER, DWORD, BOOL);
+static DWORD HashLine(LPCSTR, DWORD);
+
+BOOL SrvLogLimitParsePolicy(LPCSTR lpName, SRV_LOG_POLICY* pPolicy) {
+
+	if ((lpName == NULL) || (strcmp(lpName, "drop") == 0)) {
+		*pPolicy = SRV_LOG_LIMIT_DROP;
+	}
+	else if (strcmp(lpName, "sample") == 0) {
+		*pPolicy = SRV_LOG_LIMIT_SAMPLE;
+	}
+	else if (strcmp(lpName, "summarize") == 0) {
+		*pPolicy = SRV_LOG_LIMIT_SUMMARIZE;
+	}
+	else {
+		SetLastError(ERROR_BAD_FORMAT);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+void SrvLogLimitConfigure(LPSRV_LOG_LIMITER lpLimiter, SRV_LOG_POLICY policy,
+		DWORD dwRateBytes, DWORD dwBurstBytes, DWORD dwSample) {
+
+	lpLimiter->policy = policy;
+	lpLimiter->dwRateBytes = dwRateBytes;
+	lpLimiter->dwBurstBytes = (dwBurstBytes != 0) ? dwBurstBytes : dwRateBytes;
+	lpLimiter->dwSample = (dwSample != 0) ? dwSample : 1;
+	lpLimiter->llTokens = lpLimiter->dwBurstBytes;
+	lpLimiter->ullRefillTick = GetTickCount64();
+	lpLimiter->bOverRate = FALSE;
+	lpLimiter->bSuppressing = FALSE;
+	lpLimiter->dwSampleCount = 0;
+}
+
+BOOL SrvLogLimitAdmit(LPSRV_LOG_LIMITER lpLimiter, LPCSTR lpLine, DWORD dwLength) {
+
+	if (lpLimiter->dwRateBytes == 0) {
+		lpLimiter->bSuppressing = FALSE;
+		return TRUE;
+	}
+
+	Refill(lpLimiter);
+
+	DWORD dwHash = HashLine(lpLine, dwLength);
+	BOOL bRepeat = (dwHash == lpLimiter->dwLastHash);
+	lpLimiter->dwLastHash = dwHash;
+
+	BOOL bKeep = (lpLimiter->llTokens > 0);
+	lpLimiter->bOverRate = !bKeep;
+
+	if (!bKeep) {
+		switch (lpLimiter->policy) {
+		case SRV_LOG_LIMIT_SAMPLE:
+			bKeep = (++lpLimiter->dwSampleCount % lpLimiter->dwSample == 0);
+			break;
+		case SRV_LOG_LIMIT_SUMMARIZE:
+			bKeep = !bRepeat && (lpLimiter->llTokens > -(LONGLONG)lpLimiter->dwBurstBytes);
+			break;
+		default:
+			break;
+		}
+	}
+
+	lpLimiter->bSuppressing = !bKeep;
+
+	if (!bKeep && bRepeat) {
+		if (lpLimiter->dwRepeats++ == 0) {
+			DWORD dwCopy = (dwLength < SRV_LOG_REPEAT_SIZE) ? dwLength : SRV_LOG_REPEAT_SIZE;
+			memcpy(lpLimiter->repeated, lpLine, dwCopy);
+			lpLimiter->repeated[dwCopy] = 0;
+		}
+	}
+
+	Account(lpLimiter, dwLength + 1, TRUE);
+
+	return bKeep;
+}
+
+BOOL SrvLogLimitContinue(LPSRV_LOG_LIMITER lpLimiter, DWORD dwLength, BOOL bNewLine) {
+
+	if (lpLimiter->dwRateBytes == 0) {
+		return TRUE;
+	}
+
+	Account(lpLimiter, dwLength + (bNewLine ? 1 : 0), bNewLine);
+
+	return !lpLimiter->bSuppressing;
+}
+
+DWORD SrvLogLimitTakeMarker(LPSRV_LOG_LIMITER lpLimiter, BOOL bForce, LPSTR lpBuffer, DWORD dwSize) {
+
+	if ((lpLimiter->ullBytes == 0) || (dwSize == 0)) {
+		return 0;
+	}
+
+	if (!bForce && lpLimiter->bOverRate && (GetTickCount64() - lpLimiter->ullMarkerTick < SRV_LOG_MARKER_MILLIS)) {
+		return 0;
+	}
+
+	int length;
+
+	if (lpLimiter->dwRepeats > 0) {
+		length = _snprintf(lpBuffer, dwSize, "[SrvWrap] suppressed %lu lines / %llu bytes, %lu repeats of: %s",
+				lpLimiter->dwLines, lpLimiter->ullBytes, lpLimiter->dwRepeats, lpLimiter->repeated);
+	}
+	else {
+		length = _snprintf(lpBuffer, dwSize, "[SrvWrap] suppressed %lu lines / %llu bytes",
+				lpLimiter->dwLines, lpLimiter->ullBytes);
+	}
+
+	if ((length < 0) || ((DWORD)length >= dwSize)) {
+		length = dwSize - 1;
+	}
+	lpBuffer[length] = 0;
+
+	lpLimiter->dwLines = 0;
+	lpLimiter->ullBytes = 0;
+	lpLimiter->dwRepeats = 0;
+	lpLimiter->ullMarkers++;
+
+	return length;
+}
+
+/**
+ * Add the tokens earned since the last refill, up to a burst.
+ */
+static void Refill(LPSRV_LOG_LIMITER lpLimiter) {
+
+	ULONGLONG ullNow = GetTickCount64();
+	ULONGLONG ullElapsed = ullNow - lpLimiter->ullRefillTick;
+
+	// Earn whole bytes only, keeping the remainder of the time for the next refill.
+
+	ULONGLONG ullEarned = ullElapsed * lpLimiter->dwRateBytes / 1000;
+	if (ullEarned == 0) {
+		return;
+	}
+
+	// After a long pause the bucket is full whatever the debt.
+
+	if (ullEarned >= 2ULL * lpLimiter->dwBurstBytes) {
+		lpLimiter->llTokens = lpLimiter->dwBurstBytes;
+		lpLimiter->ullRefillTick = ullNow;
+		return;
+	}
+
+	lpLimiter->llTokens += (LONGLONG)ullEarned;
+	if (lpLimiter->llTokens > (LONGLONG)lpLimiter->dwBurstBytes) {
+		lpLimiter->llTokens = lpLimiter->dwBurstBytes;
+	}
+
+	lpLimiter->ullRefillTick += ullEarned * 1000 / lpLimiter->dwRateBytes;
+}
+
+/**
+ * Take the bytes of a kept line from the bucket, or count a suppressed one.
+ */
+static void Account(LPSRV_LOG_LIMITER lpLimiter, DWORD dwBytes, BOOL bNewLine) {
+
+	if (!lpLimiter->bSuppressing) {
+		lpLimiter->llTokens -= dwBytes;
+		if (lpLimiter->llTokens < -(LONGLONG)lpLimiter->dwBurstBytes) {
+			lpLimiter->llTokens = -(LONGLONG)lpLimiter->dwBurstBytes;
+		}
+		return;
+	}
+
+	if (lpLimiter->ullBytes == 0) {
+		lpLimiter->ullMarkerTick = GetTickCount64();
+	}
+
+	if (bNewLine) {
+		lpLimiter->dwLines++;
+		lpLimiter->ullSuppressedLines++;
+	}
+
+	lpLimiter->ullBytes += dwBytes;
+	lpLimiter->ullSuppressedBytes += dwBytes;
+}
+
+/**
+ * Hash the start of a line, ignoring digits so that a message repeated
+ * with a different time, count or id hashes the same.  FNV-1a.
+ */
+static DWORD HashLine(LPCSTR lpLine, DWORD dwLength) {
+
+	if (dwLength > HASH_SCAN_LENGTH) {
+		dwLength = HASH_SCAN_LENGTH;
+	}
+
+	DWORD dwHash = 2166136261;
+
+	for (DWORD i = 0; i < dwLength; i++) {
+		if ((lpLine[i] < '0') || (lpLine[i] > '9')) {
+			dwHash = (dwHash ^ (BYTE)lpLine[i]) * 16777619;
+		}
+	}
+
+	return dwHash;
+}
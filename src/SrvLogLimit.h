@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVLOGLIMIT_H_
+#define SRVLOGLIMIT_H_
+
+#include <windows.h>
+
+/**
+ * What to do with records that arrive while a stream is over its rate.
+ *
+ *	SRV_LOG_LIMIT_DROP		suppress them.
+ *	SRV_LOG_LIMIT_SAMPLE	keep one in dwSample and suppress the rest.
+ *	SRV_LOG_LIMIT_SUMMARIZE	suppress those that repeat the record before them,
+ *							ignoring digits, and keep the others until a second
+ *							burst is used up.
+ */
+typedef enum {
+	SRV_LOG_LIMIT_DROP,
+	SRV_LOG_LIMIT_SAMPLE,
+	SRV_LOG_LIMIT_SUMMARIZE
+} SRV_LOG_POLICY;
+
+#define SRV_LOG_MARKER_SIZE 256
+#define SRV_LOG_MARKER_MILLIS 10000		// between markers while suppressing
+#define SRV_LOG_REPEAT_SIZE 80			// of the repeated record quoted in a marker
+
+/**
+ * A token bucket of bytes for one output stream.  It fills at dwRateBytes a
+ * second up to dwBurstBytes, and each kept line takes its length from it.
+ * A record starting when the bucket is empty is over the rate.  Kept records
+ * can take the bucket below empty, down to minus a burst, so a stream that
+ * floods stays limited for a while after.
+ *
+ * Suppressing only skips bytes already read from the pipe, so the child
+ * never waits on the limit.
+ */
+typedef struct tagSRV_LOG_LIMITER {
+	SRV_LOG_POLICY policy;
+	DWORD dwRateBytes;					// 0 for no limit
+	DWORD dwBurstBytes;
+	DWORD dwSample;
+	LONGLONG llTokens;
+	ULONGLONG ullRefillTick;
+	BOOL bOverRate;
+	BOOL bSuppressing;					// the current record
+	DWORD dwSampleCount;
+	DWORD dwLastHash;					// of the first line of the last record
+
+	// Suppressed since the last marker.
+
+	ULONGLONG ullMarkerTick;			// of the first of them
+	DWORD dwLines;
+	ULONGLONG ullBytes;
+	DWORD dwRepeats;
+	char repeated[SRV_LOG_REPEAT_SIZE + 1];
+
+	ULONGLONG ullSuppressedLines;
+	ULONGLONG ullSuppressedBytes;
+	ULONGLONG ullMarkers;
+} SRV_LOG_LIMITER, *LPSRV_LOG_LIMITER;
+
+/**
+ * Convert "drop", "sample" or "summarize" to a policy.  NULL means drop.
+ */
+BOOL SrvLogLimitParsePolicy(LPCSTR lpName, SRV_LOG_POLICY* pPolicy);
+
+/**
+ * Set the rate, burst and policy, starting with a full bucket.
+ * A burst of 0 is one second at the rate.  A rate of 0 keeps everything.
+ * Counts of what was suppressed are kept.
+ */
+void SrvLogLimitConfigure(LPSRV_LOG_LIMITER lpLimiter, SRV_LOG_POLICY policy,
+		DWORD dwRateBytes, DWORD dwBurstBytes, DWORD dwSample);
+
+/**
+ * Decide whether to keep a record, given its first line, and account for the line.
+ */
+BOOL SrvLogLimitAdmit(LPSRV_LOG_LIMITER lpLimiter, LPCSTR lpLine, DWORD dwLength);
+
+/**
+ * Account for a further line, or if not bNewLine a further piece of a line,
+ * of the current record.  Returns TRUE if the record is kept.
+ */
+BOOL SrvLogLimitContinue(LPSRV_LOG_LIMITER lpLimiter, DWORD dwLength, BOOL bNewLine);
+
+/**
+ * Format a marker line, without a line end, reporting what was suppressed
+ * since the last one.  One is due when something was suppressed and the
+ * stream is back under its rate, a marker interval has passed, or bForce.
+ *
+ * Returns the length of the marker, or 0 if none is due.
+ */
+DWORD SrvLogLimitTakeMarker(LPSRV_LOG_LIMITER lpLimiter, BOOL bForce, LPSTR lpBuffer, DWORD dwSize);
+
+#endif /* SRVLOGLIMIT_H_ */
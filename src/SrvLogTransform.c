@@ -0,0 +1,768 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SrvLogTransform.h"
+
+/**
+ * The most a record header can take: the time, stream, instance,
+ * process id and level, and the end of the record before it.
+ */
+#define RECORD_HEADER_MAX (sizeof(((LPSRV_LOG_STREAM)0)->instance) + 160)
+
+#define LEVEL_SCAN_LENGTH 128
+
+static const struct {
+	LPCSTR lpWord;
+	LPCSTR lpLevel;
+} levels[] = {
+	{ "TRACE", "TRACE" },
+	{ "DEBUG", "DEBUG" },
+	{ "INFO", "INFO" },
+	{ "WARN", "WARN" },
+	{ "WARNING", "WARN" },
+	{ "ERROR", "ERROR" },
+	{ "SEVERE", "ERROR" },
+	{ "FATAL", "FATAL" },
+};
+
+static BOOL ProcessLine(LPSRV_LOG_STREAM, LPCSTR, DWORD, BOOL);
+static BOOL AppendLine(LPSRV_LOG_STREAM, LPCSTR, DWORD);
+static void AppendHeader(LPSRV_LOG_STREAM, LPCSTR, DWORD);
+static void AppendEscaped(LPSRV_LOG_STREAM, LPCSTR, DWORD);
+static DWORD GetEscapedLength(LPCSTR, DWORD);
+static void AppendDecimal(LPSRV_LOG_STREAM, DWORD, DWORD);
+static void FinishRecord(LPSRV_LOG_STREAM);
+static BOOL WriteRecords(LPSRV_LOG_STREAM, BOOL);
+static BOOL IsContinuation(LPCSTR, DWORD);
+static BOOL StartsWith(LPCSTR, DWORD, LPCSTR);
+static LPCSTR FindLevel(LPCSTR, DWORD);
+static BOOL CountWriter(LPCVOID, DWORD, LPVOID);
+static BOOL WriteLimitedRaw(LPSRV_LOG_STREAM, LPCSTR, DWORD);
+static BOOL WriteMarker(LPSRV_LOG_STREAM, BOOL);
+
+#define APPEND(lpStream, text) \
+	(memcpy((lpStream)->output + (lpStream)->dwOutputLength, (text), sizeof(text) - 1), \
+	(lpStream)->dwOutputLength += sizeof(text) - 1)
+
+BOOL SrvLogParseFormat(LPCSTR lpName, SRV_LOG_FORMAT* pFormat) {
+
+	if ((lpName == NULL) || (strcmp(lpName, "raw") == 0)) {
+		*pFormat = SRV_LOG_RAW;
+	}
+	else if (strcmp(lpName, "text") == 0) {
+		*pFormat = SRV_LOG_TEXT;
+	}
+	else if (strcmp(lpName, "json") == 0) {
+		*pFormat = SRV_LOG_JSON;
+	}
+	else {
+		SetLastError(ERROR_BAD_FORMAT);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+void SrvLogStreamInit(LPSRV_LOG_STREAM lpStream, LPCSTR lpName, SRV_LOG_WRITER lpWriter, LPVOID lpContext) {
+
+	memset(lpStream, 0, sizeof(*lpStream));
+	lpStream->lpName = lpName;
+	lpStream->format = SRV_LOG_RAW;
+	lpStream->lpWriter = lpWriter;
+	lpStream->lpContext = lpContext;
+}
+
+BOOL SrvLogStreamConfigure(LPSRV_LOG_STREAM lpStream, SRV_LOG_FORMAT format, LPCSTR lpInstance) {
+
+	BOOL bSuccess = SrvLogStreamFlush(lpStream, TRUE);
+
+	// Escape the instance name for JSON once rather than in every record.
+
+	DWORD dwLength = (DWORD)strlen(lpInstance);
+	if (dwLength > SRV_LOG_INSTANCE_SIZE) {
+		dwLength = SRV_LOG_INSTANCE_SIZE;
+	}
+
+	if (format == SRV_LOG_JSON) {
+		AppendEscaped(lpStream, lpInstance, dwLength);
+		memcpy(lpStream->instance, lpStream->output, lpStream->dwOutputLength);
+		lpStream->instance[lpStream->dwOutputLength] = 0;
+		lpStream->dwOutputLength = 0;
+	}
+	else {
+		memcpy(lpStream->instance, lpInstance, dwLength);
+		lpStream->instance[dwLength] = 0;
+	}
+
+	lpStream->format = format;
+	return bSuccess;
+}
+
+BOOL SrvLogStreamLimit(LPSRV_LOG_STREAM lpStream, SRV_LOG_POLICY policy,
+		DWORD dwRateBytes, DWORD dwBurstBytes, DWORD dwSample) {
+
+	BOOL bSuccess = WriteMarker(lpStream, TRUE);
+	SrvLogLimitConfigure(&lpStream->limiter, policy, dwRateBytes, dwBurstBytes, dwSample);
+	return bSuccess;
+}
+
+BOOL SrvLogStreamWrite(LPSRV_LOG_STREAM lpStream, LPCSTR lpData, DWORD dwLength) {
+
+	if (lpStream->format == SRV_LOG_RAW) {
+		if (lpStream->limiter.dwRateBytes != 0) {
+			return WriteLimitedRaw(lpStream, lpData, dwLength);
+		}
+		return lpStream->lpWriter(lpData, dwLength, lpStream->lpContext);
+	}
+
+	BOOL bSuccess = TRUE;
+
+	while (dwLength > 0) {
+
+		LPCSTR lpNewline = memchr(lpData, '\n', dwLength);
+		DWORD dwLineLength = (lpNewline != NULL) ? (DWORD)(lpNewline - lpData) : dwLength;
+
+		if ((lpNewline != NULL) && (lpStream->dwLineLength == 0)) {
+
+			// A whole line is transformed where it lies.
+
+			bSuccess = ProcessLine(lpStream, lpData, dwLineLength, TRUE) && bSuccess;
+		}
+		else {
+
+			// Gather the start of a line, passing on what does not fit
+			// as a piece of a longer line.
+
+			DWORD dwCopy = sizeof(lpStream->line) - lpStream->dwLineLength;
+			if (dwCopy > dwLineLength) {
+				dwCopy = dwLineLength;
+			}
+
+			memcpy(lpStream->line + lpStream->dwLineLength, lpData, dwCopy);
+			lpStream->dwLineLength += dwCopy;
+
+			if (lpStream->dwLineLength == sizeof(lpStream->line)) {
+				bSuccess = ProcessLine(lpStream, lpStream->line, lpStream->dwLineLength, FALSE) && bSuccess;
+				lpStream->dwLineLength = 0;
+				lpData += dwCopy;
+				dwLength -= dwCopy;
+				continue;
+			}
+
+			if (lpNewline == NULL) {
+				break;
+			}
+
+			bSuccess = ProcessLine(lpStream, lpStream->line, lpStream->dwLineLength, TRUE) && bSuccess;
+			lpStream->dwLineLength = 0;
+		}
+
+		lpData += dwLineLength + 1;
+		dwLength -= dwLineLength + 1;
+	}
+
+	return WriteRecords(lpStream, FALSE) && bSuccess;
+}
+
+BOOL SrvLogStreamFlush(LPSRV_LOG_STREAM lpStream, BOOL bEnd) {
+
+	BOOL bSuccess = TRUE;
+
+	if (bEnd && (lpStream->dwLineLength > 0)) {
+		bSuccess = ProcessLine(lpStream, lpStream->line, lpStream->dwLineLength, TRUE);
+		lpStream->dwLineLength = 0;
+	}
+
+	if (bEnd) {
+		lpStream->bJoinNext = FALSE;
+	}
+
+	// At the end report what was suppressed now; otherwise only if due.
+
+	if (!lpStream->bJoinNext) {
+		bSuccess = WriteMarker(lpStream, bEnd) && bSuccess;
+	}
+
+	FinishRecord(lpStream);
+	return WriteRecords(lpStream, TRUE) && bSuccess;
+}
+
+int SrvLogTransformBenchmark(LPCSTR lpFormat, DWORD dwMegabytes) {
+
+	static const char sample[] =
+			"2017-06-01 12:00:00.000 INFO  [main] com.example.Server - Listening on port 8080\n"
+			"2017-06-01 12:00:00.125 DEBUG [pool-1-thread-3] com.example.Cache - Miss for key \"order:1234\"\n"
+			"2017-06-01 12:00:00.250 WARN  [pool-1-thread-7] com.example.Client - Retrying after\ttimeout\r\n"
+			"2017-06-01 12:00:00.375 ERROR [pool-1-thread-2] com.example.Handler - Request failed\n"
+			"java.lang.IllegalStateException: Connection closed\n"
+			"\tat com.example.Connection.send(Connection.java:211)\n"
+			"\tat com.example.Handler.handle(Handler.java:88)\n"
+			"\tat java.lang.Thread.run(Thread.java:748)\n"
+			"Caused by: java.io.IOException: Broken pipe\n"
+			"\tat sun.nio.ch.FileDispatcherImpl.write0(Native Method)\n"
+			"\t... 3 more\n";
+
+	SRV_LOG_FORMAT format;
+	if (!SrvLogParseFormat(lpFormat, &format)) {
+		fprintf(stderr, "SrvWrap: unknown output log format %s\n", lpFormat);
+		return EXIT_FAILURE;
+	}
+
+	// Feed the stream reads the size of the pipe buffer, as the reader thread does.
+
+	static char input[65536];
+	DWORD dwInputLength = 0;
+	while (dwInputLength + sizeof(sample) - 1 <= sizeof(input)) {
+		memcpy(input + dwInputLength, sample, sizeof(sample) - 1);
+		dwInputLength += sizeof(sample) - 1;
+	}
+
+	static SRV_LOG_STREAM stream;
+	ULONGLONG ullOutputBytes = 0;
+	SrvLogStreamInit(&stream, "stdout", CountWriter, &ullOutputBytes);
+	SrvLogStreamConfigure(&stream, format, "SrvWrapBench1");
+	stream.dwProcessId = GetCurrentProcessId();
+
+	ULONGLONG ullInputBytes = 0;
+	ULONGLONG ullWantBytes = (ULONGLONG)dwMegabytes * 1024 * 1024;
+
+	LARGE_INTEGER liFrequency, liStart, liEnd;
+	QueryPerformanceFrequency(&liFrequency);
+	QueryPerformanceCounter(&liStart);
+
+	while (ullInputBytes < ullWantBytes) {
+		SrvLogStreamWrite(&stream, input, dwInputLength);
+		ullInputBytes += dwInputLength;
+	}
+	SrvLogStreamFlush(&stream, TRUE);
+
+	QueryPerformanceCounter(&liEnd);
+
+	double seconds = (double)(liEnd.QuadPart - liStart.QuadPart) / liFrequency.QuadPart;
+	if (seconds <= 0) {
+		seconds = 1e-9;
+	}
+
+	printf("format=%s input-bytes=%llu output-bytes=%llu lines=%llu records=%llu\n",
+			(lpFormat != NULL) ? lpFormat : "raw",
+			ullInputBytes, ullOutputBytes, stream.ullLines, stream.ullRecords);
+	printf("seconds=%.3f input-MBps=%.1f output-MBps=%.1f\n",
+			seconds,
+			ullInputBytes / seconds / (1024 * 1024),
+			ullOutputBytes / seconds / (1024 * 1024));
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Transform a line or, if not bComplete, the first part of one.
+ * A line longer than the line buffer is handled in pieces that
+ * continue one record, as long as the output buffer can hold it.
+ */
+static BOOL ProcessLine(LPSRV_LOG_STREAM lpStream, LPCSTR lpLine, DWORD dwLength, BOOL bComplete) {
+
+	if (bComplete && (dwLength > 0) && (lpLine[dwLength - 1] == '\r')) {
+		dwLength--;
+	}
+
+	BOOL bSuccess = TRUE;
+
+	do {
+		DWORD dwPiece = (dwLength > SRV_LOG_LINE_SIZE) ? SRV_LOG_LINE_SIZE : dwLength;
+		bSuccess = AppendLine(lpStream, lpLine, dwPiece) && bSuccess;
+		lpStream->bJoinNext = TRUE;
+		lpLine += dwPiece;
+		dwLength -= dwPiece;
+	} while (dwLength > 0);
+
+	lpStream->bJoinNext = !bComplete;
+	return bSuccess;
+}
+
+/**
+ * Add a piece of a line to the open record, or start a new record with it.
+ */
+static BOOL AppendLine(LPSRV_LOG_STREAM lpStream, LPCSTR lpLine, DWORD dwLength) {
+
+	LPSRV_LOG_LIMITER lpLimiter = &lpStream->limiter;
+
+	// The rest of a suppressed record is suppressed too.
+
+	if (lpLimiter->bSuppressing && (lpStream->bJoinNext || IsContinuation(lpLine, dwLength))) {
+		SrvLogLimitContinue(lpLimiter, dwLength, !lpStream->bJoinNext);
+		return TRUE;
+	}
+
+	BOOL bJoin = lpStream->bJoinNext && lpStream->bRecordOpen;
+	BOOL bContinue = !bJoin && lpStream->bRecordOpen && IsContinuation(lpLine, dwLength);
+	BOOL bSuccess = TRUE;
+
+	if (lpLimiter->dwRateBytes != 0) {
+
+		if (bJoin || bContinue) {
+			SrvLogLimitContinue(lpLimiter, dwLength, bContinue);
+		}
+		else {
+			BOOL bKeep = SrvLogLimitAdmit(lpLimiter, lpLine, dwLength);
+			bSuccess = WriteMarker(lpStream, FALSE);
+			if (!bKeep) {
+				FinishRecord(lpStream);
+				return bSuccess;
+			}
+		}
+	}
+
+	// Escaping can grow each byte to six, so count the escapes only when that
+	// much might not fit.  Make room by writing the finished records, then
+	// if need be by finishing the open one, so a record is only ever split
+	// when it is longer than the whole buffer.
+
+	DWORD dwNeed = RECORD_HEADER_MAX + ((lpStream->format == SRV_LOG_JSON) ? 6 * dwLength : dwLength) + 8;
+
+	if ((lpStream->dwOutputLength + dwNeed > sizeof(lpStream->output)) && (lpStream->format == SRV_LOG_JSON)) {
+		dwNeed = RECORD_HEADER_MAX + GetEscapedLength(lpLine, dwLength) + 8;
+	}
+
+	if (lpStream->dwOutputLength + dwNeed > sizeof(lpStream->output)) {
+
+		bSuccess = WriteRecords(lpStream, FALSE) && bSuccess;
+
+		if (lpStream->dwOutputLength + dwNeed > sizeof(lpStream->output)) {
+			FinishRecord(lpStream);
+			bSuccess = WriteRecords(lpStream, TRUE) && bSuccess;
+			bJoin = FALSE;
+			bContinue = FALSE;
+		}
+	}
+
+	if (bJoin) {
+		if (lpStream->format == SRV_LOG_TEXT) {
+			lpStream->dwOutputLength--;
+		}
+	}
+	else if (bContinue) {
+		if (lpStream->format == SRV_LOG_JSON) {
+			APPEND(lpStream, "\\n");
+		}
+		lpStream->ullLines++;
+	}
+	else {
+		FinishRecord(lpStream);
+		AppendHeader(lpStream, lpLine, dwLength);
+		lpStream->bRecordOpen = TRUE;
+		lpStream->ullLines++;
+	}
+
+	if (lpStream->format == SRV_LOG_JSON) {
+		AppendEscaped(lpStream, lpLine, dwLength);
+	}
+	else {
+		memcpy(lpStream->output + lpStream->dwOutputLength, lpLine, dwLength);
+		lpStream->dwOutputLength += dwLength;
+		APPEND(lpStream, "\n");
+	}
+
+	return bSuccess;
+}
+
+/**
+ * Start a record with the time, stream, instance and process id:
+ *
+ *	2017-06-01T12:00:00.123456Z stdout orders3 1234 <line>
+ *	{"time":"2017-06-01T12:00:00.123456Z","stream":"stdout","instance":"orders3","pid":1234,"level":"INFO","message":"<line>
+ *
+ * The time is formatted only when the second changes.
+ */
+static void AppendHeader(LPSRV_LOG_STREAM lpStream, LPCSTR lpLine, DWORD dwLength) {
+
+	FILETIME ft;
+	GetSystemTimePreciseAsFileTime(&ft);
+
+	ULARGE_INTEGER uli;
+	uli.LowPart = ft.dwLowDateTime;
+	uli.HighPart = ft.dwHighDateTime;
+
+	ULONGLONG ullSecond = uli.QuadPart / 10000000;
+
+	if ((ullSecond != lpStream->ullSecond) || (lpStream->secondText[0] == 0)) {
+		SYSTEMTIME st;
+		FileTimeToSystemTime(&ft, &st);
+		_snprintf(lpStream->secondText, sizeof(lpStream->secondText), "%04u-%02u-%02uT%02u:%02u:%02u",
+				st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+		lpStream->secondText[sizeof(lpStream->secondText) - 1] = 0;
+		lpStream->ullSecond = ullSecond;
+	}
+
+	BOOL bJson = (lpStream->format == SRV_LOG_JSON);
+	DWORD dwMicros = (DWORD)((uli.QuadPart % 10000000) / 10);
+
+	if (bJson) {
+		APPEND(lpStream, "{\"time\":\"");
+	}
+
+	DWORD dwTextLength = (DWORD)strlen(lpStream->secondText);
+	memcpy(lpStream->output + lpStream->dwOutputLength, lpStream->secondText, dwTextLength);
+	lpStream->dwOutputLength += dwTextLength;
+	APPEND(lpStream, ".");
+	AppendDecimal(lpStream, dwMicros, 6);
+
+	if (bJson) {
+		APPEND(lpStream, "Z\",\"stream\":\"");
+	}
+	else {
+		APPEND(lpStream, "Z ");
+	}
+
+	DWORD dwNameLength = (DWORD)strlen(lpStream->lpName);
+	memcpy(lpStream->output + lpStream->dwOutputLength, lpStream->lpName, dwNameLength);
+	lpStream->dwOutputLength += dwNameLength;
+
+	if (bJson) {
+		APPEND(lpStream, "\",\"instance\":\"");
+	}
+	else {
+		APPEND(lpStream, " ");
+	}
+
+	DWORD dwInstanceLength = (DWORD)strlen(lpStream->instance);
+	memcpy(lpStream->output + lpStream->dwOutputLength, lpStream->instance, dwInstanceLength);
+	lpStream->dwOutputLength += dwInstanceLength;
+
+	if (bJson) {
+		APPEND(lpStream, "\",\"pid\":");
+	}
+	else {
+		APPEND(lpStream, " ");
+	}
+
+	AppendDecimal(lpStream, lpStream->dwProcessId, 1);
+
+	if (!bJson) {
+		APPEND(lpStream, " ");
+		return;
+	}
+
+	LPCSTR lpLevel = FindLevel(lpLine, dwLength);
+	if (lpLevel != NULL) {
+		APPEND(lpStream, ",\"level\":\"");
+		DWORD dwLevelLength = (DWORD)strlen(lpLevel);
+		memcpy(lpStream->output + lpStream->dwOutputLength, lpLevel, dwLevelLength);
+		lpStream->dwOutputLength += dwLevelLength;
+		APPEND(lpStream, "\"");
+	}
+
+	APPEND(lpStream, ",\"message\":\"");
+}
+
+/**
+ * Append text as the inside of a JSON string.  Bytes from 0x80 up are
+ * copied, so UTF-8 from the child stays UTF-8.
+ */
+static void AppendEscaped(LPSRV_LOG_STREAM lpStream, LPCSTR lpText, DWORD dwLength) {
+
+	static const char hex[] = "0123456789abcdef";
+
+	LPSTR lpOut = lpStream->output + lpStream->dwOutputLength;
+
+	for (DWORD i = 0; i < dwLength; i++) {
+
+		unsigned char c = (unsigned char)lpText[i];
+
+		if ((c >= 0x20) && (c != '"') && (c != '\\')) {
+			*lpOut++ = c;
+			continue;
+		}
+
+		*lpOut++ = '\\';
+
+		switch (c) {
+		case '"':
+		case '\\':
+			*lpOut++ = c;
+			break;
+		case '\t':
+			*lpOut++ = 't';
+			break;
+		case '\r':
+			*lpOut++ = 'r';
+			break;
+		case '\n':
+			*lpOut++ = 'n';
+			break;
+		default:
+			*lpOut++ = 'u';
+			*lpOut++ = '0';
+			*lpOut++ = '0';
+			*lpOut++ = hex[c >> 4];
+			*lpOut++ = hex[c & 0xF];
+			break;
+		}
+	}
+
+	lpStream->dwOutputLength = (DWORD)(lpOut - lpStream->output);
+}
+
+static DWORD GetEscapedLength(LPCSTR lpText, DWORD dwLength) {
+
+	DWORD dwEscaped = dwLength;
+
+	for (DWORD i = 0; i < dwLength; i++) {
+		unsigned char c = (unsigned char)lpText[i];
+		if ((c == '"') || (c == '\\') || (c == '\t') || (c == '\r') || (c == '\n')) {
+			dwEscaped += 1;
+		}
+		else if (c < 0x20) {
+			dwEscaped += 5;
+		}
+	}
+
+	return dwEscaped;
+}
+
+/**
+ * Append a number with at least dwDigits digits, zero padded.
+ */
+static void AppendDecimal(LPSRV_LOG_STREAM lpStream, DWORD dwValue, DWORD dwDigits) {
+
+	char digits[10];
+	DWORD dwCount = 0;
+
+	do {
+		digits[dwCount++] = (char)('0' + dwValue % 10);
+		dwValue /= 10;
+	} while ((dwValue > 0) || (dwCount < dwDigits));
+
+	while (dwCount > 0) {
+		lpStream->output[lpStream->dwOutputLength++] = digits[--dwCount];
+	}
+}
+
+/**
+ * End the open record, if any.  Everything before the end is then ready to write.
+ */
+static void FinishRecord(LPSRV_LOG_STREAM lpStream) {
+
+	if (lpStream->bRecordOpen) {
+		if (lpStream->format == SRV_LOG_JSON) {
+			APPEND(lpStream, "\"}\n");
+		}
+		lpStream->bRecordOpen = FALSE;
+		lpStream->ullRecords++;
+	}
+
+	lpStream->dwRecordStart = lpStream->dwOutputLength;
+}
+
+/**
+ * Write the records before the open one or, if bAll, everything in the buffer.
+ * What was written is dropped even if the write failed, so that a full disk
+ * does not stall the child.
+ */
+static BOOL WriteRecords(LPSRV_LOG_STREAM lpStream, BOOL bAll) {
+
+	DWORD dwEnd = bAll ? lpStream->dwOutputLength : lpStream->dwRecordStart;
+
+	if (dwEnd == 0) {
+		return TRUE;
+	}
+
+	BOOL bSuccess = lpStream->lpWriter(lpStream->output, dwEnd, lpStream->lpContext);
+
+	memmove(lpStream->output, lpStream->output + dwEnd, lpStream->dwOutputLength - dwEnd);
+	lpStream->dwOutputLength -= dwEnd;
+	lpStream->dwRecordStart = bAll ? 0 : lpStream->dwRecordStart - dwEnd;
+
+	return bSuccess;
+}
+
+/**
+ * A Java stack trace line: an indented "at ", "... n more" or "Suppressed: ",
+ * or a "Caused by: " line, indented or not.
+ */
+static BOOL IsContinuation(LPCSTR lpLine, DWORD dwLength) {
+
+	DWORD i = 0;
+	while ((i < dwLength) && ((lpLine[i] == ' ') || (lpLine[i] == '\t'))) {
+		i++;
+	}
+
+	if (StartsWith(lpLine + i, dwLength - i, "Caused by: ")) {
+		return TRUE;
+	}
+
+	return (i > 0)
+			&& (StartsWith(lpLine + i, dwLength - i, "at ")
+				|| StartsWith(lpLine + i, dwLength - i, "... ")
+				|| StartsWith(lpLine + i, dwLength - i, "Suppressed: "));
+}
+
+static BOOL StartsWith(LPCSTR lpText, DWORD dwLength, LPCSTR lpPrefix) {
+
+	DWORD dwPrefixLength = (DWORD)strlen(lpPrefix);
+	return (dwLength >= dwPrefixLength) && (memcmp(lpText, lpPrefix, dwPrefixLength) == 0);
+}
+
+/**
+ * Find the first level word, in capitals and standing alone,
+ * near the start of a line.
+ *
+ * Returns the level it stands for, or NULL if there is none.
+ */
+static LPCSTR FindLevel(LPCSTR lpLine, DWORD dwLength) {
+
+	if (dwLength > LEVEL_SCAN_LENGTH) {
+		dwLength = LEVEL_SCAN_LENGTH;
+	}
+
+	for (DWORD i = 0; i < dwLength; i++) {
+
+		if ((lpLine[i] < 'A') || (lpLine[i] > 'Z') || ((i > 0) && isalnum((unsigned char)lpLine[i - 1]))) {
+			continue;
+		}
+
+		for (DWORD j = 0; j < sizeof(levels) / sizeof(levels[0]); j++) {
+			DWORD dwWordLength = (DWORD)strlen(levels[j].lpWord);
+			if (StartsWith(lpLine + i, dwLength - i, levels[j].lpWord)
+					&& ((i + dwWordLength == dwLength) || !isalnum((unsigned char)lpLine[i + dwWordLength]))) {
+				return levels[j].lpLevel;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Write raw output a line at a time as the limit allows, passing on each run
+ * of kept lines where it lies.
+ */
+static BOOL WriteLimitedRaw(LPSRV_LOG_STREAM lpStream, LPCSTR lpData, DWORD dwLength) {
+
+	LPSRV_LOG_LIMITER lpLimiter = &lpStream->limiter;
+	LPCSTR lpKept = lpData;
+	DWORD dwKeptLength = 0;
+	BOOL bSuccess = TRUE;
+
+	while (dwLength > 0) {
+
+		LPCSTR lpNewline = memchr(lpData, '\n', dwLength);
+		DWORD dwLineLength = (lpNewline != NULL) ? (DWORD)(lpNewline - lpData) + 1 : dwLength;
+		DWORD dwTextLength = (lpNewline != NULL) ? dwLineLength - 1 : dwLineLength;
+		BOOL bKeep;
+
+		if (lpStream->bJoinNext) {
+			bKeep = SrvLogLimitContinue(lpLimiter, dwLineLength, FALSE);
+		}
+		else if (IsContinuation(lpData, dwTextLength)) {
+			bKeep = SrvLogLimitContinue(lpLimiter, dwTextLength, TRUE);
+		}
+		else {
+			bKeep = SrvLogLimitAdmit(lpLimiter, lpData, dwTextLength);
+
+			char marker[SRV_LOG_MARKER_SIZE];
+			DWORD dwMarkerLength = SrvLogLimitTakeMarker(lpLimiter, FALSE, marker, sizeof(marker) - 1);
+
+			if (dwMarkerLength > 0) {
+				if (dwKeptLength > 0) {
+					bSuccess = lpStream->lpWriter(lpKept, dwKeptLength, lpStream->lpContext) && bSuccess;
+					dwKeptLength = 0;
+				}
+				marker[dwMarkerLength++] = '\n';
+				bSuccess = lpStream->lpWriter(marker, dwMarkerLength, lpStream->lpContext) && bSuccess;
+			}
+		}
+
+		if (bKeep) {
+			if (dwKeptLength == 0) {
+				lpKept = lpData;
+			}
+			dwKeptLength += dwLineLength;
+		}
+		else if (dwKeptLength > 0) {
+			bSuccess = lpStream->lpWriter(lpKept, dwKeptLength, lpStream->lpContext) && bSuccess;
+			dwKeptLength = 0;
+		}
+
+		lpStream->bJoinNext = (lpNewline == NULL);
+		lpData += dwLineLength;
+		dwLength -= dwLineLength;
+	}
+
+	if (dwKeptLength > 0) {
+		bSuccess = lpStream->lpWriter(lpKept, dwKeptLength, lpStream->lpContext) && bSuccess;
+	}
+
+	return bSuccess;
+}
+
+/**
+ * Write a marker for what the limit suppressed, as a record of its own,
+ * if one is due or bForce.  Must be called between lines.
+ */
+static BOOL WriteMarker(LPSRV_LOG_STREAM lpStream, BOOL bForce) {
+
+	char marker[SRV_LOG_MARKER_SIZE];
+	DWORD dwLength = SrvLogLimitTakeMarker(&lpStream->limiter, bForce, marker, sizeof(marker) - 1);
+
+	if (dwLength == 0) {
+		return TRUE;
+	}
+
+	if (lpStream->format == SRV_LOG_RAW) {
+		marker[dwLength++] = '\n';
+		return lpStream->lpWriter(marker, dwLength, lpStream->lpContext);
+	}
+
+	BOOL bSuccess = TRUE;
+
+	FinishRecord(lpStream);
+
+	if (lpStream->dwOutputLength + RECORD_HEADER_MAX + 6 * dwLength + 8 > sizeof(lpStream->output)) {
+		bSuccess = WriteRecords(lpStream, TRUE);
+	}
+
+	AppendHeader(lpStream, marker, dwLength);
+
+	if (lpStream->format == SRV_LOG_JSON) {
+		AppendEscaped(lpStream, marker, dwLength);
+	}
+	else {
+		memcpy(lpStream->output + lpStream->dwOutputLength, marker, dwLength);
+		lpStream->dwOutputLength += dwLength;
+		APPEND(lpStream, "\n");
+	}
+
+	lpStream->bRecordOpen = TRUE;
+	FinishRecord(lpStream);
+
+	return bSuccess;
+}
+
+/**
+ * Discard output, counting its bytes, for the benchmark.
+ */
+static BOOL CountWriter(LPCVOID lpData, DWORD dwLength, LPVOID lpContext) {
+
+	*(ULONGLONG*)lpContext += dwLength;
+	return TRUE;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVLOGTRANSFORM_H_
+#define SRVLOGTRANSFORM_H_
+
+#include <windows.h>
+
+#include "SrvLogLimit.h"
+
+/**
+ * Formats of captured output.
+ *
+ *	SRV_LOG_RAW		the bytes as the child wrote them.
+ *	SRV_LOG_TEXT	each line prefixed with the time, stream, instance and process id.
+ *	SRV_LOG_JSON	one JSON object per record with those fields, the level
+ *					if the first line names one, and the message.
+ *
+ * In the text and JSON formats, stack trace lines such as "\tat ...",
+ * "\t... 5 more" and "Caused by: ..." continue the record before them.
+ */
+typedef enum {
+	SRV_LOG_RAW,
+	SRV_LOG_TEXT,
+	SRV_LOG_JSON
+} SRV_LOG_FORMAT;
+
+#define SRV_LOG_LINE_SIZE 8192			// longer lines are gathered in pieces
+#define SRV_LOG_OUTPUT_SIZE 65536
+#define SRV_LOG_INSTANCE_SIZE 64
+
+/**
+ * Write transformed output.  Returns FALSE if it could not be written.
+ */
+typedef BOOL (*SRV_LOG_WRITER)(LPCVOID lpData, DWORD dwLength, LPVOID lpContext);
+
+/**
+ * The state of one output stream of the child.  Lines are gathered and records
+ * built in fixed buffers, so transforming allocates nothing.  A record is held
+ * until it cannot continue, so that a stack trace is written in one piece.
+ */
+typedef struct tagSRV_LOG_STREAM {
+	LPCSTR lpName;						// "stdout" or "stderr"
+	SRV_LOG_FORMAT format;
+	char instance[SRV_LOG_INSTANCE_SIZE * 6 + 1];	// escaped in JSON format
+	DWORD dwProcessId;
+	SRV_LOG_WRITER lpWriter;
+	LPVOID lpContext;
+	char line[SRV_LOG_LINE_SIZE];		// the start of a line not yet ended
+	DWORD dwLineLength;
+	BOOL bJoinNext;						// the next piece continues the last line
+	char output[SRV_LOG_OUTPUT_SIZE];
+	DWORD dwOutputLength;
+	DWORD dwRecordStart;				// where the open record starts in output
+	BOOL bRecordOpen;
+	ULONGLONG ullSecond;				// the second of secondText
+	char secondText[24];
+	ULONGLONG ullLines;
+	ULONGLONG ullRecords;
+	SRV_LOG_LIMITER limiter;
+} SRV_LOG_STREAM, *LPSRV_LOG_STREAM;
+
+/**
+ * Convert "raw", "text" or "json" to a format.  NULL means raw.
+ */
+BOOL SrvLogParseFormat(LPCSTR lpName, SRV_LOG_FORMAT* pFormat);
+
+/**
+ * Prepare a stream, in raw format until configured.
+ */
+void SrvLogStreamInit(LPSRV_LOG_STREAM lpStream, LPCSTR lpName, SRV_LOG_WRITER lpWriter, LPVOID lpContext);
+
+/**
+ * Change the format and instance name, first writing any open record
+ * and unfinished line.
+ */
+BOOL SrvLogStreamConfigure(LPSRV_LOG_STREAM lpStream, SRV_LOG_FORMAT format, LPCSTR lpInstance);
+
+/**
+ * Limit the rate of the stream, first writing a marker for anything
+ * suppressed under the old limit.  See SrvLogLimit.h.  Records are then
+ * kept or suppressed whole, a stack trace with its first line, and in raw
+ * format each line is treated as a record.
+ */
+BOOL SrvLogStreamLimit(LPSRV_LOG_STREAM lpStream, SRV_LOG_POLICY policy,
+		DWORD dwRateBytes, DWORD dwBurstBytes, DWORD dwSample);
+
+/**
+ * Transform output read from the child and write the finished records.
+ * Raw output is written as it is, less any lines suppressed by a limit.
+ */
+BOOL SrvLogStreamWrite(LPSRV_LOG_STREAM lpStream, LPCSTR lpData, DWORD dwLength);
+
+/**
+ * Finish the open record and write it, for when the child has paused.
+ * If bEnd, an unfinished line is written as a record too.
+ */
+BOOL SrvLogStreamFlush(LPSRV_LOG_STREAM lpStream, BOOL bEnd);
+
+/**
+ * Time transforming dwMegabytes of sample output, with stack traces,
+ * to a writer that discards it, and print the throughput to standard output.
+ *
+ * Returns a process exit code.
+ */
+int SrvLogTransformBenchmark(LPCSTR lpFormat, DWORD dwMegabytes);
+
+#endif /* SRVLOGTRANSFORM_H_ */
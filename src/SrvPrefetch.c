@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "SrvPrefetch.h"
+#include "SrvState.h"
+
+#define PREFETCH_READ_SIZE (1024 * 1024)
+#define MEGABYTE (1024.0 * 1024.0)
+
+// Files to read, claimed by the reader threads in order.
+
+static LPSTR* lpFiles = NULL;
+static DWORD dwFileCount = 0;
+static DWORD dwFileCapacity = 0;
+static volatile LONG lNextFile = 0;
+
+static HANDLE hThreads[SRV_PREFETCH_MAX_THREADS];
+static DWORD dwThreadCount = 0;
+static volatile LONG lActiveThreads = 0;
+static volatile BOOL bCancel = FALSE;
+
+// Results.
+
+static volatile LONGLONG llBytesRead = 0;
+static volatile LONG lFilesRead = 0;
+static ULONGLONG ullStarted = 0;
+static volatile ULONGLONG ullFinished = 0;
+
+static DWORD dwColdStartMillis = 0;
+static DWORD dwWarmStartMillis = 0;
+static DWORD dwWarmStarts = 0;
+
+static BOOL AddEntry(LPCSTR);
+static BOOL AddListFile(LPCSTR);
+static BOOL AddFile(LPCSTR);
+static DWORD WINAPI PrefetchThread(LPVOID);
+
+BOOL SrvPrefetchStart(LPSRV_CONFIG lpSrvConfig) {
+
+	if (lpSrvConfig->lpPrefetch == NULL) {
+		return TRUE;
+	}
+
+	if ((lpSrvConfig->dwPrefetchThreads == 0) || (lpSrvConfig->dwPrefetchThreads > SRV_PREFETCH_MAX_THREADS)) {
+		SetLastError(ERROR_BAD_FORMAT);
+		return FALSE;
+	}
+
+	// Entries are separated by semicolons, as in PATH.
+
+	char entries[MAX_PATH * 4];
+	if (strlen(lpSrvConfig->lpPrefetch) >= sizeof(entries)) {
+		SetLastError(ERROR_BAD_FORMAT);
+		return FALSE;
+	}
+	strcpy(entries, lpSrvConfig->lpPrefetch);
+
+	for (LPSTR pEntry = strtok(entries, ";"); pEntry != NULL; pEntry = strtok(NULL, ";")) {
+		if (!AddEntry(pEntry)) {
+			return FALSE;
+		}
+	}
+
+	// Files are read in the order given, usually the order the child opens them.
+
+	ullStarted = GetTickCount64();
+	ullFinished = 0;
+
+	DWORD dwThreads = lpSrvConfig->dwPrefetchThreads;
+	if (dwThreads > dwFileCount) {
+		dwThreads = dwFileCount;
+	}
+
+	if (dwThreads == 0) {
+		ullFinished = ullStarted;
+		return TRUE;
+	}
+
+	lActiveThreads = (LONG)dwThreads;
+
+	for (dwThreadCount = 0; dwThreadCount < dwThreads; dwThreadCount++) {
+
+		hThreads[dwThreadCount] = CreateThread(NULL, 0, PrefetchThread, NULL, 0, NULL);
+		if (hThreads[dwThreadCount] == NULL) {
+			DWORD dwLastError = GetLastError();
+			InterlockedExchangeAdd(&lActiveThreads, -(LONG)(dwThreads - dwThreadCount));
+			SetLastError(dwLastError);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+BOOL SrvPrefetchWait(DWORD dwWaitMillis) {
+
+	if (dwThreadCount == 0) {
+		return TRUE;
+	}
+
+	DWORD dwStarted = GetTickCount();
+	DWORD dwElapsed = 0;
+	DWORD waitResult = WAIT_TIMEOUT;
+
+	while ((waitResult == WAIT_TIMEOUT) && (dwElapsed < dwWaitMillis)) {
+
+		DWORD dwRemaining = dwWaitMillis - dwElapsed;
+		SrvStateCheckPoint(dwRemaining + 3000);
+
+		waitResult = WaitForMultipleObjects(dwThreadCount, hThreads, TRUE, (dwRemaining < 1000) ? dwRemaining : 1000);
+		dwElapsed = GetTickCount() - dwStarted;
+	}
+
+	return waitResult == WAIT_OBJECT_0;
+}
+
+void SrvPrefetchNoteReady(LPSRV_CHILD lpChild) {
+
+	ULARGE_INTEGER uliLaunched, uliReady;
+	uliLaunched.LowPart = lpChild->ftLaunched.dwLowDateTime;
+	uliLaunched.HighPart = lpChild->ftLaunched.dwHighDateTime;
+	uliReady.LowPart = lpChild->ftReady.dwLowDateTime;
+	uliReady.HighPart = lpChild->ftReady.dwHighDateTime;
+
+	DWORD dwMillis = (DWORD)((uliReady.QuadPart - uliLaunched.QuadPart) / 10000);
+
+	if (lpChild->dwLaunches <= 1) {
+		dwColdStartMillis = dwMillis;
+	}
+	else {
+		dwWarmStartMillis = dwMillis;
+		dwWarmStarts++;
+	}
+}
+
+DWORD SrvPrefetchFormat(LPSTR lpBuffer, DWORD dwSize) {
+
+	ULONGLONG ullFinishedAt = ullFinished;
+
+	int length = _snprintf(lpBuffer, dwSize,
+			"prefetch files=%ld/%lu read=%.1fMB %s=%llums cold-start=%lums warm-start=%lums warm-starts=%lu\n",
+			lFilesRead,
+			dwFileCount,
+			llBytesRead / MEGABYTE,
+			(ullFinishedAt != 0) ? "took" : "running",
+			((ullFinishedAt != 0) ? ullFinishedAt : GetTickCount64()) - ullStarted,
+			dwColdStartMillis,
+			dwWarmStartMillis,
+			dwWarmStarts);
+
+	if ((length < 0) || ((DWORD)length >= dwSize)) {
+		length = dwSize - 1;
+	}
+	lpBuffer[length] = 0;
+
+	return length;
+}
+
+void SrvPrefetchClose(void) {
+
+	bCancel = TRUE;
+
+	if (dwThreadCount != 0) {
+		WaitForMultipleObjects(dwThreadCount, hThreads, TRUE, INFINITE);
+	}
+
+	for (DWORD i = 0; i < dwThreadCount; i++) {
+		CloseHandle(hThreads[i]);
+	}
+	dwThreadCount = 0;
+
+	HANDLE hHeap = GetProcessHeap();
+
+	for (DWORD i = 0; i < dwFileCount; i++) {
+		HeapFree(hHeap, 0, lpFiles[i]);
+	}
+	if (lpFiles != NULL) {
+		HeapFree(hHeap, 0, lpFiles);
+	}
+
+	lpFiles = NULL;
+	dwFileCount = 0;
+	dwFileCapacity = 0;
+}
+
+/**
+ * Add the files named by one Prefetch entry: a path, a path whose last
+ * component has wildcards, or @ followed by a list file.
+ * Paths that match nothing are ignored, since the child may not need them.
+ */
+static BOOL AddEntry(LPCSTR lpEntry) {
+
+	while ((*lpEntry == ' ') || (*lpEntry == '\t')) {
+		lpEntry++;
+	}
+
+	if (*lpEntry == 0) {
+		return TRUE;
+	}
+
+	if (*lpEntry == '@') {
+		return AddListFile(lpEntry + 1);
+	}
+
+	if (strpbrk(lpEntry, "*?") == NULL) {
+		return AddFile(lpEntry);
+	}
+
+	// FindFirstFile() returns names without the directory.
+
+	LPCSTR pSlash = strrchr(lpEntry, '\\');
+	LPCSTR pForward = strrchr(lpEntry, '/');
+	if ((pSlash == NULL) || ((pForward != NULL) && (pForward > pSlash))) {
+		pSlash = pForward;
+	}
+	size_t dirLength = (pSlash != NULL) ? (size_t)(pSlash - lpEntry + 1) : 0;
+
+	WIN32_FIND_DATA findData;
+	HANDLE hFind = FindFirstFile(lpEntry, &findData);
+
+	if (hFind == INVALID_HANDLE_VALUE) {
+		return TRUE;
+	}
+
+	BOOL bSuccess = TRUE;
+
+	do {
+		if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0) {
+			continue;
+		}
+
+		char path[MAX_PATH];
+		if (dirLength + strlen(findData.cFileName) >= sizeof(path)) {
+			continue;
+		}
+
+		memcpy(path, lpEntry, dirLength);
+		strcpy(path + dirLength, findData.cFileName);
+
+		bSuccess = AddFile(path);
+
+	} while (bSuccess && FindNextFile(hFind, &findData));
+
+	FindClose(hFind);
+	return bSuccess;
+}
+
+/**
+ * Add the entries in a list file, one per line.
+ */
+static BOOL AddListFile(LPCSTR lpPath) {
+
+	FILE* file = fopen(lpPath, "r");
+	if (file == NULL) {
+		return TRUE;
+	}
+
+	BOOL bSuccess = TRUE;
+	char line[MAX_PATH + 2];
+
+	while (bSuccess && (fgets(line, sizeof(line), file) != NULL)) {
+
+		line[strcspn(line, "\r\n")] = 0;
+
+		// A list file may not name further list files.
+
+		if (line[0] != '@') {
+			bSuccess = AddEntry(line);
+		}
+	}
+
+	fclose(file);
+	return bSuccess;
+}
+
+/**
+ * Add one file to the list.
+ */
+static BOOL AddFile(LPCSTR lpPath) {
+
+	HANDLE hHeap = GetProcessHeap();
+
+	if (dwFileCount == dwFileCapacity) {
+
+		DWORD dwNewCapacity = (dwFileCapacity == 0) ? 64 : dwFileCapacity * 2;
+		LPSTR* lpNewFiles = (lpFiles == NULL)
+				? HeapAlloc(hHeap, 0, dwNewCapacity * sizeof(LPSTR))
+				: HeapReAlloc(hHeap, 0, lpFiles, dwNewCapacity * sizeof(LPSTR));
+
+		if (lpNewFiles == NULL) {
+			SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+			return FALSE;
+		}
+
+		lpFiles = lpNewFiles;
+		dwFileCapacity = dwNewCapacity;
+	}
+
+	LPSTR lpCopy = HeapAlloc(hHeap, 0, strlen(lpPath) + 1);
+	if (lpCopy == NULL) {
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return FALSE;
+	}
+
+	strcpy(lpCopy, lpPath);
+	lpFiles[dwFileCount++] = lpCopy;
+	return TRUE;
+}
+
+/**
+ * Read whole files with large sequential reads until none are left.
+ * The data is discarded; only the file cache keeps it.
+ */
+static DWORD WINAPI PrefetchThread(LPVOID lpParameter) {
+
+	LPBYTE lpBuffer = VirtualAlloc(NULL, PREFETCH_READ_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+	if (lpBuffer != NULL) {
+
+		LONG lIndex;
+
+		while (!bCancel && ((lIndex = InterlockedIncrement(&lNextFile) - 1) < (LONG)dwFileCount)) {
+
+			HANDLE hFile = CreateFile(lpFiles[lIndex], GENERIC_READ,
+					FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+					OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+			if (hFile == INVALID_HANDLE_VALUE) {
+				continue;
+			}
+
+			DWORD dwRead;
+			LONGLONG llFileBytes = 0;
+
+			while (!bCancel && ReadFile(hFile, lpBuffer, PREFETCH_READ_SIZE, &dwRead, NULL) && (dwRead != 0)) {
+				llFileBytes += dwRead;
+			}
+
+			CloseHandle(hFile);
+
+			InterlockedExchangeAdd64(&llBytesRead, llFileBytes);
+			InterlockedIncrement(&lFilesRead);
+		}
+
+		VirtualFree(lpBuffer, 0, MEM_RELEASE);
+	}
+
+	if (InterlockedDecrement(&lActiveThreads) == 0) {
+		ullFinished = GetTickCount64();
+	}
+
+	return 0;
+}
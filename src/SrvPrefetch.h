@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVPREFETCH_H_
+#define SRVPREFETCH_H_
+
+#include <windows.h>
+
+#include "SrvConfig.h"
+#include "SrvChild.h"
+
+/**
+ * Most threads used to read files.
+ */
+#define SRV_PREFETCH_MAX_THREADS 16
+
+/**
+ * Start reading the files named by the Prefetch setting into the file cache
+ * on background threads.  Each entry is a path, a path whose last component
+ * has wildcards, or @ followed by a file listing one such path per line.
+ * Does nothing if Prefetch is not configured.
+ *
+ * Returns FALSE with ERROR_BAD_FORMAT if PrefetchThreads is out of range.
+ */
+BOOL SrvPrefetchStart(LPSRV_CONFIG lpSrvConfig);
+
+/**
+ * Wait up to dwWaitMillis for reading to finish, reporting progress to the SCM
+ * about once a second.  Reading continues in the background after a timeout.
+ *
+ * Returns TRUE if reading has finished.
+ */
+BOOL SrvPrefetchWait(DWORD dwWaitMillis);
+
+/**
+ * Note how long a child took to become ready.  The first launch
+ * is a cold start; relaunches find the files cached by earlier runs.
+ */
+void SrvPrefetchNoteReady(LPSRV_CHILD lpChild);
+
+/**
+ * Format the prefetch results and start times into a buffer.
+ *
+ * Returns the number of characters written, not including the terminator.
+ */
+DWORD SrvPrefetchFormat(LPSTR lpBuffer, DWORD dwSize);
+
+/**
+ * Stop reading and release the file list.
+ */
+void SrvPrefetchClose(void);
+
+#endif /* SRVPREFETCH_H_ */
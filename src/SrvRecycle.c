@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+
+#include <stdio.h>
+
+#include "SrvRecycle.h"
+
+#define MEGABYTE (1024.0 * 1024.0)
+
+static HANDLE hTimer = NULL;
+
+// Settings.
+
+static BOOL bEnabled = FALSE;
+static ULONGLONG ullMaxPrivateBytes = 0;
+static DWORD dwMaxGrowthMBPerHour = 0;
+static DWORD dwMaxUptimeMinutes = 0;
+
+// Samples of the current child, oldest first from dwFirst.
+
+static ULONGLONG sampleTicks[SRV_RECYCLE_WINDOW];
+static ULONGLONG sampleBytes[SRV_RECYCLE_WINDOW];
+static DWORD dwSamples = 0;
+static DWORD dwFirst = 0;
+
+static ULONGLONG ullPrivateBytes = 0;
+static ULONGLONG ullWorkingSetBytes = 0;
+static double growthMBPerHour = 0.0;
+
+// Recycling.
+
+static BOOL bRecycleRequested = FALSE;
+static BOOL bReportReclaimed = FALSE;
+static ULONGLONG ullBytesBeforeRecycle = 0;
+static DWORD dwRecycles = 0;
+static LONGLONG llLastReclaimed = 0;
+
+static double GetGrowthMBPerHour(void);
+
+BOOL SrvRecycleOpen(void) {
+
+	hTimer = CreateWaitableTimer(NULL, FALSE, NULL);
+
+	return hTimer != NULL;
+}
+
+BOOL SrvRecycleConfigure(LPSRV_CONFIG lpSrvConfig) {
+
+	CancelWaitableTimer(hTimer);
+
+	ullMaxPrivateBytes = (ULONGLONG)lpSrvConfig->dwRecycleMaxPrivateMB * 1024 * 1024;
+	dwMaxGrowthMBPerHour = lpSrvConfig->dwRecycleMaxGrowthMBPerHour;
+	dwMaxUptimeMinutes = lpSrvConfig->dwRecycleAfterMinutes;
+
+	bEnabled = (ullMaxPrivateBytes != 0) || (dwMaxGrowthMBPerHour != 0) || (dwMaxUptimeMinutes != 0);
+
+	dwSamples = 0;
+	dwFirst = 0;
+
+	if (!bEnabled) {
+		return TRUE;
+	}
+
+	if (lpSrvConfig->dwRecycleSampleMillis == 0) {
+		SetLastError(ERROR_BAD_FORMAT);
+		return FALSE;
+	}
+
+	LARGE_INTEGER liDueTime;
+	liDueTime.QuadPart = -(LONGLONG)lpSrvConfig->dwRecycleSampleMillis * 10000;
+
+	return SetWaitableTimer(hTimer, &liDueTime, lpSrvConfig->dwRecycleSampleMillis, NULL, NULL, FALSE);
+}
+
+HANDLE SrvRecycleGetTimer(void) {
+	return hTimer;
+}
+
+BOOL SrvRecycleSample(LPSRV_CHILD lpChild, BOOL bActive, LPSTR lpMessage, DWORD dwSize) {
+
+	lpMessage[0] = 0;
+
+	if (!bEnabled || !bActive || bRecycleRequested) {
+		return FALSE;
+	}
+
+	if (!SrvChildGetMemory(lpChild, &ullPrivateBytes, &ullWorkingSetBytes)) {
+		return FALSE;
+	}
+
+	// The first sample after a recycle shows what it gave back.
+
+	if (bReportReclaimed) {
+
+		bReportReclaimed = FALSE;
+		llLastReclaimed = (LONGLONG)ullBytesBeforeRecycle - (LONGLONG)ullPrivateBytes;
+
+		_snprintf(lpMessage, dwSize, "Recycle reclaimed %.1f MB, private bytes %.1f MB before and %.1f MB after",
+				llLastReclaimed / MEGABYTE, ullBytesBeforeRecycle / MEGABYTE, ullPrivateBytes / MEGABYTE);
+		lpMessage[dwSize - 1] = 0;
+	}
+
+	// Add the sample, dropping the oldest once the window is full.
+
+	DWORD dwIndex = (dwFirst + dwSamples) % SRV_RECYCLE_WINDOW;
+	if (dwSamples == SRV_RECYCLE_WINDOW) {
+		dwFirst = (dwFirst + 1) % SRV_RECYCLE_WINDOW;
+	}
+	else {
+		dwSamples++;
+	}
+
+	sampleTicks[dwIndex] = GetTickCount64();
+	sampleBytes[dwIndex] = ullPrivateBytes;
+
+	// Judge the trend only over a full window so that startup does not count as a leak.
+
+	growthMBPerHour = (dwSamples == SRV_RECYCLE_WINDOW) ? GetGrowthMBPerHour() : 0.0;
+
+	FILETIME ftNow;
+	GetSystemTimeAsFileTime(&ftNow);
+
+	ULARGE_INTEGER uliNow, uliLaunched;
+	uliNow.LowPart = ftNow.dwLowDateTime;
+	uliNow.HighPart = ftNow.dwHighDateTime;
+	uliLaunched.LowPart = lpChild->ftLaunched.dwLowDateTime;
+	uliLaunched.HighPart = lpChild->ftLaunched.dwHighDateTime;
+
+	ULONGLONG ullUptimeMinutes = (uliNow.QuadPart - uliLaunched.QuadPart) / (60 * 10000000ULL);
+
+	if ((dwMaxUptimeMinutes != 0) && (ullUptimeMinutes >= dwMaxUptimeMinutes)) {
+		_snprintf(lpMessage, dwSize, "Recycling child process after %llu minutes", ullUptimeMinutes);
+	}
+	else if ((ullMaxPrivateBytes != 0) && (ullPrivateBytes > ullMaxPrivateBytes)) {
+		_snprintf(lpMessage, dwSize, "Recycling child process using %.1f MB private bytes",
+				ullPrivateBytes / MEGABYTE);
+	}
+	else if ((dwMaxGrowthMBPerHour != 0) && (growthMBPerHour > dwMaxGrowthMBPerHour)) {
+		_snprintf(lpMessage, dwSize, "Recycling child process growing %.1f MB per hour",
+				growthMBPerHour);
+	}
+	else {
+		return FALSE;
+	}
+
+	lpMessage[dwSize - 1] = 0;
+
+	bRecycleRequested = TRUE;
+	ullBytesBeforeRecycle = ullPrivateBytes;
+	dwRecycles++;
+
+	return TRUE;
+}
+
+void SrvRecycleReset(void) {
+
+	bReportReclaimed = bRecycleRequested;
+	bRecycleRequested = FALSE;
+
+	dwSamples = 0;
+	dwFirst = 0;
+	growthMBPerHour = 0.0;
+}
+
+DWORD SrvRecycleFormat(LPSTR lpBuffer, DWORD dwSize) {
+
+	int length = _snprintf(lpBuffer, dwSize,
+			"memory private=%.1fMB working-set=%.1fMB growth=%.1fMB/h recycles=%lu last-reclaimed=%.1fMB\n",
+			ullPrivateBytes / MEGABYTE,
+			ullWorkingSetBytes / MEGABYTE,
+			growthMBPerHour,
+			dwRecycles,
+			llLastReclaimed / MEGABYTE);
+
+	if ((length < 0) || ((DWORD)length >= dwSize)) {
+		length = dwSize - 1;
+	}
+	lpBuffer[length] = 0;
+
+	return length;
+}
+
+void SrvRecycleClose(void) {
+
+	if (hTimer != NULL) {
+		CancelWaitableTimer(hTimer);
+		CloseHandle(hTimer);
+		hTimer = NULL;
+	}
+
+	bEnabled = FALSE;
+}
+
+/**
+ * Fit a least squares line through the samples in the window.
+ *
+ * Returns its slope in megabytes per hour.
+ */
+static double GetGrowthMBPerHour(void) {
+
+	double meanHours = 0.0;
+	double meanMB = 0.0;
+
+	for (DWORD i = 0; i < dwSamples; i++) {
+		DWORD dwIndex = (dwFirst + i) % SRV_RECYCLE_WINDOW;
+		meanHours += (sampleTicks[dwIndex] - sampleTicks[dwFirst]) / 3600000.0;
+		meanMB += sampleBytes[dwIndex] / MEGABYTE;
+	}
+	meanHours /= dwSamples;
+	meanMB /= dwSamples;
+
+	double covariance = 0.0;
+	double variance = 0.0;
+
+	for (DWORD i = 0; i < dwSamples; i++) {
+		DWORD dwIndex = (dwFirst + i) % SRV_RECYCLE_WINDOW;
+		double dHours = (sampleTicks[dwIndex] - sampleTicks[dwFirst]) / 3600000.0 - meanHours;
+		double dMB = sampleBytes[dwIndex] / MEGABYTE - meanMB;
+		covariance += dHours * dMB;
+		variance += dHours * dHours;
+	}
+
+	return (variance > 0.0) ? covariance / variance : 0.0;
+}
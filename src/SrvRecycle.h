@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVRECYCLE_H_
+#define SRVRECYCLE_H_
+
+#include <windows.h>
+
+#include "SrvConfig.h"
+#include "SrvChild.h"
+
+/**
+ * Number of memory samples used to fit the growth trend.
+ */
+#define SRV_RECYCLE_WINDOW 30
+
+/**
+ * Create the sampling timer.
+ */
+BOOL SrvRecycleOpen(void);
+
+/**
+ * Apply the recycling settings from a configuration and restart sampling.
+ * Sampling is off if no recycling limit is configured.
+ */
+BOOL SrvRecycleConfigure(LPSRV_CONFIG lpSrvConfig);
+
+/**
+ * Get the timer that is signaled when memory is due to be sampled.
+ */
+HANDLE SrvRecycleGetTimer(void);
+
+/**
+ * Handle the timer by sampling the memory of the child's process tree
+ * if bActive, and checking it against the recycling limits.
+ *
+ *	lpMessage		receives a message to log, or an empty string.
+ *
+ * Returns TRUE if the child should be recycled, with the reason in lpMessage.
+ */
+BOOL SrvRecycleSample(LPSRV_CHILD lpChild, BOOL bActive, LPSTR lpMessage, DWORD dwSize);
+
+/**
+ * Forget the samples of the previous child after a restart.
+ * If the restart was a recycle, the next sample reports the memory reclaimed.
+ */
+void SrvRecycleReset(void);
+
+/**
+ * Format the memory samples and recycling counters into a buffer.
+ *
+ * Returns the number of characters written, not including the terminator.
+ */
+DWORD SrvRecycleFormat(LPSTR lpBuffer, DWORD dwSize);
+
+/**
+ * Release the timer.
+ */
+void SrvRecycleClose(void);
+
+#endif /* SRVRECYCLE_H_ */
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+#include <sddl.h>
+
+#include <stdio.h>
+
+#include "SrvStartGate.h"
+#include "SrvState.h"
+
+#pragma comment(lib, "advapi32.lib")
+
+// Slot names are global so that services in every session share them.
+// Services started with fewer slots use a prefix of the same names.
+
+static const char slotNameFormat[] = "Global\\SrvWrapStartSlot-%lu";
+
+// Full access for LocalSystem, administrators and any service account.
+
+static const char slotSecurity[] = "D:(A;;GA;;;SY)(A;;GA;;;BA)(A;;GA;;;SU)";
+
+static HANDLE hSlots[MAXIMUM_WAIT_OBJECTS];
+static DWORD dwSlotCount = 0;
+static DWORD dwHeldSlot = MAXDWORD;
+static DWORD dwWaitedMillis = 0;
+
+BOOL SrvStartGateAcquire(DWORD dwSlots, DWORD dwMaxWaitMillis, LPDWORD lpdwWaitedMillis) {
+
+	*lpdwWaitedMillis = 0;
+
+	if (dwSlots == 0) {
+		return TRUE;
+	}
+
+	if (dwSlots > MAXIMUM_WAIT_OBJECTS) {
+		SetLastError(ERROR_BAD_FORMAT);
+		return FALSE;
+	}
+
+	SECURITY_ATTRIBUTES sa;
+	sa.nLength = sizeof(sa);
+	sa.lpSecurityDescriptor = NULL;
+	sa.bInheritHandle = FALSE;
+
+	if (!ConvertStringSecurityDescriptorToSecurityDescriptor(slotSecurity, SDDL_REVISION_1,
+			&sa.lpSecurityDescriptor, NULL)) {
+		return FALSE;
+	}
+
+	for (dwSlotCount = 0; dwSlotCount < dwSlots; dwSlotCount++) {
+
+		char slotName[64];
+		_snprintf(slotName, sizeof(slotName), slotNameFormat, dwSlotCount);
+		slotName[sizeof(slotName) - 1] = 0;
+
+		hSlots[dwSlotCount] = CreateMutex(&sa, FALSE, slotName);
+		if (hSlots[dwSlotCount] == NULL) {
+			DWORD dwLastError = GetLastError();
+			LocalFree(sa.lpSecurityDescriptor);
+			SrvStartGateClose();
+			SetLastError(dwLastError);
+			return FALSE;
+		}
+	}
+
+	LocalFree(sa.lpSecurityDescriptor);
+
+	// Wait for any slot, reporting progress to the SCM about once a second.
+	// A slot abandoned by a wrapper that died is acquired just the same.
+	// A holder whose child never becomes ready keeps its slot until the child
+	// exits, so give up after dwMaxWaitMillis and go on without one.
+
+	ULONGLONG ullStarted = GetTickCount64();
+	DWORD waitResult = WAIT_TIMEOUT;
+
+	while ((waitResult == WAIT_TIMEOUT)
+			&& ((dwMaxWaitMillis == 0) || (GetTickCount64() - ullStarted < dwMaxWaitMillis))) {
+
+		SrvStateCheckPoint(3000);
+		waitResult = WaitForMultipleObjects(dwSlotCount, hSlots, FALSE, 1000);
+	}
+
+	dwWaitedMillis = (DWORD)(GetTickCount64() - ullStarted);
+	*lpdwWaitedMillis = dwWaitedMillis;
+
+	if (waitResult == WAIT_TIMEOUT) {
+		return TRUE;
+	}
+	else if (waitResult < WAIT_OBJECT_0 + dwSlotCount) {
+		dwHeldSlot = waitResult - WAIT_OBJECT_0;
+	}
+	else if ((waitResult >= WAIT_ABANDONED_0) && (waitResult < WAIT_ABANDONED_0 + dwSlotCount)) {
+		dwHeldSlot = waitResult - WAIT_ABANDONED_0;
+	}
+	else {
+		DWORD dwLastError = GetLastError();
+		SrvStartGateClose();
+		SetLastError(dwLastError);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL SrvStartGateHeld(void) {
+	return dwHeldSlot != MAXDWORD;
+}
+
+void SrvStartGateRelease(void) {
+
+	if (dwHeldSlot != MAXDWORD) {
+		ReleaseMutex(hSlots[dwHeldSlot]);
+		dwHeldSlot = MAXDWORD;
+	}
+}
+
+DWORD SrvStartGateFormat(LPSTR lpBuffer, DWORD dwSize) {
+
+	int length = _snprintf(lpBuffer, dwSize, "start-gate slots=%lu holding=%s waited=%lums\n",
+			dwSlotCount,
+			(dwHeldSlot != MAXDWORD) ? "yes" : "no",
+			dwWaitedMillis);
+
+	if ((length < 0) || ((DWORD)length >= dwSize)) {
+		length = dwSize - 1;
+	}
+	lpBuffer[length] = 0;
+
+	return length;
+}
+
+void SrvStartGateClose(void) {
+
+	SrvStartGateRelease();
+
+	for (DWORD i = 0; i < dwSlotCount; i++) {
+		CloseHandle(hSlots[i]);
+	}
+
+	dwSlotCount = 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVSTARTGATE_H_
+#define SRVSTARTGATE_H_
+
+#include <windows.h>
+
+/**
+ * Wait for one of dwSlots start slots shared by every wrapped service on the host,
+ * reporting progress to the SCM about once a second while queued.
+ * Does nothing if dwSlots is 0.
+ *
+ * Each slot is a named mutex, so the slot of a wrapper that dies is freed.
+ * Slots must be released by the thread that acquired them.
+ *
+ *	dwMaxWaitMillis		is how long to queue before going on without a slot,
+ *						since a service starting accepts no stop request;
+ *						0 waits as long as it takes.
+ *
+ *	lpdwWaitedMillis	receives how long the wait took.
+ *
+ * Returns FALSE with ERROR_BAD_FORMAT if dwSlots exceeds MAXIMUM_WAIT_OBJECTS.
+ */
+BOOL SrvStartGateAcquire(DWORD dwSlots, DWORD dwMaxWaitMillis, LPDWORD lpdwWaitedMillis);
+
+/**
+ * Returns TRUE if a start slot is held.
+ */
+BOOL SrvStartGateHeld(void);
+
+/**
+ * Release the start slot, if held, once the child is ready or has exited.
+ */
+void SrvStartGateRelease(void);
+
+/**
+ * Format the start gate state into a buffer.
+ *
+ * Returns the number of characters written, not including the terminator.
+ */
+DWORD SrvStartGateFormat(LPSTR lpBuffer, DWORD dwSize);
+
+/**
+ * Release the start slot and close the gate.
+ */
+void SrvStartGateClose(void);
+
+#endif /* SRVSTARTGATE_H_ */
@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+
+#include <tchar.h>
+#include <stdio.h>
+
+#include "SrvState.h"
+
+/**
+ * How each state is reported to the SCM.
+ */
+typedef struct tagSRV_STATE_INFO {
+	LPCSTR lpName;
+	DWORD dwCurrentState;
+	DWORD dwControlsAccepted;
+} SRV_STATE_INFO;
+
+static const SRV_STATE_INFO stateInfo[SRV_STATE_COUNT] = {
+	{ "Starting",	SERVICE_START_PENDING,	0 },
+	{ "Ready",		SERVICE_START_PENDING,	0 },
+	{ "Running",	SERVICE_RUNNING,		SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_PAUSE_CONTINUE },
+	{ "Stopping",	SERVICE_STOP_PENDING,	0 },
+	{ "Restarting",	SERVICE_RUNNING,		SERVICE_ACCEPT_STOP },
+	{ "Pausing",	SERVICE_PAUSE_PENDING,	0 },
+	{ "Paused",		SERVICE_PAUSED,			SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_PAUSE_CONTINUE },
+	{ "Continuing",	SERVICE_CONTINUE_PENDING, 0 },
+	{ "Stopped",	SERVICE_STOPPED,		0 },
+	{ "Failed",		SERVICE_STOPPED,		0 },
+};
+
+/**
+ * Permitted transitions, indexed by [from][to].
+ * Stopped and Failed are final.  The SCM sends no stop request while
+ * Pausing or Continuing, but the child can exit then, so either may
+ * move to Stopping.
+ */
+#define T TRUE
+#define F FALSE
+
+static const BOOL transitionAllowed[SRV_STATE_COUNT][SRV_STATE_COUNT] = {
+	/*				Starting	Ready	Running	Stopping	Restarting	Pausing	Paused	Continuing	Stopped	Failed */
+	/* Starting */	{ F,		T,		F,		T,			F,			F,		F,		F,			T,		T },
+	/* Ready */		{ F,		F,		T,		T,			F,			F,		F,		F,			F,		T },
+	/* Running */	{ F,		F,		F,		T,			T,			T,		F,		F,			F,		T },
+	/* Stopping */	{ F,		F,		F,		F,			F,			F,		F,		F,			T,		T },
+	/* Restarting */{ F,		T,		F,		T,			F,			F,		F,		F,			F,		T },
+	/* Pausing */	{ F,		F,		T,		T,			F,			F,		T,		F,			F,		T },
+	/* Paused */	{ F,		F,		F,		T,			F,			F,		F,		T,			F,		T },
+	/* Continuing */{ F,		F,		T,		T,			F,			F,		F,		F,			F,		T },
+	/* Stopped */	{ F,		F,		F,		F,			F,			F,		F,		F,			F,		F },
+	/* Failed */	{ F,		F,		F,		F,			F,			F,		F,		F,			F,		F },
+};
+
+#undef T
+#undef F
+
+/**
+ * Counters for one transition.  Latencies are the time
+ * spent in the from state, in performance counter ticks.
+ */
+typedef struct tagSRV_TRANSITION_STATS {
+	DWORD dwCount;
+	LONGLONG llLastTicks;
+	LONGLONG llTotalTicks;
+	LONGLONG llMaxTicks;
+	FILETIME ftLastTime;
+} SRV_TRANSITION_STATS;
+
+static CRITICAL_SECTION csState;
+static SERVICE_STATUS_HANDLE hSvcStatusHandle = NULL;
+static SERVICE_STATUS svcStatus;
+static DWORD dwCheckPoint = 1;
+static DWORD dwExtraControlsAccepted = 0;
+static BOOL bReportedRunning = FALSE;
+
+static SRV_STATE currentState = SRV_STATE_STARTING;
+static LARGE_INTEGER liStateEntered;
+static LARGE_INTEGER liFrequency;
+static SRV_TRANSITION_STATS transitionStats[SRV_STATE_COUNT][SRV_STATE_COUNT];
+
+static void ReportSvcStatus(DWORD, DWORD);
+
+void SrvStateInit(SERVICE_STATUS_HANDLE hStatusHandle) {
+
+	InitializeCriticalSection(&csState);
+
+	QueryPerformanceFrequency(&liFrequency);
+	QueryPerformanceCounter(&liStateEntered);
+
+	hSvcStatusHandle = hStatusHandle;
+
+	ZeroMemory(&svcStatus, sizeof(svcStatus));
+	svcStatus.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
+	svcStatus.dwServiceSpecificExitCode = 0;
+
+	currentState = SRV_STATE_STARTING;
+	ReportSvcStatus(NO_ERROR, 3000);
+}
+
+BOOL SrvStateTransition(SRV_STATE newState, DWORD dwExitCode, DWORD dwWaitHint) {
+
+	EnterCriticalSection(&csState);
+
+	if (!transitionAllowed[currentState][newState]) {
+		LeaveCriticalSection(&csState);
+		SetLastError(ERROR_INVALID_STATE);
+		return FALSE;
+	}
+
+	// Record how long the service stayed in the state it is leaving.
+
+	LARGE_INTEGER liNow;
+	QueryPerformanceCounter(&liNow);
+
+	LONGLONG llTicks = liNow.QuadPart - liStateEntered.QuadPart;
+
+	SRV_TRANSITION_STATS* pStats = &transitionStats[currentState][newState];
+	pStats->dwCount++;
+	pStats->llLastTicks = llTicks;
+	pStats->llTotalTicks += llTicks;
+	if (pStats->llMaxTicks < llTicks) {
+		pStats->llMaxTicks = llTicks;
+	}
+	GetSystemTimeAsFileTime(&pStats->ftLastTime);
+
+	liStateEntered = liNow;
+	currentState = newState;
+
+	ReportSvcStatus((newState == SRV_STATE_FAILED) ? dwExitCode : NO_ERROR, dwWaitHint);
+
+	LeaveCriticalSection(&csState);
+	return TRUE;
+}
+
+void SrvStateCheckPoint(DWORD dwWaitHint) {
+
+	EnterCriticalSection(&csState);
+	ReportSvcStatus(svcStatus.dwServiceSpecificExitCode, dwWaitHint);
+	LeaveCriticalSection(&csState);
+}
+
+void SrvStateAcceptControls(DWORD dwControlsAccepted) {
+
+	EnterCriticalSection(&csState);
+	dwExtraControlsAccepted |= dwControlsAccepted;
+	LeaveCriticalSection(&csState);
+}
+
+SRV_STATE SrvStateGet(void) {
+
+	EnterCriticalSection(&csState);
+	SRV_STATE state = currentState;
+	LeaveCriticalSection(&csState);
+
+	return state;
+}
+
+LPCSTR SrvStateName(SRV_STATE state) {
+	return (state < SRV_STATE_COUNT) ? stateInfo[state].lpName : "Unknown";
+}
+
+DWORD SrvStateFormat(LPSTR lpBuffer, DWORD dwSize) {
+
+	if (dwSize == 0) {
+		return 0;
+	}
+
+	EnterCriticalSection(&csState);
+
+	LARGE_INTEGER liNow;
+	QueryPerformanceCounter(&liNow);
+
+	LONGLONG llPerMicro = (liFrequency.QuadPart < 1000000) ? 1 : liFrequency.QuadPart / 1000000;
+
+	int length = _snprintf(lpBuffer, dwSize, "state=%s for=%lldus\n",
+			stateInfo[currentState].lpName,
+			(liNow.QuadPart - liStateEntered.QuadPart) / llPerMicro);
+
+	for (int from = 0; from < SRV_STATE_COUNT; from++) {
+		for (int to = 0; to < SRV_STATE_COUNT; to++) {
+
+			SRV_TRANSITION_STATS* pStats = &transitionStats[from][to];
+			if (pStats->dwCount == 0) {
+				continue;
+			}
+
+			if ((length < 0) || ((DWORD)length >= dwSize)) {
+				break;
+			}
+
+			int added = _snprintf(lpBuffer + length, dwSize - length,
+					"%s->%s count=%lu last=%lldus avg=%lldus max=%lldus\n",
+					stateInfo[from].lpName,
+					stateInfo[to].lpName,
+					pStats->dwCount,
+					pStats->llLastTicks / llPerMicro,
+					pStats->llTotalTicks / pStats->dwCount / llPerMicro,
+					pStats->llMaxTicks / llPerMicro);
+
+			length = (added < 0) ? (int)dwSize : length + added;
+		}
+	}
+
+	LeaveCriticalSection(&csState);
+
+	// _snprintf() does not terminate a truncated string.
+
+	if ((length < 0) || ((DWORD)length >= dwSize)) {
+		length = dwSize - 1;
+	}
+	lpBuffer[length] = 0;
+
+	return length;
+}
+
+//
+// Purpose:
+//   Reports the current state to the SCM.
+//   Must be called holding csState.
+//
+// Parameters:
+//   dwExitCode - The error code for SRV_STATE_FAILED
+//   dwWaitHint - Estimated time for pending operation,
+//	 in milliseconds
+//
+// Return value:
+//   None
+//
+static void ReportSvcStatus(
+		DWORD dwExitCode,
+		DWORD dwWaitHint)
+{
+	// Fill in the SERVICE_STATUS structure from the state table.
+	// A failure is reported as a service-specific error code
+	// because the code may be a child exit code rather than a system error code.
+
+	// Once the SCM has seen the service running it must not go back to a pending
+	// state, so Ready after a restart is reported as Restarting is.
+
+	const SRV_STATE_INFO* pInfo = &stateInfo[currentState];
+	if ((currentState == SRV_STATE_READY) && bReportedRunning) {
+		pInfo = &stateInfo[SRV_STATE_RESTARTING];
+	}
+
+	svcStatus.dwCurrentState = pInfo->dwCurrentState;
+	svcStatus.dwControlsAccepted = pInfo->dwControlsAccepted;
+	if (pInfo->dwControlsAccepted != 0) {
+		svcStatus.dwControlsAccepted |= dwExtraControlsAccepted;
+	}
+	svcStatus.dwWaitHint = dwWaitHint;
+
+	if (dwExitCode != NO_ERROR) {
+		svcStatus.dwWin32ExitCode = ERROR_SERVICE_SPECIFIC_ERROR;
+		svcStatus.dwServiceSpecificExitCode = dwExitCode;
+	}
+	else {
+		svcStatus.dwWin32ExitCode = NO_ERROR;
+		svcStatus.dwServiceSpecificExitCode = 0;
+	}
+
+	if (pInfo->dwCurrentState == SERVICE_RUNNING) {
+		bReportedRunning = TRUE;
+	}
+
+	if ((pInfo->dwCurrentState == SERVICE_RUNNING) || (pInfo->dwCurrentState == SERVICE_STOPPED)) {
+		svcStatus.dwCheckPoint = 0;
+	}
+	else {
+		svcStatus.dwCheckPoint = dwCheckPoint++;
+	}
+
+	// Report the status of the service to the SCM.
+	SetServiceStatus(hSvcStatusHandle, &svcStatus);
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVSTATE_H_
+#define SRVSTATE_H_
+
+#include <windows.h>
+
+/**
+ * Service states.
+ *
+ *	SRV_STATE_STARTING		the wrapper is initializing and has not yet launched the child.
+ *	SRV_STATE_READY			the child has been launched but the service is not yet reported running,
+ *							or after a restart, is still reported running as while restarting.
+ *	SRV_STATE_RUNNING		the service is running.
+ *	SRV_STATE_STOPPING		the child is being stopped and the service will stop.
+ *	SRV_STATE_RESTARTING	the child is being stopped and will be launched again.
+ *	SRV_STATE_PAUSING		the child process tree is being suspended.
+ *	SRV_STATE_PAUSED		the child process tree is suspended.
+ *	SRV_STATE_CONTINUING	the child process tree is being resumed.
+ *	SRV_STATE_STOPPED		the service stopped normally.
+ *	SRV_STATE_FAILED		the service stopped because of an error.
+ */
+typedef enum tagSRV_STATE {
+	SRV_STATE_STARTING,
+	SRV_STATE_READY,
+	SRV_STATE_RUNNING,
+	SRV_STATE_STOPPING,
+	SRV_STATE_RESTARTING,
+	SRV_STATE_PAUSING,
+	SRV_STATE_PAUSED,
+	SRV_STATE_CONTINUING,
+	SRV_STATE_STOPPED,
+	SRV_STATE_FAILED,
+	SRV_STATE_COUNT
+} SRV_STATE;
+
+/**
+ * Initialize the state machine in SRV_STATE_STARTING
+ * and report it to the SCM using the given status handle.
+ */
+void SrvStateInit(SERVICE_STATUS_HANDLE hStatusHandle);
+
+/**
+ * Move to a new state and report it to the SCM.
+ *
+ *	newState		is the state to move to.
+ *
+ *	dwExitCode		is the error code reported if newState is SRV_STATE_FAILED.
+ *
+ *	dwWaitHint		is the estimated time in milliseconds for a pending state.
+ *
+ * Returns FALSE with ERROR_INVALID_STATE if the transition table
+ * does not permit moving from the current state to newState.
+ * Safe to call concurrently from the SCM handler and the main thread.
+ */
+BOOL SrvStateTransition(SRV_STATE newState, DWORD dwExitCode, DWORD dwWaitHint);
+
+/**
+ * Report progress in the current pending state to the SCM
+ * by advancing the checkpoint with a new wait hint.
+ */
+void SrvStateCheckPoint(DWORD dwWaitHint);
+
+/**
+ * Add to the controls the SCM may send while the service is running,
+ * such as SERVICE_ACCEPT_PARAMCHANGE.  Takes effect at the next report.
+ */
+void SrvStateAcceptControls(DWORD dwControlsAccepted);
+
+/**
+ * Get the current state.
+ */
+SRV_STATE SrvStateGet(void);
+
+/**
+ * Get the display name of a state.
+ */
+LPCSTR SrvStateName(SRV_STATE state);
+
+/**
+ * Format the current state and per-transition counters into a buffer.
+ * Each transition taken at least once is reported as
+ * "from->to count=n last=us avg=us max=us" on its own line,
+ * where the latencies are the time spent in the from state.
+ *
+ * Returns the number of characters written, not including the terminator.
+ */
+DWORD SrvStateFormat(LPSTR lpBuffer, DWORD dwSize);
+
+#endif /* SRVSTATE_H_ */
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+
+#include <stdio.h>
+
+#include "SrvStopTimeout.h"
+#include "SrvHistogram.h"
+#include "SrvJournal.h"
+
+// Settings.
+
+static DWORD dwFixedMillis = 30000;
+static BOOL bAdaptive = FALSE;
+static DWORD dwPercentile = 99;
+static DWORD dwMarginMillis = 0;
+static DWORD dwMinMillis = 0;
+static DWORD dwMaxMillis = 0;
+
+// Observed stop times in milliseconds and the timeout chosen from them.
+
+static SRV_HISTOGRAM stopMillis;
+static volatile DWORD dwTimeoutMillis = 30000;
+
+static void ChooseTimeout(void);
+static void ObserveRecord(LPSRV_JOURNAL_RECORD, LPVOID);
+
+BOOL SrvStopTimeoutConfigure(LPSRV_CONFIG lpSrvConfig) {
+
+	if ((lpSrvConfig->dwStopTimeoutMillis == 0)
+			|| (lpSrvConfig->dwStopTimeoutPercentile == 0)
+			|| (lpSrvConfig->dwStopTimeoutPercentile > 100)
+			|| (lpSrvConfig->dwStopTimeoutMinMillis > lpSrvConfig->dwStopTimeoutMaxMillis)) {
+		SetLastError(ERROR_BAD_FORMAT);
+		return FALSE;
+	}
+
+	dwFixedMillis = lpSrvConfig->dwStopTimeoutMillis;
+	bAdaptive = lpSrvConfig->dwStopTimeoutAdaptive != 0;
+	dwPercentile = lpSrvConfig->dwStopTimeoutPercentile;
+	dwMarginMillis = lpSrvConfig->dwStopTimeoutMarginMillis;
+	dwMinMillis = lpSrvConfig->dwStopTimeoutMinMillis;
+	dwMaxMillis = lpSrvConfig->dwStopTimeoutMaxMillis;
+
+	SrvHistogramReset(&stopMillis);
+
+	// Earlier runs of the service are remembered only in the journal.
+	// A missing journal just means nothing has been learned yet.
+
+	if (bAdaptive && (lpSrvConfig->lpJournal != NULL)) {
+		SrvJournalForEach(lpSrvConfig->lpJournal, ObserveRecord, NULL);
+	}
+
+	ChooseTimeout();
+	return TRUE;
+}
+
+void SrvStopTimeoutObserve(LPSRV_CHILD lpChild) {
+
+	if (lpChild->stopStep == SRV_STOP_NONE) {
+		return;
+	}
+
+	SRV_JOURNAL_RECORD record;
+	SrvJournalDescribe(lpChild, SRV_END_STOP, &record);
+
+	ObserveRecord(&record, NULL);
+	ChooseTimeout();
+}
+
+DWORD SrvStopTimeoutGet(void) {
+	return dwTimeoutMillis;
+}
+
+DWORD SrvStopTimeoutFormat(LPSTR lpBuffer, DWORD dwSize) {
+
+	int length = _snprintf(lpBuffer, dwSize, "stop-timeout %s=%lums observed=%lu p50=%lums p%lu=%lums max=%lums\n",
+			(bAdaptive && (stopMillis.dwCount >= SRV_STOP_TIMEOUT_MIN_SAMPLES)) ? "adaptive" : "fixed",
+			dwTimeoutMillis,
+			stopMillis.dwCount,
+			SrvHistogramPercentile(&stopMillis, 50.0),
+			dwPercentile,
+			SrvHistogramPercentile(&stopMillis, dwPercentile),
+			stopMillis.dwMax);
+
+	if ((length < 0) || ((DWORD)length >= dwSize)) {
+		length = dwSize - 1;
+	}
+	lpBuffer[length] = 0;
+
+	return length;
+}
+
+/**
+ * Choose the timeout: the configured percentile of observed stop times
+ * plus the margin, bounded by the minimum and maximum, once enough stops
+ * have been observed; otherwise the fixed timeout.
+ */
+static void ChooseTimeout(void) {
+
+	if (!bAdaptive || (stopMillis.dwCount < SRV_STOP_TIMEOUT_MIN_SAMPLES)) {
+		dwTimeoutMillis = dwFixedMillis;
+		return;
+	}
+
+	ULONGLONG ullMillis = (ULONGLONG)SrvHistogramPercentile(&stopMillis, dwPercentile) + dwMarginMillis;
+
+	if (ullMillis < dwMinMillis) {
+		ullMillis = dwMinMillis;
+	}
+	if (ullMillis > dwMaxMillis) {
+		ullMillis = dwMaxMillis;
+	}
+
+	dwTimeoutMillis = (DWORD)ullMillis;
+}
+
+/**
+ * Add the stop time of a journal record, if its child was asked to stop.
+ */
+static void ObserveRecord(LPSRV_JOURNAL_RECORD lpRecord, LPVOID lpContext) {
+
+	ULONGLONG ullMillis;
+
+	if ((lpRecord->dwStopStep != SRV_STOP_NONE) && SrvJournalGetStopMillis(lpRecord, &ullMillis)) {
+		SrvHistogramRecord(&stopMillis, (ullMillis > MAXDWORD) ? MAXDWORD : (DWORD)ullMillis);
+	}
+}
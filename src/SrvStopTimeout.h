@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVSTOPTIMEOUT_H_
+#define SRVSTOPTIMEOUT_H_
+
+#include <windows.h>
+
+#include "SrvConfig.h"
+#include "SrvChild.h"
+
+/**
+ * Number of observed stops needed before the adaptive timeout is used.
+ */
+#define SRV_STOP_TIMEOUT_MIN_SAMPLES 5
+
+/**
+ * Apply the stop timeout settings from a configuration.
+ * In adaptive mode, observations start from the stops recorded in the Journal, if any.
+ *
+ * Returns FALSE with ERROR_BAD_FORMAT if the settings are inconsistent.
+ */
+BOOL SrvStopTimeoutConfigure(LPSRV_CONFIG lpSrvConfig);
+
+/**
+ * Learn from a child that has exited after being asked to stop.
+ * A child that had to be killed counts as taking at least the whole timeout,
+ * so repeated kills push the timeout up toward the maximum.
+ */
+void SrvStopTimeoutObserve(LPSRV_CHILD lpChild);
+
+/**
+ * Get the time in milliseconds to wait for the child to stop before killing it.
+ * Safe to call from the SCM handler thread.
+ */
+DWORD SrvStopTimeoutGet(void);
+
+/**
+ * Format the chosen timeout and observations into a buffer.
+ *
+ * Returns the number of characters written, not including the terminator.
+ */
+DWORD SrvStopTimeoutFormat(LPSTR lpBuffer, DWORD dwSize);
+
+#endif /* SRVSTOPTIMEOUT_H_ */
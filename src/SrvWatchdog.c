@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#include <windows.h>
+
+#include <stdio.h>
+
+#include "SrvWatchdog.h"
+
+/**
+ * Heartbeats are latched by an auto reset event rather than counted,
+ * so a heartbeat costs the child one SetEvent() call and never wakes
+ * the service; the service only looks at the event once per interval.
+ */
+static HANDLE hHeartbeatEvent = NULL;
+static HANDLE hTimer = NULL;
+static DWORD dwInterval = 0;
+
+static DWORD dwChecks = 0;
+static DWORD dwMisses = 0;
+static FILETIME ftLastHeartbeat;
+
+BOOL SrvWatchdogOpen(void) {
+
+	SECURITY_ATTRIBUTES sa;
+	sa.nLength = sizeof(sa);
+	sa.lpSecurityDescriptor = NULL;
+	sa.bInheritHandle = TRUE;
+
+	hHeartbeatEvent = CreateEvent(
+			&sa,	// inheritable
+			FALSE,	// auto reset event
+			FALSE,	// not signaled
+			NULL);	// no name
+
+	if (hHeartbeatEvent == NULL) {
+		return FALSE;
+	}
+
+	hTimer = CreateWaitableTimer(NULL, FALSE, NULL);
+	if (hTimer == NULL) {
+		return FALSE;
+	}
+
+	ZeroMemory(&ftLastHeartbeat, sizeof(ftLastHeartbeat));
+	return TRUE;
+}
+
+BOOL SrvWatchdogArm(DWORD dwIntervalMillis) {
+
+	dwInterval = dwIntervalMillis;
+
+	CancelWaitableTimer(hTimer);
+	ResetEvent(hHeartbeatEvent);
+
+	if (dwInterval == 0) {
+		SetEnvironmentVariable(SRV_WATCHDOG_HANDLE_VARIABLE, NULL);
+		SetEnvironmentVariable(SRV_WATCHDOG_MILLIS_VARIABLE, NULL);
+		return TRUE;
+	}
+
+	char value[32];
+
+	sprintf(value, "%llu", (ULONGLONG)(ULONG_PTR)hHeartbeatEvent);
+	if (!SetEnvironmentVariable(SRV_WATCHDOG_HANDLE_VARIABLE, value)) {
+		return FALSE;
+	}
+
+	sprintf(value, "%lu", dwInterval);
+	if (!SetEnvironmentVariable(SRV_WATCHDOG_MILLIS_VARIABLE, value)) {
+		return FALSE;
+	}
+
+	// The first heartbeat is due one interval after launch.
+
+	LARGE_INTEGER liDueTime;
+	liDueTime.QuadPart = -(LONGLONG)dwInterval * 10000;
+
+	return SetWaitableTimer(hTimer, &liDueTime, dwInterval, NULL, NULL, FALSE);
+}
+
+HANDLE SrvWatchdogGetTimer(void) {
+	return hTimer;
+}
+
+BOOL SrvWatchdogCheck(BOOL bActive) {
+
+	// Consume any heartbeat so that the next check sees only new ones.
+
+	BOOL bHeartbeat = WaitForSingleObject(hHeartbeatEvent, 0) == WAIT_OBJECT_0;
+
+	if (bHeartbeat) {
+		GetSystemTimeAsFileTime(&ftLastHeartbeat);
+	}
+
+	if (!bActive || (dwInterval == 0)) {
+		return FALSE;
+	}
+
+	dwChecks++;
+
+	if (bHeartbeat) {
+		return FALSE;
+	}
+
+	dwMisses++;
+	return TRUE;
+}
+
+DWORD SrvWatchdogFormat(LPSTR lpBuffer, DWORD dwSize) {
+
+	FILETIME ftNow;
+	GetSystemTimeAsFileTime(&ftNow);
+
+	ULARGE_INTEGER uliNow, uliLast;
+	uliNow.LowPart = ftNow.dwLowDateTime;
+	uliNow.HighPart = ftNow.dwHighDateTime;
+	uliLast.LowPart = ftLastHeartbeat.dwLowDateTime;
+	uliLast.HighPart = ftLastHeartbeat.dwHighDateTime;
+
+	// Heartbeats are only observed at checks, so the age is accurate to one interval.
+
+	int length;
+	if (uliLast.QuadPart == 0) {
+		length = _snprintf(lpBuffer, dwSize, "watchdog interval=%lums checks=%lu misses=%lu last-heartbeat=never\n",
+				dwInterval, dwChecks, dwMisses);
+	}
+	else {
+		length = _snprintf(lpBuffer, dwSize, "watchdog interval=%lums checks=%lu misses=%lu last-heartbeat=%llums ago\n",
+				dwInterval, dwChecks, dwMisses, (uliNow.QuadPart - uliLast.QuadPart) / 10000);
+	}
+
+	if ((length < 0) || ((DWORD)length >= dwSize)) {
+		length = dwSize - 1;
+	}
+	lpBuffer[length] = 0;
+
+	return length;
+}
+
+void SrvWatchdogClose(void) {
+
+	if (hTimer != NULL) {
+		CancelWaitableTimer(hTimer);
+		CloseHandle(hTimer);
+		hTimer = NULL;
+	}
+
+	if (hHeartbeatEvent != NULL) {
+		CloseHandle(hHeartbeatEvent);
+		hHeartbeatEvent = NULL;
+	}
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#ifndef SRVWATCHDOG_H_
+#define SRVWATCHDOG_H_
+
+#include <windows.h>
+
+/**
+ * Environment variables advertising the watchdog to the child,
+ * in the spirit of systemd's WATCHDOG_USEC.
+ *
+ *	SRVWRAP_WATCHDOG_HANDLE		is the decimal value of an inherited event handle;
+ *								the child sends a heartbeat by calling SetEvent() on it.
+ *	SRVWRAP_WATCHDOG_MILLIS		is the interval at which heartbeats are checked.  At least
+ *								one must arrive in each interval, so, as with WATCHDOG_USEC,
+ *								the child should send one at least twice per interval.
+ *
+ * Checks run on a fixed period rather than timing each heartbeat, so the gap
+ * between heartbeats that is tolerated is anywhere from one to two intervals.
+ */
+#define SRV_WATCHDOG_HANDLE_VARIABLE "SRVWRAP_WATCHDOG_HANDLE"
+#define SRV_WATCHDOG_MILLIS_VARIABLE "SRVWRAP_WATCHDOG_MILLIS"
+
+/**
+ * Create the inheritable heartbeat event and the check timer.
+ */
+BOOL SrvWatchdogOpen(void);
+
+/**
+ * Prepare for launching a child: advertise the watchdog in the environment
+ * it will inherit, forget earlier heartbeats and start the check timer.
+ * A dwIntervalMillis of 0 turns the watchdog off and removes the variables.
+ */
+BOOL SrvWatchdogArm(DWORD dwIntervalMillis);
+
+/**
+ * Get the timer that is signaled when heartbeats are due to be checked.
+ */
+HANDLE SrvWatchdogGetTimer(void);
+
+/**
+ * Handle the timer.  Checks that at least one heartbeat arrived since the last check,
+ * one interval ago, if bActive, otherwise simply starts a new interval.
+ *
+ * Returns TRUE if the child missed its heartbeat and should be treated as hung.
+ */
+BOOL SrvWatchdogCheck(BOOL bActive);
+
+/**
+ * Format the watchdog counters into a buffer.
+ *
+ * Returns the number of characters written, not including the terminator.
+ */
+DWORD SrvWatchdogFormat(LPSTR lpBuffer, DWORD dwSize);
+
+/**
+ * Release the event and timer.
+ */
+void SrvWatchdogClose(void);
+
+#endif /* SRVWATCHDOG_H_ */
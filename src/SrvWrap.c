@@ -19,8 +19,12 @@
  *
  * Starting the service invokes the program, which may be cmd.exe to start a Windows batch file.
  * If the program terminates itself, the service changes its status to Stopped.
+ * If it exits with a nonzero code, or the service fails, the stop is reported with
+ * exit code ERROR_SERVICE_SPECIFIC_ERROR and the program's exit code or the error
+ * as the service-specific exit code, so that SCM recovery options apply.
  * Manually stopping the service sends CTRL + C signal to the program, which must respond by terminating.
- * If the program does not terminate in a timely way, it is forcibly killed.
+ * Pausing the service suspends the program and every process it started; continuing resumes them.
+ * If the program does not terminate in a timely way, it is forcibly killed with every process it started.
  *
  * It is expected that the service will be installed using SC.exe invoked from a Windows .bat file as follows.
  * Note the extravagant use of quotes.  This is not a typo; .bat files are insane about quotes.
@@ -38,6 +42,13 @@
  *
  * 	%SVC_CONFIG%	is the path to a text file containing configuration details for the service.
  * 					This file must contain a name=value configuration parameter on each line.
+ *					Settings named for a unit, such as HealthIntervalMillis or
+ *					RecycleMaxPrivateMB, may instead give the value with a unit: ms, s, m or h
+ *					for times, as in 30s, and KB, MB or GB for sizes, as in 2GB.  Settings
+ *					that are 0 or 1 also accept false or true, no or yes, and off or on.
+ *					A mistake is reported to the event log with its line and column.
+ *					Lines starting with ; or # are comments.  One file can configure
+ *					several services using sections, described below.
  *					The configuration parameters are as follows.
  *
  *		ApplicationName
@@ -71,6 +82,315 @@
  *					If omitted, this defaults to the current directory of the
  *					Service Control Manager when it starts the new service.
  *
+ *		OutputLog
+ *					optionally is the path to a file that captures the standard output and
+ *					standard error of the wrapped program.  The file is appended to.
+ *					If omitted, output goes to the console allocated for the service.
+ *
+ *		OutputLogRotateBytes
+ *					optionally is the size in bytes at which the output log is renamed
+ *					with a .YYYYMMDD-HHMMSS-mmm suffix and a new output log started.
+ *					If omitted or 0, the output log is only rotated on request.
+ *
+ *		OutputLogIndexKB
+ *					optionally is how often, in kilobytes written, the output log's index
+ *					notes the time, 64 by default.  The index is kept in a file named by
+ *					adding .idx to the output log and moves with it on rotation.  If 0,
+ *					no index is kept.  Print the lines logged between two times with
+ *
+ *						%WRAPPER_EXE% -query-log file from [to]
+ *
+ *					or the query-log control command.  A time is YYYY-MM-DD[THH:MM[:SS]]
+ *					or HH:MM[:SS] for today, local unless followed by Z.  Rotated and
+ *					compressed logs are searched too; lines logged without an index are not.
+ *
+ *		OutputLogFormat
+ *					optionally is the form of each line in the output log:
+ *
+ *					raw			as the program wrote it, the default.
+ *					text		prefixed with the time in UTC to the microsecond, stdout
+ *								or stderr, the service name and the process id.
+ *					json		as one JSON object per line with those fields, the level
+ *								when the line names one such as ERROR, and the message.
+ *
+ *					In text and json, Java stack trace lines are kept with the line
+ *					before them as a single record.  Compare the cost of each with
+ *
+ *						%WRAPPER_EXE% -bench-log [text|json [megabytes]]
+ *
+ *					The child's output is read with overlapped reads, so a pipe is drained
+ *					into one buffer while the last is written to the log.  Compare that in
+ *					raw format with reading and writing one buffer at a time with
+ *
+ *						%WRAPPER_EXE% -bench-capture [megabytes]
+ *
+ *					A change on reload applies to standard error from the next launch.
+ *
+ *		OutputLogCompression
+ *					optionally is xpress, xpress-huff, mszip or lzms to compress each rotated
+ *					output log with that Windows Compression API algorithm, on a background
+ *					priority thread, into a file named by adding .swz.  mszip is deflate;
+ *					xpress is fastest and lzms smallest.  Read a compressed log with
+ *
+ *						%WRAPPER_EXE% -decompress file.swz > file
+ *
+ *					dump-stats reports the compression ratio and the CPU time spent.
+ *
+ *		OutputLogCompressLimit
+ *					optionally is the most rotated logs compressed at once by all the
+ *					services on this computer, 2 by default.  The first service to compress
+ *					a log sets the limit for the others.
+ *
+ *		OutputLogKeep
+ *		OutputLogKeepHours
+ *		OutputLogKeepMB
+ *					optionally limit the rotated output logs, compressed or not, to a number
+ *					of files, an age in hours and a total size in megabytes.  The oldest are
+ *					deleted after each rotation until all the limits are met.  If omitted
+ *					or 0, rotated logs are kept.
+ *
+ *		OutputLogRateBytes
+ *		OutputLogBurstBytes
+ *					optionally limit each of standard output and standard error to a rate
+ *					in bytes a second, in bursts of up to OutputLogBurstBytes, one second
+ *					at the rate by default.  The child's output is still read as fast as it
+ *					is written, so the child never waits on the limit.  Output over the rate
+ *					is handled by OutputLogLimitPolicy, a whole record at a time, and what
+ *					is suppressed is reported by a "[SrvWrap] suppressed N lines / M bytes"
+ *					line when the stream is back under the rate, every 10 seconds while it
+ *					is not, and at exit.  dump-stats reports the totals.  In the raw
+ *					OutputLogFormat the child writes both to one pipe, so they share one
+ *					limit.  If omitted or 0, output is not limited.
+ *
+ *		OutputLogLimitPolicy
+ *					optionally is what to do with records over the rate:
+ *
+ *					drop		suppress them, the default.
+ *					sample		keep one in OutputLogSample, 100 by default.
+ *					summarize	suppress those repeating the record before them, ignoring
+ *								digits, reporting the count and the text in the marker, and
+ *								keep the others until a second burst is used up.
+ *
+ *		OutputLogForward
+ *					optionally sends the captured output, as written to OutputLog, to a
+ *					collector listening on this computer:
+ *
+ *					syslog:port		RFC 5424 syslog over UDP, a datagram for each line.
+ *					syslog-tcp:port	RFC 5424 syslog over TCP, each message ended by a
+ *									newline.
+ *					tcp:port		the output as written to OutputLog, over TCP.
+ *
+ *					Syslog messages are of facility user, at severity error for standard
+ *					error and informational for standard output, with the service name
+ *					as APP-NAME and the child's process id as PROCID.  The child never
+ *					waits on the collector: output is buffered in memory, up to
+ *					OutputLogForwardBufferKB, 1024 by default, then in OutputLog with
+ *					".fwd" added, up to OutputLogForwardSpillMB, 64 by default or 0 for
+ *					none, and what does not fit is dropped and counted.  A collector that
+ *					cannot be reached is retried after 1 second, doubling up to 30.  What
+ *					is left at exit is kept in the ".fwd" file and sent after the next
+ *					start.  dump-stats reports the counts sent, spilled and dropped.
+ *
+ *		OutputLogForwardBufferKB
+ *		OutputLogForwardSpillMB
+ *					optionally are the limits on output waiting to be forwarded.  The
+ *					memory buffer keeps its size until the service restarts.
+ *
+ *		Java
+ *					optionally is 1 when CommandLine starts with the java executable of
+ *					JDK 13 or later, to let the wrapper add JVM options at each launch:
+ *
+ *					-XX:SharedArchiveFile or -XX:ArchiveClassesAtExit, with
+ *					JavaArchiveDirectory, so that the JVM loads its classes from a class
+ *					data sharing archive written when an earlier run exited.  Archives are
+ *					named by a hash of the java executable and the size and time of each jar
+ *					on the -cp, -classpath, --class-path or -jar classpath, so changing a jar
+ *					makes a new archive.  Old archives are not deleted.
+ *
+ *					-Xmx, with RecycleMaxPrivateMB, as JavaHeapPercent of that limit,
+ *					75 by default.
+ *
+ *					Options already on the command line are left alone.
+ *
+ *		ConfigCache
+ *					optionally is 1 to keep the parsed configuration, with the environment
+ *					variables it sets, in a binary file named by adding the service name
+ *					and .cache to the path of this file.  Later starts and reloads map the
+ *					cache instead of parsing while this file, any environment file and any
+ *					included files keep the same size, time and content.  Compare the two with
+ *
+ *						%WRAPPER_EXE% -bench-config %SVC_CONFIG% [iterations [%SVC_NAME%]]
+ *
+ *					The lines of an environment file are also kept, in a file named by
+ *					adding .envcache to its path, which every service reading it maps
+ *					read-only while the file keeps the same identity, size and time.
+ *					After Expand=1 its values are still expanded for each service.  Only an Environment
+ *					line after ConfigCache=1 maps it.  dump-stats reports the time this
+ *					saved.
+ *
+ *		WatchConfig
+ *					optionally is 1 to reload this configuration file whenever it is written.
+ *					Output log, health check and control code action settings apply immediately;
+ *					changes to ApplicationName, CommandLine, CurrentDirectory or the
+ *					environment restart the child.  Each reload starts from the environment
+ *					the service started with, so variables removed from the configuration
+ *					are removed from the child's, and a reload that fails leaves it as it was.
+ *
+ *		HealthCheck
+ *					optionally probes the child while it is running, in one of these forms:
+ *
+ *						tcp:port			connect to the port on 127.0.0.1.
+ *						http:port[/path]	GET the path, / by default, and expect a 2xx or 3xx status.
+ *						exec:cmdline		run the command line and expect exit code 0.
+ *
+ *					Probes never block the service; their latencies are kept in a
+ *					histogram reported by dump-stats.
+ *
+ *		HealthIntervalMillis
+ *					optionally is the time from the end of one probe to the start of the next,
+ *					10000 by default.
+ *
+ *		HealthTimeoutMillis
+ *					optionally is the time after which a probe counts as failed, 2000 by default.
+ *
+ *		HealthFailures
+ *					optionally is the number of consecutive failed probes that make the child
+ *					unhealthy, 3 by default.  0 ignores failures.
+ *
+ *		HealthMaxP99Millis
+ *					optionally makes the child unhealthy if the 99th percentile latency
+ *					over HealthWindow successful probes exceeds this.  0, the default, ignores latency.
+ *
+ *		HealthWindow
+ *					optionally is the number of successful probes per latency judgement, 100 by default.
+ *
+ *		WatchdogMillis
+ *					optionally is the interval in which the child must send a heartbeat.
+ *					The child finds an inherited event handle in the environment variable
+ *					SRVWRAP_WATCHDOG_HANDLE and the interval in SRVWRAP_WATCHDOG_MILLIS,
+ *					and sends a heartbeat by calling SetEvent() on the handle, which is
+ *					cheap enough to do every 100ms.  Heartbeats are checked once per
+ *					interval, not timed, so send one at least twice per interval, as for
+ *					systemd's WATCHDOG_USEC.  An interval without a heartbeat means the
+ *					child is hung; hang diagnostics are captured before it is stopped.
+ *					Changing this restarts the child.
+ *
+ *		RecycleMaxPrivateMB
+ *					optionally restarts the child when its process tree commits more than
+ *					this many megabytes of private memory.
+ *
+ *		RecycleMaxGrowthMBPerHour
+ *					optionally restarts the child when the private memory of its process
+ *					tree grows faster than this, judged by a least squares trend over
+ *					the last 30 samples.
+ *
+ *		RecycleAfterMinutes
+ *					optionally restarts the child after it has run this long.
+ *
+ *		RecycleSampleMillis
+ *					optionally is the time between memory samples, 60000 by default.
+ *					Recycling restarts the child gracefully and logs the memory reclaimed.
+ *
+ *		Journal
+ *					optionally is the path to a binary file recording each run of the child:
+ *					when it was launched, became ready, was asked to stop and exited; its
+ *					exit code; how far stopping it escalated; why the run ended; and its peak
+ *					memory and CPU time.  The child is ready when the service reports running
+ *					or, with HealthCheck, when the first probe succeeds.  Summarize it with
+ *
+ *						%WRAPPER_EXE% -history journal
+ *
+ *		JournalRecords
+ *					optionally is the number of runs kept in the Journal, 1000 by default;
+ *					each new run then replaces the oldest.
+ *
+ *		StopTimeoutMillis
+ *					optionally is how long the child is given to stop before it is killed,
+ *					30000 by default.
+ *
+ *		StopTimeoutAdaptive
+ *					optionally is 1 to learn the stop timeout from how long the child has
+ *					taken to stop before, including the runs recorded in the Journal.
+ *					After 5 observed stops the timeout becomes StopTimeoutPercentile of
+ *					those times plus StopTimeoutMarginMillis, kept between StopTimeoutMinMillis
+ *					and StopTimeoutMaxMillis.  A child that had to be killed counts as taking
+ *					the whole timeout, so repeated kills lengthen it.
+ *
+ *		StopTimeoutPercentile
+ *					optionally is the percentile of observed stop times used, 99 by default.
+ *
+ *		StopTimeoutMarginMillis
+ *					optionally is added to that percentile, 5000 by default.
+ *
+ *		StopTimeoutMinMillis, StopTimeoutMaxMillis
+ *					optionally bound the learned timeout, 5000 and 300000 by default.
+ *
+ *		StartGateSlots
+ *					optionally limits how many wrapped services on the host may be starting
+ *					at once, such as after a reboot.  The service waits for one of this many
+ *					host-wide slots before launching the child, and holds it until the child
+ *					is ready or exits.  Services should agree on the number; it is read only
+ *					at startup, and at most 64.
+ *
+ *		StartGateWaitMillis
+ *					optionally is how long to wait for a start slot, 10 minutes by default.
+ *					A starting service accepts no stop request, and a service whose child
+ *					never becomes ready holds its slot until the child exits, so after this
+ *					long the child is launched without a slot and the event log says so.
+ *					0 waits as long as it takes.  Read only at startup.
+ *
+ *		Prefetch
+ *					optionally lists files to read into the file cache before the child
+ *					is launched, such as the jar files of a Java service, separated by
+ *					semicolons.  Each may be a path, a path whose last component has
+ *					wildcards, or @ followed by a file listing one such path per line.
+ *					Prefetch may be given more than once to list more files.
+ *					Reading starts as soon as the configuration is read, alongside the
+ *					rest of startup.  Start times of the first launch and of relaunches
+ *					are shown by dump-stats as cold and warm starts.
+ *
+ *		PrefetchThreads
+ *					optionally is the number of files read at once, 4 by default.
+ *
+ *		PrefetchWaitMillis
+ *					optionally is how long launching the child waits for reading to
+ *					finish, 10000 by default; reading continues in the background.
+ *
+ *		HangDumpDirectory
+ *					optionally is a directory to receive a minidump of each process in the
+ *					child's process tree when the child hangs, or when it must be killed
+ *					because it did not stop within the stop timeout.
+ *
+ *		HangDumpsKept
+ *					optionally is the number of minidumps kept in HangDumpDirectory,
+ *					5 by default; the oldest are deleted after each capture.
+ *
+ *		HangThreadDumpMillis
+ *					optionally sends CTRL + BREAK before the minidumps and allows this long
+ *					for the child to write a thread dump, as a JVM does, to its output.
+ *					Programs without a CTRL + BREAK handler simply exit.
+ *
+ *		HealthAction
+ *					optionally is restart, the default, to restart an unhealthy or hung child,
+ *					or stop to stop the service so that SCM recovery options apply.
+ *
+ *		OnControl
+ *					optionally maps an SCM control code to an action, which helps diagnose
+ *					a live service without restarting it.  It may be repeated, and
+ *					must be a string in the following format:
+ *
+ *						code:action
+ *
+ *					where:
+ *
+ *					code	is a user control code from 128 to 255 as sent by
+ *							"sc control %SVC_NAME% code", or paramchange.
+ *
+ *					action	is any control request listed below, for example
+ *							"signal-child ctrl-break" for a JVM thread dump,
+ *							"reopen-logs" or "restart"; or "exec" followed by
+ *							a command line to run alongside the child.
+ *
  *		Environment
  *					specifies how to construct the environment block for the service.
  *					It must be a string in the following format:
@@ -88,20 +408,92 @@
  *										contained in the file specified by the
  *										path argument is used to update the environment.
  *
- *							inline		The remainder of this configuration file contains
- *										name=value environment variables used to
- *										update the environment.
+ *							inline		The remainder of this configuration file, or of
+ *										its section, contains name=value environment
+ *										variables used to update the environment.
  *
  *					path
  *							must be specified when source is file.
  *
  *					If Environment is omitted, default mode is used.
  *
+ * A configuration file shared by several services divides its lines into sections:
+ *
+ *		[defaults]			settings for every service; must come before any service section.
+ *		[service:name]		settings for the service installed as name, overriding the defaults.
+ *		[service:prefix*]	settings for every service whose name begins with prefix.
+ *		[env]				name=value environment variables for the defaults or service above.
+ *		[limits]
+ *		[logging]
+ *		[health]			settings for the defaults or service above, grouped for readability.
+ *
+ * for example:
+ *
+ *		[defaults]
+ *		WatchConfig=1
+ *		[health]
+ *		HealthIntervalMillis=5s
+ *
+ *		[service:orders]
+ *		CommandLine=java -jar orders.jar
+ *		[env]
+ *		PORT=8081
+ *
+ * Each service reads only the defaults and the sections matching its name, in order.  Lines
+ * before the first section apply to every service, so a file without sections configures one
+ * service as before.  Include=path reads another file, relative to the including one, as though
+ * its lines were in place of the Include line.  Changes to an included file take effect when
+ * this file is next reloaded.
+ *
+ * Values are kept as written unless Expand=1 comes before them, in the same or an earlier
+ * section; Expand=0 turns it off again.  Then values, including environment variables, are
+ * expanded once when the file is read:
+ *
+ *		${name}, %name%		an environment variable, including one set above, or a built-in
+ *							name; %name% is left as it is if the name is not defined.
+ *		${expression}		whole numbers and names joined by +, -, * and /, worked from left
+ *							to right, as in ${memory_mb / 2}.
+ *		$$					a single $, so that $${sys:user.home} passes ${sys:user.home} on.
+ *		%%					a single %, as for an OnControl command that expands it itself.
+ *
+ * Any other % is left as it is, so a Java option such as -Dlog.pattern=%d %c %m%n needs no
+ * escaping.  In an [env] section Expand=1 would set a variable, so put it above the section.
+ * The built-in names are service, instance (the number ending the service name, or 0),
+ * cores (the logical processors), core (the instance modulo cores) and memory_mb (the
+ * physical memory in MB).  So services orders1, orders2 and so on can share one template:
+ *
+ *		[service:orders*]
+ *		Expand=1
+ *		CommandLine=java -Dport=${8080 + instance} -jar orders.jar
+ *		OutputLog=C:\logs\%service%.log
+ *
  * The configuration parameters specify arguments to be passed to the Windows API
  * CreateProcess() when launching the wrapped program.  See
  * https://msdn.microsoft.com/en-us/library/windows/desktop/ms682425(v=vs.85).aspx
  * for more details.
  *
+ * While running, the service listens on the named pipe \\.\pipe\SrvWrap-%SVC_NAME% for
+ * control requests from administrators.  Send a request from the command line with:
+ *
+ *		%WRAPPER_EXE% -control %SVC_NAME% command [argument]
+ *
+ * where command is one of:
+ *
+ *		status					Report the service state and child process id.
+ *		restart					Stop the child process and launch it again.
+ *		reload-config			Read the configuration file again and apply what changed.
+ *		rotate-logs				Rotate the output log.
+ *		dump-stats				Report state transition, control, output log, health check,
+ *								watchdog, hang diagnostics and memory counters.
+ *		signal-child [ctrl-c|ctrl-break]
+ *								Send a console signal to the child process.
+ *		tail-log [lines]		Report the last lines of the output log, 10 by default.
+ *		reopen-logs				Close and reopen the output log, after an external tool renamed it.
+ *		query-log from [to]		Report the lines of the output log, rotated logs included, logged
+ *								from one time to another or to now.  See OutputLogIndexKB.
+ *
+ * The reply starts with OK, or ERR followed by an error code, on its own line.
+ *
  * Any fatal error encountered by the service writes an event to the Windows Application event log with
  * the source set to SrvWrap.  The first string reported with the event is typically the service name.
  *
@@ -120,26 +512,112 @@
 
 #include <tchar.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "SrvConfig.h"
+#include "SrvState.h"
+#include "SrvChild.h"
+#include "SrvLog.h"
+#include "SrvControl.h"
+#include "SrvHealth.h"
+#include "SrvWatchdog.h"
+#include "SrvDump.h"
+#include "SrvRecycle.h"
+#include "SrvJournal.h"
+#include "SrvStopTimeout.h"
+#include "SrvStartGate.h"
+#include "SrvPrefetch.h"
+#include "SrvJava.h"
+#include "SrvConfigCache.h"
+#include "SrvEnvCache.h"
+#include "SrvLogTransform.h"
+#include "SrvLogCompress.h"
+#include "SrvLogIndex.h"
+#include "SrvLogForward.h"
 
 static const char eventSourceName[] = "SrvWrap";
-static const DWORD waitSecondsBeforeKill = 30;
+static const DWORD waitSecondsForOutput = 30;
 
 static LPSTR lpServiceName = NULL;
 static LPSTR lpConfigName = NULL;
 
-SERVICE_STATUS		  	gSvcStatus;
-SERVICE_STATUS_HANDLE   gSvcStatusHandle;
+static LPSRV_CONFIG lpSrvConfig = NULL;
+static LPVOID lpBaseEnvironment = NULL;
+static HANDLE hConfigWatch = INVALID_HANDLE_VALUE;
+static FILETIME ftConfigTime;
+static SRV_CHILD child;
+static HANDLE hChildOutput = NULL;
+static BOOL bRestartRequested = FALSE;
+static SRV_END_REASON endReason = SRV_END_EXITED;
+static BOOL bServiceFailed = FALSE;
+static DWORD dwServiceError = NO_ERROR;
+
+/**
+ * Control codes with configured actions are passed from SvcCtrlHandler
+ * to the service main thread as bits in this mask.
+ */
+static volatile LONG pendingControls[(SRV_CONTROL_ACTIONS + 31) / 32];
+
 HANDLE				  	ghSvcStopEvent = NULL;
+HANDLE				  	ghSvcControlEvent = NULL;
+HANDLE				  	ghSvcPauseEvent = NULL;
 
 VOID WINAPI SvcCtrlHandler( DWORD );
 VOID WINAPI SvcMain(DWORD, LPTSTR*);
 
-static void ReportSvcStatus(DWORD, DWORD, DWORD);
+/**
+ * Positions of the handles waited on by the service main loop.
+ * The configuration change handle is last because it is optional.
+ */
+enum {
+	WAIT_STOP,
+	WAIT_CHILD,
+	WAIT_CONTROL_CHANNEL,
+	WAIT_CONTROL_CODE,
+	WAIT_PAUSE,
+	WAIT_HEALTH_TIMER,
+	WAIT_HEALTH_PROBE,
+	WAIT_WATCHDOG,
+	WAIT_RECYCLE,
+	WAIT_CONFIG_CHANGE,
+	WAIT_HANDLES
+};
+
+/**
+ * The steps of applying a reloaded configuration to the running modules, in order.
+ */
+enum {
+	APPLY_DUMP,
+	APPLY_STOP_TIMEOUT,
+	APPLY_RECYCLE,
+	APPLY_HEALTH,
+	APPLY_OUTPUT_LOG,
+	APPLY_LOG_COMPRESS,
+	APPLY_LOG_FORWARD,
+	APPLY_STEPS
+};
+
+static void CloseService(void);
+static BOOL OpenChildOutput(void);
+static BOOL RestartChild(void);
+static BOOL ReloadConfig(LPSTR, DWORD);
+static BOOL ApplyConfigStep(DWORD, LPSRV_CONFIG, DWORD);
+static void WatchConfig(void);
+static void ReloadChangedConfig(void);
+static void RunControlActions(void);
+static void PauseOrContinueChild(void);
+static void RequestRestart(SRV_END_REASON);
+static void RecoverChild(LPCSTR, SRV_END_REASON);
+static void MarkChildReady(void);
+static void RecordChildRun(SRV_END_REASON);
+static BOOL HandleControlRequest(SRV_COMMAND, LPSTR, LPSTR, DWORD);
+static BOOL WINAPI ConsoleCtrlHandler(DWORD);
 
 static void LogArgs(int, char*[]);
 static void LogInfo(LPTSTR);
+static void LogConfigError(void);
+static void LogStateMetrics(void);
+static void LogKill(void);
 static void LogError(LPTSTR, BOOL);
 
 /**
@@ -153,9 +631,86 @@ static void LogError(LPTSTR, BOOL);
  * 	argv[1]			is the service name used when the service was installed.
  *
  * 	argv[2]			is the path to a text file containing configuration details for the service.
+ *
+ * Alternatively, the process is invoked from the command line as a control client:
+ *
+ *		SrvWrap -control service command [argument]
+ *
+ * or to summarize a run history journal:
+ *
+ *		SrvWrap -history journal
+ *
+ * or to time parsing a configuration file against loading its cache, 1000 times by default:
+ *
+ *		SrvWrap -bench-config config [iterations [service]]
+ *
+ * or to time transforming sample output into an output log format, 1024 MB by default:
+ *
+ *		SrvWrap -bench-log [format [megabytes]]
+ *
+ * or to time capturing raw output from a pipe to a file the old buffered way and
+ * the overlapped way, 1024 MB by default:
+ *
+ *		SrvWrap -bench-capture [megabytes]
+ *
+ * or to write a compressed output log to standard output:
+ *
+ *		SrvWrap -decompress file
+ *
+ * or to print the lines of an output log and its rotated logs logged from one time to another:
+ *
+ *		SrvWrap -query-log file from [to]
  */
 int main(int argc, char* argv[])
 {
+	// Check for control client mode, which does not touch the event log.
+
+	if ((argc >= 4) && (strcmp(argv[1], "-control") == 0)) {
+		return SrvControlClient(argv[2], argc - 3, argv + 3);
+	}
+
+	// Check for run history query mode.
+
+	if ((argc == 3) && (strcmp(argv[1], "-history") == 0)) {
+		return SrvJournalPrint(argv[2]);
+	}
+
+	// Check for configuration benchmark mode.
+
+	if ((argc >= 3) && (argc <= 5) && (strcmp(argv[1], "-bench-config") == 0)) {
+		return SrvConfigCacheBenchmark(argv[2], (argc == 5) ? argv[4] : NULL,
+				(argc >= 4) ? strtoul(argv[3], NULL, 10) : 1000);
+	}
+
+	// Check for compressed output log mode.
+
+	if ((argc == 3) && (strcmp(argv[1], "-decompress") == 0)) {
+		if (!SrvLogDecompress(argv[2], GetStdHandle(STD_OUTPUT_HANDLE))) {
+			fprintf(stderr, "SrvWrap: cannot decompress %s, error %lu\n", argv[2], GetLastError());
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	// Check for output log query mode.
+
+	if ((argc >= 4) && (argc <= 5) && (strcmp(argv[1], "-query-log") == 0)) {
+		return SrvLogQueryPrint(argv[2], argv[3], (argc == 5) ? argv[4] : NULL);
+	}
+
+	// Check for output log format benchmark mode.
+
+	if ((argc >= 2) && (argc <= 4) && (strcmp(argv[1], "-bench-log") == 0)) {
+		return SrvLogTransformBenchmark((argc >= 3) ? argv[2] : "json",
+				(argc == 4) ? strtoul(argv[3], NULL, 10) : 1024);
+	}
+
+	// Check for output capture benchmark mode.
+
+	if ((argc >= 2) && (argc <= 3) && (strcmp(argv[1], "-bench-capture") == 0)) {
+		return SrvLogCaptureBenchmark((argc == 3) ? strtoul(argv[2], NULL, 10) : 1024);
+	}
+
 	// Validate the arguments.
 
 	lpServiceName = (2 <= argc) ? argv[1] : "[name omitted]";
@@ -207,23 +762,21 @@ VOID WINAPI SvcMain(DWORD dwArgc, LPTSTR *lpszArgv)
 
 	// Register the handler function for the service.
 
-	gSvcStatusHandle = RegisterServiceCtrlHandler(
+	SERVICE_STATUS_HANDLE hSvcStatusHandle = RegisterServiceCtrlHandler(
 			lpServiceName,
 			SvcCtrlHandler);
 
-	if (!gSvcStatusHandle) {
+	if (!hSvcStatusHandle) {
 		LogError(TEXT("RegisterServiceCtrlHandler"), FALSE);
 		return;
 	}
 
-	gSvcStatus.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
-	gSvcStatus.dwServiceSpecificExitCode = 0;
-
 	// Report initial status to the SCM.
-	// If startup is slow, call ReportSvcStatus() periodically with SERVICE_START_PENDING.
-	// If initialization fails, call ReportSvcStatus with SERVICE_STOPPED.
+	// If startup is slow, call SrvStateCheckPoint() periodically.
+	// If initialization fails, LogError() moves to SRV_STATE_STOPPING
+	// and CloseService() then to SRV_STATE_FAILED.
 
-	ReportSvcStatus(SERVICE_START_PENDING, NO_ERROR, 3000);
+	SrvStateInit(hSvcStatusHandle);
 
 	// Create an event. The control handler function, SvcCtrlHandler,
 	// signals this event when it receives the stop control code.
@@ -236,242 +789,1085 @@ VOID WINAPI SvcMain(DWORD dwArgc, LPTSTR *lpszArgv)
 
 	if (ghSvcStopEvent == NULL) {
 		LogError(TEXT("CreateEvent"), TRUE);
+		CloseService();
+		return;
+	}
+
+	// Create an event that SvcCtrlHandler signals when it receives
+	// a control code with a configured action.
+
+	ghSvcControlEvent = CreateEvent(
+			NULL,	// default security attributes
+			FALSE,	// auto reset event
+			FALSE,	// not signaled
+			NULL);	// no name
+
+	if (ghSvcControlEvent == NULL) {
+		LogError(TEXT("CreateEvent"), TRUE);
+		CloseService();
+		return;
+	}
+
+	// Create an event that SvcCtrlHandler signals when it receives
+	// the pause or continue control code.
+
+	ghSvcPauseEvent = CreateEvent(
+			NULL,	// default security attributes
+			FALSE,	// auto reset event
+			FALSE,	// not signaled
+			NULL);	// no name
+
+	if (ghSvcPauseEvent == NULL) {
+		LogError(TEXT("CreateEvent"), TRUE);
+		CloseService();
 		return;
 	}
 
 	// Because this is a service, it was started without a console.
 	// Allocate a console so that CTRL_C_EVENT can be sent to
 	// signal the child process to terminate cleanly.
+	// Console signals reach this process too, so ignore them here.
+	// A handler routine is used rather than ignoring CTRL + C outright
+	// because that setting would be inherited by the child.
 
 	bSuccess = AllocConsole();
 
 	if (!bSuccess) {
 		LogError(TEXT("AllocConsole"), TRUE);
+		CloseService();
+		return;
+	}
+
+	bSuccess = SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+
+	if (!bSuccess) {
+		LogError(TEXT("SetConsoleCtrlHandler"), TRUE);
+		CloseService();
+		return;
+	}
+
+	// Keep the environment from before the configuration sets its variables,
+	// for a reload to start from.
+
+	lpBaseEnvironment = SaveSrvEnvironment();
+
+	if (lpBaseEnvironment == NULL) {
+		LogError(TEXT("SaveSrvEnvironment"), TRUE);
+		CloseService();
 		return;
 	}
 
 	// Get the service configuration.
 
-	LPSRV_CONFIG lpSrvConfig = GetSrvConfig(lpConfigName);
+	lpSrvConfig = GetSrvConfig(lpConfigName, lpServiceName);
 
 	if (lpSrvConfig == NULL) {
+		LogConfigError();
 		LogError(TEXT("GetSrvConfig"), TRUE);
+		CloseService();
 		return;
 	}
 
-	// Launch the wrapped executable.
+	GetSrvConfigTime(lpConfigName, &ftConfigTime);
+	WatchConfig();
 
-	DWORD dwCreationFlags = 0;		// Do NOT use CREATE_NO_WINDOW; that suppresses the ability to send console signals
-
-	STARTUPINFO si;
-	ZeroMemory(&si, sizeof(si));
-	si.cb = sizeof(si);
-	si.dwFlags = STARTF_USESTDHANDLES;
-	si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
-	si.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
-	si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
-
-	PROCESS_INFORMATION pi;
-	ZeroMemory(&pi, sizeof(pi));
-
-	bSuccess = CreateProcess(
-			lpSrvConfig->lpApplicationName,
-			lpSrvConfig->lpCommandLine,
-			NULL,							// lpProcessAttributes
-			NULL,							// lpThreadAttributes
-			TRUE,							// bInheritHandles
-			dwCreationFlags,				// dwCreationFlags
-			lpSrvConfig->lpEnvironment,
-			lpSrvConfig->lpCurrentDirectory,
-			&si,							// lpStartupInfo
-			&pi);							// lpProcessInformation
+	// Start warming the file cache for the child if configured.
+
+	bSuccess = SrvPrefetchStart(lpSrvConfig);
 
 	if (!bSuccess) {
-		LogError(TEXT("CreateProcess"), TRUE);
+		LogError(TEXT("SrvPrefetchStart"), TRUE);
+		CloseService();
 		return;
 	}
 
-	// Report running status when initialization is complete.
+	// Forward the child output to a collector if configured.
+	// This is ready before the output is captured, so none is missed.
 
-	ReportSvcStatus(SERVICE_RUNNING, NO_ERROR, 0);
+	bSuccess = SrvLogForwardOpen(lpServiceName) && SrvLogForwardConfigure(lpSrvConfig);
 
-	// Wait until: the service is signaled to stop; or, the child process terminates.
+	if (!bSuccess) {
+		LogError(TEXT("SrvLogForwardConfigure"), TRUE);
+		CloseService();
+		return;
+	}
 
-	HANDLE waitForHandles[] = {ghSvcStopEvent, pi.hProcess};
+	// Capture the child output if requested.
 
-	DWORD waitResult = WaitForMultipleObjects(
-			2,					// nCount
-			waitForHandles,		// lpHandles
-			FALSE,				// bWaitAll
-			INFINITE);			// dwMilliseconds
+	bSuccess = OpenChildOutput();
 
-	if (waitResult == WAIT_OBJECT_0) {
+	if (!bSuccess) {
+		LogError(TEXT("SrvLogOpen"), TRUE);
+		CloseService();
+		return;
+	}
 
-		LogInfo(TEXT("Service signaled to stop"));
+	// Compress and prune rotated output logs in the background if configured.
 
-		// The service was signaled to stop; terminate the child process.
-		// Try sending CTRL + C signal.  The signal affects not only child processes
-		// but also this parent process.  So first disable the signal for this parent.
+	bSuccess = SrvLogCompressOpen() && SrvLogCompressConfigure(lpSrvConfig);
 
-		bSuccess = SetConsoleCtrlHandler(NULL, TRUE);
+	if (!bSuccess) {
+		LogError(TEXT("SrvLogCompressConfigure"), TRUE);
+		CloseService();
+		return;
+	}
 
-		if (!bSuccess) {
-			LogError(TEXT("SetConsoleCtrlHandler"), TRUE);
-			return;
-		}
+	// Open the control channel.
 
-		bSuccess = GenerateConsoleCtrlEvent(CTRL_C_EVENT, 0);
+	bSuccess = SrvControlOpen(lpServiceName, HandleControlRequest);
 
-		if (!bSuccess) {
-			LogError(TEXT("GenerateConsoleCtrlEvent"), TRUE);
-			return;
-		}
+	if (!bSuccess) {
+		LogError(TEXT("SrvControlOpen"), TRUE);
+		CloseService();
+		return;
+	}
 
-		// Wait for the child process to terminate.
+	// Prepare health checking, which starts once the child is running.
 
-		waitResult = WaitForSingleObject(pi.hProcess, waitSecondsBeforeKill * 1000);
+	bSuccess = SrvHealthOpen() && SrvHealthConfigure(lpSrvConfig);
 
-		if (waitResult == WAIT_OBJECT_0) {
-			// Normal termination.
-		}
-		else if (waitResult == WAIT_TIMEOUT) {
+	if (!bSuccess) {
+		LogError(TEXT("SrvHealthConfigure"), TRUE);
+		CloseService();
+		return;
+	}
 
-			LogInfo(TEXT("Killing child process"));
+	// Prepare to capture diagnostics from a child that hangs.
 
-			// The child process did not terminate itself in a timely way.
-			// Kill it.
+	bSuccess = SrvDumpConfigure(lpSrvConfig->lpHangDumpDirectory,
+			lpSrvConfig->dwHangDumpsKept, lpSrvConfig->dwHangThreadDumpMillis);
 
-			UINT uExitCode = WAIT_TIMEOUT;
+	if (!bSuccess) {
+		LogError(TEXT("SrvDumpConfigure"), TRUE);
+		CloseService();
+		return;
+	}
 
-			bSuccess = TerminateProcess(pi.hProcess, uExitCode);
+	// Choose the stop timeout, learning from the journal if configured.
 
-			if (!bSuccess) {
-				LogError(TEXT("TerminateProcess"), TRUE);
-				return;
-			}
-		}
-		else {
-			LogError(TEXT("WaitForSingleObject"), TRUE);
-			return;
-		}
+	bSuccess = SrvStopTimeoutConfigure(lpSrvConfig);
+
+	if (!bSuccess) {
+		LogError(TEXT("SrvStopTimeoutConfigure"), TRUE);
+		CloseService();
+		return;
 	}
-	else if (waitResult == (WAIT_OBJECT_0 + 1)) {
 
-		LogInfo(TEXT("Child process terminated"));
+	// Start sampling memory for recycling if configured.
 
-		// The child process terminated; report that the service will stop.
+	bSuccess = SrvRecycleOpen() && SrvRecycleConfigure(lpSrvConfig);
 
-		ReportSvcStatus(SERVICE_STOP_PENDING, NO_ERROR, 0);
+	if (!bSuccess) {
+		LogError(TEXT("SrvRecycleConfigure"), TRUE);
+		CloseService();
+		return;
+	}
 
-		 // If the child process terminated with an error code, report it.
+	// Advertise the heartbeat watchdog to the child if configured.
 
-		DWORD dwExitCode;
+	bSuccess = SrvWatchdogOpen() && SrvWatchdogArm(lpSrvConfig->dwWatchdogMillis);
 
-		bSuccess = GetExitCodeProcess(pi.hProcess, &dwExitCode);
+	if (!bSuccess) {
+		LogError(TEXT("SrvWatchdogArm"), TRUE);
+		CloseService();
+		return;
+	}
 
-		if (!bSuccess) {
-			LogError(TEXT("GetExitCodeProcess"), TRUE);
-			return;
-		}
+	// Wait for a start slot if starts are throttled across the host.
 
-		if (dwExitCode != 0) {
-			SetLastError(dwExitCode);
-			LogError(TEXT("Child process"), TRUE);
-			return;
-		}
-	}
-	else {
-		LogError(TEXT("WaitForMultipleObjects"), TRUE);
+	DWORD dwStartWaitMillis;
+	bSuccess = SrvStartGateAcquire(lpSrvConfig->dwStartGateSlots, lpSrvConfig->dwStartGateWaitMillis,
+			&dwStartWaitMillis);
+
+	if (!bSuccess) {
+		LogError(TEXT("SrvStartGateAcquire"), TRUE);
+		CloseService();
 		return;
 	}
 
-	// Close the handles to child process information
-	// and report service stopped normally.
+	if (lpSrvConfig->dwStartGateSlots != 0) {
+		TCHAR message[80];
+		_snprintf(message, sizeof(message), SrvStartGateHeld()
+				? TEXT("Waited %lu ms for a start slot")
+				: TEXT("Launching without a start slot after waiting %lu ms"), dwStartWaitMillis);
+		message[sizeof(message) - 1] = 0;
+		LogInfo(message);
+	}
 
-	CloseHandle(pi.hProcess);
-	CloseHandle(pi.hThread);
+	// Give the file cache a head start.
 
-	ReleaseSrvConfig(lpSrvConfig);
+	if (!SrvPrefetchWait(lpSrvConfig->dwPrefetchWaitMillis)) {
+		LogInfo(TEXT("Launching before prefetch finished"));
+	}
 
-	ReportSvcStatus(SERVICE_STOPPED, NO_ERROR, 0);
-	return;
-}
+	// Launch the wrapped executable.
 
-//
-// Purpose:
-//   Sets the current service status and reports it to the SCM.
-//
-// Parameters:
-//   dwCurrentState - The current state (see SERVICE_STATUS)
-//   dwWin32ExitCode - The system error code
-//   dwWaitHint - Estimated time for pending operation,
-//	 in milliseconds
-//
-// Return value:
-//   None
-//
-static void ReportSvcStatus(
-		DWORD dwCurrentState,
-		DWORD dwWin32ExitCode,
-		DWORD dwWaitHint)
-{
-	static DWORD dwCheckPoint = 1;
+	bSuccess = SrvChildLaunch(lpSrvConfig, hChildOutput, SrvLogGetErrorHandle(), &child);
 
-	// Fill in the SERVICE_STATUS structure.
+	if (!bSuccess) {
+		LogError(TEXT("CreateProcess"), TRUE);
+		CloseService();
+		return;
+	}
 
-	gSvcStatus.dwCurrentState = dwCurrentState;
-	gSvcStatus.dwWin32ExitCode = dwWin32ExitCode;
-	gSvcStatus.dwWaitHint = dwWaitHint;
+	// Report running status when initialization is complete.
+	// Parameter changes are accepted only if they have an action.
 
-	if (dwCurrentState == SERVICE_START_PENDING) {
-		gSvcStatus.dwControlsAccepted = 0;
-	}
-	else {
-		gSvcStatus.dwControlsAccepted = SERVICE_ACCEPT_STOP;
+	if (lpSrvConfig->lpControlActions[GetSrvControlActionIndex(SERVICE_CONTROL_PARAMCHANGE)] != NULL) {
+		SrvStateAcceptControls(SERVICE_ACCEPT_PARAMCHANGE);
 	}
 
-	if ((dwCurrentState == SERVICE_RUNNING) || (dwCurrentState == SERVICE_STOPPED)) {
-		gSvcStatus.dwCheckPoint = 0;
-	}
-	else {
-		gSvcStatus.dwCheckPoint = dwCheckPoint++;
+	SrvStateTransition(SRV_STATE_READY, NO_ERROR, 3000);
+	SrvStateTransition(SRV_STATE_RUNNING, NO_ERROR, 0);
+
+	if (lpSrvConfig->lpHealthCheck == NULL) {
+		MarkChildReady();
 	}
 
-	// Report the status of the service to the SCM.
-	SetServiceStatus(gSvcStatusHandle, &gSvcStatus);
-}
+	// Wait until: the service is signaled to stop; or, the child process terminates.
+	// Control requests are served while waiting.
 
-//
-// Purpose:
-//   Called by SCM whenever a control code is sent to the service
-//   using the ControlService function.
-//
-// Parameters:
-//   dwCtrl - control code
-//
-// Return value:
-//   None
-//
-VOID WINAPI SvcCtrlHandler(DWORD dwCtrl)
-{
-   // Handle the requested control code.
+	BOOL bRunning = TRUE;
 
-   switch(dwCtrl) {
+	while (bRunning) {
 
-	case SERVICE_CONTROL_STOP:
-		ReportSvcStatus(SERVICE_STOP_PENDING, NO_ERROR, 0);
+		HANDLE waitForHandles[WAIT_HANDLES];
+		waitForHandles[WAIT_STOP] = ghSvcStopEvent;
+		waitForHandles[WAIT_CHILD] = child.pi.hProcess;
+		waitForHandles[WAIT_CONTROL_CHANNEL] = SrvControlGetEvent();
+		waitForHandles[WAIT_CONTROL_CODE] = ghSvcControlEvent;
+		waitForHandles[WAIT_PAUSE] = ghSvcPauseEvent;
+		waitForHandles[WAIT_HEALTH_TIMER] = SrvHealthGetTimer();
+		waitForHandles[WAIT_HEALTH_PROBE] = SrvHealthGetProbeHandle();
+		waitForHandles[WAIT_WATCHDOG] = SrvWatchdogGetTimer();
+		waitForHandles[WAIT_RECYCLE] = SrvRecycleGetTimer();
+		waitForHandles[WAIT_CONFIG_CHANGE] = hConfigWatch;
 
-		// Signal the service to stop.
+		DWORD nCount = (hConfigWatch != INVALID_HANDLE_VALUE) ? WAIT_HANDLES : WAIT_CONFIG_CHANGE;
 
-		SetEvent(ghSvcStopEvent);
-		ReportSvcStatus(gSvcStatus.dwCurrentState, NO_ERROR, 0);
+		DWORD waitResult = WaitForMultipleObjects(
+				nCount,				// nCount
+				waitForHandles,		// lpHandles
+				FALSE,				// bWaitAll
+				INFINITE);			// dwMilliseconds
 
-		return;
+		if (waitResult == (WAIT_OBJECT_0 + WAIT_STOP)) {
 
-	case SERVICE_CONTROL_INTERROGATE:
-		break;
+			LogInfo(TEXT("Service signaled to stop"));
 
-	default:
+			// The service was signaled to stop; terminate the child process.
+
+			BOOL bKilled;
+
+			bSuccess = SrvChildStop(&child, SrvStopTimeoutGet(), &bKilled);
+
+			if (!bSuccess) {
+				LogError(TEXT("SrvChildStop"), TRUE);
+				CloseService();
+				return;
+			}
+
+			if (bKilled) {
+				LogKill();
+			}
+
+			RecordChildRun(SRV_END_STOP);
+
+			bRunning = FALSE;
+		}
+		else if (waitResult == (WAIT_OBJECT_0 + WAIT_CHILD)) {
+
+			LogInfo(TEXT("Child process terminated"));
+
+			RecordChildRun(SRV_END_EXITED);
+
+			// The child process terminated; report that the service will stop.
+			// The transition fails harmlessly if a stop request got there first.
+
+			SrvStateTransition(SRV_STATE_STOPPING, NO_ERROR, 3000);
+
+			 // If the child process terminated with an error code, report it.
+
+			DWORD dwExitCode;
+
+			bSuccess = GetExitCodeProcess(child.pi.hProcess, &dwExitCode);
+
+			if (!bSuccess) {
+				LogError(TEXT("GetExitCodeProcess"), TRUE);
+				CloseService();
+				return;
+			}
+
+			if (dwExitCode != 0) {
+				SetLastError(dwExitCode);
+				LogError(TEXT("Child process"), TRUE);
+				CloseService();
+				return;
+			}
+
+			bRunning = FALSE;
+		}
+		else if (waitResult == (WAIT_OBJECT_0 + WAIT_PAUSE)) {
+
+			PauseOrContinueChild();
+		}
+		else if ((waitResult == (WAIT_OBJECT_0 + WAIT_CONTROL_CHANNEL))
+				|| (waitResult == (WAIT_OBJECT_0 + WAIT_CONTROL_CODE))
+				|| (waitResult == (WAIT_OBJECT_0 + WAIT_HEALTH_TIMER))
+				|| (waitResult == (WAIT_OBJECT_0 + WAIT_HEALTH_PROBE))
+				|| (waitResult == (WAIT_OBJECT_0 + WAIT_WATCHDOG))
+				|| (waitResult == (WAIT_OBJECT_0 + WAIT_RECYCLE))
+				|| (waitResult == (WAIT_OBJECT_0 + WAIT_CONFIG_CHANGE))) {
+
+			if (waitResult == (WAIT_OBJECT_0 + WAIT_CONTROL_CHANNEL)) {
+				SrvControlService();
+			}
+			else if (waitResult == (WAIT_OBJECT_0 + WAIT_CONTROL_CODE)) {
+				RunControlActions();
+			}
+			else if (waitResult == (WAIT_OBJECT_0 + WAIT_HEALTH_TIMER)) {
+
+				// Probe only a running child, not one paused or being restarted.
+
+				if (SrvHealthOnTimer(SrvStateGet() == SRV_STATE_RUNNING) == SRV_HEALTH_UNHEALTHY) {
+					RecoverChild(SrvHealthReason(), SRV_END_UNHEALTHY);
+				}
+			}
+			else if (waitResult == (WAIT_OBJECT_0 + WAIT_HEALTH_PROBE)) {
+
+				// The first successful probe shows the child is ready.
+
+				SRV_HEALTH health = SrvHealthOnProbe();
+
+				if (health == SRV_HEALTH_HEALTHY) {
+					MarkChildReady();
+				}
+				else if (health == SRV_HEALTH_UNHEALTHY) {
+					RecoverChild(SrvHealthReason(), SRV_END_UNHEALTHY);
+				}
+			}
+			else if (waitResult == (WAIT_OBJECT_0 + WAIT_WATCHDOG)) {
+
+				// A paused child cannot send heartbeats.
+
+				if (SrvWatchdogCheck(SrvStateGet() == SRV_STATE_RUNNING)) {
+
+					// Capture the hang now; the child may still stop cleanly.
+
+					SrvDumpCapture(&child);
+					RecoverChild(TEXT("Child process missed its watchdog heartbeat"), SRV_END_HUNG);
+				}
+			}
+			else if (waitResult == (WAIT_OBJECT_0 + WAIT_RECYCLE)) {
+
+				TCHAR message[160];
+
+				if (SrvRecycleSample(&child, SrvStateGet() == SRV_STATE_RUNNING, message, sizeof(message))) {
+					RequestRestart(SRV_END_RECYCLE);
+				}
+
+				if (message[0] != 0) {
+					LogInfo(message);
+				}
+			}
+			else {
+				ReloadChangedConfig();
+			}
+
+			if (bRestartRequested) {
+
+				bRestartRequested = FALSE;
+
+				bSuccess = RestartChild();
+
+				if (!bSuccess) {
+					CloseService();
+					return;
+				}
+
+				// A stop request during the restart left no child to wait for.
+
+				if (child.pi.hProcess == NULL) {
+					bRunning = FALSE;
+				}
+			}
+		}
+		else {
+			LogError(TEXT("WaitForMultipleObjects"), TRUE);
+			CloseService();
+			return;
+		}
+	}
+
+	CloseService();
+	return;
+}
+
+/**
+ * Close the handles to child process information and the modules,
+ * letting captured output drain, and report the service stopped:
+ * SRV_STATE_FAILED if LogError() reported a failure, else SRV_STATE_STOPPED.
+ * Closing a module that was never opened does nothing.
+ */
+static void CloseService(void)
+{
+	SrvChildClose(&child);
+
+	SrvStartGateClose();
+	SrvPrefetchClose();
+	SrvRecycleClose();
+	SrvWatchdogClose();
+	SrvHealthClose();
+	SrvControlClose();
+	SrvLogClose(waitSecondsForOutput * 1000);
+	SrvLogCompressClose();
+	SrvLogForwardClose(waitSecondsForOutput * 1000);
+
+	if (hConfigWatch != INVALID_HANDLE_VALUE) {
+		FindCloseChangeNotification(hConfigWatch);
+		hConfigWatch = INVALID_HANDLE_VALUE;
+	}
+
+	lpSrvConfig = ReleaseSrvConfig(lpSrvConfig);
+	lpBaseEnvironment = ReleaseSrvEnvironment(lpBaseEnvironment);
+
+	LogStateMetrics();
+
+	if (bServiceFailed) {
+		SrvStateTransition(SRV_STATE_FAILED, dwServiceError, 0);
+	}
+	else {
+		SrvStateTransition(SRV_STATE_STOPPED, NO_ERROR, 0);
+	}
+}
+
+/**
+ * Start capturing child output if the configuration asks for it
+ * and capture is not already running.
+ */
+static BOOL OpenChildOutput(void)
+{
+	if ((lpSrvConfig->lpOutputLog == NULL) || (hChildOutput != NULL)) {
+		return TRUE;
+	}
+
+	hChildOutput = SrvLogOpen(lpSrvConfig->lpOutputLog, lpSrvConfig->dwOutputLogRotateBytes,
+			lpSrvConfig->dwOutputLogIndexKB * 1024, lpSrvConfig->lpOutputLogFormat, lpServiceName);
+
+	return (hChildOutput != NULL)
+			&& SrvLogSetLimit(lpSrvConfig->lpOutputLogLimitPolicy, lpSrvConfig->dwOutputLogRateBytes,
+					lpSrvConfig->dwOutputLogBurstBytes, lpSrvConfig->dwOutputLogSample);
+}
+
+/**
+ * Stop the child process and launch it again with the current configuration.
+ * The service stays running throughout.  If a stop request arrives while the
+ * child is stopping, the child is not launched again and child.pi is left empty.
+ *
+ * Returns FALSE after reporting the error if the service must stop.
+ */
+static BOOL RestartChild(void)
+{
+	// A stop request takes precedence over a restart.
+
+	if (!SrvStateTransition(SRV_STATE_RESTARTING, NO_ERROR, 0)) {
+		return TRUE;
+	}
+
+	LogInfo(TEXT("Restarting child process"));
+
+	BOOL bKilled;
+
+	if (!SrvChildStop(&child, SrvStopTimeoutGet(), &bKilled)) {
+		LogError(TEXT("SrvChildStop"), TRUE);
+		return FALSE;
+	}
+
+	if (bKilled) {
+		LogKill();
+	}
+
+	RecordChildRun(SRV_END_RESTART);
+
+	SrvChildClose(&child);
+
+	// Stopping the child can take up to the stop timeout.  Launching a new
+	// one for a stop request that arrived meanwhile would only stop it again.
+
+	if (WaitForSingleObject(ghSvcStopEvent, 0) == WAIT_OBJECT_0) {
+		LogInfo(TEXT("Service signaled to stop during restart"));
+		return TRUE;
+	}
+
+	// A reload may have turned output capture on or off.
+
+	if (!OpenChildOutput()) {
+		LogError(TEXT("SrvLogOpen"), TRUE);
+		return FALSE;
+	}
+
+	HANDLE hOutput = (lpSrvConfig->lpOutputLog != NULL) ? hChildOutput : NULL;
+	HANDLE hError = (lpSrvConfig->lpOutputLog != NULL) ? SrvLogGetErrorHandle() : NULL;
+
+	if (!SrvWatchdogArm(lpSrvConfig->dwWatchdogMillis)) {
+		LogError(TEXT("SrvWatchdogArm"), TRUE);
+		return FALSE;
+	}
+
+	if (!SrvChildLaunch(lpSrvConfig, hOutput, hError, &child)) {
+		LogError(TEXT("CreateProcess"), TRUE);
+		return FALSE;
+	}
+
+	// If a stop request arrived since the check above these transitions
+	// fail and the stop event is handled next.
+
+	SrvStateTransition(SRV_STATE_READY, NO_ERROR, 3000);
+	SrvStateTransition(SRV_STATE_RUNNING, NO_ERROR, 0);
+
+	if (lpSrvConfig->lpHealthCheck == NULL) {
+		MarkChildReady();
+	}
+
+	// Give the new child a full set of probes and samples before judging it.
+
+	SrvHealthReset();
+	SrvRecycleReset();
+
+	return TRUE;
+}
+
+/**
+ * Suspend or resume the child process tree after SvcCtrlHandler
+ * moved the service to SRV_STATE_PAUSING or SRV_STATE_CONTINUING.
+ * The time taken is recorded by the state machine as the
+ * Pausing->Paused and Continuing->Running transition latencies.
+ */
+static void PauseOrContinueChild(void)
+{
+	SRV_STATE state = SrvStateGet();
+	DWORD dwProcesses = 0;
+	TCHAR message[80];
+
+	if (state == SRV_STATE_PAUSING) {
+
+		if (SrvChildSuspend(&child, &dwProcesses)) {
+			SrvStateTransition(SRV_STATE_PAUSED, NO_ERROR, 0);
+
+			sprintf_s(message, 80, TEXT("Suspended %d child processes"), dwProcesses);
+			LogInfo(message);
+		}
+		else {
+
+			// Do not leave the tree partly suspended.
+
+			LogError(TEXT("SrvChildSuspend"), FALSE);
+			SrvChildResume(&child, &dwProcesses);
+			SrvStateTransition(SRV_STATE_RUNNING, NO_ERROR, 0);
+		}
+	}
+	else if (state == SRV_STATE_CONTINUING) {
+
+		if (!SrvChildResume(&child, &dwProcesses)) {
+			LogError(TEXT("SrvChildResume"), FALSE);
+		}
+		SrvStateTransition(SRV_STATE_RUNNING, NO_ERROR, 0);
+
+		sprintf_s(message, 80, TEXT("Resumed %d child processes"), dwProcesses);
+		LogInfo(message);
+	}
+}
+
+/**
+ * Carry out the configured HealthAction when the child is found
+ * unhealthy or hung: restart it, or stop the service.
+ * Either way the child goes through the normal stop path.
+ */
+static void RecoverChild(LPCSTR lpReason, SRV_END_REASON reason)
+{
+	if (SrvStateGet() != SRV_STATE_RUNNING) {
+		return;
+	}
+
+	LogInfo((LPTSTR)lpReason);
+
+	if ((lpSrvConfig->lpHealthAction != NULL) && (strcmp(lpSrvConfig->lpHealthAction, "stop") == 0)) {
+
+		if (SrvStateTransition(SRV_STATE_STOPPING, NO_ERROR, SrvStopTimeoutGet())) {
+			endReason = reason;
+			SetEvent(ghSvcStopEvent);
+		}
+	}
+	else {
+		RequestRestart(reason);
+	}
+}
+
+/**
+ * Schedule a restart of the child once the current event is handled,
+ * remembering why for the run history journal.
+ */
+static void RequestRestart(SRV_END_REASON reason)
+{
+	bRestartRequested = TRUE;
+	endReason = reason;
+}
+
+/**
+ * Record when the child became ready: when the service reported running,
+ * or when the first health probe succeeded if health checks are configured.
+ * Another service may then take the start slot.
+ */
+static void MarkChildReady(void)
+{
+	SrvStartGateRelease();
+
+	if ((child.ftReady.dwLowDateTime == 0) && (child.ftReady.dwHighDateTime == 0)) {
+		GetSystemTimeAsFileTime(&child.ftReady);
+		SrvPrefetchNoteReady(&child);
+	}
+}
+
+/**
+ * Learn the stop time of a child that has exited
+ * and append its run to the journal, if configured.
+ *
+ *	defaultReason	is why the run ended unless a more specific reason was recorded.
+ */
+static void RecordChildRun(SRV_END_REASON defaultReason)
+{
+	SRV_END_REASON reason = (endReason != SRV_END_EXITED) ? endReason : defaultReason;
+	endReason = SRV_END_EXITED;
+
+	if (child.stopStep == SRV_STOP_NONE) {
+		reason = SRV_END_EXITED;
+	}
+
+	SrvStartGateRelease();
+	SrvStopTimeoutObserve(&child);
+
+	if (lpSrvConfig->lpJournal == NULL) {
+		return;
+	}
+
+	SRV_JOURNAL_RECORD record;
+	SrvJournalDescribe(&child, reason, &record);
+
+	if (!SrvJournalAppend(lpSrvConfig->lpJournal, lpSrvConfig->dwJournalRecords, &record)) {
+		LogError(TEXT("SrvJournalAppend"), FALSE);
+	}
+}
+
+/**
+ * Carry out the configured actions for control codes
+ * received by SvcCtrlHandler since the last call.
+ * Codes without an action are ignored.
+ */
+static void RunControlActions(void)
+{
+	for (int index = 0; index < SRV_CONTROL_ACTIONS; index++) {
+
+		LONG bit = 1L << (index % 32);
+		if ((InterlockedAnd(&pendingControls[index / 32], ~bit) & bit) == 0) {
+			continue;
+		}
+
+		LPCTSTR lpAction = lpSrvConfig->lpControlActions[index];
+		if (lpAction == NULL) {
+			continue;
+		}
+
+		LogInfo((LPTSTR)lpAction);
+
+		// An action is either a side command or a control request.
+
+		BOOL bSuccess;
+		if (strncmp(lpAction, "exec ", 5) == 0) {
+			bSuccess = SrvChildRunCommand(lpAction + 5, hChildOutput, NULL);
+		}
+		else {
+			TCHAR request[SRV_CONTROL_REQUEST_SIZE];
+			TCHAR reply[SRV_CONTROL_REPLY_SIZE];
+
+			strncpy(request, lpAction, sizeof(request) - 1);
+			request[sizeof(request) - 1] = 0;
+
+			bSuccess = SrvControlExecute(request, reply, sizeof(reply));
+		}
+
+		// The action itself was just logged, and may be too long to log again here.
+
+		if (!bSuccess) {
+			LogError(TEXT("OnControl action"), FALSE);
+		}
+	}
+}
+
+/**
+ * Read the configuration file again and apply what changed.
+ * Output log and control code action changes take effect immediately.
+ * Changes to how the child is launched schedule a restart.
+ *
+ *	lpReply			receives a description of what changed.
+ *
+ * Reading the file sets its environment variables, so it starts from the
+ * environment the service started with; variables the file no longer sets
+ * are gone and the environment hash sees the change.
+ *
+ * Returns FALSE and keeps the live configuration if the file is invalid or a
+ * module refuses its new settings, putting back the settings of any module
+ * that already took them, and the live environment.
+ */
+static BOOL ReloadConfig(LPSTR lpReply, DWORD dwReplySize)
+{
+	LPVOID lpLiveEnvironment = SaveSrvEnvironment();
+
+	if ((lpLiveEnvironment == NULL) || !RestoreSrvEnvironment(lpBaseEnvironment)) {
+		DWORD dwLastError = GetLastError();
+		if (lpLiveEnvironment != NULL) {
+			RestoreSrvEnvironment(lpLiveEnvironment);
+			ReleaseSrvEnvironment(lpLiveEnvironment);
+		}
+		SetLastError(dwLastError);
+		return FALSE;
+	}
+
+	LPSRV_CONFIG lpNewConfig = GetSrvConfig(lpConfigName, lpServiceName);
+
+	if (lpNewConfig == NULL) {
+		DWORD dwLastError = GetLastError();
+		if (GetSrvConfigError()[0] != 0) {
+			_snprintf(lpReply, dwReplySize, "%s\n", GetSrvConfigError());
+		}
+		RestoreSrvEnvironment(lpLiveEnvironment);
+		ReleaseSrvEnvironment(lpLiveEnvironment);
+		SetLastError(dwLastError);
+		return FALSE;
+	}
+
+	GetSrvConfigTime(lpConfigName, &ftConfigTime);
+
+	DWORD dwChanges = CompareSrvConfig(lpSrvConfig, lpNewConfig);
+
+	DWORD dwStep;
+	for (dwStep = 0; dwStep < APPLY_STEPS; dwStep++) {
+		if (!ApplyConfigStep(dwStep, lpNewConfig, dwChanges)) {
+			break;
+		}
+	}
+
+	if (dwStep < APPLY_STEPS) {
+
+		// Put the live settings back in the modules that took the new ones,
+		// including the one that failed, which may have taken some of them.
+
+		DWORD dwLastError = GetLastError();
+
+		do {
+			ApplyConfigStep(dwStep, lpSrvConfig, dwChanges);
+		} while (dwStep-- > 0);
+
+		ReleaseSrvConfig(lpNewConfig);
+		RestoreSrvEnvironment(lpLiveEnvironment);
+		ReleaseSrvEnvironment(lpLiveEnvironment);
+		SetLastError(dwLastError);
+		return FALSE;
+	}
+
+	ReleaseSrvEnvironment(lpLiveEnvironment);
+	ReleaseSrvConfig(lpSrvConfig);
+	lpSrvConfig = lpNewConfig;
+
+	if (dwChanges & SRV_CONFIG_CHANGED_WATCH) {
+		WatchConfig();
+	}
+
+	if (lpSrvConfig->lpControlActions[GetSrvControlActionIndex(SERVICE_CONTROL_PARAMCHANGE)] != NULL) {
+		SrvStateAcceptControls(SERVICE_ACCEPT_PARAMCHANGE);
+	}
+
+	// Settings used at launch apply from the next launch; restart now
+	// unless the child is paused or already being stopped.
+
+	if ((dwChanges & SRV_CONFIG_CHANGED_LAUNCH) && (SrvStateGet() == SRV_STATE_RUNNING)) {
+		RequestRestart(SRV_END_RESTART);
+	}
+
+	_snprintf(lpReply, dwReplySize, "changed:%s%s%s%s%s%s%s%s%s\n",
+			(dwChanges == 0) ? " nothing" : "",
+			(dwChanges & SRV_CONFIG_CHANGED_LAUNCH) ? " launch" : "",
+			(dwChanges & SRV_CONFIG_CHANGED_OUTPUT_LOG) ? " output-log" : "",
+			(dwChanges & SRV_CONFIG_CHANGED_ACTIONS) ? " actions" : "",
+			(dwChanges & SRV_CONFIG_CHANGED_WATCH) ? " watch" : "",
+			(dwChanges & SRV_CONFIG_CHANGED_HEALTH) ? " health" : "",
+			(dwChanges & SRV_CONFIG_CHANGED_DIAGNOSTICS) ? " diagnostics" : "",
+			(dwChanges & SRV_CONFIG_CHANGED_RECYCLE) ? " recycle" : "",
+			(dwChanges & SRV_CONFIG_CHANGED_STOP) ? " stop" : "");
+
+	return TRUE;
+}
+
+/**
+ * Give one of the modules that take new settings while running the settings
+ * from lpConfig, if dwChanges includes any of them.  ReloadConfig() applies
+ * the steps in order, and puts back the live configuration the same way.
+ */
+static BOOL ApplyConfigStep(DWORD dwStep, LPSRV_CONFIG lpConfig, DWORD dwChanges)
+{
+	switch (dwStep) {
+
+	case APPLY_DUMP:
+		return !(dwChanges & SRV_CONFIG_CHANGED_DIAGNOSTICS)
+				|| SrvDumpConfigure(lpConfig->lpHangDumpDirectory,
+						lpConfig->dwHangDumpsKept, lpConfig->dwHangThreadDumpMillis);
+
+	case APPLY_STOP_TIMEOUT:
+		return !(dwChanges & SRV_CONFIG_CHANGED_STOP) || SrvStopTimeoutConfigure(lpConfig);
+
+	case APPLY_RECYCLE:
+		return !(dwChanges & SRV_CONFIG_CHANGED_RECYCLE) || SrvRecycleConfigure(lpConfig);
+
+	case APPLY_HEALTH:
+		return !(dwChanges & SRV_CONFIG_CHANGED_HEALTH) || SrvHealthConfigure(lpConfig);
+
+	case APPLY_OUTPUT_LOG:
+		return !(dwChanges & SRV_CONFIG_CHANGED_OUTPUT_LOG) || (hChildOutput == NULL)
+				|| (lpConfig->lpOutputLog == NULL)
+				|| (SrvLogConfigure(lpConfig->lpOutputLog, lpConfig->dwOutputLogRotateBytes,
+						lpConfig->dwOutputLogIndexKB * 1024, lpConfig->lpOutputLogFormat)
+					&& SrvLogSetLimit(lpConfig->lpOutputLogLimitPolicy, lpConfig->dwOutputLogRateBytes,
+						lpConfig->dwOutputLogBurstBytes, lpConfig->dwOutputLogSample));
+
+	// Turning capture on or off restarts the child, and moves the rotated logs too.
+
+	case APPLY_LOG_COMPRESS:
+		return !(dwChanges & (SRV_CONFIG_CHANGED_OUTPUT_LOG | SRV_CONFIG_CHANGED_LAUNCH))
+				|| SrvLogCompressConfigure(lpConfig);
+
+	case APPLY_LOG_FORWARD:
+		return !(dwChanges & (SRV_CONFIG_CHANGED_OUTPUT_LOG | SRV_CONFIG_CHANGED_LAUNCH))
+				|| SrvLogForwardConfigure(lpConfig);
+	}
+
+	return TRUE;
+}
+
+/**
+ * Start or stop watching the configuration file as configured.
+ */
+static void WatchConfig(void)
+{
+	if ((lpSrvConfig->dwWatchConfig != 0) && (hConfigWatch == INVALID_HANDLE_VALUE)) {
+
+		hConfigWatch = WatchSrvConfig(lpConfigName);
+
+		if (hConfigWatch == INVALID_HANDLE_VALUE) {
+			LogError(TEXT("WatchSrvConfig"), FALSE);
+		}
+	}
+	else if ((lpSrvConfig->dwWatchConfig == 0) && (hConfigWatch != INVALID_HANDLE_VALUE)) {
+
+		FindCloseChangeNotification(hConfigWatch);
+		hConfigWatch = INVALID_HANDLE_VALUE;
+	}
+}
+
+/**
+ * Reload the configuration after something changed in its directory,
+ * if the configuration file itself was written.
+ * A file that does not parse, perhaps because it is still being written,
+ * is reported and the live configuration kept.
+ */
+static void ReloadChangedConfig(void)
+{
+	FindNextChangeNotification(hConfigWatch);
+
+	FILETIME ftLastWriteTime;
+
+	if (!GetSrvConfigTime(lpConfigName, &ftLastWriteTime)
+			|| (CompareFileTime(&ftLastWriteTime, &ftConfigTime) == 0)) {
+		return;
+	}
+
+	TCHAR reply[SRV_CONTROL_REPLY_SIZE];
+
+	if (ReloadConfig(reply, sizeof(reply))) {
+		LogInfo(reply);
+	}
+	else {
+		ftConfigTime = ftLastWriteTime;
+		LogConfigError();
+		LogError(TEXT("ReloadConfig"), FALSE);
+	}
+}
+
+/**
+ * Carry out a request received on the control channel.
+ * Called on the service main thread from SrvControlService().
+ * Restarts are deferred until the reply has been sent.
+ */
+static BOOL HandleControlRequest(SRV_COMMAND command, LPSTR lpArgument, LPSTR lpReply, DWORD dwReplySize)
+{
+	switch (command) {
+
+	case SRV_COMMAND_STATUS: {
+
+		FILETIME ftNow;
+		GetSystemTimeAsFileTime(&ftNow);
+
+		ULARGE_INTEGER uliNow, uliLaunched;
+		uliNow.LowPart = ftNow.dwLowDateTime;
+		uliNow.HighPart = ftNow.dwHighDateTime;
+		uliLaunched.LowPart = child.ftLaunched.dwLowDateTime;
+		uliLaunched.HighPart = child.ftLaunched.dwHighDateTime;
+
+		_snprintf(lpReply, dwReplySize, "state=%s pid=%lu launches=%lu uptime=%llus\n",
+				SrvStateName(SrvStateGet()),
+				child.pi.dwProcessId,
+				child.dwLaunches,
+				(uliNow.QuadPart - uliLaunched.QuadPart) / 10000000);
+		return TRUE;
+	}
+
+	case SRV_COMMAND_RESTART:
+		if (SrvStateGet() != SRV_STATE_RUNNING) {
+			SetLastError(ERROR_INVALID_STATE);
+			return FALSE;
+		}
+		RequestRestart(SRV_END_RESTART);
+		return TRUE;
+
+	case SRV_COMMAND_RELOAD_CONFIG:
+		return ReloadConfig(lpReply, dwReplySize);
+
+	case SRV_COMMAND_ROTATE_LOGS:
+		return SrvLogRotate();
+
+	case SRV_COMMAND_DUMP_STATS: {
+
+		DWORD dwLength = SrvStateFormat(lpReply, dwReplySize);
+		dwLength += SrvControlFormat(lpReply + dwLength, dwReplySize - dwLength);
+		dwLength += SrvLogFormat(lpReply + dwLength, dwReplySize - dwLength);
+		dwLength += SrvLogCompressFormat(lpReply + dwLength, dwReplySize - dwLength);
+		dwLength += SrvLogForwardFormat(lpReply + dwLength, dwReplySize - dwLength);
+		dwLength += SrvHealthFormat(lpReply + dwLength, dwReplySize - dwLength);
+		dwLength += SrvWatchdogFormat(lpReply + dwLength, dwReplySize - dwLength);
+		dwLength += SrvDumpFormat(lpReply + dwLength, dwReplySize - dwLength);
+		dwLength += SrvRecycleFormat(lpReply + dwLength, dwReplySize - dwLength);
+		dwLength += SrvStopTimeoutFormat(lpReply + dwLength, dwReplySize - dwLength);
+		dwLength += SrvStartGateFormat(lpReply + dwLength, dwReplySize - dwLength);
+		dwLength += SrvPrefetchFormat(lpReply + dwLength, dwReplySize - dwLength);
+		dwLength += SrvJavaFormat(lpReply + dwLength, dwReplySize - dwLength);
+		SrvEnvCacheFormat(lpReply + dwLength, dwReplySize - dwLength);
+		return TRUE;
+	}
+
+	case SRV_COMMAND_SIGNAL_CHILD:
+		if ((lpArgument[0] == 0) || (strcmp(lpArgument, "ctrl-c") == 0)) {
+			return SrvChildSignal(&child, CTRL_C_EVENT);
+		}
+		else if (strcmp(lpArgument, "ctrl-break") == 0) {
+			return SrvChildSignal(&child, CTRL_BREAK_EVENT);
+		}
+		SetLastError(ERROR_BAD_ARGUMENTS);
+		return FALSE;
+
+	case SRV_COMMAND_REOPEN_LOGS:
+		return SrvLogReopen();
+
+	case SRV_COMMAND_TAIL_LOG: {
+
+		DWORD dwLines = 10;
+		if (lpArgument[0] != 0) {
+			dwLines = strtoul(lpArgument, NULL, 10);
+		}
+		return SrvLogTail(dwLines, lpReply, dwReplySize);
+	}
+
+	case SRV_COMMAND_QUERY_LOG: {
+
+		LPSTR lpTo = strchr(lpArgument, ' ');
+		if (lpTo != NULL) {
+			*lpTo++ = 0;
+		}
+
+		if (lpArgument[0] == 0) {
+			SetLastError(ERROR_BAD_ARGUMENTS);
+			return FALSE;
+		}
+		return SrvLogQueryRange(lpArgument, lpTo, lpReply, dwReplySize);
+	}
+
+	default:
+		SetLastError(ERROR_INVALID_FUNCTION);
+		return FALSE;
+	}
+}
+
+/**
+ * Ignore console signals, which are meant for the child
+ */
+static BOOL WINAPI ConsoleCtrlHandler(DWORD dwCtrlType)
+{
+	return (dwCtrlType == CTRL_C_EVENT) || (dwCtrlType == CTRL_BREAK_EVENT);
+}
+
+//
+// Purpose:
+//   Called by SCM whenever a control code is sent to the service
+//   using the ControlService function.
+//
+// Parameters:
+//   dwCtrl - control code
+//
+// Return value:
+//   None
+//
+VOID WINAPI SvcCtrlHandler(DWORD dwCtrl)
+{
+   // Handle the requested control code.
+
+   switch(dwCtrl) {
+
+	case SERVICE_CONTROL_STOP:
+
+		// Signal the service to stop, unless it is already stopping.
+		// The main thread owns all further state changes.
+
+		if (SrvStateTransition(SRV_STATE_STOPPING, NO_ERROR, SrvStopTimeoutGet())) {
+			SetEvent(ghSvcStopEvent);
+		}
+
+		return;
+
+	case SERVICE_CONTROL_PAUSE:
+		if (SrvStateTransition(SRV_STATE_PAUSING, NO_ERROR, 3000)) {
+			SetEvent(ghSvcPauseEvent);
+		}
+		return;
+
+	case SERVICE_CONTROL_CONTINUE:
+		if (SrvStateTransition(SRV_STATE_CONTINUING, NO_ERROR, 3000)) {
+			SetEvent(ghSvcPauseEvent);
+		}
+		return;
+
+	case SERVICE_CONTROL_INTERROGATE:
+		break;
+
+	default:
+
+		// Hand codes that may have an action to the main thread,
+		// which owns the configuration and looks up the action.
+
+		{
+			int index = GetSrvControlActionIndex(dwCtrl);
+
+			if ((index >= 0) && (ghSvcControlEvent != NULL)) {
+				InterlockedOr(&pendingControls[index / 32], 1L << (index % 32));
+				SetEvent(ghSvcControlEvent);
+			}
+		}
 		break;
    }
 }
@@ -536,13 +1932,53 @@ static void LogInfo(LPTSTR info) {
 	}
 }
 
+/**
+ * Report where the configuration file failed to parse, if it did, to the event log.
+ * The last error is kept for LogError().
+ */
+static void LogConfigError(void) {
+
+	DWORD dwLastError = GetLastError();
+
+	if (GetSrvConfigError()[0] != 0) {
+		LogInfo((LPTSTR)GetSrvConfigError());
+	}
+
+	SetLastError(dwLastError);
+}
+
+/**
+ * Report the state machine counters to the event log
+ */
+static void LogStateMetrics(void) {
+
+	TCHAR metrics[1024];
+	SrvStateFormat(metrics, sizeof(metrics));
+
+	LogInfo(metrics);
+}
+
+/**
+ * Report that the child was killed, with how long capturing diagnostics took
+ */
+static void LogKill(void) {
+
+	TCHAR message[160] = TEXT("Killed child process; ");
+	size_t length = strlen(message);
+	SrvDumpFormat(message + length, sizeof(message) - length);
+
+	LogInfo(message);
+}
+
 /**
  * Report error to the event log
  *
  *	szFunction		is the name of function that failed.
  *
- *	bReportStopping	if TRUE sets the service status to SERVICE_STOP_PENDING
- *					after reporting the error.
+ *	bReportStopping	if TRUE moves the service to SRV_STATE_STOPPING
+ *					after reporting the error, so that the caller can
+ *					close down with CloseService(), which reports
+ *					SRV_STATE_FAILED with the error.
  */
 static void LogError(LPTSTR szFunction, BOOL bReportStopping)
 {
@@ -552,8 +1988,11 @@ static void LogError(LPTSTR szFunction, BOOL bReportStopping)
 
 	if (NULL != hEventSource) {
 
+		// Truncate rather than let sprintf_s() end the process on a long function name.
+
 		TCHAR message[80];
-		sprintf_s(message, 80, TEXT("%s failed with error %d hex %#X"), szFunction, dwLastError, dwLastError);
+		_snprintf(message, sizeof(message), TEXT("%s failed with error %d hex %#X"), szFunction, dwLastError, dwLastError);
+		message[sizeof(message) - 1] = 0;
 
 		LPCTSTR lpszStrings[2];
 		lpszStrings[0] = lpServiceName;
@@ -574,6 +2013,8 @@ static void LogError(LPTSTR szFunction, BOOL bReportStopping)
 	}
 
 	if (bReportStopping) {
-		ReportSvcStatus(SERVICE_STOPPED, NO_ERROR, 0);
+		bServiceFailed = TRUE;
+		dwServiceError = dwLastError;
+		SrvStateTransition(SRV_STATE_STOPPING, NO_ERROR, 2 * waitSecondsForOutput * 1000);
 	}
 }
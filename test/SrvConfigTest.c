@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2017, Ronald DeSantis
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+/*
+ * Checks for CompareSrvConfig().  Link with SrvConfig.c and the modules it
+ * references, then run; the exit code is the number of failed checks.
+ */
+
+#include <windows.h>
+
+#include <tchar.h>
+#include <stdio.h>
+
+#include "SrvConfig.h"
+
+static int nFailed = 0;
+
+static void Check(LPCSTR lpName, DWORD dwChanges, DWORD dwSet, DWORD dwClear) {
+
+	if (((dwChanges & dwSet) != dwSet) || (dwChanges & dwClear)) {
+		printf("FAIL %s: changes 0x%04lx\n", lpName, dwChanges);
+		nFailed++;
+	}
+	else {
+		printf("ok   %s\n", lpName);
+	}
+}
+
+/**
+ * A reload that turns capture off must only relaunch, even when an output
+ * log setting changes with it; reconfiguring the output log would pass its
+ * NULL path to SrvLogConfigure().
+ */
+static void TestCaptureOff(void) {
+
+	SRV_CONFIG oldConfig, newConfig;
+
+	ZeroMemory(&oldConfig, sizeof(oldConfig));
+	oldConfig.lpOutputLog = TEXT("C:\\logs\\app.log");
+	oldConfig.dwOutputLogKeep = 5;
+
+	newConfig = oldConfig;
+	newConfig.lpOutputLog = NULL;
+	newConfig.dwOutputLogKeep = 10;
+	Check("capture off, keep changed", CompareSrvConfig(&oldConfig, &newConfig),
+			SRV_CONFIG_CHANGED_LAUNCH, SRV_CONFIG_CHANGED_OUTPUT_LOG);
+
+	newConfig.dwOutputLogKeep = oldConfig.dwOutputLogKeep;
+	newConfig.dwOutputLogRateBytes = 4096;
+	newConfig.lpOutputLogForward = TEXT("syslog:514");
+	Check("capture off, limit and forward changed", CompareSrvConfig(&oldConfig, &newConfig),
+			SRV_CONFIG_CHANGED_LAUNCH, SRV_CONFIG_CHANGED_OUTPUT_LOG);
+
+	Check("capture on, limit and forward changed", CompareSrvConfig(&newConfig, &oldConfig),
+			SRV_CONFIG_CHANGED_LAUNCH, SRV_CONFIG_CHANGED_OUTPUT_LOG);
+}
+
+/**
+ * With capture on before and after, an output log setting is applied in
+ * place without a relaunch.
+ */
+static void TestCaptureOn(void) {
+
+	SRV_CONFIG oldConfig, newConfig;
+
+	ZeroMemory(&oldConfig, sizeof(oldConfig));
+	oldConfig.lpOutputLog = TEXT("C:\\logs\\app.log");
+	oldConfig.dwOutputLogKeep = 5;
+
+	newConfig = oldConfig;
+	newConfig.dwOutputLogKeep = 10;
+	Check("capture stays on, keep changed", CompareSrvConfig(&oldConfig, &newConfig),
+			SRV_CONFIG_CHANGED_OUTPUT_LOG, SRV_CONFIG_CHANGED_LAUNCH);
+
+	newConfig.dwOutputLogKeep = oldConfig.dwOutputLogKeep;
+	Check("capture stays on, unchanged", CompareSrvConfig(&oldConfig, &newConfig),
+			0, SRV_CONFIG_CHANGED_LAUNCH | SRV_CONFIG_CHANGED_OUTPUT_LOG);
+}
+
+/**
+ * With capture off before and after, output log settings have no effect.
+ */
+static void TestCaptureOffBoth(void) {
+
+	SRV_CONFIG oldConfig, newConfig;
+
+	ZeroMemory(&oldConfig, sizeof(oldConfig));
+	newConfig = oldConfig;
+	newConfig.dwOutputLogKeep = 10;
+	newConfig.dwOutputLogSample = 100;
+	Check("capture stays off, keep changed", CompareSrvConfig(&oldConfig, &newConfig),
+			0, SRV_CONFIG_CHANGED_LAUNCH | SRV_CONFIG_CHANGED_OUTPUT_LOG);
+}
+
+int _tmain(int argc, _TCHAR* argv[]) {
+
+	TestCaptureOff();
+	TestCaptureOn();
+	TestCaptureOffBoth();
+
+	return nFailed;
+}